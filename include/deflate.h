@@ -0,0 +1,248 @@
+/*
+ * Response compression
+ * A small deflate encoder: LZ77 over a DEFLATE_WINDOW window with the
+ * fixed Huffman codes, framed as gzip (RFC 1952) or zlib (RFC 1950) and
+ * written into the Deflater's own bounded buffer. With a sink, each full
+ * buffer is handed on and the output has no size limit. No Arduino
+ * dependencies, so the native tests can check its output against zlib.
+ */
+
+#ifndef DEFLATE_H
+#define DEFLATE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define DEFLATE_WINDOW 2048            // Longest match distance; power of two
+#define DEFLATE_HASH_BITS 10
+#define DEFLATE_MAX_CHAIN 16           // Match candidates tried per position
+#define DEFLATE_OUT_MAX 4096           // Compressed bytes buffered; ~16 KB of JSON
+
+enum ContentCoding : uint8_t { CODING_IDENTITY, CODING_GZIP, CODING_DEFLATE };
+
+// Takes a full output buffer; the Deflater reuses it once this returns
+typedef void (*DeflateSink)(void* context, const uint8_t* data, size_t length);
+
+struct Deflater {
+  uint16_t head[1 << DEFLATE_HASH_BITS];  // Latest position per hash (low 16 bits)
+  uint16_t prev[DEFLATE_WINDOW];          // Earlier position with the same hash
+  uint32_t bits;
+  uint8_t bitCount;
+  size_t limit;              // Output past this abandons the encode, or goes to the sink
+  bool overflow;
+  DeflateSink sink;          // Set by the caller; NULL to abandon instead
+  void* sinkContext;
+  size_t flushed;            // Bytes already handed to the sink
+  size_t outLength;
+  uint8_t out[DEFLATE_OUT_MAX];
+};
+
+const uint16_t DEFLATE_LENGTH_BASE[29] = {
+  3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+  35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+const uint8_t DEFLATE_LENGTH_EXTRA[29] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+  3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+const uint16_t DEFLATE_DISTANCE_BASE[30] = {
+  1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+  257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+const uint8_t DEFLATE_DISTANCE_EXTRA[30] = {
+  0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+  7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+inline uint32_t crc32Update(uint32_t crc, const uint8_t* data, size_t length) {
+  for (size_t i = 0; i < length; i++) {
+    crc ^= data[i];
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+    }
+  }
+  return crc;
+}
+
+inline uint32_t adler32(const uint8_t* data, size_t length) {
+  uint32_t a = 1;
+  uint32_t b = 0;
+  for (size_t i = 0; i < length; i++) {
+    a = (a + data[i]) % 65521;
+    b = (b + a) % 65521;
+  }
+  return (b << 16) | a;
+}
+
+inline void deflatePutByte(Deflater& d, uint8_t byte) {
+  if (d.outLength >= d.limit) {
+    if (d.sink == NULL) {
+      d.overflow = true;
+      return;
+    }
+    d.sink(d.sinkContext, d.out, d.outLength);
+    d.flushed += d.outLength;
+    d.outLength = 0;
+  }
+  d.out[d.outLength++] = byte;
+}
+
+// LSB first, as deflate packs everything but Huffman codes
+inline void deflatePutBits(Deflater& d, uint32_t value, int count) {
+  d.bits |= value << d.bitCount;
+  d.bitCount += count;
+  while (d.bitCount >= 8) {
+    deflatePutByte(d, d.bits & 0xFF);
+    d.bits >>= 8;
+    d.bitCount -= 8;
+  }
+}
+
+// Huffman codes go out most significant bit first
+inline void deflatePutCode(Deflater& d, uint32_t code, int length) {
+  uint32_t reversed = 0;
+  for (int i = 0; i < length; i++) {
+    reversed = (reversed << 1) | (code & 1);
+    code >>= 1;
+  }
+  deflatePutBits(d, reversed, length);
+}
+
+// Fixed literal/length code (RFC 1951, 3.2.6)
+inline void deflatePutSymbol(Deflater& d, int symbol) {
+  if (symbol < 144) {
+    deflatePutCode(d, 0x30 + symbol, 8);
+  } else if (symbol < 256) {
+    deflatePutCode(d, 0x190 + symbol - 144, 9);
+  } else if (symbol < 280) {
+    deflatePutCode(d, symbol - 256, 7);
+  } else {
+    deflatePutCode(d, 0xC0 + symbol - 280, 8);
+  }
+}
+
+inline void deflatePutMatch(Deflater& d, int length, int distance) {
+  int code = 28;
+  while (DEFLATE_LENGTH_BASE[code] > length) {
+    code--;
+  }
+  deflatePutSymbol(d, 257 + code);
+  deflatePutBits(d, length - DEFLATE_LENGTH_BASE[code], DEFLATE_LENGTH_EXTRA[code]);
+  code = 29;
+  while (DEFLATE_DISTANCE_BASE[code] > distance) {
+    code--;
+  }
+  deflatePutCode(d, code, 5);
+  deflatePutBits(d, distance - DEFLATE_DISTANCE_BASE[code], DEFLATE_DISTANCE_EXTRA[code]);
+}
+
+inline uint32_t deflateHash(const uint8_t* p) {
+  return ((p[0] << 16 | p[1] << 8 | p[2]) * 2654435761u) >> (32 - DEFLATE_HASH_BITS);
+}
+
+inline void deflateInsert(Deflater& d, const uint8_t* data, size_t pos) {
+  uint32_t h = deflateHash(data + pos);
+  d.prev[pos & (DEFLATE_WINDOW - 1)] = d.head[h];
+  d.head[h] = pos;
+}
+
+// Encodes data as one fixed-Huffman block in the given framing. Positions
+// are kept as 16 bits, so a candidate may be stale; every one is checked
+// against the data, which keeps the output correct and only costs ratio.
+// Without a sink, leaves the result in d.out and returns its size, or 0
+// once it would exceed `limit` bytes (at most DEFLATE_OUT_MAX). With one,
+// every `limit` bytes go to the sink as they fill, the tail is left in
+// d.out, and the return is the whole size.
+inline size_t deflateBody(Deflater& d, const uint8_t* data, size_t length, ContentCoding coding, size_t limit) {
+  memset(d.head, 0, sizeof(d.head));
+  d.bits = 0;
+  d.bitCount = 0;
+  d.limit = limit < sizeof(d.out) ? limit : sizeof(d.out);
+  d.overflow = false;
+  d.flushed = 0;
+  d.outLength = 0;
+  
+  static const uint8_t gzipHeader[10] = { 0x1F, 0x8B, 8, 0, 0, 0, 0, 0, 0, 0xFF };
+  static const uint8_t zlibHeader[2] = { 0x78, 0x01 };
+  const uint8_t* header = coding == CODING_GZIP ? gzipHeader : zlibHeader;
+  for (size_t i = 0; i < (coding == CODING_GZIP ? sizeof(gzipHeader) : sizeof(zlibHeader)); i++) {
+    deflatePutByte(d, header[i]);
+  }
+  
+  deflatePutBits(d, 1, 1);  // BFINAL
+  deflatePutBits(d, 1, 2);  // Fixed Huffman codes
+  size_t pos = 0;
+  while (pos < length && !d.overflow) {
+    int bestLength = 0;
+    int bestDistance = 0;
+    if (pos + 3 <= length) {
+      int maxLength = length - pos < 258 ? length - pos : 258;
+      uint16_t candidate = d.head[deflateHash(data + pos)];
+      uint16_t lastDistance = 0;
+      for (int chain = 0; chain < DEFLATE_MAX_CHAIN; chain++) {
+        uint16_t distance = (uint16_t)(pos - candidate);
+        if (distance == 0 || distance > DEFLATE_WINDOW || distance <= lastDistance) {
+          break;
+        }
+        lastDistance = distance;
+        const uint8_t* a = data + pos;
+        const uint8_t* b = a - distance;
+        if (a[bestLength] == b[bestLength]) {
+          int n = 0;
+          while (n < maxLength && a[n] == b[n]) {
+            n++;
+          }
+          if (n > bestLength) {
+            bestLength = n;
+            bestDistance = distance;
+            if (n == maxLength) {
+              break;
+            }
+          }
+        }
+        candidate = d.prev[candidate & (DEFLATE_WINDOW - 1)];
+      }
+    }
+    
+    if (bestLength >= 3) {
+      deflatePutMatch(d, bestLength, bestDistance);
+      for (size_t end = pos + bestLength; pos < end; pos++) {
+        if (pos + 3 <= length) {
+          deflateInsert(d, data, pos);
+        }
+      }
+    } else {
+      deflatePutSymbol(d, data[pos]);
+      if (pos + 3 <= length) {
+        deflateInsert(d, data, pos);
+      }
+      pos++;
+    }
+  }
+  deflatePutSymbol(d, 256);  // End of block
+  if (d.bitCount > 0) {
+    deflatePutBits(d, 0, 8 - d.bitCount);
+  }
+  
+  if (d.overflow) {
+    return 0;
+  }
+  
+  uint32_t check = coding == CODING_GZIP ? ~crc32Update(0xFFFFFFFF, data, length) : adler32(data, length);
+  for (int i = 0; i < 4; i++) {
+    if (coding == CODING_GZIP) {
+      deflatePutByte(d, check >> (8 * i));   // CRC-32, little-endian
+    } else {
+      deflatePutByte(d, check >> (24 - 8 * i));  // Adler-32, big-endian
+    }
+  }
+  if (coding == CODING_GZIP) {
+    for (int i = 0; i < 4; i++) {
+      deflatePutByte(d, length >> (8 * i));  // ISIZE
+    }
+  }
+  return d.overflow ? 0 : d.flushed + d.outLength;
+}
+
+#endif
@@ -0,0 +1,130 @@
+/*
+ * Wired gateway framing
+ * Payload [type][seq][body][CRC-16/CCITT-FALSE], COBS-encoded so 0x00 can
+ * end each frame, with multi-byte fields little-endian. Mirrored in
+ * tools/gateway.py, and free of Arduino dependencies so the native tests
+ * can run it on the host.
+ */
+
+#ifndef GATEWAY_FRAME_H
+#define GATEWAY_FRAME_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define GATEWAY_MAX_PAYLOAD 128
+#define GATEWAY_MAX_FRAME (GATEWAY_MAX_PAYLOAD + GATEWAY_MAX_PAYLOAD / 254 + 2)
+
+// CRC-16/CCITT-FALSE: polynomial 0x1021, initial value 0xFFFF
+inline uint16_t gatewayCrc(const uint8_t* data, size_t length) {
+  uint16_t crc = 0xFFFF;
+  for (size_t i = 0; i < length; i++) {
+    crc ^= (uint16_t)data[i] << 8;
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+  }
+  return crc;
+}
+
+// Consistent Overhead Byte Stuffing: removes every 0x00 from the payload
+// so 0x00 can delimit frames. `out` needs length + length / 254 + 1 bytes.
+inline size_t cobsEncode(const uint8_t* in, size_t length, uint8_t* out) {
+  size_t codeAt = 0;
+  size_t written = 1;
+  uint8_t code = 1;
+  for (size_t i = 0; i < length; i++) {
+    if (in[i] == 0) {
+      out[codeAt] = code;
+      codeAt = written++;
+      code = 1;
+      continue;
+    }
+    out[written++] = in[i];
+    if (++code == 0xFF) {
+      out[codeAt] = code;
+      codeAt = written++;
+      code = 1;
+    }
+  }
+  out[codeAt] = code;
+  return written;
+}
+
+// Decodes a frame without its delimiter; `out` may equal `in`. Returns the
+// payload length, or 0 if the frame is malformed.
+inline size_t cobsDecode(const uint8_t* in, size_t length, uint8_t* out) {
+  size_t read = 0;
+  size_t written = 0;
+  while (read < length) {
+    uint8_t code = in[read++];
+    if (code == 0 || read + code - 1 > length) {
+      return 0;
+    }
+    for (uint8_t i = 1; i < code; i++) {
+      out[written++] = in[read++];
+    }
+    if (code != 0xFF && read < length) {
+      out[written++] = 0;
+    }
+  }
+  return written;
+}
+
+inline void putU32(uint8_t*& p, uint32_t value) {
+  for (int i = 0; i < 4; i++) {
+    *p++ = (uint8_t)(value >> (8 * i));
+  }
+}
+
+inline void putF32(uint8_t*& p, float value) {
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  putU32(p, bits);
+}
+
+inline uint32_t getU32(const uint8_t*& p) {
+  uint32_t value = 0;
+  for (int i = 0; i < 4; i++) {
+    value |= (uint32_t)*p++ << (8 * i);
+  }
+  return value;
+}
+
+inline float getF32(const uint8_t*& p) {
+  uint32_t bits = getU32(p);
+  float value;
+  memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+// Frames a message, delimiter included, into `frame` (GATEWAY_MAX_FRAME
+// bytes). Returns 0, framing nothing, for a body over GATEWAY_MAX_PAYLOAD - 4.
+inline size_t gatewayEncodeFrame(uint8_t type, uint8_t seq, const uint8_t* body, size_t length, uint8_t* frame) {
+  if (length > GATEWAY_MAX_PAYLOAD - 4) {
+    return 0;
+  }
+  uint8_t payload[GATEWAY_MAX_PAYLOAD];
+  payload[0] = type;
+  payload[1] = seq;
+  memcpy(payload + 2, body, length);
+  uint16_t crc = gatewayCrc(payload, length + 2);
+  payload[length + 2] = (uint8_t)crc;
+  payload[length + 3] = (uint8_t)(crc >> 8);
+  
+  size_t frameLength = cobsEncode(payload, length + 4, frame);
+  frame[frameLength++] = 0x00;
+  return frameLength;
+}
+
+// True if a decoded payload is long enough and its CRC matches
+inline bool gatewayPayloadValid(const uint8_t* payload, size_t length) {
+  if (length < 4) {
+    return false;
+  }
+  uint16_t crc = payload[length - 2] | ((uint16_t)payload[length - 1] << 8);
+  return gatewayCrc(payload, length - 2) == crc;
+}
+
+#endif
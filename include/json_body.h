@@ -0,0 +1,327 @@
+/*
+ * JSON request bodies
+ * Schemas derived from plain structs at compile time, and a
+ * recursive-descent parser that fills those structs from a mutable,
+ * NUL-terminated buffer. Nothing is allocated: strings are unescaped in
+ * place (an escape never decodes to more bytes than it takes) and numbers
+ * are read where they stand. No Arduino dependencies, so the parser also
+ * builds on the host for the native tests.
+ */
+
+#ifndef JSON_BODY_H
+#define JSON_BODY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define JSON_MAX_DEPTH 8               // Nesting allowed inside skipped members
+
+enum JsonType : uint8_t { JSON_FLOAT, JSON_UINT, JSON_BOOL, JSON_STRING, JSON_OBJECTS };
+
+template <typename T> constexpr JsonType jsonTypeOf();
+template <> constexpr JsonType jsonTypeOf<float>() { return JSON_FLOAT; }
+template <> constexpr JsonType jsonTypeOf<uint32_t>() { return JSON_UINT; }
+template <> constexpr JsonType jsonTypeOf<bool>() { return JSON_BOOL; }
+template <> constexpr JsonType jsonTypeOf<const char*>() { return JSON_STRING; }
+
+struct JsonSchema;
+struct JsonField {
+  const char* name;          // Same as the struct member
+  JsonType type;
+  uint16_t offset;           // Of the member in the target struct
+  uint16_t limit;            // Longest string, or most array elements
+  uint16_t countOffset;      // JSON_OBJECTS: uint32_t member taking the length
+  const JsonSchema* element; // JSON_OBJECTS: schema of each element
+};
+
+struct JsonSchema {
+  const JsonField* fields;
+  uint8_t count;
+  uint16_t stride;           // sizeof the target struct
+};
+
+// A member filled from the JSON member of the same name. The JSON type
+// follows from the C++ type; strings are `const char*` into the body.
+#define JSON_FIELD(T, member, limit) \
+  { #member, jsonTypeOf<decltype(T::member)>(), offsetof(T, member), limit, 0, NULL }
+// An array of objects into `member[N]`, its length into `countMember`
+#define JSON_OBJECTS_FIELD(T, member, countMember, schema) \
+  { #member, JSON_OBJECTS, offsetof(T, member), sizeof(T::member) / sizeof(T::member[0]), \
+    offsetof(T, countMember), &schema }
+#define JSON_SCHEMA(T, fields) { fields, sizeof(fields) / sizeof(fields[0]), sizeof(T) }
+
+inline void jsonSkipSpace(char*& p) {
+  while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') {
+    p++;
+  }
+}
+
+inline bool jsonLiteral(char*& p, const char* literal) {
+  size_t length = strlen(literal);
+  if (strncmp(p, literal, length) != 0) {
+    return false;
+  }
+  p += length;
+  return true;
+}
+
+inline bool jsonHex4(const char* p, uint32_t& out) {
+  out = 0;
+  for (int i = 0; i < 4; i++) {
+    char c = p[i];
+    int digit = c >= '0' && c <= '9' ? c - '0' :
+                c >= 'a' && c <= 'f' ? c - 'a' + 10 :
+                c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+    if (digit < 0) {
+      return false;
+    }
+    out = (out << 4) | digit;
+  }
+  return true;
+}
+
+// Unescapes the string at p (on its opening quote) in place and
+// NUL-terminates it; `out` points at the result
+inline bool jsonString(char*& p, char*& out) {
+  if (*p != '"') {
+    return false;
+  }
+  char* read = p + 1;
+  char* write = read;
+  out = read;
+  for (;;) {
+    char c = *read++;
+    if (c == '"') {
+      break;
+    }
+    if ((uint8_t)c < 0x20) {
+      return false;  // Control character or end of body
+    }
+    if (c != '\\') {
+      *write++ = c;
+      continue;
+    }
+    c = *read++;
+    switch (c) {
+      case '"': case '\\': case '/': *write++ = c; break;
+      case 'b': *write++ = '\b'; break;
+      case 'f': *write++ = '\f'; break;
+      case 'n': *write++ = '\n'; break;
+      case 'r': *write++ = '\r'; break;
+      case 't': *write++ = '\t'; break;
+      case 'u': {
+        uint32_t code;
+        uint32_t low;
+        if (!jsonHex4(read, code) || code == 0) {
+          return false;
+        }
+        read += 4;
+        if (code >= 0xD800 && code < 0xDC00 && read[0] == '\\' && read[1] == 'u' &&
+            jsonHex4(read + 2, low) && low >= 0xDC00 && low < 0xE000) {
+          code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+          read += 6;
+        }
+        if (code < 0x80) {
+          *write++ = code;
+        } else if (code < 0x800) {
+          *write++ = 0xC0 | (code >> 6);
+          *write++ = 0x80 | (code & 0x3F);
+        } else if (code < 0x10000) {
+          *write++ = 0xE0 | (code >> 12);
+          *write++ = 0x80 | ((code >> 6) & 0x3F);
+          *write++ = 0x80 | (code & 0x3F);
+        } else {
+          *write++ = 0xF0 | (code >> 18);
+          *write++ = 0x80 | ((code >> 12) & 0x3F);
+          *write++ = 0x80 | ((code >> 6) & 0x3F);
+          *write++ = 0x80 | (code & 0x3F);
+        }
+        break;
+      }
+      default:
+        return false;
+    }
+  }
+  *write = '\0';
+  p = read;
+  return true;
+}
+
+// JSON number grammar only: no hex, inf or nan that strtod would accept
+inline bool jsonNumber(char*& p, double& out) {
+  char* start = p;
+  if (*p == '-') {
+    p++;
+  }
+  if (*p < '0' || *p > '9') {
+    return false;
+  }
+  while ((*p >= '0' && *p <= '9') || *p == '.' || *p == 'e' || *p == 'E' || *p == '+' || *p == '-') {
+    p++;
+  }
+  char* end;
+  out = strtod(start, &end);
+  return end == p && isfinite(out);
+}
+
+// Skips a value of any type, for members the schema does not name. Only
+// its tokens and bracket nesting are checked: what it holds is ignored.
+inline bool jsonSkipValue(char*& p) {
+  char open[JSON_MAX_DEPTH];
+  int depth = 0;
+  do {
+    jsonSkipSpace(p);
+    char c = *p;
+    char* text;
+    double number;
+    if (c == '{' || c == '[') {
+      if (depth == JSON_MAX_DEPTH) {
+        return false;
+      }
+      open[depth++] = c;
+      p++;
+      continue;
+    }
+    if (c == '}' || c == ']') {
+      if (depth == 0 || open[depth - 1] != (c == '}' ? '{' : '[')) {
+        return false;
+      }
+      depth--;
+      p++;
+    } else if (c == ',' || c == ':') {
+      if (depth == 0) {
+        return false;
+      }
+      p++;
+    } else if (!(c == '"' ? jsonString(p, text) :
+                 c == 't' ? jsonLiteral(p, "true") :
+                 c == 'f' ? jsonLiteral(p, "false") :
+                 c == 'n' ? jsonLiteral(p, "null") : jsonNumber(p, number))) {
+      return false;
+    }
+  } while (depth > 0);
+  return true;
+}
+
+inline bool jsonObject(char*& p, const JsonSchema& schema, uint8_t* target);
+
+inline bool jsonField(char*& p, const JsonField& field, uint8_t* target) {
+  uint8_t* member = target + field.offset;
+  double number;
+  char* text;
+  switch (field.type) {
+    case JSON_FLOAT:
+      if (!jsonNumber(p, number)) {
+        return false;
+      }
+      *(float*)member = number;
+      return true;
+    case JSON_UINT:
+      if (!jsonNumber(p, number) || number < 0 || number > UINT32_MAX || number != floor(number)) {
+        return false;
+      }
+      *(uint32_t*)member = number;
+      return true;
+    case JSON_BOOL:
+      if (jsonLiteral(p, "true")) {
+        *(bool*)member = true;
+      } else if (jsonLiteral(p, "false")) {
+        *(bool*)member = false;
+      } else {
+        return false;
+      }
+      return true;
+    case JSON_STRING:
+      if (!jsonString(p, text) || strlen(text) > field.limit) {
+        return false;
+      }
+      *(const char**)member = text;
+      return true;
+    case JSON_OBJECTS: {
+      uint32_t count = 0;
+      if (*p != '[') {
+        return false;
+      }
+      p++;
+      jsonSkipSpace(p);
+      if (*p == ']') {
+        p++;
+      } else {
+        for (;;) {
+          if (count == field.limit || !jsonObject(p, *field.element, member + count * field.element->stride)) {
+            return false;
+          }
+          count++;
+          jsonSkipSpace(p);
+          if (*p == ']') {
+            p++;
+            break;
+          }
+          if (*p != ',') {
+            return false;
+          }
+          p++;
+        }
+      }
+      *(uint32_t*)(target + field.countOffset) = count;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Members absent from the body, or null, keep what the caller put in target
+inline bool jsonObject(char*& p, const JsonSchema& schema, uint8_t* target) {
+  jsonSkipSpace(p);
+  if (*p != '{') {
+    return false;
+  }
+  p++;
+  jsonSkipSpace(p);
+  if (*p == '}') {
+    p++;
+    return true;
+  }
+  for (;;) {
+    char* name;
+    if (!jsonString(p, name)) {
+      return false;
+    }
+    jsonSkipSpace(p);
+    if (*p != ':') {
+      return false;
+    }
+    p++;
+    jsonSkipSpace(p);
+    
+    const JsonField* field = NULL;
+    for (uint8_t i = 0; i < schema.count && field == NULL; i++) {
+      if (strcmp(schema.fields[i].name, name) == 0) {
+        field = &schema.fields[i];
+      }
+    }
+    if (field == NULL) {
+      if (!jsonSkipValue(p)) {
+        return false;
+      }
+    } else if (!jsonLiteral(p, "null") && !jsonField(p, *field, target)) {
+      return false;
+    }
+    
+    jsonSkipSpace(p);
+    if (*p == '}') {
+      p++;
+      return true;
+    }
+    if (*p != ',') {
+      return false;
+    }
+    p++;
+    jsonSkipSpace(p);
+  }
+}
+
+#endif
@@ -0,0 +1,34 @@
+/*
+ * Route hashing
+ * The hash behind the perfect route index: FNV-1a with a seed and a final
+ * fold, constexpr so the index can be searched for at compile time. No
+ * Arduino dependencies, so the native tests can check it on the host.
+ */
+
+#ifndef ROUTE_HASH_H
+#define ROUTE_HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// FNV-1a, usable both at compile time and on the request path. The final
+// fold matters: FNV's low bits depend only on the low bits of the input, so
+// without it no seed could separate paths that agree there.
+constexpr uint32_t routeHash(const char* str, uint32_t seed) {
+  uint32_t h = 2166136261u ^ seed;
+  while (*str) {
+    h = (h ^ (uint8_t)*str++) * 16777619u;
+  }
+  return h ^ (h >> 16);
+}
+
+// Smallest power of two with at least twice as many slots as routes
+constexpr size_t routeSlotCount(size_t routes) {
+  size_t slots = 1;
+  while (slots < routes * 2) {
+    slots <<= 1;
+  }
+  return slots;
+}
+
+#endif
@@ -0,0 +1,97 @@
+/*
+ * Scheduler job table
+ * The jobs loop() runs from its timer queue, and the queue itself: a
+ * binary min-heap of job slots ordered by release time, plus the ranking
+ * among jobs that are due together. Times are micros(), compared by signed
+ * difference so wraparound is safe. Running the jobs stays in main.cpp;
+ * this part has no Arduino dependencies so the native tests can drive it.
+ */
+
+#ifndef SCHEDULER_HEAP_H
+#define SCHEDULER_HEAP_H
+
+#include <stdint.h>
+
+#define SCHED_MAX_JOBS 12
+
+// Lower runs first
+enum JobPriority : uint8_t { PRIORITY_SAMPLING, PRIORITY_INPUT, PRIORITY_TELEMETRY, PRIORITY_REPORTING, PRIORITY_HOUSEKEEPING };
+
+typedef void (*JobFn)();
+
+struct Job {
+  const char* name;
+  JobFn fn;                  // NULL for a free slot
+  uint32_t periodUs;         // 0 for a one-shot job
+  uint32_t deadlineUs;       // After release
+  JobPriority priority;
+  bool queued;
+  uint32_t releaseUs;        // micros() it next becomes due
+  uint32_t runs;
+  uint32_t misses;           // Started after releaseUs + deadlineUs
+  uint32_t skipped;          // Whole periods lost to overruns
+  uint32_t maxLatenessUs;    // Worst start after release
+  uint32_t maxRunUs;
+};
+
+struct Scheduler {
+  Job jobs[SCHED_MAX_JOBS];
+  uint8_t jobCount;          // Slots in use, one-shot slots are kept for their stats
+  uint8_t heap[SCHED_MAX_JOBS];  // Queued jobs, min-heap on releaseUs
+  uint8_t heapSize;
+  uint32_t misses;
+  uint32_t reportedMisses;   // At the last status print
+};
+
+inline bool releasedBefore(const Scheduler& s, uint8_t a, uint8_t b) {
+  return (int32_t)(s.jobs[a].releaseUs - s.jobs[b].releaseUs) < 0;
+}
+
+inline void schedulerPush(Scheduler& s, uint8_t index) {
+  uint8_t at = s.heapSize++;
+  while (at > 0) {
+    uint8_t parent = (at - 1) / 2;
+    if (!releasedBefore(s, index, s.heap[parent])) {
+      break;
+    }
+    s.heap[at] = s.heap[parent];
+    at = parent;
+  }
+  s.heap[at] = index;
+  s.jobs[index].queued = true;
+}
+
+// Removes and returns the job released first; the heap must not be empty
+inline uint8_t schedulerPop(Scheduler& s) {
+  uint8_t top = s.heap[0];
+  uint8_t last = s.heap[--s.heapSize];
+  uint8_t at = 0;
+  for (;;) {
+    uint8_t child = 2 * at + 1;
+    if (child >= s.heapSize) {
+      break;
+    }
+    if (child + 1 < s.heapSize && releasedBefore(s, s.heap[child + 1], s.heap[child])) {
+      child++;
+    }
+    if (!releasedBefore(s, s.heap[child], last)) {
+      break;
+    }
+    s.heap[at] = s.heap[child];
+    at = child;
+  }
+  s.heap[at] = last;
+  return top;
+}
+
+// Of two due jobs, whether a should run before b
+inline bool jobOutranks(const Scheduler& s, uint8_t a, uint8_t b) {
+  const Job& jobA = s.jobs[a];
+  const Job& jobB = s.jobs[b];
+  if (jobA.priority != jobB.priority) {
+    return jobA.priority < jobB.priority;
+  }
+  return (int32_t)((jobA.releaseUs + jobA.deadlineUs) - (jobB.releaseUs + jobB.deadlineUs)) < 0;
+}
+
+#endif
@@ -0,0 +1,111 @@
+/*
+ * Shared sensor snapshot
+ * loop() owns the HX711 and the filter; other tasks (the on-demand task,
+ * and whatever moves off loop() later) read a published copy instead of
+ * the globals. It is a sequence lock: the one writer never waits, and a
+ * reader that overlapped a write simply reads again. The payload is kept in
+ * relaxed atomic words so the protocol is race-free by the C++ memory model,
+ * not just on the ESP32; on Xtensa those are plain 32-bit loads and stores.
+ * Off the device the reader's back-off is a thread yield, so the native
+ * tests can race real threads through it.
+ */
+
+#ifndef SENSOR_SNAPSHOT_H
+#define SENSOR_SNAPSHOT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#ifdef ARDUINO
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#else
+#include <thread>
+#endif
+
+#define SNAPSHOT_SPIN_LIMIT 64         // Retries before a reader yields to the writer
+
+struct SensorSnapshot {
+  float weight;              // Filtered grams
+  int32_t raw;               // HX711 counts of the latest reading
+  uint32_t sampledAt;        // millis() of the latest reading
+  uint32_t sequence;         // Publications so far
+  int8_t ir;                 // HIGH or LOW
+  uint8_t fault;             // SensorFault of the load cell
+};
+#define SNAPSHOT_WORDS ((sizeof(SensorSnapshot) + 3) / 4)
+
+struct SnapshotCell {
+  std::atomic<uint32_t> seq;             // Odd while a write is in progress
+  std::atomic<uint32_t> words[SNAPSHOT_WORDS];
+};
+
+// Single writer per cell
+inline void publishSnapshot(SnapshotCell& cell, const SensorSnapshot& value) {
+  uint32_t words[SNAPSHOT_WORDS] = {};
+  memcpy(words, &value, sizeof(value));
+  uint32_t seq = cell.seq.load(std::memory_order_relaxed);
+  cell.seq.store(seq + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  for (size_t i = 0; i < SNAPSHOT_WORDS; i++) {
+    cell.words[i].store(words[i], std::memory_order_relaxed);
+  }
+  cell.seq.store(seq + 2, std::memory_order_release);
+}
+
+// A reader on the writer's core may preempt it mid-write, so after
+// SNAPSHOT_SPIN_LIMIT retries it sleeps a tick to let the writer finish
+// instead of spinning forever
+inline SensorSnapshot readSnapshot(SnapshotCell& cell, uint32_t* retries = NULL) {
+  uint32_t words[SNAPSHOT_WORDS];
+  uint32_t spins = 0;
+  for (;;) {
+    uint32_t before = cell.seq.load(std::memory_order_acquire);
+    if ((before & 1) == 0) {
+      for (size_t i = 0; i < SNAPSHOT_WORDS; i++) {
+        words[i] = cell.words[i].load(std::memory_order_relaxed);
+      }
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (cell.seq.load(std::memory_order_relaxed) == before) {
+        break;
+      }
+    }
+    if (retries != NULL) {
+      (*retries)++;
+    }
+    if (++spins % SNAPSHOT_SPIN_LIMIT == 0) {
+#ifdef ARDUINO
+      vTaskDelay(1);
+#else
+      std::this_thread::yield();
+#endif
+    }
+  }
+  SensorSnapshot value;
+  memcpy(&value, words, sizeof(value));
+  return value;
+}
+
+// Check pattern for the contention benchmark and the host stress tests:
+// value number n, every field derivable from the sequence, so a read that
+// mixes two writes fails snapshotCheckConsistent()
+inline SensorSnapshot snapshotCheckValue(uint32_t n) {
+  SensorSnapshot value;
+  memset(&value, 0, sizeof(value));
+  value.sequence = n;
+  value.sampledAt = ~n;
+  value.raw = (int32_t)(n * 2654435761u);
+  value.weight = (float)(n & 0xFFFF);
+  value.ir = n & 1;
+  value.fault = n % 5;
+  return value;
+}
+
+inline bool snapshotCheckConsistent(const SensorSnapshot& value) {
+  uint32_t n = value.sequence;
+  return value.sampledAt == ~n && value.raw == (int32_t)(n * 2654435761u) &&
+         value.weight == (float)(n & 0xFFFF) && value.ir == (int8_t)(n & 1) && value.fault == n % 5;
+}
+
+#endif
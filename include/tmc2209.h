@@ -0,0 +1,158 @@
+/*
+ * TMC2209 UART protocol
+ * Datagram framing and register packing for the single-wire UART: an
+ * 8-byte write, a 4-byte read request and the 8-byte reply, each closed
+ * by the CRC8 from the datasheet. The register transactions take the UART
+ * as any Stream-like type (available, read, write, flush) and the clock as
+ * a function, so the native tests can run them against a scripted wire;
+ * the driver backend in main.cpp passes Serial2 and micros().
+ */
+
+#ifndef TMC2209_H
+#define TMC2209_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TMC_SYNC 0x05
+#define TMC_REPLY_ADDRESS 0xFF         // Replies always come from the master address
+#define TMC_WRITE_LENGTH 8
+#define TMC_READ_LENGTH 4
+#define TMC_REG_GCONF 0x00
+#define TMC_REG_IFCNT 0x02
+#define TMC_REG_IOIN 0x06
+#define TMC_IOIN_VERSION 0x21          // IOIN bits 31..24 on every TMC2209
+#define TMC_REG_IHOLD_IRUN 0x10
+#define TMC_REG_TPWMTHRS 0x13
+#define TMC_REG_TCOOLTHRS 0x14
+#define TMC_REG_SGTHRS 0x40
+#define TMC_REG_SG_RESULT 0x41
+#define TMC_REG_CHOPCONF 0x6C
+#define TMC_CHOPCONF_BASE 0x10000053UL // Power-on default: toff 3, hstrt 5, intpol
+#define TMC_GCONF_UART 0x1C0UL         // pdn_disable, mstep_reg_select, multistep_filt
+#define TMC_IHOLDDELAY 8               // Power-down ramp at standstill, 2^18 clocks per step
+
+// CRC8 (polynomial x^8 + x^2 + x + 1), bytes fed LSB first
+inline uint8_t tmcCrc(const uint8_t* datagram, size_t length) {
+  uint8_t crc = 0;
+  for (size_t i = 0; i < length; i++) {
+    uint8_t byte = datagram[i];
+    for (int bit = 0; bit < 8; bit++) {
+      if ((crc >> 7) ^ (byte & 0x01)) {
+        crc = (crc << 1) ^ 0x07;
+      } else {
+        crc = crc << 1;
+      }
+      byte >>= 1;
+    }
+  }
+  return crc;
+}
+
+// Register write, value most significant byte first
+inline void tmcWriteDatagram(uint8_t* out, uint8_t address, uint8_t reg, uint32_t value) {
+  out[0] = TMC_SYNC;
+  out[1] = address;
+  out[2] = reg | 0x80;
+  out[3] = (uint8_t)(value >> 24);
+  out[4] = (uint8_t)(value >> 16);
+  out[5] = (uint8_t)(value >> 8);
+  out[6] = (uint8_t)value;
+  out[7] = tmcCrc(out, 7);
+}
+
+inline void tmcReadRequest(uint8_t* out, uint8_t address, uint8_t reg) {
+  out[0] = TMC_SYNC;
+  out[1] = address;
+  out[2] = reg;
+  out[3] = tmcCrc(out, 3);
+}
+
+// Checks a reply to a read of `reg` and unpacks its value
+inline bool tmcParseReply(const uint8_t* reply, uint8_t reg, uint32_t& value) {
+  if (reply[0] != TMC_SYNC || reply[1] != TMC_REPLY_ADDRESS || reply[2] != reg ||
+      reply[7] != tmcCrc(reply, 7)) {
+    return false;
+  }
+  value = ((uint32_t)reply[3] << 24) | ((uint32_t)reply[4] << 16) | ((uint32_t)reply[5] << 8) | reply[6];
+  return true;
+}
+
+// MRES for a step mode in microsteps per full step: 0 is 256, 8 is full steps
+inline uint8_t tmcMres(uint8_t mode) {
+  uint8_t level = 0;
+  while ((1 << level) < mode && level < 8) {
+    level++;
+  }
+  return 8 - level;
+}
+
+inline uint32_t tmcChopconf(uint8_t mres, bool vsense) {
+  uint32_t chopconf = (TMC_CHOPCONF_BASE & ~(0x0FUL << 24)) | ((uint32_t)mres << 24);
+  if (vsense) {
+    chopconf |= 1UL << 17;
+  }
+  return chopconf;
+}
+
+// Converts an RMS current into the 5-bit current scale, switching to the
+// low sense range (finer steps) when the current fits in it
+inline uint8_t tmcCurrentScale(uint16_t runMa, float rsense, bool& vsense) {
+  float scaled = 32.0 * 1.41421 * (runMa / 1000.0) * (rsense + 0.02);
+  float cs = scaled / 0.325 - 1.0;
+  vsense = cs < 16.0;
+  if (vsense) {
+    cs = scaled / 0.180 - 1.0;
+  }
+  int irun = (int)(cs + 0.5);
+  return irun < 0 ? 0 : irun > 31 ? 31 : irun;
+}
+
+inline uint32_t tmcIholdIrun(uint8_t irun, uint8_t holdPercent) {
+  uint8_t ihold = (uint8_t)(irun * holdPercent / 100);
+  return (uint32_t)ihold | ((uint32_t)irun << 8) | ((uint32_t)TMC_IHOLDDELAY << 16);
+}
+
+template <typename Uart>
+void tmcWriteRegister(Uart& uart, uint8_t address, uint8_t reg, uint32_t value) {
+  uint8_t datagram[TMC_WRITE_LENGTH];
+  tmcWriteDatagram(datagram, address, reg, value);
+  uart.write(datagram, sizeof(datagram));
+  uart.flush();
+}
+
+// False on a short or corrupt reply, or none within timeoutUs of nowUs()
+template <typename Uart, typename Clock>
+bool tmcReadRegister(Uart& uart, uint8_t address, uint8_t reg, uint32_t& value, Clock nowUs, uint32_t timeoutUs) {
+  uint8_t request[TMC_READ_LENGTH];
+  tmcReadRequest(request, address, reg);
+  while (uart.available()) {
+    uart.read();
+  }
+  uart.write(request, sizeof(request));
+  uart.flush();
+  
+  // Our own request comes back first on the shared wire, then the reply
+  uint8_t received[TMC_READ_LENGTH + TMC_WRITE_LENGTH];
+  size_t count = 0;
+  uint32_t start = nowUs();
+  while (count < sizeof(received) && (uint32_t)(nowUs() - start) < timeoutUs) {
+    if (uart.available()) {
+      received[count++] = uart.read();
+    }
+  }
+  if (count < sizeof(received)) {
+    return false;
+  }
+  
+  return tmcParseReply(received + sizeof(request), reg, value);
+}
+
+// Whether a TMC2209 answers at `address`, by its IOIN version
+template <typename Uart, typename Clock>
+bool tmcProbe(Uart& uart, uint8_t address, Clock nowUs, uint32_t timeoutUs) {
+  uint32_t ioin;
+  return tmcReadRegister(uart, address, TMC_REG_IOIN, ioin, nowUs, timeoutUs) && (ioin >> 24) == TMC_IOIN_VERSION;
+}
+
+#endif
@@ -9,11 +9,58 @@
 #include <WebServer.h>
 #include <AccelStepper.h>
 #include <HX711.h>
+#include <HTTPClient.h>
+#include <Preferences.h>
+#include <esp_ota_ops.h>
+#include <esp_partition.h>
+#include <esp_system.h>
+#include <mbedtls/sha1.h>
+#include <mbedtls/base64.h>
+#include <mbedtls/ssl.h>
+#include <mbedtls/ssl_cache.h>
+#include <mbedtls/ssl_ticket.h>
+#include <mbedtls/ctr_drbg.h>
+#include <mbedtls/entropy.h>
+#include <mbedtls/net_sockets.h>
+#include <lwip/sockets.h>
+#include <WiFiUdp.h>
+#include <atomic>
+#include "json_body.h"
+#include "deflate.h"
+#include "tmc2209.h"
+#include "gateway_frame.h"
+#include "route_hash.h"
+#include "sensor_snapshot.h"
+#include "scheduler_heap.h"
 
 // WiFi Configuration
+// Built-in network; more can be stored through /api/wifi
 const char* ssid = "Wokwi-GUEST";
 const char* password = "";
 
+#define MAX_WIFI_NETWORKS 8            // Built-in one included
+#define ROAM_CHECK_MS 5000
+#define ROAM_RSSI_THRESHOLD -72        // dBm; look for a better AP below this
+#define ROAM_HYSTERESIS_DB 8           // A new AP must be this much stronger
+#define ROAM_SCAN_INTERVAL_MS 60000    // Between scans while connected but weak
+#define ROAM_LOST_SCAN_INTERVAL_MS 15000  // Between scans while disconnected
+
+struct WifiNetwork {
+  char ssid[33];
+  char password[65];
+};
+WifiNetwork wifiNetworks[MAX_WIFI_NETWORKS];
+uint8_t wifiNetworkCount = 0;
+Preferences wifiPrefs;
+
+struct WifiRoamer {
+  bool scanning;             // Async scan in progress
+  unsigned long lastScanAt;
+  unsigned long lastCheckAt;
+  uint32_t roams;
+};
+WifiRoamer roamer;
+
 // DEBUG: Set to true to skip WiFi (for testing in Wokwi)
 #define SKIP_WIFI false  // Set to true to disable WiFi completely
 
@@ -24,6 +71,14 @@ const char* password = "";
 #define DT_PIN 18       // HX711 DT pin
 #define SCK_PIN 19      // HX711 SCK pin
 #define IR_SENSOR_PIN 21 // IR Sensor OUT pin
+#define MS1_PIN 25      // A4988 MS1 pin
+#define MS2_PIN 26      // A4988 MS2 pin
+#define MS3_PIN 27      // A4988 MS3 pin
+#define TMC_UART_RX_PIN 16 // TMC2209 PDN_UART (direct)
+#define TMC_UART_TX_PIN 17 // TMC2209 PDN_UART (through 1k)
+#define TMC_DIAG_PIN 34    // TMC2209 DIAG (StallGuard output)
+#define GATEWAY_RX_PIN 32  // Wired gateway UART RX
+#define GATEWAY_TX_PIN 33  // Wired gateway UART TX
 
 // Stepper Motor Configuration
 #define MOTOR_INTERFACE_TYPE 1  // Driver interface
@@ -32,28 +87,1629 @@ const char* password = "";
 #define ACCELERATION 500.0
 #define DISPENSE_STEPS 400  // Adjust based on desired food amount
 
+// Microstepping Configuration
+// Step counts everywhere outside the motion helpers are in full steps.
+// The position itself is kept in 1/16 steps so it stays exact across
+// mode switches.
+#define MICROSTEP_RESOLUTION 16        // Finest A4988 mode; unit of the position counter
+#define STEP_MODE_BULK 1               // Full steps for high-speed delivery
+#define STEP_MODE_FINE 8               // 1/8 steps for the final approach
+#define FINE_APPROACH_FRACTION 0.1     // Share of a portion left for the fine phase
+#define FINE_APPROACH_MIN_GRAMS 1.0
+uint8_t stepMode = STEP_MODE_BULK;     // Microsteps per full step right now
+long fineBase = 0;                     // 1/16-step position when stepMode last changed
+
+// Stepper Driver Configuration
+// AccelStepper generates STEP/DIR for every backend; the backend handles
+// enable, step mode, current and stall detection.
+#define DRIVER_A4988 1
+#define DRIVER_TMC2209 2
+#define STEPPER_DRIVER DRIVER_A4988
+#define TMC_UART_BAUD 115200
+#define TMC_ADDRESS 0                  // MS1/MS2 strapped low
+#define TMC_RSENSE 0.11                // Sense resistor, ohms
+#define TMC_RUN_CURRENT_MA 600         // RMS run current
+#define TMC_MAX_CURRENT_MA 1400
+#define TMC_HOLD_PERCENT 50            // Standstill current, % of run current
+#define TMC_STALL_THRESHOLD 80         // SGTHRS; higher stalls on lighter load
+#define TMC_REPLY_TIMEOUT_US 3000
+#define STALL_MIN_SPEED 100.0          // Full steps/s; StallGuard is blind below this
+
+class StepperDriver {
+public:
+  virtual ~StepperDriver() {}
+  virtual const char* name() const = 0;
+  virtual bool begin() = 0;
+  virtual void setEnabled(bool enabled) = 0;
+  virtual void setStepMode(uint8_t mode) = 0;
+  
+  // Optional capabilities; false when the backend has no such control
+  virtual bool setCurrent(uint16_t runMa, uint8_t holdPercent) { return false; }
+  virtual bool setStallThreshold(uint8_t threshold) { return false; }
+  virtual bool supportsStallDetection() const { return false; }
+  
+  // Stall latched since the last clearStall()
+  virtual bool stalled() { return false; }
+  virtual void clearStall() {}
+  
+  // Backend-specific fields for /api/motor, each with a leading comma
+  virtual void appendJson(String& json) {}
+};
+
+// Step mode on MS1-MS3, no current control or load feedback
+class A4988Driver : public StepperDriver {
+public:
+  const char* name() const override { return "a4988"; }
+  bool begin() override;
+  void setEnabled(bool enabled) override;
+  void setStepMode(uint8_t mode) override;
+};
+
+// Single-wire UART (TX through 1k, RX direct, so requests echo back) for
+// step mode, current and StallGuard; DIAG raises an interrupt on stall.
+// Runs in StealthChop, which StallGuard4 requires.
+class Tmc2209Driver : public StepperDriver {
+public:
+  // The port is opened by setup(); the driver only talks through it
+  Tmc2209Driver(Stream& uart, uint8_t address) : uart(uart), address(address) {}
+  const char* name() const override { return "tmc2209"; }
+  bool begin() override;
+  void setEnabled(bool enabled) override;
+  void setStepMode(uint8_t mode) override;
+  bool setCurrent(uint16_t runMa, uint8_t holdPercent) override;
+  bool setStallThreshold(uint8_t threshold) override;
+  bool supportsStallDetection() const override { return true; }
+  bool stalled() override;
+  void clearStall() override;
+  void appendJson(String& json) override;
+  
+private:
+  void writeRegister(uint8_t reg, uint32_t value);
+  bool readRegister(uint8_t reg, uint32_t& value);
+  void writeChopconf();
+  
+  Stream& uart;
+  uint8_t address;
+  bool responding = false;
+  uint8_t mres = 8;          // Full steps
+  bool vsense = false;
+  uint16_t runCurrentMa = TMC_RUN_CURRENT_MA;
+  uint8_t holdPercent = TMC_HOLD_PERCENT;
+  uint8_t stallThreshold = TMC_STALL_THRESHOLD;
+};
+
+#if STEPPER_DRIVER == DRIVER_TMC2209
+Tmc2209Driver motorDriver(Serial2, TMC_ADDRESS);
+#else
+A4988Driver motorDriver;
+#endif
+StepperDriver& driver = motorDriver;
+
+volatile bool stallSignalled = false;  // Set from the DIAG interrupt
+uint32_t stallCount = 0;
+
 // Load Cell Configuration
 float calibration_factor = -7050.0;  // Adjust based on your load cell
 HX711 scale;
 
+// Load Cell Health Configuration
+// Every reading is checked before it reaches the weight filter. While the
+// load cell is faulted its weight is withheld and portions are dispensed
+// open loop from the learned grams-per-step model.
+#define SENSOR_NOT_READY_MS 1000       // No conversion for this long (HX711 runs at 10 Hz)
+#define SENSOR_STUCK_SAMPLES 30        // Identical raw counts in a row
+#define SENSOR_RAW_MAX 8388607L        // 24-bit full scale; the HX711 clips here
+#define SENSOR_RAW_MIN -8388608L
+#define SENSOR_MAX_JUMP_GRAMS 250.0    // Between consecutive accepted readings
+#define SENSOR_MAX_JUMPS 5             // Rejected jumps per window before faulting
+#define SENSOR_JUMP_WINDOW_MS 10000
+#define SENSOR_MAX_NOISE_GRAMS 5.0     // RMS sample-to-sample noise
+#define SENSOR_NOISE_ALPHA 0.05
+#define SENSOR_RECOVERY_MS 5000        // Clean readings needed to clear a fault
+
+enum SensorFault {
+  SENSOR_OK,
+  SENSOR_NOT_READY,
+  SENSOR_STUCK,
+  SENSOR_SATURATED,
+  SENSOR_ERRATIC,
+  SENSOR_NOISY
+};
+
+struct LoadCellHealth {
+  SensorFault fault;         // SENSOR_OK when weight feedback can be trusted
+  SensorFault lastFault;
+  unsigned long faultSince;
+  bool recovering;           // Readings are clean again, waiting out SENSOR_RECOVERY_MS
+  unsigned long cleanSince;
+  unsigned long lastReadyAt;
+  bool tared;                // Offset taken; false if the HX711 was missing at boot
+  long lastRaw;
+  uint16_t sameCount;
+  bool havePrevious;
+  float lastReading;         // Last accepted reading
+  bool pendingJump;          // One outlier held back
+  float jumpReading;
+  uint8_t jumps;
+  unsigned long jumpWindowStart;
+  float noiseVar;            // EMA of half the squared sample-to-sample change
+  uint32_t faults;           // Since boot
+  uint32_t rejected;         // Readings kept out of the filter
+};
+LoadCellHealth loadCell;
+
 // Stepper Motor Object
 AccelStepper stepper(MOTOR_INTERFACE_TYPE, STEP_PIN, DIR_PIN);
 
 // Web Server
-WebServer server(80);
+// WebServer keeps serving a client until it closes the connection or
+// HTTP_MAX_CLOSE_WAIT (2 s) passes, and accepts nobody else meanwhile.
+// Parked long-polls and the sample stream take the socket over instead.
+class FeederServer : public WebServer {
+public:
+  FeederServer(int port) : WebServer(port) {}
+  
+  // The current client, which the server then lets go of when the handler
+  // returns; the caller's copy keeps the socket open
+  WiFiClient detachClient() {
+    WiFiClient client = _currentClient;
+    _currentClient = WiFiClient();
+    return client;
+  }
+};
+FeederServer server(80);
+
+// Scheduler Configuration
+// Periodic sensor and bookkeeping work runs from a timer queue in loop().
+// Each job has a period, a deadline (how late after its release it may
+// still start) and a priority; of the jobs due, the highest priority runs
+// first, then the earliest deadline. Starting past the deadline counts as
+// a miss, so a new job that hogs loop() shows up against the jobs it
+// delays. Motion and the web server still run on every loop() pass.
+#define WEIGHT_POLL_MS 5               // HX711 readiness; 80 SPS is one reading per 12.5 ms
+#define WEIGHT_DEADLINE_MS 10
+#define IR_SAMPLE_MS 10
+#define IR_SAMPLE_DEADLINE_MS 20
+#define TELEMETRY_PERIOD_MS 20         // Long-poll answers and link quality
+#define TELEMETRY_DEADLINE_MS 100
+#define STATUS_PERIOD_MS 5000          // Serial status print
+#define STATUS_DEADLINE_MS 1000
+#define HOUSEKEEPING_PERIOD_MS 100     // Roaming, counters, OTA reboot
+#define HOUSEKEEPING_DEADLINE_MS 1000
+
+// Indexed by JobPriority; the job table and its heap live in
+// include/scheduler_heap.h
+const char* const PRIORITY_NAMES[] = { "sampling", "input", "telemetry", "reporting", "housekeeping" };
+
+Scheduler scheduler;
+
+// State Version / Long-Poll Configuration
+#define LONGPOLL_TIMEOUT_MS 25000      // Max time a /api/status request is parked
+#define MAX_PARKED_CLIENTS 4           // Concurrent long-poll requests
+#define WEIGHT_CHANGE_THRESHOLD 0.5    // Grams of change that count as new state
+#define WEIGHT_FILTER_ALPHA 0.2        // EMA factor for the background weight sample
+
+// Observable feeder state. stateVersion only ever increases; any change a
+// client could care about (weight, IR, dispense) bumps it.
+uint32_t stateVersion = 1;
+float currentWeight = 0.0;             // Filtered weight, updated from loop()
+float publishedWeight = 0.0;           // Weight at the last version bump
+int currentIR = HIGH;
+
+// Shared Sensor Snapshot Configuration
+// The seqlock itself lives in include/sensor_snapshot.h
+SnapshotCell sensorCell;
+SensorSnapshot lastPublished;          // Writer's own copy, loop() only
+
+// Link Quality Configuration
+// RSSI, telemetry write failures and how long telemetry takes to leave the
+// socket are tracked continuously. The worst of the three sets the link
+// level, and the level sets telemetry cadence and detail so a marginal
+// link isn't flooded with updates that would only time out.
+#define LINK_SAMPLE_MS 2000
+#define LINK_ALPHA 0.2                 // EMA factor for all link measurements
+#define LINK_UPGRADE_HOLD_MS 10000     // A better level must last this long
+#define RSSI_FAIR -70.0                // dBm
+#define RSSI_POOR -80.0
+#define SEND_MS_FAIR 50.0              // Time to hand a response to the socket
+#define SEND_MS_POOR 250.0
+#define SEND_FAILURE_FAIR 0.05         // Share of failed or short writes
+#define SEND_FAILURE_POOR 0.2
+
+enum LinkLevel { LINK_GOOD, LINK_FAIR, LINK_POOR };
+
+struct LinkPolicy {
+  unsigned long minPushIntervalMs;     // Between change-driven long-poll answers
+  float weightThreshold;               // Grams of change that count as new state
+  unsigned long streamFlushMs;         // Longest a streamed sample waits
+  bool streamSummariesOnly;
+};
+const LinkPolicy LINK_POLICIES[] = {
+  { 0,    WEIGHT_CHANGE_THRESHOLD,     100,  false },  // LINK_GOOD
+  { 500,  2 * WEIGHT_CHANGE_THRESHOLD, 400,  false },  // LINK_FAIR
+  { 2000, 4 * WEIGHT_CHANGE_THRESHOLD, 1000, true  },  // LINK_POOR
+};
+
+struct LinkQuality {
+  float rssi;
+  float sendMs;
+  float failureRate;
+  LinkLevel level;
+  LinkLevel pending;         // Better level waiting out the hold time
+  unsigned long pendingSince;
+  unsigned long sampledAt;
+  unsigned long lastPushAt;  // Last change-driven long-poll answer
+};
+LinkQuality linkQuality = { 0.0, 0.0, 0.0, LINK_GOOD, LINK_GOOD, 0, 0, 0 };
+
+// Long-poll requests waiting for stateVersion to move past `since`
+struct ParkedClient {
+  WiFiClient client;
+  uint32_t since;
+  unsigned long parkedAt;
+  unsigned long dueAt;       // When an injected delay started, 0 if none
+  bool active;
+};
+ParkedClient parkedClients[MAX_PARKED_CLIENTS];
+
+// Feeding Program Configuration
+#define MAX_PROGRAM_PORTIONS 8
+#define PORTION_SETTLE_MS 1500         // Time for kibble to land and the scale to settle
+#define MAX_PORTION_STEPS 4000         // Safety cap on a single portion's move
+#define MAX_PORTION_GRAMS 500.0        // Larger portions are rejected, not capped
+#define MAX_PORTION_INTERVAL_MS 86400000UL
+#define MAX_BOWL_GRAMS 5000.0          // Highest onlyIfBelow threshold accepted
+#define MIN_LEARN_GRAMS 1.0            // Smallest delivery trusted for learning
+#define DEFAULT_GRAMS_PER_STEP 0.025   // ~10 g per DISPENSE_STEPS until learned
+#define GPS_LEARN_ALPHA 0.3            // EMA factor for the grams-per-step model
+#define NO_CONDITION -1.0
+#define PLAN_MARGIN 1.25               // Step budget over the model when the scale can stop us
+#define DEFAULT_FLIGHT_DELAY_MS 300.0  // Auger exit to landing, until learned
+#define MAX_FLIGHT_DELAY_MS 2000.0
+#define FLIGHT_LEARN_ALPHA 0.3
+#define MIN_LEARN_FLOW 2.0             // g/s at stop needed to learn the flight delay
+#define MOTION_HISTORY_INTERVAL_MS 25
+#define MOTION_HISTORY_SIZE 100        // 2.5 s of step positions
+
+enum PortionResult {
+  PORTION_PENDING,
+  PORTION_SETTLING,
+  PORTION_DONE,
+  PORTION_SKIPPED_FULL,      // Bowl was not below the portion's threshold
+  PORTION_SKIPPED_BLOCKED,   // IR obstruction when the portion was due
+  PORTION_CANCELLED,
+  PORTION_JAMMED,            // Driver reported a stall during the move
+  PORTION_SKIPPED_NO_WEIGHT  // Conditional, and the load cell was faulted
+};
+
+struct Portion {
+  float grams;
+  unsigned long intervalMs;  // Wait after the previous portion's motion ends
+  float onlyIfBelow;         // Bowl threshold in grams, NO_CONDITION to always run
+  PortionResult result;
+  float steps;               // Full steps, including the fine phase
+  float startWeight;         // Settled bowl weight before this portion
+  float delivered;
+  bool stoppedEarly;         // Predictive stop fired
+  float observedAtStop;      // Scale-visible delivery when the stop was issued
+  float flowAtStop;          // g/s at that moment
+  float decelAtStop;         // Predicted grams still to come out while decelerating
+  bool openLoop;             // Dispensed from the model; delivered is an estimate
+  bool fineApproach;         // Bulk phase done, finishing in microsteps
+  float moveStartPosition;   // Full steps
+  float fineStartPosition;   // Full steps
+  float fineRemainder;       // Open-loop only: fractional steps for the fine phase
+  bool jammed;
+};
+
+enum ProgramState {
+  PROGRAM_IDLE,
+  PROGRAM_WAITING,    // Interval before portions[current]
+  PROGRAM_MOVING,     // portions[current] is being dispensed
+  PROGRAM_DRAINING    // All motion done, last settle measurement pending
+};
+
+// A program is executed from loop(). The settle measurement of one portion
+// runs while the next portion's move is already ramping up; the food the new
+// move has delivered by then is estimated from gramsPerStep and taken out.
+struct FeedProgram {
+  uint32_t id;
+  Portion portions[MAX_PROGRAM_PORTIONS];
+  uint8_t total;             // Portions requested
+  uint8_t count;             // Portions that will run (shrinks on cancel)
+  uint8_t current;
+  int8_t settling;           // Portion awaiting its settle measurement, -1 if none
+  ProgramState state;
+  unsigned long phaseStart;  // When the current interval began
+  unsigned long settleAt;    // When `settling` can be measured
+  unsigned long startDelayMs;  // Fleet stagger before the first portion
+};
+FeedProgram program;
+float gramsPerStep = DEFAULT_GRAMS_PER_STEP;
+
+// In-flight mass model. The scale lags the bowl by the food's flight time
+// plus the delay of the weight filter; both are tracked so the stop can be
+// issued that much mass ahead of the target.
+float flightDelayMs = DEFAULT_FLIGHT_DELAY_MS;
+float sampleIntervalMs = 100.0;        // Measured time between weight samples
+unsigned long lastWeightSampleAt = 0;
+
+// Recent stepper positions, so in-flight mass follows the actual flow over
+// the lag window rather than the instantaneous speed during ramps
+struct MotionSample {
+  unsigned long at;
+  float position;            // Full steps
+};
+MotionSample motionHistory[MOTION_HISTORY_SIZE];
+uint8_t motionHistoryHead = 0;
+
+// Simulation / Benchmark Configuration
+#define SIM_SAMPLE_INTERVAL_MS 100     // Simulated HX711 at 10 SPS
+#define SIM_FLIGHT_BUCKET_MS 20        // Food emitted within this window lands together
+#define SIM_MAX_IN_FLIGHT 32
+#define BENCH_MAX_REPS 10
+
+// Auger/food behaviour for the simulated bowl
+struct FoodProfile {
+  const char* name;
+  float gramsPerStep;
+  float flowVariation;       // Relative std-dev of delivered mass (clumping)
+  unsigned long flightMs;    // Time from leaving the auger to landing
+};
+const FoodProfile FOOD_PROFILES[] = {
+  { "small_kibble", 0.020, 0.10, 250 },
+  { "large_kibble", 0.035, 0.30, 350 },
+  { "pellets",      0.025, 0.05, 200 },
+};
+const float BENCH_NOISE_LEVELS[] = { 0.05, 0.5 };        // Load-cell noise, g RMS
+const float BENCH_PORTION_SIZES[] = { 5.0, 15.0, 40.0 };  // Grams
+const uint8_t BENCH_PORTION_COUNTS[] = { 1, 4 };          // Portions per program, back to back
+#define PROFILE_COUNT (sizeof(FOOD_PROFILES) / sizeof(FOOD_PROFILES[0]))
+#define NOISE_COUNT (sizeof(BENCH_NOISE_LEVELS) / sizeof(BENCH_NOISE_LEVELS[0]))
+#define SIZE_COUNT (sizeof(BENCH_PORTION_SIZES) / sizeof(BENCH_PORTION_SIZES[0]))
+#define PIPELINE_COUNT (sizeof(BENCH_PORTION_COUNTS) / sizeof(BENCH_PORTION_COUNTS[0]))
+#define BENCH_CASE_COUNT (PROFILE_COUNT * NOISE_COUNT * SIZE_COUNT * PIPELINE_COUNT)
+
+// While active, the bowl is simulated from the commanded steps and the
+// motor driver stays disabled, so the real dispense logic can be exercised
+// without moving food.
+struct SimBowl {
+  bool active;
+  const FoodProfile* profile;
+  float noise;
+  float landed;              // True mass in the bowl
+  float lastPosition;        // Full steps
+  unsigned long lastSample;
+  struct {
+    unsigned long landAt;
+    float grams;
+  } inFlight[SIM_MAX_IN_FLIGHT];
+  uint8_t inFlightCount;
+};
+SimBowl sim;
+
+struct BenchCase {
+  uint8_t profile;
+  uint8_t noise;
+  uint8_t size;
+  uint8_t pipeline;
+  uint8_t runs;
+  float errors[BENCH_MAX_REPS];          // Delivered minus requested, grams per portion
+  unsigned long settleMs[BENCH_MAX_REPS];
+  unsigned long motorMs[BENCH_MAX_REPS];
+};
+
+struct Benchmark {
+  bool running;
+  bool runInProgress;
+  uint8_t reps;
+  uint8_t caseIndex;
+  unsigned long runStart;
+  unsigned long motorOnAtStart;
+  float gramsPerStepAtStart;
+  BenchCase cases[BENCH_CASE_COUNT];
+};
+Benchmark bench;
+
+// Contention Benchmark Configuration
+// Stresses the sensor snapshot against the two obvious alternatives, a
+// FreeRTOS queue and a mutex-guarded copy, with one unpaced writer on core
+// 0 and readers spread over both cores. Every value carries a check pattern
+// and a sequence number, so torn or out-of-order reads are counted, not
+// just throughput.
+#define CONTENTION_MAX_READERS 4
+#define CONTENTION_DEFAULT_MS 1000     // Per primitive
+#define CONTENTION_MAX_MS 3000         // Stays well inside the task watchdog
+#define CONTENTION_YIELD_OPS 1024      // Operations between yields, so idle tasks run
+#define CONTENTION_QUEUE_LENGTH 16
+
+enum ContentionPrimitive : uint8_t { CONTENTION_SNAPSHOT, CONTENTION_QUEUE, CONTENTION_MUTEX, CONTENTION_PRIMITIVES };
+const char* const CONTENTION_NAMES[CONTENTION_PRIMITIVES] = { "snapshot", "queue", "mutex" };
+
+struct ContentionResult {
+  uint32_t elapsedMs;
+  uint32_t writes;
+  uint32_t writeStalls;      // Queue full
+  uint32_t reads;
+  uint32_t retries;          // Snapshot reads that overlapped a write
+  uint32_t torn;             // Reads failing the check pattern or going backwards
+  uint32_t maxWriteUs;
+  uint32_t maxReadUs;        // Includes waiting for data on the queue
+};
+
+struct ContentionBench {
+  std::atomic<bool> running;
+  std::atomic<uint8_t> phase;        // Primitive being measured while running
+  uint8_t readers;
+  uint32_t durationMs;
+  std::atomic<bool> stop;
+  std::atomic<uint8_t> live;         // Worker tasks still running
+  SnapshotCell cell;
+  QueueHandle_t queue;
+  SemaphoreHandle_t mutex;
+  SensorSnapshot guarded;            // The mutex-protected copy
+  ContentionResult results[CONTENTION_PRIMITIVES];
+};
+ContentionBench contention;
+portMUX_TYPE contentionLock = portMUX_INITIALIZER_UNLOCKED;  // Workers fold results under it
+
+// Driver-enabled time, for benchmarks and the motor duty statistics
+unsigned long motorOnMs = 0;
+unsigned long motorEnabledAt = 0;
+bool motorEnabled = false;
+
+// Motor Governor Configuration
+// The A4988 drives full coil current whenever ENABLE is low, stepping or
+// not, so heat is modelled from enabled time with a first-order model:
+// 0.0 is ambient, 1.0 the steady state of running continuously.
+#define THERMAL_TAU_MS 120000.0        // Heating/cooling time constant
+#define THERMAL_LIMIT 0.6              // New moves held back above this
+#define THERMAL_RESUME 0.45            // ...until cooled to this
+#define HOLD_AFTER_MOVE_MS 150         // Keep the rotor energised while it settles
+#define HOLD_WINDOW_MS 600             // Stay enabled across gaps up to this long
+#define NO_NEXT_MOVE 0xFFFFFFFFUL
+
+struct MotorGovernor {
+  float heat;
+  unsigned long updatedAt;
+  bool throttled;
+  bool releasePending;
+  unsigned long releaseAt;
+  uint32_t deferredMoves;    // Moves that had to wait for cooling
+};
+MotorGovernor governor;
+
+// Feeding History
+// Settled and skipped portions, most recent HISTORY_SIZE kept. Records are
+// numbered from boot so readers can page through and spot gaps.
+#define HISTORY_SIZE 32
+
+struct FeedRecord {
+  uint32_t at;               // millis() when the result was known
+  uint32_t programId;
+  float grams;
+  float delivered;
+  uint8_t result;            // PortionResult
+};
+FeedRecord feedHistory[HISTORY_SIZE];
+uint32_t feedHistoryCount = 0;       // Records ever written
+
+// On-Demand Dispensing Configuration
+// In on-demand mode an IR visit earns a small portion, within a rolling
+// 24 h budget and a cooldown between portions. The IR edge interrupt wakes
+// a task above loop() priority that debounces, decides and makes the first
+// step itself, so the reaction never waits behind HTTP or a loop() pass.
+// The rest of the move is stepped from loop() like any other, and is
+// dispensed open loop: it is too short for the predictive stop to help.
+// The task only starts a move that needs nothing but the stepper: a step
+// mode switch, a cooling governor or a slot of the site motor budget to
+// negotiate are left to loop(), which starts the visit portion like any
+// other move or gives up after ON_DEMAND_PENDING_MS.
+#define ON_DEMAND_GRAMS 5.0              // Defaults; set via /api/ondemand
+#define ON_DEMAND_DAILY_GRAMS 60.0
+#define ON_DEMAND_COOLDOWN_MS 1800000UL
+#define ON_DEMAND_MAX_PER_DAY 32         // Portions remembered for the budget
+#define ON_DEMAND_DAY_MS 86400000UL
+#define IR_DEBOUNCE_MS 20                // Beam must stay broken this long
+#define ON_DEMAND_TASK_PRIORITY 5        // loop() runs at 1
+#define ON_DEMAND_LOCK_WAIT_MS 5         // Longest wait for loop() to let go of the motor
+#define ON_DEMAND_PENDING_MS 3000        // Longest a visit left to loop() waits for a fleet slot
+#define ON_DEMAND_PROGRAM_ID 0           // Feed history id of visit portions
+
+enum VisitOutcome {
+  VISIT_FED,
+  VISIT_BOUNCE,        // Beam clear again within IR_DEBOUNCE_MS
+  VISIT_DISABLED,
+  VISIT_COOLDOWN,
+  VISIT_BUDGET,
+  VISIT_BUSY,          // Program, benchmark or another move in progress
+  VISIT_THROTTLED,     // Thermal governor
+  VISIT_FLEET,         // No slot of the site motor budget within ON_DEMAND_PENDING_MS
+  VISIT_OUTCOME_COUNT,
+  VISIT_PENDING = VISIT_OUTCOME_COUNT  // Left to loop(); counted once decided
+};
+
+struct OnDemand {
+  bool enabled;
+  float grams;
+  float dailyGrams;
+  uint32_t cooldownMs;
+  TaskHandle_t task;
+  volatile uint32_t edgeUs;  // micros() of the last IR edge, from the interrupt
+  bool moving;               // A visit portion owns the stepper
+  bool started;              // The task started a move; loop() announces it
+  bool pending;              // A visit left to loop() to start
+  uint32_t pendingEdgeUs;
+  unsigned long pendingSince;
+  bool settling;
+  unsigned long settleAt;
+  Portion portion;
+  unsigned long fedAt[ON_DEMAND_MAX_PER_DAY];
+  float fedGrams[ON_DEMAND_MAX_PER_DAY];
+  uint8_t fedHead;           // Next slot; the previous one is the latest portion
+  uint32_t fedCount;         // Visit portions started since boot
+  uint32_t outcomes[VISIT_OUTCOME_COUNT];
+  uint32_t lastLatencyUs;    // IR edge to first step
+  uint32_t maxLatencyUs;
+  float meanLatencyUs;
+};
+OnDemand onDemand;
+Preferences onDemandPrefs;
+
+// Held by whichever context touches the stepper or the motor governor:
+// loop() for its motion passes, the on-demand task while it starts a move
+SemaphoreHandle_t motionMutex = NULL;
+
+// Fleet Coordination Configuration
+// Feeders on one power circuit share a budget of concurrently energised
+// motors, negotiated over a multicast group. Each program's first portion
+// is also offset by a slot derived from the device id, so a site-wide
+// schedule doesn't make every feeder ask at the same instant. Without
+// WiFi only the offset applies.
+#define FLEET_ENABLED true
+#define FLEET_GROUP_IP 239, 255, 70, 70
+#define FLEET_PORT 4570
+#define FLEET_MAGIC 0x314C4653         // "SFL1" little-endian
+#define FLEET_MOTOR_BUDGET 4           // Default; set per site via /api/fleet
+#define FLEET_STAGGER_SLOTS 8
+#define FLEET_STAGGER_SLOT_MS 250
+#define FLEET_SETTLE_MS 60             // Listen for competing requests this long
+#define FLEET_REQUEST_REPEAT_MS 100
+#define FLEET_REQUEST_TTL_MS 350       // A peer's request lapses unless repeated
+#define FLEET_REFRESH_MS 500           // Lease refresh while holding
+#define FLEET_LEASE_MARGIN_MS 1000
+#define FLEET_ABANDON_MS 500           // Drop a request nobody is waiting on
+#define FLEET_DISPENSE_WAIT_MS 3000      // Longest a queued /dispense waits for the budget
+#define FLEET_MAX_PEERS 32
+#define FLEET_ANNOUNCE_MS 10000        // Presence for collectors (tools/aggregator.cpp)
+
+enum FleetMessage : uint8_t { FLEET_REQUEST = 1, FLEET_HOLD = 2, FLEET_RELEASE = 3, FLEET_ANNOUNCE = 4 };
+enum FleetState : uint8_t { FLEET_IDLE, FLEET_REQUESTING, FLEET_HOLDING };
+
+// 16-byte datagram, little-endian
+struct FleetPacket {
+  uint32_t magic;
+  uint8_t type;
+  uint8_t budget;            // Sender's configured budget, informational
+  uint16_t reserved;
+  uint32_t id;
+  uint32_t value;            // REQUEST: ms waited so far; HOLD: lease ms;
+                             // ANNOUNCE: HTTP port, HTTPS port << 16 (0 if off)
+};
+
+struct FleetPeer {
+  uint32_t id;               // 0 if the slot is free
+  FleetState state;
+  uint32_t waitingMs;        // As of heardAt
+  unsigned long heardAt;
+  unsigned long expiresAt;
+};
+
+struct Fleet {
+  WiFiUDP udp;
+  bool listening;
+  uint32_t id;
+  uint8_t budget;
+  FleetState state;
+  unsigned long requestedAt;
+  unsigned long lastAskedAt;   // Last fleetMayStart() while requesting
+  unsigned long lastSentAt;    // Budget messages only
+  unsigned long lastAnnouncedAt;
+  unsigned long leaseMs;
+  uint32_t grants;
+  uint32_t waits;              // Requests that had to wait for the budget
+  bool waited;
+  FleetPeer peers[FLEET_MAX_PEERS];
+};
+Fleet fleet;
+Preferences fleetPrefs;
+
+// A /dispense the site budget did not grant at once. loop() keeps asking
+// and runs it when granted, so the handler never waits.
+struct QueuedDispense {
+  bool pending;
+  unsigned long since;
+};
+QueuedDispense queuedDispense;
+
+// HTTPS Configuration
+// A TLS front end on port 443 proxies each request over loopback to the
+// plain web server, so every route is served on both. mbedtls runs on the
+// ESP32's AES, SHA and bignum accelerators (enabled in the core's sdkconfig).
+// A full handshake costs far more than a request, so connections are kept
+// alive between requests and reconnecting clients resume from a session
+// ticket or the session cache. Certificate and key are PEM in NVS,
+// installed through /api/tls (see tools/make_test_ca.sh).
+//
+// Once HTTPS is running, plain HTTP is read-only: control requests,
+// replacing the key through /api/tls among them, are refused unless they
+// came through the front end. The first certificate can only go over
+// plain HTTP, so install it on a network you trust. With httpRedirect set
+// (POST /api/tls) port 80 does nothing but redirect to HTTPS.
+#define TLS_ENABLED true
+#define TLS_PORT "443"
+#define TLS_BACKEND_PORT "80"
+#define TLS_MAX_SESSIONS 2             // Concurrent connections, ~25 KB heap each
+#define TLS_MIN_FREE_HEAP 60000        // Refuse new connections below this
+#define TLS_READ_TIMEOUT_MS 15000      // Keep-alive idle limit
+#define TLS_HANDSHAKE_TIMEOUT_MS 5000  // Whole handshake, so a stalled client frees its slot
+#define TLS_BACKEND_TIMEOUT_MS 30000   // Longer than a parked long-poll
+#define TLS_HEAD_MAX 2048              // Request or response head
+#define TLS_CACHE_ENTRIES 8
+#define TLS_SESSION_LIFETIME_S 86400
+#define TLS_TASK_STACK 10240
+
+struct TlsConnection;
 
-// Timing Variables
-unsigned long lastWeightDisplay = 0;
-const unsigned long weightDisplayInterval = 5000;  // 5 seconds for testing (change to 30000 for production)
+struct TlsServer {
+  bool running;
+  String error;
+  mbedtls_entropy_context entropy;
+  mbedtls_ctr_drbg_context drbg;
+  mbedtls_x509_crt cert;
+  mbedtls_pk_context key;
+  mbedtls_ssl_config conf;
+  mbedtls_ssl_cache_context cache;
+  mbedtls_ssl_ticket_context tickets;
+  mbedtls_net_context listener;
+  SemaphoreHandle_t slots;           // Free connection slots
+  SemaphoreHandle_t handshakeMutex;  // Handshake steps share the cache, tickets, RNG and key
+  TlsConnection* stepping;           // Whose handshake step holds the mutex
+  bool httpRedirect;                 // Port 80 only redirects while running
+  uint32_t connections;
+  uint32_t fullHandshakes;
+  uint32_t resumedHandshakes;
+  uint32_t requests;
+  uint32_t failures;                 // Handshakes that didn't complete
+  uint32_t refused;                  // No slot or too little heap
+  float fullHandshakeMs;             // EMAs
+  float resumedHandshakeMs;
+};
+TlsServer tls;
+Preferences tlsPrefs;
+
+struct TlsConnection {
+  mbedtls_net_context net;
+  uint8_t ip[16];
+  size_t ipLength;
+  bool resumed;                      // Set by the callbacks during its handshake
+  uint8_t buf[TLS_HEAD_MAX];
+  uint8_t head[TLS_HEAD_MAX + 64];   // Rewritten request or response head
+};
+
+// JSON Request Body Configuration
+// application/json bodies are collected into one fixed buffer rather than
+// the WebServer's "plain" argument String, and parsed in place: strings are
+// unescaped where they lie and handed out as pointers into the buffer, and
+// values go straight into fixed structs through schemas derived from those
+// structs at compile time (include/json_body.h). A body whose
+// Content-Length is over REQUEST_BODY_MAX is refused with 413 before any of
+// it is kept.
+#define REQUEST_BODY_MAX 2048
+
+enum BodyState : uint8_t { BODY_NONE, BODY_RECEIVING, BODY_READY, BODY_TOO_LARGE };
+
+struct RequestBody {
+  BodyState state;
+  size_t length;
+  char buf[REQUEST_BODY_MAX + 1];      // NUL-terminated once READY
+};
+RequestBody requestBody;
+
+// POST /api/program
+struct PortionBody {
+  float grams;
+  uint32_t intervalMs;
+  float below;
+};
+struct ProgramBody {
+  PortionBody portions[MAX_PROGRAM_PORTIONS];
+  uint32_t portionCount;
+};
+constexpr JsonField PORTION_FIELDS[] = {
+  JSON_FIELD(PortionBody, grams, 0),
+  JSON_FIELD(PortionBody, intervalMs, 0),
+  JSON_FIELD(PortionBody, below, 0),
+};
+constexpr JsonSchema PORTION_BODY = JSON_SCHEMA(PortionBody, PORTION_FIELDS);
+constexpr JsonField PROGRAM_FIELDS[] = {
+  JSON_OBJECTS_FIELD(ProgramBody, portions, portionCount, PORTION_BODY),
+};
+constexpr JsonSchema PROGRAM_BODY = JSON_SCHEMA(ProgramBody, PROGRAM_FIELDS);
+
+// POST /api/ondemand
+struct OnDemandBody {
+  bool enabled;
+  float grams;
+  float dailyGrams;
+  uint32_t cooldownMs;
+};
+constexpr JsonField ON_DEMAND_FIELDS[] = {
+  JSON_FIELD(OnDemandBody, enabled, 0),
+  JSON_FIELD(OnDemandBody, grams, 0),
+  JSON_FIELD(OnDemandBody, dailyGrams, 0),
+  JSON_FIELD(OnDemandBody, cooldownMs, 0),
+};
+constexpr JsonSchema ON_DEMAND_BODY = JSON_SCHEMA(OnDemandBody, ON_DEMAND_FIELDS);
+
+// POST and DELETE /api/wifi
+struct WifiBody {
+  const char* ssid;
+  const char* password;
+};
+constexpr JsonField WIFI_FIELDS[] = {
+  JSON_FIELD(WifiBody, ssid, 32),
+  JSON_FIELD(WifiBody, password, 64),
+};
+constexpr JsonSchema WIFI_BODY = JSON_SCHEMA(WifiBody, WIFI_FIELDS);
+
+// Response Compression Configuration
+// Responses are gzip- or deflate-encoded when the client's Accept-Encoding
+// allows it. The encoder is LZ77 over a small window with the fixed Huffman
+// codes (include/deflate.h), so its whole state is a few KB (the ROM's
+// miniz compressor keeps a 32 KB dictionary and much larger tables). A
+// body whose compressed form fits the Deflater's buffer keeps an exact
+// Content-Length, and with it TLS keep-alive; one that doesn't shrink is
+// abandoned mid-encode and goes out as it is. Anything larger is streamed
+// buffer by buffer with chunked encoding, and the TLS proxy closes after it.
+#define COMPRESS_MIN_BYTES 512         // Smaller responses go out as they are
+Deflater deflater;           // Only loop() sends responses
+
+// Network Fault Injection Configuration
+// Scripted network faults for recovery testing on the bench, in the spirit
+// of the simulated bowl. Each step of a script opens a window in which the
+// link is dropped, known access points vanish from scans, fleet datagrams
+// and long-poll answers are lost or delayed, and the sample stream drains
+// like a slow client. Faults act where the firmware meets the network, so
+// reconnecting, roaming, re-polling and backpressure all run their normal
+// code. Outage, recovery time and delivery counts are kept per script.
+#define NETFAULT_ENABLED false         // Bench units only: anyone on the LAN could run a script
+#define NETFAULT_MAX_STEPS 8
+#define NETFAULT_SETTLE_MS 120000UL    // Longest wait for recovery after the last step
+
+struct NetFaultStep {
+  uint32_t atMs;             // From the start of the script
+  uint32_t durationMs;
+  bool dropLink;             // Disconnect when the step starts
+  bool hideAps;              // Known networks missing from scan results
+  uint32_t lossPercent;      // Of long-poll answers and fleet datagrams
+  uint32_t latencyMs;        // Added before long-poll answers
+  uint32_t slowBytesPerSec;  // Sample stream drain rate, 0 for unlimited
+};
+
+struct NetFaultScript {
+  NetFaultStep steps[NETFAULT_MAX_STEPS];
+  uint32_t stepCount;
+};
+constexpr JsonField NETFAULT_STEP_FIELDS[] = {
+  JSON_FIELD(NetFaultStep, atMs, 0),
+  JSON_FIELD(NetFaultStep, durationMs, 0),
+  JSON_FIELD(NetFaultStep, dropLink, 0),
+  JSON_FIELD(NetFaultStep, hideAps, 0),
+  JSON_FIELD(NetFaultStep, lossPercent, 0),
+  JSON_FIELD(NetFaultStep, latencyMs, 0),
+  JSON_FIELD(NetFaultStep, slowBytesPerSec, 0),
+};
+constexpr JsonSchema NETFAULT_STEP_BODY = JSON_SCHEMA(NetFaultStep, NETFAULT_STEP_FIELDS);
+constexpr JsonField NETFAULT_SCRIPT_FIELDS[] = {
+  JSON_OBJECTS_FIELD(NetFaultScript, steps, stepCount, NETFAULT_STEP_BODY),
+};
+constexpr JsonSchema NETFAULT_SCRIPT_BODY = JSON_SCHEMA(NetFaultScript, NETFAULT_SCRIPT_FIELDS);
+
+struct NetFault {
+  NetFaultScript script;
+  bool running;
+  unsigned long startedAt;
+  unsigned long endsAt;      // Offset of the last step's end
+  int step;                  // Active step, -1 between steps
+  NetFaultStep active;       // Faults in force now, all zero between steps
+  float streamBudget;        // Bytes the slow stream may still write
+  unsigned long streamBudgetAt;
+  unsigned long outageSince; // 0 while connected
+  unsigned long clearedAt;   // Link fault ended with the link still down
+
+  // Results of the current or last script
+  unsigned long outageMs;
+  unsigned long longestOutageMs;
+  unsigned long worstRecoveryMs;  // From a link fault ending to reconnecting
+  uint32_t reconnects;
+  uint32_t pollsAnswered;
+  uint32_t pollsLost;
+  uint32_t datagramsSent;
+  uint32_t datagramsSentLost;
+  uint32_t datagramsReceived;
+  uint32_t datagramsReceivedLost;
+  uint32_t streamBytes;      // Written while throttled
+};
+NetFault netFault;
+
+// Lifetime Counters Configuration
+// Counters live in RAM and are committed as one blob, alternating between
+// two NVS keys so a write torn by power loss leaves the previous copy
+// intact. Commits are batched: hourly while anything changed, sooner
+// after a jam or reboot is recorded, and always before a planned restart.
+#define COUNTERS_COMMIT_MS 3600000UL
+#define COUNTERS_URGENT_COMMIT_MS 60000UL  // After jams and reboot causes
+#define COUNTERS_MAGIC 0x43544E43          // "CNTC" little-endian
+#define RESET_REASON_COUNT 11              // esp_reset_reason_t values
+
+struct LifetimeCounters {
+  uint32_t magic;
+  uint32_t sequence;         // Higher copy wins on load
+  uint32_t dispenses;        // Portions and manual dispenses
+  double gramsDelivered;     // Measured, where a scale was present
+  uint64_t fineSteps;        // 1/16 steps moved
+  uint64_t motorOnMs;
+  uint32_t jams;
+  uint32_t resets[RESET_REASON_COUNT];
+  uint32_t crc;              // CRC-32 of everything above
+};
+
+struct CounterStore {
+  LifetimeCounters values;
+  bool dirty;
+  bool urgent;
+  unsigned long committedAt;
+  long lastFinePosition;
+  unsigned long lastMotorOnMs;
+  uint32_t commits;          // Since boot
+};
+CounterStore counters;
+Preferences counterPrefs;
+
+// Wired Gateway Configuration
+// Binary protocol on UART1, beside the human-readable log on Serial. Each
+// frame is COBS-encoded and ends in 0x00. The decoded payload is
+// [type][seq][body][CRC-16/CCITT-FALSE], multi-byte fields little-endian
+// (include/gateway_frame.h).
+// Replies echo the request's seq. Unsolicited status events need a credit
+// from the gateway (GW_CREDIT) and coalesce while none is available.
+#define GATEWAY_ENABLED true
+#define GATEWAY_BAUD 230400
+#define GATEWAY_PROTOCOL_VERSION 1
+#define GATEWAY_TX_BUFFER 512
+#define HISTORY_PER_FRAME 6
+
+enum GatewayMessage : uint8_t {
+  GW_PING = 0x01,            // -> GW_PONG
+  GW_GET_STATUS = 0x02,      // -> GW_STATUS
+  GW_START_PROGRAM = 0x03,   // count, count x (grams f32, intervalMs u32, onlyIfBelow f32) -> GW_RESULT
+  GW_CANCEL_PROGRAM = 0x04,  // -> GW_RESULT
+  GW_GET_HISTORY = 0x05,     // from u32 -> GW_HISTORY
+  GW_CREDIT = 0x06,          // credits u8, no reply
+  GW_PONG = 0x81,            // protocol, framesIn, framesOut, crcErrors, overflows
+  GW_STATUS = 0x82,          // see gatewayStatusBody()
+  GW_RESULT = 0x83,          // code u8, value u32
+  GW_EVENT_STATUS = 0x84,    // as GW_STATUS, sent on state changes
+  GW_HISTORY = 0x85          // first u32, count u8, count x FeedRecord
+};
+
+enum GatewayResult : uint8_t {
+  GW_OK,
+  GW_BUSY,
+  GW_INVALID,
+  GW_UNKNOWN
+};
+
+struct Gateway {
+  uint8_t rx[GATEWAY_MAX_FRAME];
+  size_t rxLength;
+  bool rxOverflow;           // Discarding until the next delimiter
+  uint8_t credits;
+  uint8_t eventSeq;
+  uint32_t eventVersion;     // stateVersion last reported
+  uint32_t framesIn;
+  uint32_t framesOut;
+  uint32_t crcErrors;
+  uint32_t overflows;
+};
+Gateway gateway;
+
+// Raw Sample Stream Configuration
+// One WebSocket client on /api/stream gets every HX711 sample and every
+// motor step in batched binary frames. Frames are written without
+// blocking; if the client falls behind far enough to fill the rings, the
+// stream drops to periodic summaries until it keeps up again.
+#define STREAM_SAMPLE_RING 256
+#define STREAM_STEP_RING 512
+#define STREAM_BATCH_SAMPLES 32
+#define STREAM_BATCH_STEPS 64
+#define STREAM_SUMMARY_MS 500
+#define STREAM_RESUME_SUMMARIES 2      // Unblocked summaries before raw resumes
+#define STREAM_HEADER_SIZE 14
+#define STREAM_SUMMARY_SIZE 44
+#define STREAM_FRAME_MAX (4 + STREAM_HEADER_SIZE + STREAM_BATCH_SAMPLES * 16 + STREAM_BATCH_STEPS * 8)
+#define STREAM_FRAME_RAW 1
+#define STREAM_FRAME_SUMMARY 2
+
+struct StreamSample {
+  uint32_t atUs;
+  int32_t raw;               // HX711 counts
+  float filtered;            // Grams, as published
+  int32_t position;          // 1/16 steps; & 63 is the electrical phase
+};
+
+struct StepEvent {
+  uint32_t atUs;
+  int32_t position;          // 1/16 steps after the step
+};
+
+struct SampleStream {
+  WiFiClient client;
+  bool active;
+  bool summarizing;
+  uint8_t cleanSummaries;    // Consecutive summaries sent without blocking
+  StreamSample samples[STREAM_SAMPLE_RING];
+  uint16_t sampleHead;       // Oldest unsent
+  uint16_t sampleCount;
+  StepEvent steps[STREAM_STEP_RING];
+  uint16_t stepHead;
+  uint16_t stepCount;
+  long lastPosition;
+  uint8_t tx[STREAM_FRAME_MAX];  // Frame being written
+  size_t txLength;
+  size_t txSent;
+  unsigned long txStartedAt;
+  uint8_t rx[2 + 4 + 125];   // One client control frame
+  size_t rxLength;
+  unsigned long lastFlush;
+  uint32_t seq;
+  uint32_t dropped;          // Samples only delivered as summaries
+  // Summary of samples since the last summary frame
+  uint32_t summaryFromUs;
+  uint32_t summaryToUs;
+  uint16_t summaryCount;
+  int32_t rawMin;
+  int32_t rawMax;
+  float rawSum;
+  float lastFiltered;
+  uint32_t summarySteps;
+};
+SampleStream stream;
+
+// OTA Update Configuration
+#define OTA_SECTOR_SIZE 4096
+#define OTA_CHECKPOINT_SECTORS 16      // Persist resume state every 64 KB written
+#define OTA_PULL_RETRIES 5
+#define OTA_PULL_RETRY_DELAY_MS 2000
+#define OTA_RESTART_DELAY_MS 1000
+#define OTA_DELTA_MAGIC 0x31444653     // "SFD1" little-endian
+#define OTA_DELTA_HEADER_SIZE 40       // magic, target size, source SHA-256
+
+enum OtaFormat { OTA_FORMAT_FULL, OTA_FORMAT_DELTA };
+enum OtaState { OTA_IDLE, OTA_RECEIVING, OTA_DONE, OTA_FAILED };
+enum OtaParse { OTA_PARSE_HEADER, OTA_PARSE_OP, OTA_PARSE_BODY };
+
+// Resume state. Saved only right after a sector flush, when everything up to
+// outputOffset is on flash and the parser holds no buffered input.
+struct OtaCheckpoint {
+  uint8_t format;
+  uint8_t hasSha;
+  uint8_t op;
+  uint8_t parse;
+  uint32_t imageSize;
+  uint32_t inputOffset;      // Bytes of the upload consumed
+  uint32_t outputOffset;     // Bytes of the image on flash
+  uint32_t opSource;
+  uint32_t opRemaining;
+  uint8_t sha256[32];        // Expected SHA-256 of the finished image
+};
+
+struct OtaSession {
+  OtaState state;
+  OtaCheckpoint cp;
+  const esp_partition_t* partition;
+  uint8_t header[OTA_DELTA_HEADER_SIZE];
+  uint8_t headerFill;
+  uint8_t opArgs[8];
+  uint8_t opArgsFill;
+  uint16_t sectorFill;
+  uint16_t sectorsSinceCheckpoint;
+  bool rejected;             // Current upload refused; ignore its data
+  bool pulling;              // A pull is in progress; uploads are refused
+  bool pullStarted;          // The pull opened the session; retries resume it
+  String error;
+  unsigned long restartAt;
+};
+OtaSession ota;
+uint8_t otaSector[OTA_SECTOR_SIZE];
+Preferences otaPrefs;
+
+// The pull task only does the HTTP transfer. It posts what it receives to
+// loop(), which owns the session, the flash writes and otaPrefs, and asks
+// loop() where to resume and whether to retry.
+#define OTA_PULL_CHUNK 1024
+#define OTA_PULL_QUEUE_LENGTH 4
+
+enum OtaPullKind : uint8_t {
+  OTA_PULL_ATTEMPT,          // About to connect; replies with the resume offset
+  OTA_PULL_OPEN,             // Response arrived; replies whether to stream it
+  OTA_PULL_DATA,
+  OTA_PULL_END,              // Transfer over; replies whether to retry
+  OTA_PULL_EXIT              // Task is done; no reply
+};
+
+struct OtaPullMessage {
+  OtaPullKind kind;
+  uint16_t length;           // DATA
+  uint32_t offset;           // OPEN: input offset of the first byte sent
+  uint32_t size;             // OPEN: image size, 0 if unknown
+  uint8_t data[OTA_PULL_CHUNK];
+};
+
+struct OtaPullReply {
+  bool proceed;
+  uint32_t offset;           // ATTEMPT: where to resume
+};
+
+struct OtaPullRequest {
+  String url;
+  String format;
+  String sha256;
+  uint32_t size;
+};
+OtaPullRequest otaPullRequest;         // Read-only while ota.pulling
+QueueHandle_t otaPullMessages = NULL;
+QueueHandle_t otaPullReplies = NULL;
+std::atomic<bool> otaPullStreaming(false);  // Cleared by loop() to end a transfer early
 
 // Function Prototypes
 void setupWiFi();
 void handleRoot();
+void loadWifiNetworks();
+int bestKnownNetwork(int scanCount);
+void connectToScanned(int index);
+void serviceWiFi();
+void handleWifi();
 void handleDispense();
 void handleWeight();
 void handleNotFound();
+void handleStatus();
 void dispenseFood();
+void serviceQueuedDispense();
 float getWeight();
+void bumpStateVersion();
+void sampleWeight();
+void sampleIr();
+void confirmIr();
+void printStatus();
+void serviceTelemetry();
+void serviceHousekeeping();
+int schedulePeriodic(const char* name, JobFn fn, uint32_t periodMs, uint32_t deadlineMs, JobPriority priority);
+int scheduleOnce(const char* name, JobFn fn, uint32_t delayMs, uint32_t deadlineMs, JobPriority priority);
+void setupScheduler();
+void runScheduler();
+unsigned long schedulerIdleMs(unsigned long limitMs);
+void handleSchedule();
+String buildStatusJson();
+void serviceParkedClients();
+void handleProgram();
+bool startProgram(const float* grams, const unsigned long* intervals, const float* below, int count);
+bool weightFeedbackAvailable();
+bool acceptLoadCellReading(long raw, float& reading);
+void serviceLoadCellHealth();
+const char* sensorFaultName(SensorFault fault);
+void handleLoadCell();
+float plannedPortionSteps(const Portion& portion);
+void setStepMode(uint8_t mode);
+long motorFinePosition();
+float motorSteps();
+float motorSpeedSteps();
+float motorDecelSteps();
+float filterLagMs();
+float scaleLagMs();
+float positionLagging(unsigned long lagMs);
+float predictedInFlightGrams(float gps);
+float predictedDecelGrams(float gps);
+void recordMotionHistory();
+void cancelProgram();
+void serviceProgram();
+String buildProgramJson();
+void handleOta();
+void handleOtaUpload(HTTPUpload& upload);
+void handleOtaPull();
+void serviceOta();
+void serviceOtaPull();
+void setMotorEnabled(bool enabled);
+unsigned long motorOnTime();
+bool irBlocked();
+void acquireMotor();
+void releaseMotor(unsigned long nextMoveInMs);
+bool motorMayStart(long steps);
+unsigned long motorCooldownMs();
+void serviceMotorGovernor();
+void handleMotor();
+void serviceStallDetection();
+void recordFeedHistory(const Portion& portion, uint32_t programId);
+void serviceGateway();
+void handleStream();
+void streamRecordSample(long raw, float filtered);
+void streamRecordSteps();
+void serviceStream();
+void setupFleet();
+void receiveRequestBody(WebServer& srv, HTTPRaw& raw);
+bool hasRequestBody();
+bool parseRequestBody(const JsonSchema& schema, void* target);
+String jsonQuote(const char* text);
+void sendResponse(int code, const char* type, const String& body);
+void serviceNetFault();
+bool netFaultLose();
+size_t netFaultStreamAllowance(size_t wanted);
+void handleNetFault();
+void publishSensorSnapshot();
+void handleContend();
+void setupCounters();
+void serviceCounters();
+void commitCounters();
+void countDispense(float grams);
+void countJam();
+void handleCounters();
+void setupOnDemand();
+bool setupTls();
+void tlsListenTask(void* param);
+void tlsConnectionTask(void* param);
+void handleTls();
+void serviceOnDemand();
+bool visitBusy();
+void handleOnDemand();
+unsigned long fleetStartOffsetMs();
+bool fleetMayStart(unsigned long moveMs);
+void fleetRelease();
+void serviceFleet();
+void handleFleet();
+unsigned long estimateMoveMs(long steps);
+const LinkPolicy& linkPolicy();
+const char* linkLevelName(LinkLevel level);
+void noteTelemetrySend(bool ok, unsigned long elapsedMs);
+void serviceLinkQuality();
+void simulateBowl();
+void handleBenchmark();
+void serviceBenchmark();
+
+// ========================================
+// Route Table
+// ========================================
+// All HTTP routes are declared here once. The table is indexed at compile
+// time with a collision-free (perfect) hash of the path, so dispatch is a
+// single hash, one table probe and one strcmp, and nothing is allocated at
+// registration time.
+
+typedef void (*RouteHandlerFn)();
+typedef void (*RouteUploadFn)(HTTPUpload& upload);
+
+// Admission classes, each with its own token buckets. Reads are cheap;
+// renders build large responses or block on the scale; control commands
+// change state. Any non-GET request to a read route counts as control.
+enum RouteClass : uint8_t { ROUTE_READ, ROUTE_RENDER, ROUTE_CONTROL, ROUTE_CLASS_COUNT };
+
+struct Route {
+  const char* path;
+  HTTPMethod method;     // HTTP_ANY accepts every method
+  RouteHandlerFn handler;
+  RouteUploadFn upload;  // Streams multipart bodies; NULL if not accepted
+  RouteClass cls;
+};
+
+constexpr Route ROUTES[] = {
+  { "/",             HTTP_ANY,  handleRoot,      NULL,            ROUTE_RENDER },
+  { "/dispense",     HTTP_ANY,  handleDispense,  NULL,            ROUTE_CONTROL },
+  { "/weight",       HTTP_ANY,  handleWeight,    NULL,            ROUTE_RENDER },
+  { "/api/status",   HTTP_GET,  handleStatus,    NULL,            ROUTE_READ },
+  { "/api/program",  HTTP_ANY,  handleProgram,   NULL,            ROUTE_READ },
+  { "/api/ota",      HTTP_ANY,  handleOta,       handleOtaUpload, ROUTE_READ },
+  { "/api/ota/pull", HTTP_POST, handleOtaPull,   NULL,            ROUTE_CONTROL },
+  { "/api/bench",    HTTP_ANY,  handleBenchmark, NULL,            ROUTE_READ },
+  { "/api/motor",    HTTP_ANY,  handleMotor,     NULL,            ROUTE_READ },
+  { "/api/stream",   HTTP_GET,  handleStream,    NULL,            ROUTE_READ },
+  { "/api/wifi",     HTTP_ANY,  handleWifi,      NULL,            ROUTE_READ },
+  { "/api/fleet",    HTTP_ANY,  handleFleet,     NULL,            ROUTE_READ },
+  { "/api/counters", HTTP_GET,  handleCounters,  NULL,            ROUTE_READ },
+  { "/api/loadcell", HTTP_GET,  handleLoadCell,  NULL,            ROUTE_READ },
+  { "/api/ondemand", HTTP_ANY,  handleOnDemand,  NULL,            ROUTE_READ },
+  { "/api/tls",      HTTP_ANY,  handleTls,       NULL,            ROUTE_READ },
+  { "/api/netfault", HTTP_ANY,  handleNetFault,  NULL,            ROUTE_READ },
+  { "/api/contend",  HTTP_ANY,  handleContend,   NULL,            ROUTE_READ },
+  { "/api/sched",    HTTP_GET,  handleSchedule,  NULL,            ROUTE_READ },
+};
+constexpr size_t ROUTE_COUNT = sizeof(ROUTES) / sizeof(ROUTES[0]);
+
+constexpr size_t ROUTE_SLOTS = routeSlotCount(ROUTE_COUNT);
+
+struct RouteIndex {
+  uint32_t seed;
+  int8_t slot[ROUTE_SLOTS];  // Index into ROUTES, -1 if empty
+};
+
+// Searches for a seed under which every path lands in its own slot
+constexpr RouteIndex buildRouteIndex() {
+  for (uint32_t seed = 0; seed < 4096; seed++) {
+    RouteIndex index = { seed, {} };
+    for (size_t i = 0; i < ROUTE_SLOTS; i++) {
+      index.slot[i] = -1;
+    }
+    bool collision = false;
+    for (size_t r = 0; r < ROUTE_COUNT && !collision; r++) {
+      size_t s = routeHash(ROUTES[r].path, seed) & (ROUTE_SLOTS - 1);
+      if (index.slot[s] >= 0) {
+        collision = true;
+      } else {
+        index.slot[s] = (int8_t)r;
+      }
+    }
+    if (!collision) {
+      return index;
+    }
+  }
+  return { UINT32_MAX, {} };
+}
+constexpr RouteIndex ROUTE_INDEX = buildRouteIndex();
+static_assert(ROUTE_INDEX.seed != UINT32_MAX, "No perfect hash seed for ROUTES; widen the search");
+static_assert(ROUTE_COUNT < 128, "Route index uses int8_t slots");
+
+const Route* findRoute(const char* path) {
+  int8_t r = ROUTE_INDEX.slot[routeHash(path, ROUTE_INDEX.seed) & (ROUTE_SLOTS - 1)];
+  if (r < 0 || strcmp(ROUTES[r].path, path) != 0) {
+    return NULL;
+  }
+  return &ROUTES[r];
+}
+
+// ========================================
+// Admission Control
+// ========================================
+// Token buckets per client address and admission class, plus one shared
+// bucket per class bounding the total. Requests over the limit get a 429
+// before their handler runs, so a flooding dashboard costs one lookup per
+// request and control commands keep their own budget whatever reads do.
+
+struct BucketLimit {
+  float ratePerSec;
+  float burst;
+};
+const BucketLimit CLIENT_LIMITS[ROUTE_CLASS_COUNT] = {
+  { 10.0, 20.0 },  // ROUTE_READ
+  { 1.0,  3.0 },   // ROUTE_RENDER
+  { 2.0,  5.0 },   // ROUTE_CONTROL
+};
+const BucketLimit TOTAL_LIMITS[ROUTE_CLASS_COUNT] = {
+  { 30.0, 40.0 },
+  { 3.0,  5.0 },
+  { 6.0,  10.0 },
+};
+#define ADMISSION_CLIENTS 8            // Addresses tracked; least recent evicted
+
+struct TokenBucket {
+  float tokens;
+  unsigned long refilledAt;
+  bool primed;               // Starts full on first use
+};
+
+struct ClientBuckets {
+  uint32_t ip;               // 0 if the slot is free
+  unsigned long seenAt;
+  TokenBucket buckets[ROUTE_CLASS_COUNT];
+};
+
+struct Admission {
+  ClientBuckets clients[ADMISSION_CLIENTS];
+  TokenBucket total[ROUTE_CLASS_COUNT];
+  uint32_t rejected[ROUTE_CLASS_COUNT];
+  unsigned long loggedAt;
+};
+Admission admission;
+
+// Refills by elapsed time and tries to take one token. On failure, sets
+// waitMs to when a token will be available.
+bool takeToken(TokenBucket& bucket, const BucketLimit& limit, unsigned long now, unsigned long& waitMs) {
+  if (!bucket.primed) {
+    bucket.tokens = limit.burst;
+    bucket.primed = true;
+  } else {
+    bucket.tokens = min(limit.burst, bucket.tokens + (now - bucket.refilledAt) * limit.ratePerSec / 1000.0f);
+  }
+  bucket.refilledAt = now;
+  if (bucket.tokens >= 1.0) {
+    return true;
+  }
+  waitMs = max(waitMs, (unsigned long)((1.0 - bucket.tokens) * 1000.0 / limit.ratePerSec));
+  return false;
+}
+
+RouteClass admissionClass(const Route* route, HTTPMethod method) {
+  if (route->cls == ROUTE_READ && method != HTTP_GET && method != HTTP_HEAD) {
+    return ROUTE_CONTROL;
+  }
+  return route->cls;
+}
+
+// Nothing but the TLS front end connects to the web server over loopback
+bool requestViaTls(WebServer& srv) {
+  return srv.client().remoteIP() == IPAddress(127, 0, 0, 1);
+}
+
+// The TLS front end names the real client in X-Forwarded-For; the header
+// is only believed from it
+uint32_t requestClientIp(WebServer& srv) {
+  IPAddress forwarded;
+  if (requestViaTls(srv) && srv.hasHeader("X-Forwarded-For") &&
+      forwarded.fromString(srv.header("X-Forwarded-For"))) {
+    return (uint32_t)forwarded;
+  }
+  return (uint32_t)srv.client().remoteIP();
+}
+
+enum PlainHttpVerdict : uint8_t { PLAIN_ALLOWED, PLAIN_REFUSED, PLAIN_REDIRECTED };
+
+// What a request may do if it came over plain HTTP while HTTPS is running
+PlainHttpVerdict plainHttpVerdict(WebServer& srv, const Route* route, HTTPMethod method) {
+  if (!tls.running || requestViaTls(srv)) {
+    return PLAIN_ALLOWED;
+  }
+  if (tls.httpRedirect) {
+    return PLAIN_REDIRECTED;
+  }
+  return admissionClass(route, method) == ROUTE_CONTROL ? PLAIN_REFUSED : PLAIN_ALLOWED;
+}
+
+String urlEncode(const String& text) {
+  static const char hex[] = "0123456789ABCDEF";
+  String out;
+  for (size_t i = 0; i < text.length(); i++) {
+    char c = text[i];
+    if (isalnum((unsigned char)c) || c == '-' || c == '_' || c == '.' || c == '~') {
+      out += c;
+    } else {
+      out += '%';
+      out += hex[(uint8_t)c >> 4];
+      out += hex[(uint8_t)c & 0x0F];
+    }
+  }
+  return out;
+}
+
+// The same request on the HTTPS front end. Only a GET's arguments are its
+// query; anything else would repeat a form body in the URL.
+String httpsLocation(WebServer& srv, HTTPMethod method, const String& uri) {
+  String host = srv.hostHeader();
+  int colon = host.indexOf(':');
+  if (colon >= 0) {
+    host = host.substring(0, colon);
+  }
+  if (host.length() == 0) {
+    host = WiFi.localIP().toString();
+  }
+  String location = "https://" + host + (strcmp(TLS_PORT, "443") == 0 ? "" : ":" TLS_PORT) + uri;
+  if (method == HTTP_GET || method == HTTP_HEAD) {
+    for (int i = 0; i < srv.args(); i++) {
+      location += (i == 0 ? "?" : "&") + urlEncode(srv.argName(i)) + "=" + urlEncode(srv.arg(i));
+    }
+  }
+  return location;
+}
+
+void sendPlainHttpVerdict(WebServer& srv, PlainHttpVerdict verdict, HTTPMethod method, const String& uri) {
+  if (verdict == PLAIN_REDIRECTED) {
+    srv.sendHeader("Location", httpsLocation(srv, method, uri));
+    srv.send(308, "text/plain", "Use HTTPS");
+  } else {
+    srv.send(403, "text/plain", "Control requests need HTTPS");
+  }
+}
+
+// Charges one request of class `cls` from `ip` if both its own and the
+// shared bucket allow it; otherwise sets waitMs and counts the rejection
+bool admissionCheck(uint32_t ip, RouteClass cls, unsigned long& waitMs) {
+  unsigned long now = millis();
+  ClientBuckets* client = NULL;
+  ClientBuckets* oldest = &admission.clients[0];
+  for (int i = 0; i < ADMISSION_CLIENTS; i++) {
+    ClientBuckets& candidate = admission.clients[i];
+    if (candidate.ip == ip) {
+      client = &candidate;
+      break;
+    }
+    if (candidate.ip == 0 || (oldest->ip != 0 && now - candidate.seenAt > now - oldest->seenAt)) {
+      oldest = &candidate;
+    }
+  }
+  if (client == NULL) {
+    client = oldest;
+    memset(client, 0, sizeof(*client));
+    client->ip = ip;
+  }
+  client->seenAt = now;
+  
+  // Both buckets must have a token; neither is charged unless both do
+  waitMs = 0;
+  TokenBucket& own = client->buckets[cls];
+  TokenBucket& total = admission.total[cls];
+  bool ownOk = takeToken(own, CLIENT_LIMITS[cls], now, waitMs);
+  bool totalOk = takeToken(total, TOTAL_LIMITS[cls], now, waitMs);
+  if (ownOk && totalOk) {
+    own.tokens -= 1.0;
+    total.tokens -= 1.0;
+    return true;
+  }
+  
+  admission.rejected[cls]++;
+  if (now - admission.loggedAt >= 1000) {
+    admission.loggedAt = now;
+    Serial.print("[DEBUG] ⚠ Rate limited ");
+    Serial.println(IPAddress(ip));
+  }
+  return false;
+}
+
+void sendTooManyRequests(WebServer& srv, unsigned long waitMs) {
+  srv.sendHeader("Retry-After", String(waitMs / 1000 + 1));
+  srv.send(429, "text/plain", "Too many requests");
+}
+
+// Single WebServer handler that dispatches through the table. Known paths
+// with the wrong method get 405 instead of falling through to 404, and
+// every request passes the plain HTTP policy and admission control first.
+class RouteTableHandler : public RequestHandler {
+public:
+  bool canHandle(HTTPMethod method, String uri) override {
+    return findRoute(uri.c_str()) != NULL;
+  }
+  
+  bool handle(WebServer& srv, HTTPMethod method, String uri) override {
+    bool handled = dispatch(srv, method, uri);
+    requestBody.state = BODY_NONE;
+    return handled;
+  }
+  
+  bool canUpload(String uri) override {
+    const Route* route = findRoute(uri.c_str());
+    return route != NULL && route->upload != NULL;
+  }
+  
+  void upload(WebServer& srv, String uri, HTTPUpload& upload) override {
+    const Route* route = findRoute(uri.c_str());
+    if (route == NULL || route->upload == NULL) {
+      return;
+    }
+    if (upload.status == UPLOAD_FILE_START) {
+      plainVerdict = plainHttpVerdict(srv, route, srv.method());
+      bool admitted = plainVerdict == PLAIN_ALLOWED &&
+                      admissionCheck(requestClientIp(srv), admissionClass(route, srv.method()), waitMs);
+      uploadState = admitted ? UPLOAD_ADMITTED : UPLOAD_REFUSED;
+    }
+    if (uploadState == UPLOAD_ADMITTED) {
+      route->upload(upload);
+    }
+  }
+  
+  // JSON bodies go to requestBody; anything else keeps the WebServer's own
+  // form and "plain" argument handling
+  bool canRaw(String uri) override {
+    return findRoute(uri.c_str()) != NULL && server.header("Content-Type").startsWith("application/json");
+  }
+  
+  void raw(WebServer& srv, String uri, HTTPRaw& raw) override {
+    receiveRequestBody(srv, raw);
+  }
+  
+private:
+  bool dispatch(WebServer& srv, HTTPMethod method, String uri) {
+    const Route* route = findRoute(uri.c_str());
+    if (route == NULL) {
+      return false;
+    }
+    if (route->method != HTTP_ANY && route->method != method) {
+      srv.send(405, "text/plain", "Method not allowed");
+      return true;
+    }
+    
+    // An upload was already admitted or refused when it started
+    bool admitted;
+    if (uploadState == UPLOAD_NONE) {
+      plainVerdict = plainHttpVerdict(srv, route, method);
+      admitted = plainVerdict == PLAIN_ALLOWED && admissionCheck(requestClientIp(srv), admissionClass(route, method), waitMs);
+    } else {
+      admitted = uploadState == UPLOAD_ADMITTED;
+    }
+    uploadState = UPLOAD_NONE;
+    
+    if (plainVerdict != PLAIN_ALLOWED) {
+      sendPlainHttpVerdict(srv, plainVerdict, method, uri);
+      plainVerdict = PLAIN_ALLOWED;
+      return true;
+    }
+    if (!admitted) {
+      sendTooManyRequests(srv, waitMs);
+      return true;
+    }
+    if (requestBody.state == BODY_TOO_LARGE) {
+      srv.send(413, "text/plain", "Request body too large");
+      return true;
+    }
+    route->handler();
+    return true;
+  }
+  
+  // Uploads stream in before handle() runs, so they are admitted when they
+  // start and handle() sends the verdict
+  enum { UPLOAD_NONE, UPLOAD_ADMITTED, UPLOAD_REFUSED } uploadState = UPLOAD_NONE;
+  PlainHttpVerdict plainVerdict = PLAIN_ALLOWED;
+  unsigned long waitMs = 0;
+};
+RouteTableHandler routeTableHandler;
+
+// Typed query parameters. Returns false when the argument is absent or does
+// not parse completely as T, leaving `out` untouched.
+template <typename T> bool parseQueryValue(const char* text, T& out);
+
+template <> bool parseQueryValue<uint32_t>(const char* text, uint32_t& out) {
+  char* end;
+  unsigned long v = strtoul(text, &end, 10);
+  if (end == text || *end != '\0' || *text == '-') {
+    return false;
+  }
+  out = (uint32_t)v;
+  return true;
+}
+
+template <> bool parseQueryValue<int32_t>(const char* text, int32_t& out) {
+  char* end;
+  long v = strtol(text, &end, 10);
+  if (end == text || *end != '\0') {
+    return false;
+  }
+  out = (int32_t)v;
+  return true;
+}
+
+// NaN, inf and values past float range (strtof gives inf) are refused
+template <> bool parseQueryValue<float>(const char* text, float& out) {
+  char* end;
+  float v = strtof(text, &end);
+  if (end == text || *end != '\0' || !isfinite(v)) {
+    return false;
+  }
+  out = v;
+  return true;
+}
+
+template <> bool parseQueryValue<bool>(const char* text, bool& out) {
+  if (strcmp(text, "1") == 0 || strcmp(text, "true") == 0) {
+    out = true;
+  } else if (strcmp(text, "0") == 0 || strcmp(text, "false") == 0) {
+    out = false;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+template <typename T>
+bool queryParam(const char* name, T& out) {
+  if (!server.hasArg(name)) {
+    return false;
+  }
+  return parseQueryValue<T>(server.arg(name).c_str(), out);
+}
 
 void setup() {
   // CRITICAL: Start Serial FIRST - exactly like the working example
@@ -92,6 +1748,14 @@ void setup() {
   Serial.println("  - Stepper motor...");
   pinMode(ENABLE_PIN, OUTPUT);
   digitalWrite(ENABLE_PIN, HIGH);  // Disable motor initially
+  #if STEPPER_DRIVER == DRIVER_TMC2209
+    Serial2.begin(TMC_UART_BAUD, SERIAL_8N1, TMC_UART_RX_PIN, TMC_UART_TX_PIN);
+  #endif
+  if (!driver.begin()) {
+    Serial.print("    ⚠ ");
+    Serial.print(driver.name());
+    Serial.println(" not responding");
+  }
   stepper.setMaxSpeed(MAX_SPEED);
   stepper.setAcceleration(ACCELERATION);
   Serial.println("    ✓ Done");
@@ -111,23 +1775,45 @@ void setup() {
   scale.begin(DT_PIN, SCK_PIN);
   scale.set_scale(calibration_factor);
   delay(100);
+  loadCell.lastReadyAt = millis();
   if (scale.is_ready()) {
     scale.tare();
+    loadCell.tared = true;
     Serial.println("    ✓ Done (HX711 ready)");
   } else {
-    Serial.println("    ⚠ HX711 not detected (simulation mode)");
-    scale.tare();
+    // Tared from the first reading if it turns up later
+    Serial.println("    ⚠ HX711 not detected (open-loop dispensing)");
+    loadCell.fault = SENSOR_NOT_READY;
+    loadCell.lastFault = SENSOR_NOT_READY;
+    loadCell.faults = 1;
   }
   delay(50);
   
   // Setup Web Server
   Serial.println("Setting up web server...");
-  server.on("/", handleRoot);
-  server.on("/dispense", handleDispense);
-  server.on("/weight", handleWeight);
+  otaPrefs.begin("ota", false);
+  setupFleet();
+  setupCounters();
+  setupOnDemand();
+  setupScheduler();
+  #if GATEWAY_ENABLED
+    Serial1.setTxBufferSize(GATEWAY_TX_BUFFER);
+    Serial1.begin(GATEWAY_BAUD, SERIAL_8N1, GATEWAY_RX_PIN, GATEWAY_TX_PIN);
+  #endif
+  static const char* collectedHeaders[] = { "Upgrade", "Sec-WebSocket-Key", "X-Forwarded-For", "Content-Type", "Accept-Encoding" };
+  server.collectHeaders(collectedHeaders, 5);
+  server.addHandler(&routeTableHandler);
   server.onNotFound(handleNotFound);
   server.begin();
   Serial.println("  ✓ Web server started!");
+  #if TLS_ENABLED
+    if (setupTls()) {
+      Serial.println("  ✓ HTTPS on port " TLS_PORT);
+    } else {
+      Serial.print("  ⚠ HTTPS not started: ");
+      Serial.println(tls.error);
+    }
+  #endif
   
   Serial.println();
   Serial.println("========================================");
@@ -157,37 +1843,71 @@ void setup() {
 }
 
 void loop() {
-  // Continuous output to verify loop is running (like the working example)
-  static unsigned long lastStatus = 0;
-  unsigned long now = millis();
+  // Sensors, long-polls, status print and housekeeping, as they come due
+  runScheduler();
   
-  // Print status every 5 seconds
-  if (now - lastStatus >= 5000) {
-    Serial.println("Status update:");
-    Serial.print("  Weight: ");
-    float weight = getWeight();
-    Serial.print(weight, 2);
-    Serial.print(" g | IR: ");
-    int irStatus = digitalRead(IR_SENSOR_PIN);
-    Serial.println(irStatus == LOW ? "OBSTRUCTION" : "CLEAR");
-    lastStatus = now;
-  }
+  // Advance any running feeding program or visit portion
+  xSemaphoreTake(motionMutex, portMAX_DELAY);
+  recordMotionHistory();
+  serviceProgram();
+  serviceOnDemand();
+  xSemaphoreGive(motionMutex);
+  
+  // Apply what the OTA pull task has downloaded
+  serviceOtaPull();
+  
+  // Run the network fault script, if one was started
+  #if NETFAULT_ENABLED
+    serviceNetFault();
+  #endif
+  
+  // Track the site motor budget
+  #if FLEET_ENABLED
+    serviceFleet();
+  #endif
+  
+  // Run a /dispense that was waiting on the site motor budget
+  serviceQueuedDispense();
+  
+  // Step through the simulator benchmark, if one was started
+  serviceBenchmark();
+  
+  // Feed the raw sample stream, if a client is attached
+  serviceStream();
+  
+  // Answer and update a wired gateway
+  #if GATEWAY_ENABLED
+    serviceGateway();
+  #endif
   
   // Handle web server
   server.handleClient();
   
   // Run stepper motor if needed
+  xSemaphoreTake(motionMutex, portMAX_DELAY);
   stepper.run();
+  streamRecordSteps();
+  serviceStallDetection();
+  serviceMotorGovernor();
+  bool moving = stepper.distanceToGo() != 0;
+  xSemaphoreGive(motionMutex);
   
-  delay(10);
+  // run() makes at most one step per call, so don't throttle while moving;
+  // otherwise sleep until the next job is due
+  if (!moving) {
+    delay(schedulerIdleMs(10));
+  }
 }
 
 void setupWiFi() {
   Serial.println("[DEBUG] ===== setupWiFi() STARTED =====");
-  Serial.print("[DEBUG] Target SSID: ");
-  Serial.println(ssid);
-  Serial.print("[DEBUG] Password: ");
-  Serial.println(strlen(password) > 0 ? "***" : "(empty)");
+  loadWifiNetworks();
+  Serial.print("[DEBUG] Known networks: ");
+  for (int i = 0; i < wifiNetworkCount; i++) {
+    Serial.print(i > 0 ? ", " : "");
+    Serial.print(wifiNetworks[i].ssid);
+  }
+  Serial.println();
   Serial.flush();
   delay(100);
   
@@ -210,7 +1930,7 @@ void setupWiFi() {
   Serial.println(" networks");
   Serial.flush();
   
-  bool networkFound = false;
+  int best = bestKnownNetwork(n);
   if (n > 0) {
     Serial.println("[DEBUG] Available networks:");
     for (int i = 0; i < n; i++) {
@@ -222,10 +1942,9 @@ void setupWiFi() {
       Serial.print(WiFi.RSSI(i));
       Serial.print(" dBm)");
       
-      // Check if this is our target network
-      if (WiFi.SSID(i) == String(ssid)) {
-        Serial.print(" <-- TARGET FOUND!");
-        networkFound = true;
+      // Mark the known network with the strongest signal
+      if (i == best) {
+        Serial.print(" <-- BEST KNOWN");
       }
       Serial.println();
       Serial.flush();
@@ -235,15 +1954,16 @@ void setupWiFi() {
     Serial.flush();
   }
   
-  // Step 3: Only connect if network was found
-  if (networkFound) {
-    Serial.println("[DEBUG] Step 3: Target network found! Attempting connection...");
+  // Step 3: Only connect if a known network was found
+  if (best >= 0) {
+    Serial.println("[DEBUG] Step 3: Known network found! Attempting connection...");
     Serial.flush();
     delay(100);
     
     Serial.println("[DEBUG] Calling WiFi.begin()...");
     Serial.flush();
-    WiFi.begin(ssid, password);
+    connectToScanned(best);
+    WiFi.scanDelete();
     
     Serial.println("[DEBUG] WiFi.begin() returned - waiting for connection...");
     Serial.flush();
@@ -292,7 +2012,7 @@ void setupWiFi() {
       Serial.println("[DEBUG]   (WL_DISCONNECTED=6)");
     }
   } else {
-    Serial.println("[DEBUG] Step 3: Target network NOT found in scan");
+    Serial.println("[DEBUG] Step 3: No known network found in scan");
     Serial.println("[DEBUG] ⚠ Skipping connection attempt");
     Serial.println("[DEBUG]   Network may be out of range or hidden");
     Serial.println("[DEBUG]   Continuing without WiFi connection");
@@ -305,6 +2025,7 @@ void setupWiFi() {
 void handleRoot() {
   Serial.println("[DEBUG] handleRoot() called");
   float weight = getWeight();
+  String weightText = isnan(weight) ? String("unavailable") : String(weight, 2) + " g";
   int irStatus = digitalRead(IR_SENSOR_PIN);
   String irStatusText = (irStatus == LOW) ? "OBSTRUCTION DETECTED" : "Clear";
   
@@ -324,7 +2045,7 @@ void handleRoot() {
   html += "</style></head><body>";
   html += "<div class='container'>";
   html += "<h1>🐾 ESP32 Smart Feeder</h1>";
-  html += "<div class='weight'>Current Weight: " + String(weight, 2) + " g</div>";
+  html += "<div class='weight'>Current Weight: " + weightText + "</div>";
   html += "<div class='status " + String((irStatus == LOW) ? "obstruction" : "") + "'>";
   html += "IR Sensor: " + irStatusText + "</div>";
   html += "<button onclick='dispenseFood()' " + String((irStatus == LOW) ? "disabled" : "") + ">Dispense Food</button>";
@@ -337,28 +2058,69 @@ void handleRoot() {
   html += "  });";
   html += "}";
   html += "function updateWeight() {";
-  html += "  fetch('/weight').then(r => r.text()).then(data => {";
-  html += "    document.querySelector('.weight').innerHTML = 'Current Weight: ' + data + ' g';";
+  html += "  fetch('/weight').then(r => r.ok ? r.text().then(t => t + ' g') : 'unavailable').then(data => {";
+  html += "    document.querySelector('.weight').innerHTML = 'Current Weight: ' + data;";
   html += "  });";
   html += "}";
-  html += "setInterval(updateWeight, 30000);";
+  html += "let version = 0;";
+  html += "function pollStatus() {";
+  html += "  fetch('/api/status?since=' + version).then(r => r.json()).then(s => {";
+  html += "    version = s.version;";
+  html += "    document.querySelector('.weight').innerHTML = 'Current Weight: ' + (s.weight === null ? 'unavailable' : s.weight.toFixed(2) + ' g');";
+  html += "    pollStatus();";
+  html += "  }).catch(() => setTimeout(pollStatus, 5000));";
+  html += "}";
+  html += "pollStatus();";
   html += "</script>";
   html += "</div></body></html>";
   
-  server.send(200, "text/html", html);
+  sendResponse(200, "text/html", html);
 }
 
 void handleDispense() {
   Serial.println("[DEBUG] Dispense command received via web");
+  if (program.state != PROGRAM_IDLE || bench.running) {
+    server.send(409, "text/plain", "Feeding program in progress");
+    return;
+  }
+  if (onDemand.pending || onDemand.moving) {
+    server.send(409, "text/plain", "On-demand portion in progress");
+    return;
+  }
+  if (queuedDispense.pending) {
+    server.send(409, "text/plain", "Dispense already queued");
+    return;
+  }
+  if (!motorMayStart(DISPENSE_STEPS)) {
+    server.sendHeader("Retry-After", String(motorCooldownMs() / 1000 + 1));
+    server.send(503, "text/plain", "Motor cooling down");
+    return;
+  }
+  // Before taking a slot of the site budget that the move would never use
+  if (digitalRead(IR_SENSOR_PIN) == LOW) {
+    server.send(409, "text/plain", "Dispensing blocked: obstruction detected");
+    return;
+  }
+  // Another feeder holds the budget: loop() runs the dispense once granted
+  if (!fleetMayStart(estimateMoveMs(DISPENSE_STEPS))) {
+    queuedDispense.pending = true;
+    queuedDispense.since = millis();
+    server.send(202, "text/plain", "Dispense queued for the site motor budget");
+    return;
+  }
   dispenseFood();
   
   float weight = getWeight();
-  String response = "Food dispensed! Current weight: " + String(weight, 2) + " g";
+  String response = "Food dispensed! Current weight: " + (isnan(weight) ? String("unavailable") : String(weight, 2) + " g");
   server.send(200, "text/plain", response);
 }
 
 void handleWeight() {
   float weight = getWeight();
+  if (isnan(weight)) {
+    server.send(503, "text/plain", "Load cell unavailable: " + String(sensorFaultName(loadCell.fault)));
+    return;
+  }
   server.send(200, "text/plain", String(weight, 2));
 }
 
@@ -366,15 +2128,53 @@ void handleNotFound() {
   server.send(404, "text/plain", "Not found");
 }
 
-void dispenseFood() {
-  Serial.println("[DEBUG] dispenseFood() called");
-  int irValue = digitalRead(IR_SENSOR_PIN);
-  
-  Serial.print("[DEBUG] IR Sensor status: ");
-  Serial.println(irValue == LOW ? "OBSTRUCTION DETECTED" : "CLEAR");
-  
-  if (irValue == LOW) {
-    Serial.println("[DEBUG] ❌ Dispensing BLOCKED - obstruction detected!");
+// GET /api/status[?since=V]
+// Without `since`, or when the state is already newer than V, answers at
+// once. Otherwise the connection is parked until the version moves or
+// LONGPOLL_TIMEOUT_MS passes, and is answered from serviceParkedClients().
+void handleStatus() {
+  if (!server.hasArg("since")) {
+    sendResponse(200, "application/json", buildStatusJson());
+    return;
+  }
+  
+  uint32_t since;
+  if (!queryParam("since", since)) {
+    server.send(400, "text/plain", "Invalid 'since'");
+    return;
+  }
+  if (since < stateVersion) {
+    sendResponse(200, "application/json", buildStatusJson());
+    return;
+  }
+  
+  for (int i = 0; i < MAX_PARKED_CLIENTS; i++) {
+    if (!parkedClients[i].active) {
+      // Take the socket off the WebServer; the response is written later
+      // without going back through it
+      parkedClients[i].client = server.detachClient();
+      parkedClients[i].since = since;
+      parkedClients[i].parkedAt = millis();
+      parkedClients[i].dueAt = 0;
+      parkedClients[i].active = true;
+      return;
+    }
+  }
+  
+  // All slots busy: degrade to a plain poll rather than refusing
+  sendResponse(200, "application/json", buildStatusJson());
+}
+
+void dispenseFood() {
+  Serial.println("[DEBUG] dispenseFood() called");
+  int irValue = digitalRead(IR_SENSOR_PIN);
+  
+  Serial.print("[DEBUG] IR Sensor status: ");
+  Serial.println(irValue == LOW ? "OBSTRUCTION DETECTED" : "CLEAR");
+  
+  if (irValue == LOW) {
+    Serial.println("[DEBUG] ❌ Dispensing BLOCKED - obstruction detected!");
+    fleetRelease();
     return;
   }
   
@@ -382,24 +2182,55 @@ void dispenseFood() {
   Serial.print("[DEBUG] Steps to move: ");
   Serial.println(DISPENSE_STEPS);
   
-  digitalWrite(ENABLE_PIN, LOW);
+  // Holds the motor for the whole move; the on-demand task finds it busy
+  xSemaphoreTake(motionMutex, portMAX_DELAY);
+  acquireMotor();
   delay(10);
   
+  setStepMode(STEP_MODE_BULK);
   stepper.move(DISPENSE_STEPS);
   
   Serial.println("[DEBUG] Motor running...");
   while (stepper.run()) {
+    streamRecordSteps();
+    serviceStallDetection();
     delay(1);
   }
+  streamRecordSteps();  // The final step's run() returns false
   
-  digitalWrite(ENABLE_PIN, HIGH);
+  releaseMotor(NO_NEXT_MOVE);
+  xSemaphoreGive(motionMutex);
+  countDispense(0.0);
+  bumpStateVersion();
   
   Serial.println("[DEBUG] ✓ Food dispensing complete!");
   delay(1000);
   Serial.println();
 }
 
+// Keeps a queued /dispense's fleet request alive until it is granted or
+// FLEET_DISPENSE_WAIT_MS passes
+void serviceQueuedDispense() {
+  if (!queuedDispense.pending) {
+    return;
+  }
+  if (motorMayStart(DISPENSE_STEPS) && fleetMayStart(estimateMoveMs(DISPENSE_STEPS))) {
+    queuedDispense.pending = false;
+    dispenseFood();
+    return;
+  }
+  if (millis() - queuedDispense.since >= FLEET_DISPENSE_WAIT_MS) {
+    queuedDispense.pending = false;
+    fleetRelease();
+    Serial.println("[DEBUG] Queued dispense dropped: site motor budget still in use");
+  }
+}
+
+// NAN while the load cell is faulted
 float getWeight() {
+  if (loadCell.fault != SENSOR_OK) {
+    return NAN;
+  }
   if (scale.is_ready()) {
     float reading = scale.get_units(10);
     if (reading < 0) {
@@ -410,3 +2241,4746 @@ float getWeight() {
     return 0.0;
   }
 }
+
+void bumpStateVersion() {
+  stateVersion++;
+  publishedWeight = currentWeight;
+}
+
+// Non-blocking weight sampling, a scheduler job. Only takes an HX711
+// reading when a conversion is ready, so it never stalls the loop the way
+// get_units(10) does.
+void sampleWeight() {
+  bool haveReading = false;
+  float reading = 0.0;
+  long raw = 0;
+  
+  if (sim.active) {
+    simulateBowl();
+    unsigned long now = millis();
+    if (now - sim.lastSample >= SIM_SAMPLE_INTERVAL_MS) {
+      sim.lastSample = now;
+      // Box-Muller normal noise on the true bowl mass
+      float u1 = (random(1, 10001)) / 10001.0;
+      float u2 = (random(0, 10000)) / 10000.0;
+      reading = sim.landed + sim.noise * sqrt(-2.0 * log(u1)) * cos(2.0 * PI * u2);
+      raw = lround(reading * calibration_factor);
+      haveReading = true;
+    }
+  } else if (scale.is_ready()) {
+    // Same as get_units(1), keeping the raw count for the sample stream
+    raw = scale.read();
+    reading = (raw - scale.get_offset()) / scale.get_scale();
+    haveReading = acceptLoadCellReading(raw, reading);
+  } else {
+    serviceLoadCellHealth();
+  }
+  
+  if (haveReading) {
+    unsigned long sampledAt = millis();
+    if (lastWeightSampleAt != 0) {
+      sampleIntervalMs += 0.1 * ((sampledAt - lastWeightSampleAt) - sampleIntervalMs);
+    }
+    lastWeightSampleAt = sampledAt;
+    
+    if (reading < 0) {
+      reading = 0.0;
+    }
+    currentWeight += WEIGHT_FILTER_ALPHA * (reading - currentWeight);
+    streamRecordSample(raw, currentWeight);
+    if (fabs(currentWeight - publishedWeight) >= linkPolicy().weightThreshold) {
+      bumpStateVersion();
+    }
+  }
+  
+  if (haveReading || loadCell.fault != lastPublished.fault) {
+    if (haveReading) {
+      lastPublished.raw = raw;
+      lastPublished.sampledAt = lastWeightSampleAt;
+    }
+    publishSensorSnapshot();
+  }
+}
+
+// A change of the beam is only taken once it has held for IR_DEBOUNCE_MS
+void sampleIr() {
+  if (digitalRead(IR_SENSOR_PIN) != currentIR) {
+    scheduleOnce("ir_debounce", confirmIr, IR_DEBOUNCE_MS, IR_SAMPLE_DEADLINE_MS, PRIORITY_INPUT);
+  }
+}
+
+void confirmIr() {
+  int ir = digitalRead(IR_SENSOR_PIN);
+  if (ir != currentIR) {
+    currentIR = ir;
+    bumpStateVersion();
+    publishSensorSnapshot();
+  }
+}
+
+String buildStatusJson() {
+  String json = "{";
+  json += "\"version\":" + String(stateVersion);
+  json += ",\"weight\":" + (loadCell.fault == SENSOR_OK || sim.active ? String(currentWeight, 2) : String("null"));
+  json += ",\"loadCell\":\"" + String(sensorFaultName(loadCell.fault)) + "\"";
+  json += ",\"ir\":\"" + String(currentIR == LOW ? "obstruction" : "clear") + "\"";
+  json += ",\"program\":" + String(program.state == PROGRAM_IDLE ? 0 : program.id);
+  json += ",\"motorThrottled\":" + String(governor.throttled ? "true" : "false");
+  json += ",\"uptime\":" + String(millis());
+  json += ",\"link\":\"" + String(linkLevelName(linkQuality.level)) + "\"";
+  json += ",\"rssi\":" + String((int)linkQuality.rssi);
+  json += ",\"rateLimited\":" + String(admission.rejected[ROUTE_READ] + admission.rejected[ROUTE_RENDER] + admission.rejected[ROUTE_CONTROL]);
+  json += "}";
+  return json;
+}
+
+void serviceParkedClients() {
+  unsigned long now = millis();
+  String body;
+  bool pushed = false;
+  
+  for (int i = 0; i < MAX_PARKED_CLIENTS; i++) {
+    ParkedClient& parked = parkedClients[i];
+    if (!parked.active) {
+      continue;
+    }
+    
+    if (!parked.client.connected()) {
+      parked.client.stop();
+      parked.active = false;
+      continue;
+    }
+    
+    // On timeout the unchanged state is returned; the client simply re-polls.
+    // On slower links changes are answered at most every minPushIntervalMs.
+    bool timedOut = now - parked.parkedAt >= LONGPOLL_TIMEOUT_MS;
+    bool changed = parked.since < stateVersion &&
+                   now - linkQuality.lastPushAt >= linkPolicy().minPushIntervalMs;
+    if (!changed && !timedOut) {
+      continue;
+    }
+    if (NETFAULT_ENABLED && netFault.active.latencyMs > 0) {
+      if (parked.dueAt == 0) {
+        parked.dueAt = now;
+      }
+      if (now - parked.dueAt < netFault.active.latencyMs) {
+        continue;
+      }
+    }
+    if (changed) {
+      pushed = true;
+    }
+    if (netFaultLose()) {
+      netFault.pollsLost++;
+      parked.client.stop();
+      parked.active = false;
+      continue;
+    }
+    
+    if (body.length() == 0) {
+      body = buildStatusJson();
+    }
+    String header = "HTTP/1.1 200 OK\r\n"
+                    "Content-Type: application/json\r\n"
+                    "Cache-Control: no-store\r\n"
+                    "Content-Length: " + String(body.length()) + "\r\n"
+                    "Connection: close\r\n\r\n";
+    unsigned long started = millis();
+    size_t written = parked.client.print(header);
+    written += parked.client.print(body);
+    noteTelemetrySend(written == header.length() + body.length(), millis() - started);
+    if (netFault.running) {
+      netFault.pollsAnswered++;
+    }
+    parked.client.stop();
+    parked.active = false;
+  }
+  
+  if (pushed) {
+    linkQuality.lastPushAt = now;
+  }
+}
+
+// ========================================
+// Feeding Programs
+// ========================================
+
+// Parses "a,b,c" into out[]. A single value is repeated for all `expected`
+// entries; "-" or an empty field yields `fallback`. Returns false on bad input.
+bool parseFloatList(const String& text, float* out, int expected, float fallback) {
+  const char* p = text.c_str();
+  int n = 0;
+  while (n < expected) {
+    const char* comma = strchr(p, ',');
+    size_t len = comma ? (size_t)(comma - p) : strlen(p);
+    if (len == 0 || (len == 1 && *p == '-')) {
+      out[n] = fallback;
+    } else {
+      char field[16];
+      if (len >= sizeof(field)) {
+        return false;
+      }
+      memcpy(field, p, len);
+      field[len] = '\0';
+      if (!parseQueryValue<float>(field, out[n])) {
+        return false;
+      }
+    }
+    n++;
+    if (!comma) {
+      break;
+    }
+    p = comma + 1;
+  }
+  if (n == 1) {
+    for (int i = 1; i < expected; i++) {
+      out[i] = out[0];
+    }
+    return true;
+  }
+  return n == expected && strchr(p, ',') == NULL;
+}
+
+// Program from a JSON body. Missing intervals are 0 and missing conditions
+// NO_CONDITION; a missing or non-positive size fails in startProgram().
+bool parseProgramBody(float* grams, unsigned long* intervals, float* below, int& count) {
+  ProgramBody body;
+  for (int i = 0; i < MAX_PROGRAM_PORTIONS; i++) {
+    body.portions[i] = { 0.0, 0, NO_CONDITION };
+  }
+  body.portionCount = 0;
+  if (!parseRequestBody(PROGRAM_BODY, &body)) {
+    return false;
+  }
+  count = body.portionCount;
+  for (int i = 0; i < count; i++) {
+    grams[i] = body.portions[i].grams;
+    intervals[i] = body.portions[i].intervalMs;
+    below[i] = body.portions[i].below;
+  }
+  return true;
+}
+
+// /api/program
+//   POST   ?portions=g1,g2,...[&interval=ms|ms1,...][&below=g|g1,...]
+//          or {"portions":[{"grams":G,"intervalMs":MS,"below":G},...]}
+//          with intervalMs and below optional
+//   GET    progress of the current or last program
+//   DELETE cancel the running program
+void handleProgram() {
+  HTTPMethod method = server.method();
+  
+  if (method == HTTP_GET) {
+    sendResponse(200, "application/json", buildProgramJson());
+    return;
+  }
+  
+  if (method == HTTP_DELETE) {
+    cancelProgram();
+    sendResponse(200, "application/json", buildProgramJson());
+    return;
+  }
+  
+  if (method != HTTP_POST) {
+    server.send(405, "text/plain", "Method not allowed");
+    return;
+  }
+  
+  if (program.state != PROGRAM_IDLE || bench.running) {
+    server.send(409, "text/plain", "Feeding program in progress");
+    return;
+  }
+  
+  float grams[MAX_PROGRAM_PORTIONS];
+  float below[MAX_PROGRAM_PORTIONS];
+  unsigned long intervals[MAX_PROGRAM_PORTIONS];
+  int count = 0;
+  
+  if (hasRequestBody()) {
+    if (!parseProgramBody(grams, intervals, below, count)) {
+      server.send(400, "text/plain", "Malformed program");
+      return;
+    }
+  } else {
+    if (!server.hasArg("portions")) {
+      server.send(400, "text/plain", "Missing 'portions'");
+      return;
+    }
+    
+    // Portion count is the number of comma-separated fields
+    String portionsArg = server.arg("portions");
+    count = 1;
+    for (unsigned int i = 0; i < portionsArg.length(); i++) {
+      if (portionsArg[i] == ',') {
+        count++;
+      }
+    }
+    if (count > MAX_PROGRAM_PORTIONS) {
+      server.send(400, "text/plain", "Too many portions");
+      return;
+    }
+    
+    float intervalsF[MAX_PROGRAM_PORTIONS];
+    if (!parseFloatList(portionsArg, grams, count, NO_CONDITION) ||
+        !parseFloatList(server.hasArg("interval") ? server.arg("interval") : String("0"), intervalsF, count, 0) ||
+        !parseFloatList(server.hasArg("below") ? server.arg("below") : String("-"), below, count, NO_CONDITION)) {
+      server.send(400, "text/plain", "Malformed program");
+      return;
+    }
+    for (int i = 0; i < count; i++) {
+      if (!isfinite(intervalsF[i]) || intervalsF[i] < 0 || intervalsF[i] > MAX_PORTION_INTERVAL_MS) {
+        server.send(400, "text/plain", "Malformed program");
+        return;
+      }
+      intervals[i] = (unsigned long)intervalsF[i];
+    }
+  }
+  
+  if (!startProgram(grams, intervals, below, count)) {
+    server.send(400, "text/plain", "Invalid portion");
+    return;
+  }
+  sendResponse(202, "application/json", buildProgramJson());
+}
+
+// Every front end lands here, so this is where sizes, intervals and
+// thresholds are bounded: NaN and inf parse fine from HTTP and arrive
+// as raw floats from the gateway
+bool startProgram(const float* grams, const unsigned long* intervals, const float* below, int count) {
+  if (count < 1 || count > MAX_PROGRAM_PORTIONS) {
+    return false;
+  }
+  for (int i = 0; i < count; i++) {
+    if (!isfinite(grams[i]) || grams[i] <= 0 || grams[i] > MAX_PORTION_GRAMS ||
+        intervals[i] > MAX_PORTION_INTERVAL_MS) {
+      return false;
+    }
+    if (below[i] != NO_CONDITION && (!isfinite(below[i]) || below[i] < 0 || below[i] > MAX_BOWL_GRAMS)) {
+      return false;
+    }
+  }
+  
+  program.id++;
+  program.total = count;
+  program.count = count;
+  for (int i = 0; i < count; i++) {
+    Portion& portion = program.portions[i];
+    portion.grams = grams[i];
+    portion.intervalMs = intervals[i];
+    portion.onlyIfBelow = below[i];
+    portion.result = PORTION_PENDING;
+    portion.steps = 0;
+    portion.startWeight = 0.0;
+    portion.delivered = 0.0;
+    portion.stoppedEarly = false;
+    portion.openLoop = false;
+    portion.fineApproach = false;
+    portion.fineRemainder = 0.0;
+    portion.jammed = false;
+  }
+  program.current = 0;
+  program.settling = -1;
+  program.state = PROGRAM_WAITING;
+  program.phaseStart = millis();
+  program.startDelayMs = fleetStartOffsetMs();
+  
+  Serial.print("[DEBUG] Feeding program #");
+  Serial.print(program.id);
+  Serial.print(" started with ");
+  Serial.print(count);
+  Serial.println(" portions");
+  bumpStateVersion();
+  return true;
+}
+
+void cancelProgram() {
+  if (program.state == PROGRAM_IDLE) {
+    return;
+  }
+  
+  // A move in progress decelerates to a stop and is still measured
+  int firstCancelled = program.current;
+  if (program.state == PROGRAM_MOVING) {
+    stepper.stop();
+    firstCancelled++;
+  }
+  for (int i = firstCancelled; i < program.count; i++) {
+    program.portions[i].result = PORTION_CANCELLED;
+  }
+  program.count = firstCancelled;
+  if (program.state == PROGRAM_WAITING) {
+    program.state = PROGRAM_DRAINING;
+  }
+  
+  Serial.print("[DEBUG] Feeding program #");
+  Serial.print(program.id);
+  Serial.println(" cancelled");
+  bumpStateVersion();
+}
+
+// Completes the settle measurement of program.settling. If a later portion
+// is already moving, its contribution so far is estimated and subtracted,
+// and that portion's baseline is corrected to the settled value.
+void finishSettling() {
+  Portion& settled = program.portions[program.settling];
+  
+  float inFlight = 0.0;
+  if (program.state == PROGRAM_MOVING) {
+    inFlight = gramsPerStep * (motorSteps() - program.portions[program.current].moveStartPosition);
+  }
+  
+  // Without a trustworthy scale the model's estimate stands in
+  if (settled.openLoop || !weightFeedbackAvailable()) {
+    settled.openLoop = true;
+    settled.delivered = settled.steps * gramsPerStep;
+  } else {
+    settled.delivered = currentWeight - settled.startWeight - inFlight;
+  }
+  if (settled.delivered < 0) {
+    settled.delivered = 0.0;
+  }
+  settled.result = settled.jammed ? PORTION_JAMMED : PORTION_DONE;
+  
+  // Learn grams-per-step only from deliveries the scale can resolve
+  if (!settled.openLoop && !settled.jammed && settled.steps > 0 && settled.delivered >= MIN_LEARN_GRAMS) {
+    float observed = settled.delivered / settled.steps;
+    gramsPerStep += GPS_LEARN_ALPHA * (observed - gramsPerStep);
+  }
+  
+  // What arrived after a predictive stop, beyond the deceleration mass,
+  // was in flight or hidden by the filter: that gives the real lag.
+  if (settled.stoppedEarly && !settled.openLoop && !settled.jammed && settled.flowAtStop >= MIN_LEARN_FLOW) {
+    float fineGrams = settled.fineApproach ? (settled.steps - (settled.fineStartPosition - settled.moveStartPosition)) * gramsPerStep : 0.0;
+    float tail = settled.delivered - fineGrams - settled.observedAtStop - settled.decelAtStop;
+    float lagMs = 1000.0 * tail / settled.flowAtStop - filterLagMs();
+    lagMs = constrain(lagMs, 0.0f, (float)MAX_FLIGHT_DELAY_MS);
+    flightDelayMs += FLIGHT_LEARN_ALPHA * (lagMs - flightDelayMs);
+  }
+  
+  if (program.state == PROGRAM_MOVING) {
+    program.portions[program.current].startWeight = settled.startWeight + settled.delivered;
+  }
+  recordFeedHistory(settled, program.id);
+  countDispense(settled.delivered);
+  
+  Serial.print("[DEBUG] Portion ");
+  Serial.print(program.settling + 1);
+  Serial.print(": ");
+  Serial.print(settled.delivered, 2);
+  Serial.print(" g of ");
+  Serial.print(settled.grams, 2);
+  Serial.print(" g in ");
+  Serial.print(settled.steps);
+  Serial.println(" steps");
+  
+  program.settling = -1;
+  bumpStateVersion();
+}
+
+bool weightFeedbackAvailable() {
+  return sim.active || loadCell.fault == SENSOR_OK;
+}
+
+// Group delay of the EMA weight filter at the current sample rate, plus
+// half a sample period for the HX711 conversion itself
+float filterLagMs() {
+  return sampleIntervalMs * ((1.0 - WEIGHT_FILTER_ALPHA) / WEIGHT_FILTER_ALPHA + 0.5);
+}
+
+void recordMotionHistory() {
+  unsigned long now = millis();
+  uint8_t last = (motionHistoryHead + MOTION_HISTORY_SIZE - 1) % MOTION_HISTORY_SIZE;
+  if (now - motionHistory[last].at < MOTION_HISTORY_INTERVAL_MS) {
+    return;
+  }
+  motionHistory[motionHistoryHead].at = now;
+  motionHistory[motionHistoryHead].position = motorSteps();
+  motionHistoryHead = (motionHistoryHead + 1) % MOTION_HISTORY_SIZE;
+}
+
+// Total delay between food leaving the auger and showing on the scale
+float scaleLagMs() {
+  return flightDelayMs + filterLagMs();
+}
+
+// Stepper position lagMs ago, as far back as the history reaches
+float positionLagging(unsigned long lagMs) {
+  unsigned long now = millis();
+  float position = motorSteps();
+  
+  for (int i = 1; i <= MOTION_HISTORY_SIZE; i++) {
+    const MotionSample& sample = motionHistory[(motionHistoryHead + MOTION_HISTORY_SIZE - i) % MOTION_HISTORY_SIZE];
+    position = sample.position;
+    if (now - sample.at >= lagMs) {
+      break;
+    }
+  }
+  return position;
+}
+
+// Food that has left the auger but is not yet visible on the scale: the
+// steps made within the lag window
+float predictedInFlightGrams(float gps) {
+  float steps = motorSteps() - positionLagging((unsigned long)scaleLagMs());
+  return fabs(steps) * gps;
+}
+
+// Food still delivered while the motor decelerates after stop()
+float predictedDecelGrams(float gps) {
+  return motorDecelSteps() * gps;
+}
+
+// Moves on to the next portion, or to draining once all have been handled
+void advancePortion(unsigned long now) {
+  program.current++;
+  program.phaseStart = now;
+  program.state = program.current < program.count ? PROGRAM_WAITING : PROGRAM_DRAINING;
+}
+
+// Full steps budgeted for a portion
+float plannedPortionSteps(const Portion& portion) {
+  // With the scale watching, budget extra steps so an underestimated model
+  // still reaches the target; the predictive stop ends the move. It can't
+  // while the previous portion settles, and a short move may be over
+  // before that ends, so back-to-back portions get the plain model and
+  // the fine approach makes up any shortfall.
+  float steps = portion.grams / gramsPerStep;
+  if (weightFeedbackAvailable() && program.settling < 0) {
+    steps *= PLAN_MARGIN;
+  }
+  return constrain(steps, 1.0f / STEP_MODE_FINE, (float)MAX_PORTION_STEPS);
+}
+
+// Grams the bulk phase leaves for the microstepped final approach
+float fineApproachGrams(const Portion& portion) {
+  return min(portion.grams, max((float)FINE_APPROACH_MIN_GRAMS, (float)(FINE_APPROACH_FRACTION * portion.grams)));
+}
+
+void startPortionMove(unsigned long now) {
+  Portion& portion = program.portions[program.current];
+  float steps = plannedPortionSteps(portion);
+  
+  // Baseline is provisional while the previous portion is still settling.
+  // Any realignment steps from the mode switch count towards this portion.
+  portion.startWeight = currentWeight;
+  portion.moveStartPosition = motorSteps();
+  program.state = PROGRAM_MOVING;
+  
+  acquireMotor();
+  setStepMode(STEP_MODE_BULK);
+  
+  // Open loop the whole steps go in bulk and the fraction is microstepped;
+  // closed loop the predictive stop decides where the bulk phase ends.
+  portion.openLoop = !weightFeedbackAvailable();
+  if (portion.openLoop) {
+    portion.fineRemainder = steps - floor(steps);
+    steps = floor(steps);
+  }
+  stepper.move((long)(steps + 0.5));
+  bumpStateVersion();
+}
+
+// Starts the microstepped final approach for `fullSteps` more full steps
+void startFineApproach(Portion& portion, float fullSteps) {
+  setStepMode(STEP_MODE_FINE);
+  portion.fineApproach = true;
+  portion.fineStartPosition = motorSteps();
+  stepper.move((long)(fullSteps * STEP_MODE_FINE + 0.5));
+}
+
+void serviceProgram() {
+  if (program.state == PROGRAM_IDLE) {
+    return;
+  }
+  unsigned long now = millis();
+  
+  if (program.settling >= 0 && (long)(now - program.settleAt) >= 0) {
+    finishSettling();
+  }
+  
+  switch (program.state) {
+    case PROGRAM_WAITING: {
+      Portion& portion = program.portions[program.current];
+      unsigned long delayMs = portion.intervalMs + (program.current == 0 ? program.startDelayMs : 0);
+      if (now - program.phaseStart < delayMs) {
+        break;
+      }
+      
+      // Conditions are evaluated on settled weight only. A faulted load
+      // cell leaves currentWeight at its last reading, which may be from
+      // before the previous portion landed: rather than feed blind the
+      // portion is skipped, so the bowl can't be overfilled.
+      if (portion.onlyIfBelow != NO_CONDITION) {
+        if (program.settling >= 0) {
+          break;
+        }
+        if (!weightFeedbackAvailable()) {
+          Serial.print("[DEBUG] ❌ Conditional portion skipped - load cell ");
+          Serial.println(sensorFaultName(loadCell.fault));
+          portion.result = PORTION_SKIPPED_NO_WEIGHT;
+          recordFeedHistory(portion, program.id);
+          advancePortion(now);
+          bumpStateVersion();
+          break;
+        }
+        if (currentWeight >= portion.onlyIfBelow) {
+          portion.result = PORTION_SKIPPED_FULL;
+          recordFeedHistory(portion, program.id);
+          advancePortion(now);
+          bumpStateVersion();
+          break;
+        }
+      }
+      
+      if (irBlocked()) {
+        Serial.println("[DEBUG] ❌ Portion skipped - obstruction detected!");
+        portion.result = PORTION_SKIPPED_BLOCKED;
+        recordFeedHistory(portion, program.id);
+        advancePortion(now);
+        bumpStateVersion();
+        break;
+      }
+      
+      // Thermal governor and the site motor budget may space moves out;
+      // the portion simply waits
+      long steps = (long)plannedPortionSteps(portion);
+      if (onDemand.pending || onDemand.moving || onDemand.settling || queuedDispense.pending) {
+        break;
+      }
+      if (!motorMayStart(steps) || !fleetMayStart(estimateMoveMs(steps))) {
+        break;
+      }
+      
+      startPortionMove(now);
+      break;
+    }
+    
+    case PROGRAM_MOVING: {
+      Portion& portion = program.portions[program.current];
+      
+      // Load cell lost mid-move: the plan included margin for the
+      // predictive stop, so re-plan the rest of the portion from the model
+      if (!portion.openLoop && !portion.jammed && !weightFeedbackAvailable()) {
+        portion.openLoop = true;
+        float remaining = max(0.0f, portion.grams / gramsPerStep - (motorSteps() - portion.moveStartPosition));
+        if (portion.fineApproach) {
+          stepper.move((long)(remaining * STEP_MODE_FINE + 0.5));
+        } else {
+          portion.fineRemainder = remaining - floor(remaining);
+          stepper.move((long)floor(remaining));
+        }
+        Serial.println("[DEBUG] Load cell lost mid-portion, continuing open loop");
+      }
+      
+      // Closed loop needs a settled baseline
+      bool closedLoop = weightFeedbackAvailable() && program.settling < 0;
+      float observed = currentWeight - portion.startWeight;
+      
+      // Once the scale shows a good share of this move, rate the flow from
+      // it rather than the long-term model (bounded, as the early part of
+      // a move is noisy)
+      float gps = gramsPerStep;
+      float stepsVisible = positionLagging((unsigned long)scaleLagMs()) - portion.moveStartPosition;
+      if (observed >= max(3.0 * MIN_LEARN_GRAMS, 0.2 * portion.grams) && stepsVisible > 0) {
+        gps = constrain(observed / stepsVisible, 0.5f * gramsPerStep, 2.0f * gramsPerStep);
+      }
+      
+      // Predictive stop: the scale trails the bowl, so stop once what it
+      // shows plus what is still falling reaches the target. The bulk
+      // phase aims short of the target by the fine-approach share.
+      if (closedLoop && stepper.distanceToGo() != 0) {
+        float target = portion.fineApproach ? portion.grams : portion.grams - fineApproachGrams(portion);
+        float inFlight = predictedInFlightGrams(gps);
+        float decel = predictedDecelGrams(gps);
+        if (observed + inFlight + decel >= target) {
+          if (!portion.fineApproach && !portion.stoppedEarly) {
+            portion.stoppedEarly = true;
+            portion.observedAtStop = observed;
+            portion.flowAtStop = motorSpeedSteps() * gps;
+            portion.decelAtStop = decel;
+          }
+          stepper.stop();
+        }
+      }
+      
+      // One measurement in flight at a time: wait for the previous to land
+      if (stepper.distanceToGo() != 0 || program.settling >= 0) {
+        break;
+      }
+      
+      // Bulk phase done: finish the remainder in microsteps
+      if (!portion.fineApproach && !portion.jammed) {
+        float remainingSteps = portion.fineRemainder;
+        if (closedLoop) {
+          float remaining = portion.grams - observed - predictedInFlightGrams(gps);
+          remainingSteps = remaining > 0 ? remaining / gps * PLAN_MARGIN : 0.0;
+        }
+        if (remainingSteps * STEP_MODE_FINE >= 1.0) {
+          startFineApproach(portion, remainingSteps);
+          break;
+        }
+      }
+      
+      portion.steps = motorSteps() - portion.moveStartPosition;
+      portion.result = PORTION_SETTLING;
+      program.settling = program.current;
+      program.settleAt = now + PORTION_SETTLE_MS;
+      
+      // The governor holds the driver across short gaps to the next move
+      if (program.current + 1 < program.count) {
+        releaseMotor(program.portions[program.current + 1].intervalMs);
+      } else {
+        releaseMotor(NO_NEXT_MOVE);
+      }
+      advancePortion(now);
+      break;
+    }
+    
+    case PROGRAM_DRAINING:
+      if (program.settling < 0) {
+        releaseMotor(NO_NEXT_MOVE);
+        program.state = PROGRAM_IDLE;
+        Serial.print("[DEBUG] ✓ Feeding program #");
+        Serial.print(program.id);
+        Serial.println(" complete");
+        bumpStateVersion();
+      }
+      break;
+    
+    default:
+      break;
+  }
+}
+
+String buildProgramJson() {
+  static const char* const stateNames[] = { "idle", "waiting", "moving", "draining" };
+  static const char* const resultNames[] = { "pending", "settling", "done", "skipped_full", "skipped_blocked", "cancelled", "jammed", "skipped_no_weight" };
+  
+  String json = "{";
+  json += "\"id\":" + String(program.id);
+  json += ",\"state\":\"" + String(stateNames[program.state]) + "\"";
+  json += ",\"gramsPerStep\":" + String(gramsPerStep, 4);
+  json += ",\"flightDelayMs\":" + String(flightDelayMs, 0);
+  json += ",\"portions\":[";
+  for (int i = 0; i < program.total; i++) {
+    const Portion& portion = program.portions[i];
+    if (i > 0) {
+      json += ",";
+    }
+    json += "{\"grams\":" + String(portion.grams, 2);
+    json += ",\"result\":\"" + String(resultNames[portion.result]) + "\"";
+    json += ",\"steps\":" + String(portion.steps, 2);
+    json += ",\"delivered\":" + String(portion.delivered, 2);
+    json += ",\"estimated\":" + String(portion.openLoop ? "true" : "false") + "}";
+  }
+  json += "]}";
+  return json;
+}
+
+// ========================================
+// OTA Updates
+// ========================================
+// Images are streamed straight into the inactive OTA partition one flash
+// sector at a time, either pushed as a multipart upload to /api/ota or
+// pulled by the device from a URL. Progress is checkpointed to NVS so an
+// interrupted transfer resumes from the last checkpoint (GET /api/ota
+// reports it as "resumeOffset").
+//
+// Two formats are accepted. "full" is a plain application image. "delta"
+// rebuilds the new image from the running one:
+//   header  u32 magic "SFD1", u32 target size, u8[32] digest of the
+//           running image the patch was made against
+//   ops     'C' u32 src, u32 len           copy from the running image
+//           'A' u32 src, u32 len, len bytes running image bytes plus these
+//           'I' u32 len, len bytes          literal bytes
+// All integers are little-endian. tools/make_delta.py produces patches.
+//
+// Image digests, both in the delta header and in the optional sha256=
+// parameter, are what esp_partition_get_sha256() reports. For an image
+// with an appended hash (esptool's default) that is the appended hash,
+// i.e. the SHA-256 of the file minus its last 32 bytes, not sha256sum of
+// the file; make_delta.py --digest prints the right value.
+
+uint32_t readLE32(const uint8_t* p) {
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+void otaFail(const String& reason) {
+  ota.state = OTA_FAILED;
+  ota.error = reason;
+  Serial.print("[DEBUG] ❌ OTA failed: ");
+  Serial.println(reason);
+  bumpStateVersion();
+}
+
+void otaSaveCheckpoint() {
+  otaPrefs.putBytes("cp", &ota.cp, sizeof(ota.cp));
+  ota.sectorsSinceCheckpoint = 0;
+}
+
+void otaClearCheckpoint() {
+  otaPrefs.remove("cp");
+}
+
+bool otaFlushSector() {
+  uint32_t base = ota.cp.outputOffset - ota.sectorFill;
+  if (ota.sectorFill < OTA_SECTOR_SIZE) {
+    memset(otaSector + ota.sectorFill, 0xFF, OTA_SECTOR_SIZE - ota.sectorFill);
+  }
+  if (esp_partition_erase_range(ota.partition, base, OTA_SECTOR_SIZE) != ESP_OK ||
+      esp_partition_write(ota.partition, base, otaSector, OTA_SECTOR_SIZE) != ESP_OK) {
+    otaFail("Flash write failed at " + String(base));
+    return false;
+  }
+  ota.sectorFill = 0;
+  if (++ota.sectorsSinceCheckpoint >= OTA_CHECKPOINT_SECTORS) {
+    otaSaveCheckpoint();
+  }
+  return true;
+}
+
+// Appends image bytes, never crossing a sector boundary. Callers advance
+// their op state before calling so a flush always sees a consistent state.
+bool otaEmit(const uint8_t* data, size_t len) {
+  memcpy(otaSector + ota.sectorFill, data, len);
+  ota.sectorFill += len;
+  ota.cp.outputOffset += len;
+  if (ota.sectorFill == OTA_SECTOR_SIZE) {
+    return otaFlushSector();
+  }
+  return true;
+}
+
+size_t otaSectorSpace() {
+  return OTA_SECTOR_SIZE - ota.sectorFill;
+}
+
+bool otaBegin(OtaFormat format, uint32_t imageSize, const String& sha256Hex) {
+  ota.partition = esp_ota_get_next_update_partition(NULL);
+  if (ota.partition == NULL) {
+    otaFail("No OTA partition");
+    return false;
+  }
+  
+  memset(&ota.cp, 0, sizeof(ota.cp));
+  ota.cp.format = format;
+  ota.cp.imageSize = imageSize;
+  if (sha256Hex.length() == 64) {
+    for (int i = 0; i < 32; i++) {
+      char byteHex[3] = { sha256Hex[i * 2], sha256Hex[i * 2 + 1], '\0' };
+      ota.cp.sha256[i] = (uint8_t)strtoul(byteHex, NULL, 16);
+    }
+    ota.cp.hasSha = 1;
+  }
+  
+  if (format == OTA_FORMAT_FULL) {
+    if (imageSize == 0 || imageSize > ota.partition->size) {
+      otaFail("Image size missing or too large");
+      return false;
+    }
+    ota.cp.parse = OTA_PARSE_BODY;
+    ota.cp.op = 'I';
+    ota.cp.opRemaining = imageSize;
+  } else {
+    ota.cp.parse = OTA_PARSE_HEADER;
+  }
+  
+  ota.headerFill = 0;
+  ota.opArgsFill = 0;
+  ota.sectorFill = 0;
+  ota.sectorsSinceCheckpoint = 0;
+  ota.error = "";
+  ota.state = OTA_RECEIVING;
+  otaSaveCheckpoint();
+  
+  Serial.print("[DEBUG] OTA started (");
+  Serial.print(format == OTA_FORMAT_FULL ? "full" : "delta");
+  Serial.print(") into partition ");
+  Serial.println(ota.partition->label);
+  bumpStateVersion();
+  return true;
+}
+
+// Restores the last checkpoint. The caller must resend from inputOffset.
+bool otaResume(uint32_t offset) {
+  if (otaPrefs.getBytes("cp", &ota.cp, sizeof(ota.cp)) != sizeof(ota.cp)) {
+    return false;
+  }
+  if (offset != ota.cp.inputOffset) {
+    return false;
+  }
+  ota.partition = esp_ota_get_next_update_partition(NULL);
+  if (ota.partition == NULL) {
+    return false;
+  }
+  ota.headerFill = 0;
+  ota.opArgsFill = 0;
+  ota.sectorFill = 0;
+  ota.sectorsSinceCheckpoint = 0;
+  ota.error = "";
+  ota.state = OTA_RECEIVING;
+  
+  Serial.print("[DEBUG] OTA resumed at offset ");
+  Serial.println(offset);
+  return true;
+}
+
+bool otaParseHeader() {
+  const esp_partition_t* running = esp_ota_get_running_partition();
+  uint8_t runningSha[32];
+  
+  if (readLE32(ota.header) != OTA_DELTA_MAGIC) {
+    otaFail("Bad delta magic");
+    return false;
+  }
+  ota.cp.imageSize = readLE32(ota.header + 4);
+  if (ota.cp.imageSize == 0 || ota.cp.imageSize > ota.partition->size) {
+    otaFail("Delta target size invalid");
+    return false;
+  }
+  if (esp_partition_get_sha256(running, runningSha) != ESP_OK ||
+      memcmp(runningSha, ota.header + 8, 32) != 0) {
+    otaFail("Delta was made against a different image");
+    return false;
+  }
+  ota.cp.parse = OTA_PARSE_OP;
+  return true;
+}
+
+// Runs the current op as far as the available input allows
+bool otaRunBody(const uint8_t*& data, size_t& len) {
+  const esp_partition_t* running = esp_ota_get_running_partition();
+  uint8_t scratch[256];
+  
+  while (ota.cp.opRemaining > 0) {
+    size_t piece = min((size_t)ota.cp.opRemaining, min(otaSectorSpace(), sizeof(scratch)));
+    
+    if (ota.cp.op != 'C') {
+      if (len == 0) {
+        return true;
+      }
+      piece = min(piece, len);
+    }
+    
+    if (ota.cp.op == 'I') {
+      memcpy(scratch, data, piece);
+    } else {
+      if (ota.cp.opSource + piece > running->size ||
+          esp_partition_read(running, ota.cp.opSource, scratch, piece) != ESP_OK) {
+        otaFail("Delta source read out of range");
+        return false;
+      }
+      if (ota.cp.op == 'A') {
+        for (size_t i = 0; i < piece; i++) {
+          scratch[i] += data[i];
+        }
+      }
+      ota.cp.opSource += piece;
+    }
+    
+    if (ota.cp.op != 'C') {
+      data += piece;
+      len -= piece;
+      ota.cp.inputOffset += piece;
+    }
+    ota.cp.opRemaining -= piece;
+    
+    if (ota.cp.outputOffset + piece > ota.cp.imageSize) {
+      otaFail("Delta writes past target size");
+      return false;
+    }
+    if (!otaEmit(scratch, piece)) {
+      return false;
+    }
+  }
+  
+  ota.cp.parse = OTA_PARSE_OP;
+  return true;
+}
+
+// Consumes upload bytes. Safe to call with any split of the stream.
+bool otaFeed(const uint8_t* data, size_t len) {
+  while (ota.state == OTA_RECEIVING) {
+    if (ota.cp.outputOffset == ota.cp.imageSize && ota.cp.parse != OTA_PARSE_HEADER) {
+      return true;
+    }
+    
+    switch (ota.cp.parse) {
+      case OTA_PARSE_HEADER: {
+        if (len == 0) {
+          return true;
+        }
+        size_t take = min(len, (size_t)(OTA_DELTA_HEADER_SIZE - ota.headerFill));
+        memcpy(ota.header + ota.headerFill, data, take);
+        ota.headerFill += take;
+        ota.cp.inputOffset += take;
+        data += take;
+        len -= take;
+        if (ota.headerFill == OTA_DELTA_HEADER_SIZE && !otaParseHeader()) {
+          return false;
+        }
+        break;
+      }
+      
+      case OTA_PARSE_OP: {
+        if (len == 0) {
+          return true;
+        }
+        if (ota.opArgsFill == 0) {
+          ota.cp.op = *data++;
+          len--;
+          ota.cp.inputOffset++;
+          if (ota.cp.op != 'C' && ota.cp.op != 'A' && ota.cp.op != 'I') {
+            otaFail("Unknown delta op");
+            return false;
+          }
+          ota.opArgsFill = 1;
+          break;
+        }
+        
+        size_t argBytes = ota.cp.op == 'I' ? 4 : 8;
+        size_t take = min(len, argBytes - (ota.opArgsFill - 1));
+        memcpy(ota.opArgs + ota.opArgsFill - 1, data, take);
+        ota.opArgsFill += take;
+        ota.cp.inputOffset += take;
+        data += take;
+        len -= take;
+        if ((size_t)(ota.opArgsFill - 1) == argBytes) {
+          if (ota.cp.op == 'I') {
+            ota.cp.opRemaining = readLE32(ota.opArgs);
+          } else {
+            ota.cp.opSource = readLE32(ota.opArgs);
+            ota.cp.opRemaining = readLE32(ota.opArgs + 4);
+          }
+          ota.opArgsFill = 0;
+          ota.cp.parse = OTA_PARSE_BODY;
+        }
+        break;
+      }
+      
+      case OTA_PARSE_BODY:
+        if (!otaRunBody(data, len)) {
+          return false;
+        }
+        if (ota.cp.opRemaining > 0) {
+          return true;
+        }
+        break;
+    }
+  }
+  return false;
+}
+
+bool otaFinish() {
+  if (ota.sectorFill > 0 && !otaFlushSector()) {
+    return false;
+  }
+  
+  if (ota.cp.hasSha) {
+    uint8_t sha[32];
+    if (esp_partition_get_sha256(ota.partition, sha) != ESP_OK ||
+        memcmp(sha, ota.cp.sha256, 32) != 0) {
+      otaFail("SHA-256 mismatch");
+      otaClearCheckpoint();
+      return false;
+    }
+  }
+  
+  // Validates the image header and checksum before switching
+  esp_err_t err = esp_ota_set_boot_partition(ota.partition);
+  otaClearCheckpoint();
+  if (err != ESP_OK) {
+    otaFail(String("Image rejected: ") + esp_err_to_name(err));
+    return false;
+  }
+  
+  ota.state = OTA_DONE;
+  ota.restartAt = millis() + OTA_RESTART_DELAY_MS;
+  Serial.println("[DEBUG] ✓ OTA image verified, restarting soon");
+  bumpStateVersion();
+  return true;
+}
+
+bool otaComplete() {
+  return ota.state == OTA_RECEIVING && ota.cp.parse != OTA_PARSE_HEADER &&
+         ota.cp.outputOffset == ota.cp.imageSize;
+}
+
+// Starts a new session at offset 0 or resumes at the checkpointed offset
+bool otaOpen(uint32_t offset, const String& format, uint32_t size, const String& sha256Hex) {
+  if (offset == 0) {
+    return otaBegin(format == "delta" ? OTA_FORMAT_DELTA : OTA_FORMAT_FULL, size, sha256Hex);
+  }
+  return otaResume(offset);
+}
+
+String buildOtaJson() {
+  static const char* const stateNames[] = { "idle", "receiving", "done", "failed" };
+  OtaCheckpoint saved;
+  bool resumable = otaPrefs.getBytes("cp", &saved, sizeof(saved)) == sizeof(saved);
+  
+  String json = "{";
+  json += "\"state\":\"" + String(stateNames[ota.state]) + "\"";
+  json += ",\"format\":\"" + String(ota.cp.format == OTA_FORMAT_DELTA ? "delta" : "full") + "\"";
+  json += ",\"size\":" + String(ota.cp.imageSize);
+  json += ",\"received\":" + String(ota.cp.inputOffset);
+  json += ",\"written\":" + String(ota.cp.outputOffset);
+  json += ",\"resumeOffset\":" + String(resumable ? saved.inputOffset : 0);
+  json += ",\"pulling\":" + String(ota.pulling ? "true" : "false");
+  if (ota.error.length() > 0) {
+    json += ",\"error\":\"" + ota.error + "\"";
+  }
+  json += "}";
+  return json;
+}
+
+// Multipart body of POST /api/ota?offset=N&format=full|delta&size=S&sha256=H
+void handleOtaUpload(HTTPUpload& upload) {
+  if (upload.status == UPLOAD_FILE_START) {
+    uint32_t offset = 0;
+    uint32_t size = 0;
+    queryParam("offset", offset);
+    queryParam("size", size);
+    ota.rejected = ota.pulling || !otaOpen(offset, server.arg("format"), size, server.arg("sha256"));
+  } else if (ota.rejected) {
+    return;
+  } else if (upload.status == UPLOAD_FILE_WRITE) {
+    otaFeed(upload.buf, upload.currentSize);
+  } else if (upload.status == UPLOAD_FILE_END) {
+    if (otaComplete()) {
+      otaFinish();
+    }
+  } else if (upload.status == UPLOAD_FILE_ABORTED) {
+    Serial.println("[DEBUG] OTA upload interrupted; resumable from checkpoint");
+    ota.state = OTA_IDLE;
+  }
+}
+
+// /api/ota
+//   GET    session progress and resume offset
+//   POST   multipart image upload (see handleOtaUpload)
+//   DELETE abandon the session and its checkpoint
+void handleOta() {
+  HTTPMethod method = server.method();
+  
+  if (method == HTTP_DELETE) {
+    if (!ota.pulling) {
+      otaClearCheckpoint();
+      ota.state = OTA_IDLE;
+      memset(&ota.cp, 0, sizeof(ota.cp));
+    }
+    sendResponse(200, "application/json", buildOtaJson());
+    return;
+  }
+  
+  if (method == HTTP_POST) {
+    if (ota.rejected) {
+      server.send(409, "application/json", buildOtaJson());
+    } else if (ota.state == OTA_DONE) {
+      sendResponse(200, "application/json", buildOtaJson());
+    } else if (ota.state == OTA_FAILED) {
+      server.send(422, "application/json", buildOtaJson());
+    } else {
+      // Stream ended early; the client resumes from resumeOffset
+      ota.state = OTA_IDLE;
+      sendResponse(202, "application/json", buildOtaJson());
+    }
+    return;
+  }
+  
+  sendResponse(200, "application/json", buildOtaJson());
+}
+
+// Sends a message to loop() and waits for its answer
+OtaPullReply otaPullAsk(OtaPullMessage& message) {
+  OtaPullReply reply;
+  xQueueSend(otaPullMessages, &message, portMAX_DELAY);
+  xQueueReceive(otaPullReplies, &reply, portMAX_DELAY);
+  return reply;
+}
+
+// Downloads the image with HTTP Range requests, resuming from the last
+// checkpoint after a dropped connection. Touches no shared state: every
+// decision is loop()'s, through otaPullAsk().
+void otaPullTask(void* param) {
+  static OtaPullMessage message;
+  
+  for (int attempt = 0; attempt <= OTA_PULL_RETRIES; attempt++) {
+    if (attempt > 0) {
+      vTaskDelay(pdMS_TO_TICKS(OTA_PULL_RETRY_DELAY_MS));
+    }
+    
+    message.kind = OTA_PULL_ATTEMPT;
+    OtaPullReply reply = otaPullAsk(message);
+    if (!reply.proceed) {
+      break;
+    }
+    uint32_t offset = reply.offset;
+    
+    HTTPClient http;
+    http.begin(otaPullRequest.url);
+    if (offset > 0) {
+      http.addHeader("Range", "bytes=" + String(offset) + "-");
+    }
+    int code = http.GET();
+    if (code != HTTP_CODE_OK && code != HTTP_CODE_PARTIAL_CONTENT) {
+      Serial.print("[DEBUG] OTA pull HTTP error: ");
+      Serial.println(code);
+      http.end();
+      continue;
+    }
+    
+    // A server that ignores Range restarts the transfer from scratch
+    if (code == HTTP_CODE_OK) {
+      offset = 0;
+    }
+    message.kind = OTA_PULL_OPEN;
+    message.offset = offset;
+    message.size = otaPullRequest.size;
+    if (message.size == 0 && offset == 0 && http.getSize() > 0) {
+      message.size = http.getSize();
+    }
+    if (!otaPullAsk(message).proceed) {
+      http.end();
+      continue;
+    }
+    
+    WiFiClient* stream = http.getStreamPtr();
+    unsigned long lastData = millis();
+    while (otaPullStreaming.load() && millis() - lastData < 10000) {
+      int available = stream->available();
+      if (available <= 0) {
+        if (!http.connected()) {
+          break;
+        }
+        vTaskDelay(pdMS_TO_TICKS(5));
+        continue;
+      }
+      message.kind = OTA_PULL_DATA;
+      message.length = stream->readBytes(message.data, min((size_t)available, sizeof(message.data)));
+      xQueueSend(otaPullMessages, &message, portMAX_DELAY);
+      lastData = millis();
+    }
+    http.end();
+    
+    message.kind = OTA_PULL_END;
+    if (!otaPullAsk(message).proceed) {
+      break;
+    }
+  }
+  
+  message.kind = OTA_PULL_EXIT;
+  xQueueSend(otaPullMessages, &message, portMAX_DELAY);
+  vTaskDelete(NULL);
+}
+
+// Applies what the pull task posted. Called from loop() on every pass, so
+// the download isn't held to a scheduler period.
+void serviceOtaPull() {
+  static OtaPullMessage message;
+  if (!ota.pulling) {
+    return;
+  }
+  
+  for (int i = 0; i < OTA_PULL_QUEUE_LENGTH && xQueueReceive(otaPullMessages, &message, 0) == pdTRUE; i++) {
+    OtaPullReply reply = { false, 0 };
+    switch (message.kind) {
+      case OTA_PULL_ATTEMPT: {
+        OtaCheckpoint saved;
+        reply.proceed = ota.state != OTA_DONE && ota.state != OTA_FAILED;
+        if (ota.pullStarted && otaPrefs.getBytes("cp", &saved, sizeof(saved)) == sizeof(saved)) {
+          reply.offset = saved.inputOffset;
+        }
+        xQueueSend(otaPullReplies, &reply, 0);
+        break;
+      }
+      
+      case OTA_PULL_OPEN:
+        reply.proceed = otaOpen(message.offset, otaPullRequest.format, message.size, otaPullRequest.sha256);
+        if (reply.proceed) {
+          ota.pullStarted = true;
+          otaPullStreaming.store(true);
+        }
+        xQueueSend(otaPullReplies, &reply, 0);
+        break;
+      
+      case OTA_PULL_DATA:
+        // Chunks already in the queue when the transfer was ended are dropped
+        if (otaPullStreaming.load()) {
+          otaFeed(message.data, message.length);
+          if (ota.state != OTA_RECEIVING || otaComplete()) {
+            otaPullStreaming.store(false);
+          }
+        }
+        break;
+      
+      case OTA_PULL_END:
+        otaPullStreaming.store(false);
+        if (otaComplete()) {
+          otaFinish();
+        }
+        if (ota.state == OTA_RECEIVING) {
+          ota.state = OTA_IDLE;
+        }
+        reply.proceed = ota.state != OTA_DONE && ota.state != OTA_FAILED;
+        xQueueSend(otaPullReplies, &reply, 0);
+        break;
+      
+      case OTA_PULL_EXIT:
+        if (ota.state != OTA_DONE && ota.state != OTA_FAILED) {
+          otaFail("Pull gave up after retries");
+        }
+        ota.pulling = false;
+        return;
+    }
+  }
+}
+
+// POST /api/ota/pull?url=U[&format=delta][&size=S][&sha256=H]
+void handleOtaPull() {
+  if (ota.pulling || ota.state == OTA_RECEIVING) {
+    server.send(409, "application/json", buildOtaJson());
+    return;
+  }
+  if (!server.hasArg("url")) {
+    server.send(400, "text/plain", "Missing 'url'");
+    return;
+  }
+  if (otaPullMessages == NULL) {
+    otaPullMessages = xQueueCreate(OTA_PULL_QUEUE_LENGTH, sizeof(OtaPullMessage));
+    otaPullReplies = xQueueCreate(1, sizeof(OtaPullReply));
+  }
+  
+  otaPullRequest.url = server.arg("url");
+  otaPullRequest.format = server.arg("format");
+  otaPullRequest.sha256 = server.arg("sha256");
+  otaPullRequest.size = 0;
+  queryParam("size", otaPullRequest.size);
+  
+  ota.pulling = true;
+  ota.pullStarted = false;
+  ota.error = "";
+  otaPullStreaming.store(false);
+  if (xTaskCreatePinnedToCore(otaPullTask, "ota_pull", 8192, NULL, 1, NULL, 0) != pdPASS) {
+    ota.pulling = false;
+    server.send(500, "text/plain", "Could not start OTA task");
+    return;
+  }
+  sendResponse(202, "application/json", buildOtaJson());
+}
+
+void serviceOta() {
+  // Never reboot with food moving or about to: a program, the bench, the
+  // simulator, a visit portion or a queued dispense
+  if (ota.state == OTA_DONE && !visitBusy() && !onDemand.pending &&
+      (long)(millis() - ota.restartAt) >= 0) {
+    Serial.println("[DEBUG] Restarting into new firmware...");
+    commitCounters();
+    Serial.flush();
+    ESP.restart();
+  }
+}
+
+// ========================================
+// Motor Enable
+// ========================================
+
+// Switches the driver output stage and accounts driver-on time. In
+// simulation the driver is held disabled so no food actually moves.
+void setMotorEnabled(bool enabled) {
+  if (enabled == motorEnabled) {
+    return;
+  }
+  unsigned long now = millis();
+  if (motorEnabled) {
+    motorOnMs += now - motorEnabledAt;
+  } else {
+    motorEnabledAt = now;
+  }
+  motorEnabled = enabled;
+  driver.setEnabled(enabled && !sim.active);
+  if (!enabled) {
+    fleetRelease();
+  }
+}
+
+unsigned long motorOnTime() {
+  return motorOnMs + (motorEnabled ? millis() - motorEnabledAt : 0);
+}
+
+// ========================================
+// Motor Governor
+// ========================================
+// Owns driver enable timing between moves and keeps the driver's modelled
+// heat under THERMAL_LIMIT. Moves are only spaced out when the next one
+// would cross the limit, so short bursts run back to back at full rate.
+
+// Rough duration of a move with a trapezoidal (or triangular) profile
+unsigned long estimateMoveMs(long steps) {
+  float rampSteps = MAX_SPEED * MAX_SPEED / ACCELERATION;  // Up and down
+  if (steps <= rampSteps) {
+    return (unsigned long)(2000.0 * sqrt(steps / ACCELERATION));
+  }
+  return (unsigned long)(1000.0 * (2.0 * MAX_SPEED / ACCELERATION + (steps - rampSteps) / MAX_SPEED));
+}
+
+void updateMotorHeat() {
+  unsigned long now = millis();
+  unsigned long elapsed = now - governor.updatedAt;
+  governor.updatedAt = now;
+  float target = motorEnabled ? 1.0 : 0.0;
+  governor.heat += (target - governor.heat) * (1.0 - exp(-(float)elapsed / THERMAL_TAU_MS));
+}
+
+void acquireMotor() {
+  governor.releasePending = false;
+  updateMotorHeat();
+  setMotorEnabled(true);
+}
+
+// Schedules the driver to be disabled. If the next move is known to follow
+// within HOLD_WINDOW_MS the driver simply stays enabled until then.
+void releaseMotor(unsigned long nextMoveInMs) {
+  unsigned long hold = HOLD_AFTER_MOVE_MS;
+  if (nextMoveInMs <= HOLD_WINDOW_MS) {
+    hold += nextMoveInMs;
+  }
+  governor.releasePending = true;
+  governor.releaseAt = millis() + hold;
+}
+
+// True if a move of `steps` can start now without pushing the modelled
+// heat past the limit. Once throttled, waits for THERMAL_RESUME.
+bool motorMayStart(long steps) {
+  updateMotorHeat();
+  
+  if (governor.throttled) {
+    if (governor.heat > THERMAL_RESUME) {
+      return false;
+    }
+    governor.throttled = false;
+    Serial.println("[DEBUG] Motor cooled down, moves resumed");
+    bumpStateVersion();
+  }
+  
+  float predicted = 1.0 - (1.0 - governor.heat) * exp(-(float)estimateMoveMs(steps) / THERMAL_TAU_MS);
+  if (predicted > THERMAL_LIMIT) {
+    governor.throttled = true;
+    governor.deferredMoves++;
+    Serial.println("[DEBUG] ⚠ Motor thermal limit reached, spacing moves");
+    bumpStateVersion();
+    return false;
+  }
+  return true;
+}
+
+// Time for the modelled heat to fall back to THERMAL_RESUME
+unsigned long motorCooldownMs() {
+  updateMotorHeat();
+  if (governor.heat <= THERMAL_RESUME) {
+    return 0;
+  }
+  return (unsigned long)(THERMAL_TAU_MS * log(governor.heat / THERMAL_RESUME));
+}
+
+void serviceMotorGovernor() {
+  updateMotorHeat();
+  if (governor.releasePending && stepper.distanceToGo() == 0 &&
+      (long)(millis() - governor.releaseAt) >= 0) {
+    governor.releasePending = false;
+    setMotorEnabled(false);
+  }
+}
+
+// /api/motor
+//   GET    driver, enable and thermal state
+//   POST   ?currentMa=&holdPercent=&stallThreshold=  tune a smart driver
+void handleMotor() {
+  if (server.method() == HTTP_POST) {
+    uint32_t currentMa = TMC_RUN_CURRENT_MA;
+    uint32_t holdPercent = TMC_HOLD_PERCENT;
+    uint32_t threshold = TMC_STALL_THRESHOLD;
+    bool hasCurrent = server.hasArg("currentMa") || server.hasArg("holdPercent");
+    bool hasThreshold = server.hasArg("stallThreshold");
+    if ((server.hasArg("currentMa") && (!queryParam("currentMa", currentMa) || currentMa < 100 || currentMa > TMC_MAX_CURRENT_MA)) ||
+        (server.hasArg("holdPercent") && (!queryParam("holdPercent", holdPercent) || holdPercent > 100)) ||
+        (hasThreshold && (!queryParam("stallThreshold", threshold) || threshold > 255))) {
+      server.send(400, "text/plain", "Invalid motor settings");
+      return;
+    }
+    if ((hasCurrent && !driver.setCurrent(currentMa, holdPercent)) ||
+        (hasThreshold && !driver.setStallThreshold(threshold))) {
+      server.send(501, "text/plain", "Not supported by " + String(driver.name()));
+      return;
+    }
+  } else if (server.method() != HTTP_GET) {
+    server.send(405, "text/plain", "Method not allowed");
+    return;
+  }
+  
+  updateMotorHeat();
+  String json = "{";
+  json += "\"driver\":\"" + String(driver.name()) + "\"";
+  json += ",\"enabled\":" + String(motorEnabled ? "true" : "false");
+  json += ",\"onTimeMs\":" + String(motorOnTime());
+  json += ",\"heat\":" + String(governor.heat, 3);
+  json += ",\"limit\":" + String(THERMAL_LIMIT, 2);
+  json += ",\"throttled\":" + String(governor.throttled ? "true" : "false");
+  json += ",\"cooldownMs\":" + String(motorCooldownMs());
+  json += ",\"deferredMoves\":" + String(governor.deferredMoves);
+  json += ",\"stallDetection\":" + String(driver.supportsStallDetection() ? "true" : "false");
+  json += ",\"stalls\":" + String(stallCount);
+  driver.appendJson(json);
+  json += "}";
+  sendResponse(200, "application/json", json);
+}
+
+bool irBlocked() {
+  return !sim.active && digitalRead(IR_SENSOR_PIN) == LOW;
+}
+
+// ========================================
+// Simulated Auger / Bowl
+// ========================================
+
+// Converts steps made since the last call into falling food, and lands
+// whatever has finished its flight.
+void simulateBowl() {
+  unsigned long now = millis();
+  float position = motorSteps();
+  float steps = position - sim.lastPosition;
+  sim.lastPosition = position;
+  
+  if (steps > 0) {
+    float u1 = (random(1, 10001)) / 10001.0;
+    float u2 = (random(0, 10000)) / 10000.0;
+    float gaussian = sqrt(-2.0 * log(u1)) * cos(2.0 * PI * u2);
+    float grams = steps * sim.profile->gramsPerStep * (1.0 + sim.profile->flowVariation * gaussian);
+    if (grams < 0) {
+      grams = 0.0;
+    }
+    
+    unsigned long landAt = now + sim.profile->flightMs;
+    uint8_t last = sim.inFlightCount - 1;
+    if (sim.inFlightCount > 0 && landAt - sim.inFlight[last].landAt < SIM_FLIGHT_BUCKET_MS) {
+      sim.inFlight[last].grams += grams;
+    } else if (sim.inFlightCount < SIM_MAX_IN_FLIGHT) {
+      sim.inFlight[sim.inFlightCount].landAt = landAt;
+      sim.inFlight[sim.inFlightCount].grams = grams;
+      sim.inFlightCount++;
+    } else {
+      sim.inFlight[last].grams += grams;
+    }
+  }
+  
+  uint8_t landedCount = 0;
+  while (landedCount < sim.inFlightCount && (long)(now - sim.inFlight[landedCount].landAt) >= 0) {
+    sim.landed += sim.inFlight[landedCount].grams;
+    landedCount++;
+  }
+  if (landedCount > 0) {
+    memmove(sim.inFlight, sim.inFlight + landedCount, (sim.inFlightCount - landedCount) * sizeof(sim.inFlight[0]));
+    sim.inFlightCount -= landedCount;
+  }
+}
+
+// ========================================
+// Dispense Benchmark
+// ========================================
+// Runs programs through the normal feeding engine against the simulated
+// bowl, for every food profile, noise level and portion size, both as a
+// single portion and as several at interval 0, where each move starts
+// while the last portion is still settling. Reports portion error, time to
+// a settled result and motor-on time per case. Learned grams-per-step carries over between repetitions
+// of a case, as it would on a real feeder.
+
+void startBenchmarkRun() {
+  BenchCase& benchCase = bench.cases[bench.caseIndex];
+  
+  sim.profile = &FOOD_PROFILES[benchCase.profile];
+  sim.noise = BENCH_NOISE_LEVELS[benchCase.noise];
+  sim.landed = 0.0;
+  sim.inFlightCount = 0;
+  sim.lastPosition = motorSteps();
+  currentWeight = 0.0;
+  publishedWeight = 0.0;
+  
+  float grams[MAX_PROGRAM_PORTIONS];
+  unsigned long intervals[MAX_PROGRAM_PORTIONS];
+  float below[MAX_PROGRAM_PORTIONS];
+  int count = BENCH_PORTION_COUNTS[benchCase.pipeline];
+  for (int i = 0; i < count; i++) {
+    grams[i] = BENCH_PORTION_SIZES[benchCase.size];
+    intervals[i] = 0;
+    below[i] = NO_CONDITION;
+  }
+  bench.runStart = millis();
+  bench.motorOnAtStart = motorOnTime();
+  bench.runInProgress = startProgram(grams, intervals, below, count);
+}
+
+void serviceBenchmark() {
+  if (program.state != PROGRAM_IDLE) {
+    return;
+  }
+  
+  // A stopped benchmark leaves simulation on until its last move drained
+  if (!bench.running) {
+    if (sim.active) {
+      sim.active = false;
+      currentWeight = 0.0;
+    }
+    return;
+  }
+  
+  if (bench.runInProgress) {
+    BenchCase& benchCase = bench.cases[bench.caseIndex];
+    int count = BENCH_PORTION_COUNTS[benchCase.pipeline];
+    benchCase.errors[benchCase.runs] = sim.landed / count - BENCH_PORTION_SIZES[benchCase.size];
+    benchCase.settleMs[benchCase.runs] = millis() - bench.runStart;
+    benchCase.motorMs[benchCase.runs] = motorOnTime() - bench.motorOnAtStart;
+    benchCase.runs++;
+    bench.runInProgress = false;
+    
+    if (benchCase.runs >= bench.reps) {
+      bench.caseIndex++;
+      gramsPerStep = bench.gramsPerStepAtStart;
+    }
+  }
+  
+  if (bench.caseIndex >= BENCH_CASE_COUNT) {
+    bench.running = false;
+    Serial.println("[DEBUG] ✓ Benchmark complete");
+    bumpStateVersion();
+    return;
+  }
+  
+  startBenchmarkRun();
+}
+
+int compareFloats(const void* a, const void* b) {
+  float fa = *(const float*)a;
+  float fb = *(const float*)b;
+  return (fa > fb) - (fa < fb);
+}
+
+String buildBenchmarkJson() {
+  String json = "{";
+  json += "\"running\":" + String(bench.running ? "true" : "false");
+  json += ",\"reps\":" + String(bench.reps);
+  json += ",\"cases\":[";
+  bool first = true;
+  for (size_t i = 0; i < BENCH_CASE_COUNT; i++) {
+    const BenchCase& benchCase = bench.cases[i];
+    if (benchCase.runs == 0) {
+      continue;
+    }
+    
+    float absErrors[BENCH_MAX_REPS];
+    float sumError = 0.0;
+    unsigned long sumSettle = 0;
+    unsigned long sumMotor = 0;
+    for (int r = 0; r < benchCase.runs; r++) {
+      absErrors[r] = fabs(benchCase.errors[r]);
+      sumError += benchCase.errors[r];
+      sumSettle += benchCase.settleMs[r];
+      sumMotor += benchCase.motorMs[r];
+    }
+    qsort(absErrors, benchCase.runs, sizeof(float), compareFloats);
+    
+    if (!first) {
+      json += ",";
+    }
+    first = false;
+    json += "{\"profile\":\"" + String(FOOD_PROFILES[benchCase.profile].name) + "\"";
+    json += ",\"noise\":" + String(BENCH_NOISE_LEVELS[benchCase.noise], 2);
+    json += ",\"grams\":" + String(BENCH_PORTION_SIZES[benchCase.size], 1);
+    json += ",\"portions\":" + String(BENCH_PORTION_COUNTS[benchCase.pipeline]);
+    json += ",\"runs\":" + String(benchCase.runs);
+    json += ",\"meanError\":" + String(sumError / benchCase.runs, 2);
+    json += ",\"p50AbsError\":" + String(absErrors[(benchCase.runs - 1) / 2], 2);
+    json += ",\"p95AbsError\":" + String(absErrors[(int)ceil(0.95 * benchCase.runs) - 1], 2);
+    json += ",\"maxAbsError\":" + String(absErrors[benchCase.runs - 1], 2);
+    json += ",\"meanSettleMs\":" + String(sumSettle / benchCase.runs);
+    json += ",\"meanMotorMs\":" + String(sumMotor / benchCase.runs) + "}";
+  }
+  json += "]}";
+  return json;
+}
+
+// /api/bench
+//   POST   [?reps=N]  start the simulator benchmark (feeder must be idle)
+//   GET    per-case results so far
+//   DELETE stop the benchmark
+void handleBenchmark() {
+  HTTPMethod method = server.method();
+  
+  if (method == HTTP_POST) {
+    if (bench.running || program.state != PROGRAM_IDLE) {
+      server.send(409, "text/plain", "Feeder busy");
+      return;
+    }
+    
+    uint32_t reps = 3;
+    if (server.hasArg("reps") && (!queryParam("reps", reps) || reps < 1 || reps > BENCH_MAX_REPS)) {
+      server.send(400, "text/plain", "Invalid 'reps'");
+      return;
+    }
+    
+    memset(bench.cases, 0, sizeof(bench.cases));
+    size_t index = 0;
+    for (size_t p = 0; p < PROFILE_COUNT; p++) {
+      for (size_t n = 0; n < NOISE_COUNT; n++) {
+        for (size_t g = 0; g < SIZE_COUNT; g++) {
+          for (size_t c = 0; c < PIPELINE_COUNT; c++) {
+            bench.cases[index].profile = p;
+            bench.cases[index].noise = n;
+            bench.cases[index].size = g;
+            bench.cases[index].pipeline = c;
+            index++;
+          }
+        }
+      }
+    }
+    bench.reps = reps;
+    bench.caseIndex = 0;
+    bench.runInProgress = false;
+    bench.gramsPerStepAtStart = gramsPerStep;
+    sim.active = true;
+    sim.lastSample = millis();
+    bench.running = true;
+    
+    Serial.println("[DEBUG] Benchmark started on simulated bowl");
+    sendResponse(202, "application/json", buildBenchmarkJson());
+    return;
+  }
+  
+  if (method == HTTP_DELETE) {
+    if (bench.running) {
+      cancelProgram();
+      bench.running = false;
+      bench.runInProgress = false;
+      gramsPerStep = bench.gramsPerStepAtStart;
+    }
+    sendResponse(200, "application/json", buildBenchmarkJson());
+    return;
+  }
+  
+  sendResponse(200, "application/json", buildBenchmarkJson());
+}
+
+// ========================================
+// Microstepping
+// ========================================
+// The driver backend sets the step mode. Full steps give the fastest bulk delivery;
+// microsteps give fine resolution for the last grams. AccelStepper counts
+// pulses in the current mode, so its position is folded into fineBase on
+// every switch and motorFinePosition() stays continuous.
+
+long motorFinePosition() {
+  return fineBase + stepper.currentPosition() * (MICROSTEP_RESOLUTION / stepMode);
+}
+
+float motorSteps() {
+  return motorFinePosition() / (float)MICROSTEP_RESOLUTION;
+}
+
+float motorSpeedSteps() {
+  return fabs(stepper.speed()) / stepMode;
+}
+
+// Full steps still to come if stop() were called now
+float motorDecelSteps() {
+  float speed = fabs(stepper.speed());
+  float decelPulses = speed * speed / (2.0 * stepper.acceleration());
+  decelPulses = min(decelPulses, (float)labs(stepper.distanceToGo()));
+  return decelPulses / stepMode;
+}
+
+// Changes the driver's step mode. Only call with the motor stopped.
+void setStepMode(uint8_t mode) {
+  if (mode == stepMode) {
+    return;
+  }
+  
+  // The driver can only step a coarse mode from that mode's own grid in
+  // its microstep table, so finish any partial step in the current mode
+  long grid = MICROSTEP_RESOLUTION / mode;
+  long misalign = ((motorFinePosition() % grid) + grid) % grid;
+  if (misalign != 0) {
+    stepper.move((grid - misalign) / (MICROSTEP_RESOLUTION / stepMode));
+    while (stepper.run()) {
+      streamRecordSteps();
+    }
+    streamRecordSteps();
+  }
+  
+  fineBase = motorFinePosition();
+  stepper.setCurrentPosition(0);
+  stepMode = mode;
+  
+  driver.setStepMode(mode);
+  
+  // Same pulse rate limit, same angular acceleration
+  stepper.setAcceleration(ACCELERATION * mode);
+}
+
+// ========================================
+// Stepper Driver Backends
+// ========================================
+
+bool A4988Driver::begin() {
+  pinMode(MS1_PIN, OUTPUT);
+  pinMode(MS2_PIN, OUTPUT);
+  pinMode(MS3_PIN, OUTPUT);
+  setStepMode(STEP_MODE_BULK);
+  return true;
+}
+
+void A4988Driver::setEnabled(bool enabled) {
+  digitalWrite(ENABLE_PIN, enabled ? LOW : HIGH);
+}
+
+void A4988Driver::setStepMode(uint8_t mode) {
+  digitalWrite(MS1_PIN, (mode == 2 || mode == 8 || mode == 16) ? HIGH : LOW);
+  digitalWrite(MS2_PIN, (mode == 4 || mode == 8 || mode == 16) ? HIGH : LOW);
+  digitalWrite(MS3_PIN, mode == 16 ? HIGH : LOW);
+}
+
+void IRAM_ATTR onStallSignal() {
+  stallSignalled = true;
+}
+
+bool Tmc2209Driver::begin() {
+  responding = tmcProbe(uart, address, micros, TMC_REPLY_TIMEOUT_US);
+  
+  writeRegister(TMC_REG_GCONF, TMC_GCONF_UART);
+  writeRegister(TMC_REG_TPWMTHRS, 0);          // StealthChop at every speed
+  writeRegister(TMC_REG_TCOOLTHRS, 0xFFFFF);   // StallGuard at every speed
+  setCurrent(runCurrentMa, holdPercent);       // Also writes CHOPCONF
+  setStallThreshold(stallThreshold);
+  
+  pinMode(TMC_DIAG_PIN, INPUT);
+  attachInterrupt(digitalPinToInterrupt(TMC_DIAG_PIN), onStallSignal, RISING);
+  return responding;
+}
+
+void Tmc2209Driver::setEnabled(bool enabled) {
+  digitalWrite(ENABLE_PIN, enabled ? LOW : HIGH);
+}
+
+void Tmc2209Driver::setStepMode(uint8_t mode) {
+  mres = tmcMres(mode);
+  writeChopconf();
+}
+
+bool Tmc2209Driver::setCurrent(uint16_t runMa, uint8_t hold) {
+  uint8_t irun = tmcCurrentScale(runMa, TMC_RSENSE, vsense);
+  runCurrentMa = runMa;
+  holdPercent = hold;
+  writeChopconf();
+  writeRegister(TMC_REG_IHOLD_IRUN, tmcIholdIrun(irun, hold));
+  return true;
+}
+
+bool Tmc2209Driver::setStallThreshold(uint8_t threshold) {
+  stallThreshold = threshold;
+  writeRegister(TMC_REG_SGTHRS, threshold);
+  return true;
+}
+
+bool Tmc2209Driver::stalled() {
+  return stallSignalled;
+}
+
+void Tmc2209Driver::clearStall() {
+  stallSignalled = false;
+}
+
+void Tmc2209Driver::appendJson(String& json) {
+  json += ",\"uartOk\":" + String(responding ? "true" : "false");
+  json += ",\"runCurrentMa\":" + String(runCurrentMa);
+  json += ",\"holdPercent\":" + String(holdPercent);
+  json += ",\"stallThreshold\":" + String(stallThreshold);
+  
+  // Load margin: falls towards 2 * SGTHRS as the load approaches a stall
+  uint32_t sgResult;
+  if (readRegister(TMC_REG_SG_RESULT, sgResult)) {
+    json += ",\"stallGuard\":" + String(sgResult & 0x3FF);
+  } else {
+    json += ",\"stallGuard\":null";
+  }
+}
+
+void Tmc2209Driver::writeRegister(uint8_t reg, uint32_t value) {
+  tmcWriteRegister(uart, address, reg, value);
+}
+
+bool Tmc2209Driver::readRegister(uint8_t reg, uint32_t& value) {
+  return tmcReadRegister(uart, address, reg, value, micros, TMC_REPLY_TIMEOUT_US);
+}
+
+void Tmc2209Driver::writeChopconf() {
+  writeRegister(TMC_REG_CHOPCONF, tmcChopconf(mres, vsense));
+}
+
+// Acts on a stall the driver reported: stops the motor at once and ends
+// any running program, whose current portion is recorded as jammed.
+void serviceStallDetection() {
+  if (!driver.stalled()) {
+    return;
+  }
+  driver.clearStall();
+  
+  if (stepper.distanceToGo() == 0 || motorSpeedSteps() < STALL_MIN_SPEED) {
+    return;
+  }
+  
+  stepper.setCurrentPosition(stepper.currentPosition());  // Stop without decelerating
+  stallCount++;
+  countJam();
+  Serial.println("[DEBUG] ⚠ Motor stall detected, auger jammed?");
+  
+  if (program.state == PROGRAM_MOVING) {
+    program.portions[program.current].jammed = true;
+    cancelProgram();
+  }
+  if (onDemand.moving) {
+    onDemand.portion.jammed = true;
+  }
+  bumpStateVersion();
+}
+
+// ========================================
+// Feeding History
+// ========================================
+
+void recordFeedHistory(const Portion& portion, uint32_t programId) {
+  FeedRecord& record = feedHistory[feedHistoryCount % HISTORY_SIZE];
+  record.at = millis();
+  record.programId = programId;
+  record.grams = portion.grams;
+  record.delivered = portion.delivered;
+  record.result = portion.result;
+  feedHistoryCount++;
+}
+
+// ========================================
+// Wired Gateway
+// ========================================
+
+void sendGatewayFrame(uint8_t type, uint8_t seq, const uint8_t* body, size_t length) {
+  uint8_t frame[GATEWAY_MAX_FRAME];
+  size_t frameLength = gatewayEncodeFrame(type, seq, body, length, frame);
+  if (frameLength == 0) {
+    return;
+  }
+  Serial1.write(frame, frameLength);
+  gateway.framesOut++;
+}
+
+// version u32, weight f32 (NaN while the load cell is faulted), ir u8,
+// program state u8, program id u32, current portion u8, motor throttled u8,
+// uptime u32, history count u32
+size_t gatewayStatusBody(uint8_t* body) {
+  uint8_t* p = body;
+  putU32(p, stateVersion);
+  putF32(p, weightFeedbackAvailable() ? currentWeight : NAN);
+  *p++ = currentIR == LOW ? 1 : 0;
+  *p++ = program.state;
+  putU32(p, program.id);
+  *p++ = program.current;
+  *p++ = governor.throttled ? 1 : 0;
+  putU32(p, millis());
+  putU32(p, feedHistoryCount);
+  return p - body;
+}
+
+void sendGatewayResult(uint8_t seq, GatewayResult code, uint32_t value) {
+  uint8_t body[5];
+  uint8_t* p = body;
+  *p++ = code;
+  putU32(p, value);
+  sendGatewayFrame(GW_RESULT, seq, body, sizeof(body));
+}
+
+void handleGatewayFrame(const uint8_t* payload, size_t length) {
+  if (!gatewayPayloadValid(payload, length)) {
+    gateway.crcErrors++;
+    return;
+  }
+  gateway.framesIn++;
+  
+  uint8_t type = payload[0];
+  uint8_t seq = payload[1];
+  const uint8_t* p = payload + 2;
+  size_t bodyLength = length - 4;
+  uint8_t body[GATEWAY_MAX_PAYLOAD];
+  uint8_t* out = body;
+  
+  switch (type) {
+    case GW_PING:
+      *out++ = GATEWAY_PROTOCOL_VERSION;
+      putU32(out, gateway.framesIn);
+      putU32(out, gateway.framesOut);
+      putU32(out, gateway.crcErrors);
+      putU32(out, gateway.overflows);
+      sendGatewayFrame(GW_PONG, seq, body, out - body);
+      break;
+      
+    case GW_GET_STATUS:
+      sendGatewayFrame(GW_STATUS, seq, body, gatewayStatusBody(body));
+      break;
+      
+    case GW_START_PROGRAM: {
+      uint8_t count = bodyLength > 0 ? *p++ : 0;
+      if (count < 1 || count > MAX_PROGRAM_PORTIONS || bodyLength != 1 + 12 * (size_t)count) {
+        sendGatewayResult(seq, GW_INVALID, 0);
+        break;
+      }
+      if (program.state != PROGRAM_IDLE || bench.running) {
+        sendGatewayResult(seq, GW_BUSY, program.id);
+        break;
+      }
+      float grams[MAX_PROGRAM_PORTIONS];
+      unsigned long intervals[MAX_PROGRAM_PORTIONS];
+      float below[MAX_PROGRAM_PORTIONS];
+      for (int i = 0; i < count; i++) {
+        grams[i] = getF32(p);
+        intervals[i] = getU32(p);
+        below[i] = getF32(p);
+      }
+      if (!startProgram(grams, intervals, below, count)) {
+        sendGatewayResult(seq, GW_INVALID, 0);
+        break;
+      }
+      sendGatewayResult(seq, GW_OK, program.id);
+      break;
+    }
+    
+    case GW_CANCEL_PROGRAM:
+      cancelProgram();
+      sendGatewayResult(seq, GW_OK, program.id);
+      break;
+      
+    case GW_GET_HISTORY: {
+      if (bodyLength != 4) {
+        sendGatewayResult(seq, GW_INVALID, 0);
+        break;
+      }
+      // Records older than the ring are gone; start at the oldest kept
+      uint32_t first = getU32(p);
+      uint32_t oldest = feedHistoryCount > HISTORY_SIZE ? feedHistoryCount - HISTORY_SIZE : 0;
+      first = constrain(first, oldest, feedHistoryCount);
+      uint8_t count = (uint8_t)min((uint32_t)HISTORY_PER_FRAME, feedHistoryCount - first);
+      putU32(out, first);
+      *out++ = count;
+      for (uint8_t i = 0; i < count; i++) {
+        const FeedRecord& record = feedHistory[(first + i) % HISTORY_SIZE];
+        putU32(out, record.at);
+        putU32(out, record.programId);
+        putF32(out, record.grams);
+        putF32(out, record.delivered);
+        *out++ = record.result;
+      }
+      sendGatewayFrame(GW_HISTORY, seq, body, out - body);
+      break;
+    }
+    
+    case GW_CREDIT:
+      if (bodyLength == 1) {
+        gateway.credits = min(255, gateway.credits + *p);
+      }
+      break;
+      
+    default:
+      sendGatewayResult(seq, GW_UNKNOWN, type);
+      break;
+  }
+}
+
+void serviceGateway() {
+  while (Serial1.available()) {
+    uint8_t byte = Serial1.read();
+    if (byte == 0x00) {
+      if (gateway.rxOverflow) {
+        gateway.overflows++;
+      } else if (gateway.rxLength > 0) {
+        size_t length = cobsDecode(gateway.rx, gateway.rxLength, gateway.rx);
+        handleGatewayFrame(gateway.rx, length);
+      }
+      gateway.rxLength = 0;
+      gateway.rxOverflow = false;
+    } else if (gateway.rxLength < sizeof(gateway.rx)) {
+      gateway.rx[gateway.rxLength++] = byte;
+    } else {
+      gateway.rxOverflow = true;
+    }
+  }
+  
+  // One event carries the latest state, so missed versions just coalesce
+  if (gateway.eventVersion != stateVersion && gateway.credits > 0 &&
+      Serial1.availableForWrite() >= GATEWAY_MAX_FRAME) {
+    uint8_t body[GATEWAY_MAX_PAYLOAD];
+    sendGatewayFrame(GW_EVENT_STATUS, gateway.eventSeq++, body, gatewayStatusBody(body));
+    gateway.eventVersion = stateVersion;
+    gateway.credits--;
+  }
+}
+
+// ========================================
+// Raw Sample Stream
+// ========================================
+
+// GET /api/stream  (WebSocket upgrade)
+// Binary messages, little-endian. Raw batches:
+//   type=1 u8, step mode u8, samples u16, steps u16, seq u32, dropped u32,
+//   samples x (atUs u32, raw i32, filtered f32, position i32),
+//   steps x (atUs u32, position i32)
+// Summaries while the client is behind:
+//   type=2 u8, step mode u8, samples u16, seq u32, dropped u32,
+//   fromUs u32, toUs u32, rawMin i32, rawMax i32, rawMean f32,
+//   filtered f32, position i32, steps u32
+void handleStream() {
+  if (!server.header("Upgrade").equalsIgnoreCase("websocket") || !server.hasHeader("Sec-WebSocket-Key")) {
+    server.send(426, "text/plain", "WebSocket upgrade required");
+    return;
+  }
+  if (stream.active) {
+    server.send(503, "text/plain", "Stream busy");
+    return;
+  }
+  
+  String key = server.header("Sec-WebSocket-Key") + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+  uint8_t digest[20];
+  mbedtls_sha1_ret((const unsigned char*)key.c_str(), key.length(), digest);
+  unsigned char accept[32];
+  size_t acceptLength;
+  mbedtls_base64_encode(accept, sizeof(accept), &acceptLength, digest, sizeof(digest));
+  accept[acceptLength] = '\0';
+  
+  // Take the socket off the WebServer, as for parked long-polls
+  WiFiClient client = server.detachClient();
+  client.print("HTTP/1.1 101 Switching Protocols\r\n"
+               "Upgrade: websocket\r\n"
+               "Connection: Upgrade\r\n"
+               "Sec-WebSocket-Accept: " + String((const char*)accept) + "\r\n\r\n");
+  client.setNoDelay(true);
+  
+  stream.client = client;
+  stream.summarizing = false;
+  stream.cleanSummaries = 0;
+  stream.sampleHead = 0;
+  stream.sampleCount = 0;
+  stream.stepHead = 0;
+  stream.stepCount = 0;
+  stream.lastPosition = motorFinePosition();
+  stream.txLength = 0;
+  stream.txSent = 0;
+  stream.rxLength = 0;
+  stream.lastFlush = millis();
+  stream.seq = 0;
+  stream.dropped = 0;
+  stream.summaryCount = 0;
+  stream.summarySteps = 0;
+  stream.active = true;
+  Serial.println("[DEBUG] Sample stream client attached");
+}
+
+void streamResetSummary() {
+  stream.summaryCount = 0;
+  stream.summarySteps = 0;
+  stream.rawSum = 0.0;
+}
+
+// The client is behind (rings full) or the link is poor: stop sending
+// samples individually
+void streamStartSummarizing() {
+  stream.summarizing = true;
+  stream.cleanSummaries = 0;
+  stream.dropped += stream.sampleCount;
+  stream.sampleCount = 0;
+  stream.stepCount = 0;
+  streamResetSummary();
+  Serial.println("[DEBUG] Sample stream switched to summaries");
+}
+
+void streamRecordSample(long raw, float filtered) {
+  if (!stream.active) {
+    return;
+  }
+  uint32_t nowUs = micros();
+  
+  if (!stream.summarizing && stream.sampleCount == STREAM_SAMPLE_RING) {
+    streamStartSummarizing();
+  }
+  
+  if (stream.summarizing) {
+    if (stream.summaryCount == 0) {
+      stream.summaryFromUs = nowUs;
+      stream.rawMin = raw;
+      stream.rawMax = raw;
+    }
+    stream.summaryToUs = nowUs;
+    stream.rawMin = min(stream.rawMin, (int32_t)raw);
+    stream.rawMax = max(stream.rawMax, (int32_t)raw);
+    stream.rawSum += raw;
+    stream.lastFiltered = filtered;
+    stream.summaryCount++;
+    stream.dropped++;
+    return;
+  }
+  
+  StreamSample& sample = stream.samples[(stream.sampleHead + stream.sampleCount) % STREAM_SAMPLE_RING];
+  sample.atUs = nowUs;
+  sample.raw = raw;
+  sample.filtered = filtered;
+  sample.position = motorFinePosition();
+  stream.sampleCount++;
+}
+
+// Called after every stepper.run(), which makes at most one step
+void streamRecordSteps() {
+  if (!stream.active) {
+    return;
+  }
+  long position = motorFinePosition();
+  if (position == stream.lastPosition) {
+    return;
+  }
+  long moved = labs(position - stream.lastPosition);
+  stream.lastPosition = position;
+  
+  if (!stream.summarizing && stream.stepCount == STREAM_STEP_RING) {
+    streamStartSummarizing();
+  }
+  if (stream.summarizing) {
+    stream.summarySteps += moved;
+    return;
+  }
+  
+  StepEvent& event = stream.steps[(stream.stepHead + stream.stepCount) % STREAM_STEP_RING];
+  event.atUs = micros();
+  event.position = position;
+  stream.stepCount++;
+}
+
+void streamPut16(uint8_t*& p, uint16_t value) {
+  *p++ = (uint8_t)value;
+  *p++ = (uint8_t)(value >> 8);
+}
+
+// Starts a binary message in stream.tx; the payload goes at the returned
+// pointer and must be `length` bytes
+uint8_t* streamBeginFrame(size_t length) {
+  uint8_t* p = stream.tx;
+  *p++ = 0x82;  // FIN, binary
+  if (length < 126) {
+    *p++ = (uint8_t)length;
+  } else {
+    *p++ = 126;
+    *p++ = (uint8_t)(length >> 8);
+    *p++ = (uint8_t)length;
+  }
+  stream.txLength = (p - stream.tx) + length;
+  stream.txSent = 0;
+  stream.txStartedAt = millis();
+  return p;
+}
+
+void streamBuildRawFrame() {
+  uint16_t samples = min((uint16_t)STREAM_BATCH_SAMPLES, stream.sampleCount);
+  uint16_t steps = min((uint16_t)STREAM_BATCH_STEPS, stream.stepCount);
+  uint8_t* p = streamBeginFrame(STREAM_HEADER_SIZE + samples * 16 + steps * 8);
+  
+  *p++ = STREAM_FRAME_RAW;
+  *p++ = stepMode;
+  streamPut16(p, samples);
+  streamPut16(p, steps);
+  putU32(p, stream.seq++);
+  putU32(p, stream.dropped);
+  for (uint16_t i = 0; i < samples; i++) {
+    const StreamSample& sample = stream.samples[stream.sampleHead];
+    putU32(p, sample.atUs);
+    putU32(p, (uint32_t)sample.raw);
+    putF32(p, sample.filtered);
+    putU32(p, (uint32_t)sample.position);
+    stream.sampleHead = (stream.sampleHead + 1) % STREAM_SAMPLE_RING;
+  }
+  stream.sampleCount -= samples;
+  for (uint16_t i = 0; i < steps; i++) {
+    const StepEvent& event = stream.steps[stream.stepHead];
+    putU32(p, event.atUs);
+    putU32(p, (uint32_t)event.position);
+    stream.stepHead = (stream.stepHead + 1) % STREAM_STEP_RING;
+  }
+  stream.stepCount -= steps;
+}
+
+void streamBuildSummaryFrame() {
+  uint8_t* p = streamBeginFrame(STREAM_SUMMARY_SIZE);
+  *p++ = STREAM_FRAME_SUMMARY;
+  *p++ = stepMode;
+  streamPut16(p, stream.summaryCount);
+  putU32(p, stream.seq++);
+  putU32(p, stream.dropped);
+  putU32(p, stream.summaryFromUs);
+  putU32(p, stream.summaryToUs);
+  putU32(p, (uint32_t)stream.rawMin);
+  putU32(p, (uint32_t)stream.rawMax);
+  putF32(p, stream.summaryCount > 0 ? stream.rawSum / stream.summaryCount : 0.0);
+  putF32(p, stream.lastFiltered);
+  putU32(p, (uint32_t)motorFinePosition());
+  putU32(p, stream.summarySteps);
+  streamResetSummary();
+}
+
+// Writes as much of the pending frame as the socket takes without
+// blocking. Returns false if the connection failed.
+bool streamWritePending() {
+  if (stream.txSent >= stream.txLength) {
+    return true;
+  }
+  while (stream.txSent < stream.txLength) {
+    size_t allowed = netFaultStreamAllowance(stream.txLength - stream.txSent);
+    if (allowed == 0) {
+      return true;  // Injected slow client: the rest waits like a full socket
+    }
+    int sent = send(stream.client.fd(), stream.tx + stream.txSent, allowed, MSG_DONTWAIT);
+    if (sent < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return true;
+      }
+      noteTelemetrySend(false, millis() - stream.txStartedAt);
+      return false;
+    }
+    stream.txSent += sent;
+  }
+  noteTelemetrySend(true, millis() - stream.txStartedAt);
+  return true;
+}
+
+void streamClose() {
+  stream.client.stop();
+  stream.active = false;
+  Serial.println("[DEBUG] Sample stream client detached");
+}
+
+// Client frames are masked. Pings are answered; a close ends the stream;
+// anything else is ignored.
+void streamReadControl() {
+  while (stream.client.available() && stream.rxLength < sizeof(stream.rx)) {
+    stream.rx[stream.rxLength++] = stream.client.read();
+    if (stream.rxLength < 2) {
+      continue;
+    }
+    uint8_t length = stream.rx[1] & 0x7F;
+    if (length > 125 || !(stream.rx[1] & 0x80)) {
+      streamClose();  // Oversized or unmasked: not something we accept
+      return;
+    }
+    if (stream.rxLength < 6 + (size_t)length) {
+      continue;
+    }
+    
+    uint8_t opcode = stream.rx[0] & 0x0F;
+    uint8_t* payload = stream.rx + 6;
+    for (uint8_t i = 0; i < length; i++) {
+      payload[i] ^= stream.rx[2 + (i & 3)];
+    }
+    stream.rxLength = 0;
+    
+    if (opcode == 0x8) {
+      const uint8_t closeFrame[] = { 0x88, 0x00 };
+      stream.client.write(closeFrame, sizeof(closeFrame));
+      streamClose();
+      return;
+    }
+    if (opcode == 0x9 && stream.txSent >= stream.txLength) {
+      uint8_t pong[2 + 125] = { 0x8A, length };
+      memcpy(pong + 2, payload, length);
+      stream.client.write(pong, 2 + length);
+    }
+  }
+}
+
+void serviceStream() {
+  if (!stream.active) {
+    return;
+  }
+  if (!stream.client.connected()) {
+    streamClose();
+    return;
+  }
+  streamReadControl();
+  if (!stream.active) {
+    return;
+  }
+  
+  if (!streamWritePending()) {
+    streamClose();
+    return;
+  }
+  if (stream.txSent < stream.txLength) {
+    return;  // Socket full; samples keep queueing in the rings
+  }
+  
+  unsigned long now = millis();
+  if (linkPolicy().streamSummariesOnly && !stream.summarizing) {
+    streamStartSummarizing();
+  }
+  if (stream.summarizing) {
+    if (now - stream.lastFlush < STREAM_SUMMARY_MS) {
+      return;
+    }
+    stream.lastFlush = now;
+    streamBuildSummaryFrame();
+    if (!streamWritePending()) {
+      streamClose();
+      return;
+    }
+    // Back to raw once summaries go straight out
+    if (stream.txSent < stream.txLength) {
+      stream.cleanSummaries = 0;
+    } else if (++stream.cleanSummaries >= STREAM_RESUME_SUMMARIES && !linkPolicy().streamSummariesOnly) {
+      stream.summarizing = false;
+      Serial.println("[DEBUG] Sample stream caught up, sending raw samples");
+    }
+    return;
+  }
+  
+  bool batchFull = stream.sampleCount >= STREAM_BATCH_SAMPLES || stream.stepCount >= STREAM_BATCH_STEPS;
+  bool batchDue = (stream.sampleCount > 0 || stream.stepCount > 0) && now - stream.lastFlush >= linkPolicy().streamFlushMs;
+  if (batchFull || batchDue) {
+    stream.lastFlush = now;
+    streamBuildRawFrame();
+    if (!streamWritePending()) {
+      streamClose();
+    }
+  }
+}
+
+// ========================================
+// Link Quality
+// ========================================
+
+const LinkPolicy& linkPolicy() {
+  return LINK_POLICIES[linkQuality.level];
+}
+
+const char* linkLevelName(LinkLevel level) {
+  static const char* const names[] = { "good", "fair", "poor" };
+  return names[level];
+}
+
+// Records one telemetry write: whether it went out whole and how long it
+// took to hand to the socket (or, for the stream, to drain)
+void noteTelemetrySend(bool ok, unsigned long elapsedMs) {
+  linkQuality.sendMs += LINK_ALPHA * (elapsedMs - linkQuality.sendMs);
+  linkQuality.failureRate += LINK_ALPHA * ((ok ? 0.0 : 1.0) - linkQuality.failureRate);
+}
+
+LinkLevel assessLink() {
+  LinkLevel level = LINK_GOOD;
+  if (linkQuality.rssi < RSSI_FAIR || linkQuality.sendMs > SEND_MS_FAIR || linkQuality.failureRate > SEND_FAILURE_FAIR) {
+    level = LINK_FAIR;
+  }
+  if (linkQuality.rssi < RSSI_POOR || linkQuality.sendMs > SEND_MS_POOR || linkQuality.failureRate > SEND_FAILURE_POOR) {
+    level = LINK_POOR;
+  }
+  return level;
+}
+
+// Samples RSSI and re-rates the link. Degrading takes effect at once;
+// improving must hold for LINK_UPGRADE_HOLD_MS so a marginal link
+// doesn't flap between policies.
+void serviceLinkQuality() {
+  unsigned long now = millis();
+  if (now - linkQuality.sampledAt < LINK_SAMPLE_MS || WiFi.status() != WL_CONNECTED) {
+    return;
+  }
+  
+  float rssi = WiFi.RSSI();
+  if (linkQuality.sampledAt == 0) {
+    linkQuality.rssi = rssi;
+  } else {
+    linkQuality.rssi += LINK_ALPHA * (rssi - linkQuality.rssi);
+  }
+  linkQuality.sampledAt = now;
+  
+  LinkLevel assessed = assessLink();
+  LinkLevel previous = linkQuality.level;
+  if (assessed > linkQuality.level) {
+    linkQuality.level = assessed;
+  } else if (assessed < linkQuality.level) {
+    if (assessed != linkQuality.pending) {
+      linkQuality.pending = assessed;
+      linkQuality.pendingSince = now;
+    } else if (now - linkQuality.pendingSince >= LINK_UPGRADE_HOLD_MS) {
+      linkQuality.level = assessed;
+    }
+  }
+  if (assessed >= linkQuality.level) {
+    linkQuality.pending = linkQuality.level;
+  }
+  
+  if (linkQuality.level != previous) {
+    Serial.print("[DEBUG] Link quality now ");
+    Serial.print(linkLevelName(linkQuality.level));
+    Serial.print(" (RSSI ");
+    Serial.print(linkQuality.rssi, 0);
+    Serial.print(" dBm, send ");
+    Serial.print(linkQuality.sendMs, 0);
+    Serial.print(" ms, failures ");
+    Serial.print(linkQuality.failureRate * 100.0, 0);
+    Serial.println("%)");
+    bumpStateVersion();
+  }
+}
+
+// ========================================
+// WiFi Networks and Roaming
+// ========================================
+// The built-in network plus any stored in NVS are candidates. The known
+// network with the strongest scanned signal is joined by BSSID, so the
+// feeder stays on that access point rather than whichever the driver
+// picks. A weak or lost link triggers a background scan and, if another
+// access point is clearly stronger, a move to it.
+
+void loadWifiNetworks() {
+  wifiNetworkCount = 0;
+  strlcpy(wifiNetworks[0].ssid, ssid, sizeof(wifiNetworks[0].ssid));
+  strlcpy(wifiNetworks[0].password, password, sizeof(wifiNetworks[0].password));
+  wifiNetworkCount = 1;
+  
+  wifiPrefs.begin("wifi", false);
+  uint8_t stored = wifiPrefs.getUChar("count", 0);
+  for (uint8_t i = 0; i < stored && wifiNetworkCount < MAX_WIFI_NETWORKS; i++) {
+    WifiNetwork& network = wifiNetworks[wifiNetworkCount];
+    String ssidKey = "s" + String(i);
+    String passwordKey = "p" + String(i);
+    if (wifiPrefs.getString(ssidKey.c_str(), network.ssid, sizeof(network.ssid)) == 0) {
+      continue;
+    }
+    wifiPrefs.getString(passwordKey.c_str(), network.password, sizeof(network.password));
+    wifiNetworkCount++;
+  }
+}
+
+// Stores every network but the built-in one
+void saveWifiNetworks() {
+  wifiPrefs.clear();
+  wifiPrefs.putUChar("count", wifiNetworkCount - 1);
+  for (uint8_t i = 1; i < wifiNetworkCount; i++) {
+    String ssidKey = "s" + String(i - 1);
+    String passwordKey = "p" + String(i - 1);
+    wifiPrefs.putString(ssidKey.c_str(), wifiNetworks[i].ssid);
+    wifiPrefs.putString(passwordKey.c_str(), wifiNetworks[i].password);
+  }
+}
+
+int findWifiNetwork(const char* name) {
+  for (int i = 0; i < wifiNetworkCount; i++) {
+    if (strcmp(wifiNetworks[i].ssid, name) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Scan index of the strongest access point of any known network, or -1
+int bestKnownNetwork(int scanCount) {
+  int best = -1;
+  for (int i = 0; i < scanCount; i++) {
+    if (findWifiNetwork(WiFi.SSID(i).c_str()) < 0 || (NETFAULT_ENABLED && netFault.active.hideAps)) {
+      continue;
+    }
+    if (best < 0 || WiFi.RSSI(i) > WiFi.RSSI(best)) {
+      best = i;
+    }
+  }
+  return best;
+}
+
+// Joins scan result `index`, pinned to its BSSID and channel
+void connectToScanned(int index) {
+  const WifiNetwork& network = wifiNetworks[findWifiNetwork(WiFi.SSID(index).c_str())];
+  uint8_t bssid[6];
+  memcpy(bssid, WiFi.BSSID(index), sizeof(bssid));
+  
+  Serial.print("[DEBUG] Joining ");
+  Serial.print(network.ssid);
+  Serial.print(" via ");
+  Serial.print(WiFi.BSSIDstr(index));
+  Serial.print(" (");
+  Serial.print(WiFi.RSSI(index));
+  Serial.println(" dBm)");
+  
+  if (WiFi.status() == WL_CONNECTED) {
+    WiFi.disconnect();
+  }
+  WiFi.begin(network.ssid, network.password, WiFi.channel(index), bssid);
+}
+
+void serviceWiFi() {
+  unsigned long now = millis();
+  
+  if (roamer.scanning) {
+    int n = WiFi.scanComplete();
+    if (n == WIFI_SCAN_RUNNING) {
+      return;
+    }
+    roamer.scanning = false;
+    if (n < 0) {
+      return;
+    }
+    
+    int best = bestKnownNetwork(n);
+    if (best >= 0) {
+      bool connected = WiFi.status() == WL_CONNECTED;
+      bool sameAp = connected && memcmp(WiFi.BSSID(best), WiFi.BSSID(), 6) == 0;
+      if (!connected || (!sameAp && WiFi.RSSI(best) >= WiFi.RSSI() + ROAM_HYSTERESIS_DB)) {
+        if (connected) {
+          roamer.roams++;
+        }
+        connectToScanned(best);
+      }
+    }
+    WiFi.scanDelete();
+    return;
+  }
+  
+  if (now - roamer.lastCheckAt < ROAM_CHECK_MS) {
+    return;
+  }
+  roamer.lastCheckAt = now;
+  
+  // Scanning takes the radio off-channel, so not while an update downloads
+  bool lost = WiFi.status() != WL_CONNECTED;
+  bool weak = !lost && WiFi.RSSI() < ROAM_RSSI_THRESHOLD;
+  unsigned long interval = lost ? ROAM_LOST_SCAN_INTERVAL_MS : ROAM_SCAN_INTERVAL_MS;
+  if ((lost || weak) && now - roamer.lastScanAt >= interval && ota.state != OTA_RECEIVING) {
+    if (WiFi.scanNetworks(true) == WIFI_SCAN_FAILED) {
+      return;
+    }
+    roamer.scanning = true;
+    roamer.lastScanAt = now;
+  }
+}
+
+// /api/wifi
+//   GET    known networks (no passwords) and the current access point
+//   POST   ?ssid=&password=  add or update a stored network
+//   DELETE ?ssid=            forget a stored network
+// Both also take {"ssid":S,"password":P} as a JSON body.
+void handleWifi() {
+  HTTPMethod method = server.method();
+  
+  if (method == HTTP_POST || method == HTTP_DELETE) {
+    String ssidArg = server.arg("ssid");
+    String passwordArg = server.arg("password");
+    WifiBody body = { ssidArg.c_str(), passwordArg.c_str() };
+    if ((hasRequestBody() && !parseRequestBody(WIFI_BODY, &body)) ||
+        body.ssid[0] == '\0' || strlen(body.ssid) > 32 || strlen(body.password) > 64) {
+      server.send(400, "text/plain", "Invalid 'ssid' or 'password'");
+      return;
+    }
+    int index = findWifiNetwork(body.ssid);
+    if (index == 0) {
+      server.send(409, "text/plain", "Built-in network cannot be changed");
+      return;
+    }
+    
+    if (method == HTTP_POST) {
+      if (index < 0) {
+        if (wifiNetworkCount >= MAX_WIFI_NETWORKS) {
+          server.send(409, "text/plain", "Network list full");
+          return;
+        }
+        index = wifiNetworkCount++;
+      }
+      strlcpy(wifiNetworks[index].ssid, body.ssid, sizeof(wifiNetworks[index].ssid));
+      strlcpy(wifiNetworks[index].password, body.password, sizeof(wifiNetworks[index].password));
+    } else {
+      if (index < 0) {
+        server.send(404, "text/plain", "Unknown network");
+        return;
+      }
+      memmove(&wifiNetworks[index], &wifiNetworks[index + 1], (wifiNetworkCount - index - 1) * sizeof(WifiNetwork));
+      wifiNetworkCount--;
+    }
+    saveWifiNetworks();
+  } else if (method != HTTP_GET) {
+    server.send(405, "text/plain", "Method not allowed");
+    return;
+  }
+  
+  String json = "{\"networks\":[";
+  for (int i = 0; i < wifiNetworkCount; i++) {
+    json += (i > 0 ? "," : "") + jsonQuote(wifiNetworks[i].ssid);
+  }
+  json += "]";
+  json += ",\"connected\":" + String(WiFi.status() == WL_CONNECTED ? "true" : "false");
+  json += ",\"ssid\":" + jsonQuote(WiFi.SSID().c_str());
+  json += ",\"bssid\":\"" + WiFi.BSSIDstr() + "\"";
+  json += ",\"rssi\":" + String(WiFi.RSSI());
+  json += ",\"roams\":" + String(roamer.roams);
+  json += "}";
+  sendResponse(200, "application/json", json);
+}
+
+// ========================================
+// Fleet Coordination
+// ========================================
+// A feeder wanting the motor multicasts REQUESTs (with how long it has
+// waited), listens for FLEET_SETTLE_MS, then counts HOLDers plus
+// requesters ahead of it (longer wait, then lower id). If that is under
+// the budget it HOLDs with a lease, refreshed while the driver is enabled,
+// and RELEASEs when the driver is disabled. Leases and requests expire on
+// their own, so a feeder that drops off the network can't block others.
+
+void setupFleet() {
+  // Mix the MAC so neighbouring devices land in different stagger slots
+  uint32_t id = (uint32_t)ESP.getEfuseMac() ^ (uint32_t)(ESP.getEfuseMac() >> 32);
+  id ^= id >> 16;
+  id *= 0x45d9f3b;
+  id ^= id >> 16;
+  fleet.id = id != 0 ? id : 1;
+  
+  fleetPrefs.begin("fleet", false);
+  fleet.budget = fleetPrefs.getUChar("budget", FLEET_MOTOR_BUDGET);
+}
+
+unsigned long fleetStartOffsetMs() {
+  if (!FLEET_ENABLED) {
+    return 0;
+  }
+  return (fleet.id % FLEET_STAGGER_SLOTS) * FLEET_STAGGER_SLOT_MS;
+}
+
+bool fleetActive() {
+  return FLEET_ENABLED && fleet.listening && !sim.active && WiFi.status() == WL_CONNECTED;
+}
+
+void fleetSend(FleetMessage type, uint32_t value) {
+  FleetPacket packet = { FLEET_MAGIC, type, fleet.budget, 0, fleet.id, value };
+  if (netFault.running) {
+    netFault.datagramsSent++;
+  }
+  if (netFaultLose()) {
+    netFault.datagramsSentLost++;
+  } else {
+    fleet.udp.beginPacket(IPAddress(FLEET_GROUP_IP), FLEET_PORT);
+    fleet.udp.write((const uint8_t*)&packet, sizeof(packet));
+    fleet.udp.endPacket();
+  }
+  if (type != FLEET_ANNOUNCE) {
+    fleet.lastSentAt = millis();
+  }
+}
+
+// Peers (not counting us) that come before us for the budget
+int fleetPeersAhead(unsigned long now) {
+  uint32_t waited = now - fleet.requestedAt;
+  int ahead = 0;
+  for (int i = 0; i < FLEET_MAX_PEERS; i++) {
+    const FleetPeer& peer = fleet.peers[i];
+    if (peer.id == 0 || (long)(now - peer.expiresAt) >= 0) {
+      continue;
+    }
+    if (peer.state == FLEET_HOLDING) {
+      ahead++;
+    } else if (peer.state == FLEET_REQUESTING) {
+      uint32_t peerWaited = peer.waitingMs + (now - peer.heardAt);
+      if (peerWaited > waited || (peerWaited == waited && peer.id < fleet.id)) {
+        ahead++;
+      }
+    }
+  }
+  return ahead;
+}
+
+// Non-blocking: true once this feeder holds a slot of the site budget for
+// a move of about moveMs. Call repeatedly until it succeeds.
+bool fleetMayStart(unsigned long moveMs) {
+  if (!fleetActive()) {
+    return true;
+  }
+  unsigned long now = millis();
+  fleet.leaseMs = moveMs + HOLD_WINDOW_MS + FLEET_LEASE_MARGIN_MS;
+  
+  if (fleet.state == FLEET_HOLDING) {
+    return true;
+  }
+  if (fleet.state == FLEET_IDLE) {
+    fleet.state = FLEET_REQUESTING;
+    fleet.requestedAt = now;
+    fleet.waited = false;
+    fleetSend(FLEET_REQUEST, 0);
+  }
+  fleet.lastAskedAt = now;
+  
+  if (now - fleet.requestedAt < FLEET_SETTLE_MS) {
+    return false;
+  }
+  if (fleetPeersAhead(now) >= fleet.budget) {
+    if (!fleet.waited) {
+      fleet.waited = true;
+      fleet.waits++;
+    }
+    return false;
+  }
+  
+  fleet.state = FLEET_HOLDING;
+  fleet.grants++;
+  fleetSend(FLEET_HOLD, fleet.leaseMs);
+  return true;
+}
+
+void fleetRelease() {
+  if (fleet.state == FLEET_IDLE) {
+    return;
+  }
+  fleet.state = FLEET_IDLE;
+  if (fleet.listening) {
+    fleetSend(FLEET_RELEASE, 0);
+  }
+}
+
+void fleetHeard(const FleetPacket& packet) {
+  if (packet.type == FLEET_ANNOUNCE) {
+    return;
+  }
+  unsigned long now = millis();
+  int slot = -1;
+  for (int i = 0; i < FLEET_MAX_PEERS; i++) {
+    FleetPeer& peer = fleet.peers[i];
+    if (peer.id == packet.id) {
+      slot = i;
+      break;
+    }
+    // Reuse an empty or long-expired slot if the peer is new
+    if (slot < 0 && (peer.id == 0 || (long)(now - peer.expiresAt) >= 0)) {
+      slot = i;
+    }
+  }
+  if (slot < 0) {
+    return;
+  }
+  
+  FleetPeer& peer = fleet.peers[slot];
+  if (packet.type == FLEET_RELEASE) {
+    if (peer.id == packet.id) {
+      peer.id = 0;
+    }
+    return;
+  }
+  peer.id = packet.id;
+  peer.heardAt = now;
+  if (packet.type == FLEET_HOLD) {
+    peer.state = FLEET_HOLDING;
+    peer.expiresAt = now + packet.value;
+  } else {
+    peer.state = FLEET_REQUESTING;
+    peer.waitingMs = packet.value;
+    peer.expiresAt = now + FLEET_REQUEST_TTL_MS;
+  }
+}
+
+void serviceFleet() {
+  if (!fleet.listening) {
+    if (WiFi.status() != WL_CONNECTED) {
+      return;
+    }
+    fleet.listening = fleet.udp.beginMulticast(IPAddress(FLEET_GROUP_IP), FLEET_PORT);
+    if (!fleet.listening) {
+      return;
+    }
+  }
+  
+  while (fleet.udp.parsePacket() > 0) {
+    FleetPacket packet;
+    if (fleet.udp.read((uint8_t*)&packet, sizeof(packet)) != sizeof(packet) ||
+        packet.magic != FLEET_MAGIC || packet.id == fleet.id) {
+      continue;
+    }
+    if (netFault.running) {
+      netFault.datagramsReceived++;
+    }
+    if (netFaultLose()) {
+      netFault.datagramsReceivedLost++;
+    } else {
+      fleetHeard(packet);
+    }
+  }
+  
+  unsigned long now = millis();
+  if (now - fleet.lastAnnouncedAt >= FLEET_ANNOUNCE_MS) {
+    fleet.lastAnnouncedAt = now;
+    fleetSend(FLEET_ANNOUNCE, 80 | (tls.running ? 443UL << 16 : 0));
+  }
+  
+  if (fleet.state == FLEET_REQUESTING) {
+    if (now - fleet.lastAskedAt >= FLEET_ABANDON_MS) {
+      fleetRelease();  // Program cancelled while waiting
+    } else if (now - fleet.lastSentAt >= FLEET_REQUEST_REPEAT_MS) {
+      fleetSend(FLEET_REQUEST, now - fleet.requestedAt);
+    }
+  } else if (fleet.state == FLEET_HOLDING && now - fleet.lastSentAt >= FLEET_REFRESH_MS) {
+    fleetSend(FLEET_HOLD, fleet.leaseMs);
+  }
+}
+
+// /api/fleet
+//   GET    coordination state and peers heard
+//   POST   ?budget=N  set the site motor budget (persisted)
+void handleFleet() {
+  if (server.method() == HTTP_POST) {
+    uint32_t budget;
+    if (!queryParam("budget", budget) || budget < 1 || budget > 255) {
+      server.send(400, "text/plain", "Invalid 'budget'");
+      return;
+    }
+    fleet.budget = budget;
+    fleetPrefs.putUChar("budget", fleet.budget);
+  } else if (server.method() != HTTP_GET) {
+    server.send(405, "text/plain", "Method not allowed");
+    return;
+  }
+  
+  static const char* const stateNames[] = { "idle", "requesting", "holding" };
+  unsigned long now = millis();
+  String json = "{";
+  json += "\"id\":" + String(fleet.id);
+  json += ",\"active\":" + String(fleetActive() ? "true" : "false");
+  json += ",\"budget\":" + String(fleet.budget);
+  json += ",\"offsetMs\":" + String(fleetStartOffsetMs());
+  json += ",\"state\":\"" + String(stateNames[fleet.state]) + "\"";
+  json += ",\"grants\":" + String(fleet.grants);
+  json += ",\"waits\":" + String(fleet.waits);
+  json += ",\"peers\":[";
+  bool first = true;
+  for (int i = 0; i < FLEET_MAX_PEERS; i++) {
+    const FleetPeer& peer = fleet.peers[i];
+    if (peer.id == 0 || (long)(now - peer.expiresAt) >= 0) {
+      continue;
+    }
+    json += first ? "" : ",";
+    json += "{\"id\":" + String(peer.id) + ",\"state\":\"" + String(stateNames[peer.state]) + "\"}";
+    first = false;
+  }
+  json += "]}";
+  sendResponse(200, "application/json", json);
+}
+
+// ========================================
+// Lifetime Counters
+// ========================================
+
+uint32_t countersCrc(const LifetimeCounters& values) {
+  return ~crc32Update(0xFFFFFFFF, (const uint8_t*)&values, offsetof(LifetimeCounters, crc));
+}
+
+bool loadCounterCopy(const char* key, LifetimeCounters& out) {
+  if (counterPrefs.getBytes(key, &out, sizeof(out)) != sizeof(out)) {
+    return false;
+  }
+  return out.magic == COUNTERS_MAGIC && out.crc == countersCrc(out);
+}
+
+void setupCounters() {
+  counterPrefs.begin("counters", false);
+  
+  LifetimeCounters a;
+  LifetimeCounters b;
+  bool haveA = loadCounterCopy("c0", a);
+  bool haveB = loadCounterCopy("c1", b);
+  if (haveA && (!haveB || a.sequence > b.sequence)) {
+    counters.values = a;
+  } else if (haveB) {
+    counters.values = b;
+  } else {
+    memset(&counters.values, 0, sizeof(counters.values));
+    counters.values.magic = COUNTERS_MAGIC;
+  }
+  
+  esp_reset_reason_t reason = esp_reset_reason();
+  if (reason < RESET_REASON_COUNT) {
+    counters.values.resets[reason]++;
+  }
+  counters.dirty = true;
+  counters.urgent = true;
+  counters.committedAt = millis();
+  counters.lastFinePosition = motorFinePosition();
+  counters.lastMotorOnMs = motorOnTime();
+}
+
+void commitCounters() {
+  if (!counters.dirty) {
+    return;
+  }
+  counters.values.sequence++;
+  counters.values.crc = countersCrc(counters.values);
+  counterPrefs.putBytes(counters.values.sequence & 1 ? "c1" : "c0", &counters.values, sizeof(counters.values));
+  counters.dirty = false;
+  counters.urgent = false;
+  counters.committedAt = millis();
+  counters.commits++;
+}
+
+void countDispense(float grams) {
+  if (sim.active) {
+    return;
+  }
+  counters.values.dispenses++;
+  counters.values.gramsDelivered += grams;
+  counters.dirty = true;
+}
+
+void countJam() {
+  counters.values.jams++;
+  counters.dirty = true;
+  counters.urgent = true;
+}
+
+void serviceCounters() {
+  // Simulated runs hold the driver disabled and move no food
+  long position = motorFinePosition();
+  if (position != counters.lastFinePosition) {
+    if (!sim.active) {
+      counters.values.fineSteps += labs(position - counters.lastFinePosition);
+      counters.dirty = true;
+    }
+    counters.lastFinePosition = position;
+  }
+  unsigned long onMs = motorOnTime();
+  if (onMs != counters.lastMotorOnMs) {
+    counters.values.motorOnMs += onMs - counters.lastMotorOnMs;
+    counters.lastMotorOnMs = onMs;
+    counters.dirty = true;
+  }
+  
+  unsigned long sinceCommit = millis() - counters.committedAt;
+  if (counters.dirty && (sinceCommit >= COUNTERS_COMMIT_MS ||
+                         (counters.urgent && sinceCommit >= COUNTERS_URGENT_COMMIT_MS))) {
+    commitCounters();
+  }
+}
+
+// GET /api/counters
+void handleCounters() {
+  static const char* const resetNames[RESET_REASON_COUNT] = {
+    "unknown", "power_on", "external", "software", "panic", "int_wdt",
+    "task_wdt", "wdt", "deep_sleep", "brownout", "sdio"
+  };
+  const LifetimeCounters& values = counters.values;
+  String json = "{";
+  json += "\"dispenses\":" + String(values.dispenses);
+  json += ",\"gramsDelivered\":" + String(values.gramsDelivered, 1);
+  json += ",\"steps\":" + String((double)values.fineSteps / MICROSTEP_RESOLUTION, 0);
+  json += ",\"motorHours\":" + String(values.motorOnMs / 3600000.0, 3);
+  json += ",\"jams\":" + String(values.jams);
+  json += ",\"resets\":{";
+  for (int i = 0; i < RESET_REASON_COUNT; i++) {
+    json += (i > 0 ? ",\"" : "\"") + String(resetNames[i]) + "\":" + String(values.resets[i]);
+  }
+  json += "}";
+  json += ",\"lastReset\":\"" + String(resetNames[min((int)esp_reset_reason(), RESET_REASON_COUNT - 1)]) + "\"";
+  json += ",\"pendingCommit\":" + String(counters.dirty ? "true" : "false");
+  json += ",\"commitsSinceBoot\":" + String(counters.commits);
+  json += "}";
+  sendResponse(200, "application/json", json);
+}
+
+// ========================================
+// Load Cell Health
+// ========================================
+
+const char* sensorFaultName(SensorFault fault) {
+  static const char* const names[] = { "ok", "not_ready", "stuck", "saturated", "erratic", "noisy" };
+  return names[fault];
+}
+
+// Raises or clears the load cell fault. A fault clears only after readings
+// have stayed clean for SENSOR_RECOVERY_MS.
+void updateLoadCellFault(SensorFault fault, unsigned long now) {
+  if (fault != SENSOR_OK) {
+    loadCell.recovering = false;
+    if (loadCell.fault == SENSOR_OK) {
+      loadCell.faults++;
+      loadCell.faultSince = now;
+      Serial.print("[DEBUG] ⚠ Load cell fault: ");
+      Serial.print(sensorFaultName(fault));
+      Serial.println(" - dispensing open loop");
+      bumpStateVersion();
+    }
+    loadCell.fault = fault;
+    loadCell.lastFault = fault;
+    return;
+  }
+  
+  if (loadCell.fault == SENSOR_OK) {
+    return;
+  }
+  if (!loadCell.recovering) {
+    loadCell.recovering = true;
+    loadCell.cleanSince = now;
+  } else if (now - loadCell.cleanSince >= SENSOR_RECOVERY_MS) {
+    loadCell.fault = SENSOR_OK;
+    loadCell.recovering = false;
+    Serial.println("[DEBUG] ✓ Load cell healthy again");
+    bumpStateVersion();
+  }
+}
+
+// Checks a fresh HX711 reading. Returns whether it may go into the weight
+// filter; `reading` is corrected if the cell had to be tared first.
+bool acceptLoadCellReading(long raw, float& reading) {
+  unsigned long now = millis();
+  loadCell.lastReadyAt = now;
+  
+  if (!loadCell.tared) {
+    scale.set_offset(raw);
+    loadCell.tared = true;
+    reading = 0.0;
+    Serial.println("[DEBUG] Load cell appeared, tared on first reading");
+  }
+  
+  SensorFault fault = SENSOR_OK;
+  bool accept = true;
+  
+  // 24-bit conversions always carry a few counts of noise; a run of
+  // identical values means the converter or its wiring has frozen
+  loadCell.sameCount = raw == loadCell.lastRaw ? loadCell.sameCount + 1 : 0;
+  loadCell.lastRaw = raw;
+  if (loadCell.sameCount >= SENSOR_STUCK_SAMPLES) {
+    fault = SENSOR_STUCK;
+    accept = false;
+  }
+  if (raw >= SENSOR_RAW_MAX || raw <= SENSOR_RAW_MIN) {
+    fault = SENSOR_SATURATED;
+    accept = false;
+  }
+  
+  if (accept && loadCell.havePrevious) {
+    float change = reading - loadCell.lastReading;
+    if (fabs(change) > SENSOR_MAX_JUMP_GRAMS) {
+      // One outlier is held back. A second reading agreeing with it is a
+      // real step (bowl lifted or put back) and is taken.
+      if (loadCell.pendingJump && fabs(reading - loadCell.jumpReading) <= SENSOR_MAX_JUMP_GRAMS) {
+        loadCell.pendingJump = false;
+        change = 0.0;
+      } else {
+        loadCell.pendingJump = true;
+        loadCell.jumpReading = reading;
+        if (now - loadCell.jumpWindowStart >= SENSOR_JUMP_WINDOW_MS) {
+          loadCell.jumpWindowStart = now;
+          loadCell.jumps = 0;
+        }
+        if (++loadCell.jumps > SENSOR_MAX_JUMPS) {
+          fault = SENSOR_ERRATIC;
+        }
+        accept = false;
+      }
+    } else {
+      loadCell.pendingJump = false;
+    }
+    
+    if (accept) {
+      loadCell.noiseVar += SENSOR_NOISE_ALPHA * (0.5 * change * change - loadCell.noiseVar);
+      if (sqrt(loadCell.noiseVar) > SENSOR_MAX_NOISE_GRAMS) {
+        fault = SENSOR_NOISY;
+      }
+    }
+  }
+  
+  if (accept) {
+    loadCell.lastReading = reading;
+    loadCell.havePrevious = true;
+  } else {
+    loadCell.rejected++;
+  }
+  updateLoadCellFault(fault, now);
+  return accept;
+}
+
+// Called between conversions to catch a converter that stopped answering
+void serviceLoadCellHealth() {
+  unsigned long now = millis();
+  if (now - loadCell.lastReadyAt >= SENSOR_NOT_READY_MS) {
+    loadCell.havePrevious = false;
+    updateLoadCellFault(SENSOR_NOT_READY, now);
+  }
+}
+
+// GET /api/loadcell
+void handleLoadCell() {
+  unsigned long now = millis();
+  String json = "{";
+  json += "\"state\":\"" + String(sensorFaultName(loadCell.fault)) + "\"";
+  json += ",\"openLoop\":" + String(weightFeedbackAvailable() ? "false" : "true");
+  json += ",\"lastFault\":\"" + String(sensorFaultName(loadCell.lastFault)) + "\"";
+  json += ",\"faultForMs\":" + String(loadCell.fault == SENSOR_OK ? 0 : now - loadCell.faultSince);
+  json += ",\"recovering\":" + String(loadCell.recovering ? "true" : "false");
+  json += ",\"faults\":" + String(loadCell.faults);
+  json += ",\"rejected\":" + String(loadCell.rejected);
+  json += ",\"noiseGrams\":" + String(sqrt(loadCell.noiseVar), 3);
+  json += ",\"lastReadyMsAgo\":" + String(now - loadCell.lastReadyAt);
+  json += ",\"gramsPerStep\":" + String(gramsPerStep, 4);
+  json += "}";
+  sendResponse(200, "application/json", json);
+}
+
+// ========================================
+// On-Demand Dispensing
+// ========================================
+
+void IRAM_ATTR onIrEdge() {
+  onDemand.edgeUs = micros();
+  BaseType_t woken = pdFALSE;
+  vTaskNotifyGiveFromISR(onDemand.task, &woken);
+  if (woken) {
+    portYIELD_FROM_ISR();
+  }
+}
+
+// Grams of visit portions in the last 24 h
+float onDemandGramsToday(unsigned long now) {
+  float total = 0.0;
+  for (int i = 0; i < ON_DEMAND_MAX_PER_DAY; i++) {
+    if (onDemand.fedGrams[i] > 0 && now - onDemand.fedAt[i] < ON_DEMAND_DAY_MS) {
+      total += onDemand.fedGrams[i];
+    }
+  }
+  return total;
+}
+
+unsigned long onDemandCooldownLeftMs(unsigned long now) {
+  // Any portion that started counts, even one a jam cut to nothing
+  if (onDemand.fedCount == 0) {
+    return 0;
+  }
+  uint8_t last = (onDemand.fedHead + ON_DEMAND_MAX_PER_DAY - 1) % ON_DEMAND_MAX_PER_DAY;
+  unsigned long since = now - onDemand.fedAt[last];
+  return since < onDemand.cooldownMs ? onDemand.cooldownMs - since : 0;
+}
+
+// Starts the visit portion's move and makes its first step. Called with
+// motionMutex held, by the task on its fast path or by loop() for a
+// pending visit; the step mode switch is a no-op on the fast path.
+void beginVisitPortion(uint32_t edgeUs, float steps) {
+  Portion& portion = onDemand.portion;
+  portion.grams = onDemand.grams;
+  portion.intervalMs = 0;
+  portion.onlyIfBelow = NO_CONDITION;
+  portion.result = PORTION_PENDING;
+  portion.steps = 0;
+  portion.startWeight = readSnapshot(sensorCell).weight;
+  portion.delivered = 0.0;
+  portion.stoppedEarly = false;
+  portion.openLoop = !weightFeedbackAvailable();
+  portion.fineApproach = false;
+  portion.fineRemainder = 0.0;
+  portion.jammed = false;
+  
+  acquireMotor();
+  setStepMode(STEP_MODE_BULK);
+  portion.moveStartPosition = motorSteps();
+  stepper.move(lround(steps));
+  stepper.run();
+  onDemand.moving = true;
+  
+  uint32_t latencyUs = micros() - edgeUs;
+  onDemand.lastLatencyUs = latencyUs;
+  onDemand.maxLatencyUs = max(onDemand.maxLatencyUs, latencyUs);
+  onDemand.meanLatencyUs += (onDemand.outcomes[VISIT_FED] == 0 ? 1.0 : 0.1) * (latencyUs - onDemand.meanLatencyUs);
+  
+  // Counted against the budget from the start; corrected once settled
+  onDemand.fedAt[onDemand.fedHead] = millis();
+  onDemand.fedGrams[onDemand.fedHead] = onDemand.grams;
+  onDemand.fedHead = (onDemand.fedHead + 1) % ON_DEMAND_MAX_PER_DAY;
+  onDemand.fedCount++;
+}
+
+bool visitBusy() {
+  return program.state != PROGRAM_IDLE || bench.running || sim.active ||
+         onDemand.moving || onDemand.settling || queuedDispense.pending ||
+         stepper.distanceToGo() != 0;
+}
+
+// Runs in the on-demand task. Decides on the visit and, if it earns a
+// portion that needs nothing but the stepper, starts it there and then.
+// Touches no state loop() publishes without the mutex: the version bump,
+// the governor's transitions and the fleet are all loop()'s.
+VisitOutcome startVisitPortion(uint32_t edgeUs) {
+  // loop() only holds the motor for short passes; a manual dispense holds
+  // it throughout, and then the feeder is busy anyway
+  if (xSemaphoreTake(motionMutex, pdMS_TO_TICKS(ON_DEMAND_LOCK_WAIT_MS)) != pdTRUE) {
+    return VISIT_BUSY;
+  }
+  unsigned long now = millis();
+  VisitOutcome outcome = VISIT_FED;
+  if (!onDemand.enabled) {
+    outcome = VISIT_DISABLED;
+  } else if (onDemandCooldownLeftMs(now) > 0) {
+    outcome = VISIT_COOLDOWN;
+  } else if (onDemandGramsToday(now) + onDemand.grams > onDemand.dailyGrams) {
+    outcome = VISIT_BUDGET;
+  } else if (onDemand.pending || visitBusy()) {
+    outcome = VISIT_BUSY;
+  }
+  if (outcome != VISIT_FED) {
+    xSemaphoreGive(motionMutex);
+    return outcome;
+  }
+  
+  // The governor's heat is read, not advanced: close enough for a move
+  // this short, and loop() re-checks properly on the slow path
+  float steps = constrain(onDemand.grams / gramsPerStep, 1.0f, (float)MAX_PORTION_STEPS);
+  float predicted = 1.0 - (1.0 - governor.heat) * exp(-(float)estimateMoveMs((long)steps) / THERMAL_TAU_MS);
+  if (stepMode != STEP_MODE_BULK || governor.throttled || predicted > THERMAL_LIMIT || fleetActive()) {
+    onDemand.pending = true;
+    onDemand.pendingEdgeUs = edgeUs;
+    onDemand.pendingSince = now;
+    xSemaphoreGive(motionMutex);
+    return VISIT_PENDING;
+  }
+  
+  beginVisitPortion(edgeUs, steps);
+  onDemand.started = true;
+  xSemaphoreGive(motionMutex);
+  return VISIT_FED;
+}
+
+// Called from loop() with motionMutex held: starts a visit the task left
+// pending once the governor and the site motor budget allow it
+void serviceVisitPending(unsigned long now) {
+  VisitOutcome outcome = VISIT_FED;
+  float steps = constrain(onDemand.grams / gramsPerStep, 1.0f, (float)MAX_PORTION_STEPS);
+  if (visitBusy()) {
+    outcome = VISIT_BUSY;
+  } else if (!motorMayStart((long)steps)) {
+    outcome = VISIT_THROTTLED;
+  } else if (!fleetMayStart(estimateMoveMs((long)steps))) {
+    if (now - onDemand.pendingSince < ON_DEMAND_PENDING_MS) {
+      return;
+    }
+    fleetRelease();
+    outcome = VISIT_FLEET;
+  }
+  onDemand.pending = false;
+  onDemand.outcomes[outcome]++;
+  if (outcome != VISIT_FED) {
+    return;
+  }
+  
+  beginVisitPortion(onDemand.pendingEdgeUs, steps);
+  Serial.print("[DEBUG] IR visit: portion started ");
+  Serial.print(onDemand.lastLatencyUs / 1000.0, 1);
+  Serial.println(" ms after the edge, from loop()");
+  bumpStateVersion();
+}
+
+void onDemandTask(void* param) {
+  for (;;) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    uint32_t edgeUs = onDemand.edgeUs;
+    
+    // Debounce: the beam must still be broken, and edges from the same
+    // approach are dropped
+    vTaskDelay(pdMS_TO_TICKS(IR_DEBOUNCE_MS));
+    ulTaskNotifyTake(pdTRUE, 0);
+    VisitOutcome outcome = digitalRead(IR_SENSOR_PIN) == LOW ? startVisitPortion(edgeUs) : VISIT_BOUNCE;
+    if (outcome == VISIT_PENDING) {
+      continue;
+    }
+    onDemand.outcomes[outcome]++;
+    
+    if (outcome == VISIT_FED) {
+      Serial.print("[DEBUG] IR visit: portion started ");
+      Serial.print(onDemand.lastLatencyUs / 1000.0, 1);
+      Serial.println(" ms after the edge");
+    }
+  }
+}
+
+void setupOnDemand() {
+  onDemandPrefs.begin("ondemand", false);
+  onDemand.enabled = onDemandPrefs.getBool("enabled", false);
+  onDemand.grams = onDemandPrefs.getFloat("grams", ON_DEMAND_GRAMS);
+  onDemand.dailyGrams = onDemandPrefs.getFloat("daily", ON_DEMAND_DAILY_GRAMS);
+  onDemand.cooldownMs = onDemandPrefs.getULong("cooldown", ON_DEMAND_COOLDOWN_MS);
+  
+  motionMutex = xSemaphoreCreateMutex();
+  
+  // Same core as loop(), so the task preempts it rather than racing it
+  xTaskCreatePinnedToCore(onDemandTask, "on_demand", 4096, NULL, ON_DEMAND_TASK_PRIORITY, &onDemand.task, xPortGetCoreID());
+  attachInterrupt(digitalPinToInterrupt(IR_SENSOR_PIN), onIrEdge, FALLING);
+}
+
+// Called from loop() with motionMutex held: finishes a visit portion's
+// move and records what it delivered once the food has settled
+void serviceOnDemand() {
+  unsigned long now = millis();
+  Portion& portion = onDemand.portion;
+  
+  if (onDemand.started) {
+    onDemand.started = false;
+    bumpStateVersion();
+  }
+  if (onDemand.pending) {
+    serviceVisitPending(now);
+  }
+  
+  if (onDemand.moving && stepper.distanceToGo() == 0) {
+    onDemand.moving = false;
+    portion.steps = motorSteps() - portion.moveStartPosition;
+    portion.result = PORTION_SETTLING;
+    releaseMotor(NO_NEXT_MOVE);
+    onDemand.settling = true;
+    onDemand.settleAt = now + PORTION_SETTLE_MS;
+  }
+  
+  if (!onDemand.settling || (long)(now - onDemand.settleAt) < 0) {
+    return;
+  }
+  onDemand.settling = false;
+  if (portion.openLoop || !weightFeedbackAvailable()) {
+    portion.openLoop = true;
+    portion.delivered = portion.steps * gramsPerStep;
+  } else {
+    portion.delivered = max(0.0f, currentWeight - portion.startWeight);
+  }
+  portion.result = portion.jammed ? PORTION_JAMMED : PORTION_DONE;
+  
+  uint8_t last = (onDemand.fedHead + ON_DEMAND_MAX_PER_DAY - 1) % ON_DEMAND_MAX_PER_DAY;
+  onDemand.fedGrams[last] = portion.delivered;
+  recordFeedHistory(portion, ON_DEMAND_PROGRAM_ID);
+  countDispense(portion.delivered);
+  bumpStateVersion();
+}
+
+// GET /api/ondemand
+// POST /api/ondemand?enabled=B&grams=G&dailyGrams=G&cooldownMs=MS (any subset),
+//      or the same members in a JSON object
+void handleOnDemand() {
+  if (server.method() == HTTP_POST) {
+    OnDemandBody body = { onDemand.enabled, onDemand.grams, onDemand.dailyGrams, onDemand.cooldownMs };
+    bool parsed;
+    if (hasRequestBody()) {
+      parsed = parseRequestBody(ON_DEMAND_BODY, &body);
+    } else {
+      parsed = (!server.hasArg("enabled") || queryParam("enabled", body.enabled)) &&
+               (!server.hasArg("grams") || queryParam("grams", body.grams)) &&
+               (!server.hasArg("dailyGrams") || queryParam("dailyGrams", body.dailyGrams)) &&
+               (!server.hasArg("cooldownMs") || queryParam("cooldownMs", body.cooldownMs));
+    }
+    if (!parsed || body.grams <= 0 || body.dailyGrams < 0) {
+      server.send(400, "text/plain", "Invalid parameter");
+      return;
+    }
+    bool enabled = body.enabled;
+    float grams = body.grams;
+    float dailyGrams = body.dailyGrams;
+    uint32_t cooldownMs = body.cooldownMs;
+    onDemand.enabled = enabled;
+    onDemand.grams = grams;
+    onDemand.dailyGrams = dailyGrams;
+    onDemand.cooldownMs = cooldownMs;
+    onDemandPrefs.putBool("enabled", enabled);
+    onDemandPrefs.putFloat("grams", grams);
+    onDemandPrefs.putFloat("daily", dailyGrams);
+    onDemandPrefs.putULong("cooldown", cooldownMs);
+  } else if (server.method() != HTTP_GET) {
+    server.send(405, "text/plain", "Method not allowed");
+    return;
+  }
+  
+  static const char* const outcomeNames[VISIT_OUTCOME_COUNT] = {
+    "fed", "bounce", "disabled", "cooldown", "budget", "busy", "throttled", "fleet"
+  };
+  unsigned long now = millis();
+  float usedGrams = onDemandGramsToday(now);
+  String json = "{";
+  json += "\"enabled\":" + String(onDemand.enabled ? "true" : "false");
+  json += ",\"grams\":" + String(onDemand.grams, 2);
+  json += ",\"dailyGrams\":" + String(onDemand.dailyGrams, 2);
+  json += ",\"cooldownMs\":" + String(onDemand.cooldownMs);
+  json += ",\"usedGrams\":" + String(usedGrams, 2);
+  json += ",\"remainingGrams\":" + String(max(0.0f, onDemand.dailyGrams - usedGrams), 2);
+  json += ",\"cooldownLeftMs\":" + String(onDemandCooldownLeftMs(now));
+  json += ",\"active\":" + String(onDemand.moving || onDemand.settling ? "true" : "false");
+  json += ",\"pending\":" + String(onDemand.pending ? "true" : "false");
+  json += ",\"latencyUs\":{\"last\":" + String(onDemand.lastLatencyUs);
+  json += ",\"mean\":" + String(onDemand.meanLatencyUs, 0);
+  json += ",\"max\":" + String(onDemand.maxLatencyUs) + "}";
+  json += ",\"visits\":{";
+  for (int i = 0; i < VISIT_OUTCOME_COUNT; i++) {
+    json += (i > 0 ? ",\"" : "\"") + String(outcomeNames[i]) + "\":" + String(onDemand.outcomes[i]);
+  }
+  json += "}}";
+  sendResponse(200, "application/json", json);
+}
+
+// ========================================
+// HTTPS Front End
+// ========================================
+
+// Session cache and ticket callbacks, wrapped to notice resumptions. They
+// run inside a handshake step, under handshakeMutex.
+int tlsCacheGet(void* cache, mbedtls_ssl_session* session) {
+  int ret = mbedtls_ssl_cache_get(cache, session);
+  if (ret == 0) {
+    tls.stepping->resumed = true;
+  }
+  return ret;
+}
+
+int tlsTicketParse(void* tickets, mbedtls_ssl_session* session, unsigned char* buf, size_t len) {
+  int ret = mbedtls_ssl_ticket_parse(tickets, session, buf, len);
+  if (ret == 0) {
+    tls.stepping->resumed = true;
+  }
+  return ret;
+}
+
+bool tlsFail(const char* what, int ret) {
+  tls.error = String(what) + " (-0x" + String(-ret, HEX) + ")";
+  return false;
+}
+
+bool setupTls() {
+  static const int ciphersuites[] = {
+    MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_128_GCM_SHA256,
+    MBEDTLS_TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256,
+    MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_256_GCM_SHA384,
+    MBEDTLS_TLS_ECDHE_RSA_WITH_AES_256_GCM_SHA384,
+    0
+  };
+  
+  tlsPrefs.begin("tls", false);
+  tls.httpRedirect = tlsPrefs.getBool("redirect", false);
+  String certPem = tlsPrefs.getString("cert", "");
+  String keyPem = tlsPrefs.getString("key", "");
+  if (certPem.length() == 0 || keyPem.length() == 0) {
+    tls.error = "No certificate installed";
+    return false;
+  }
+  
+  mbedtls_entropy_init(&tls.entropy);
+  mbedtls_ctr_drbg_init(&tls.drbg);
+  mbedtls_x509_crt_init(&tls.cert);
+  mbedtls_pk_init(&tls.key);
+  mbedtls_ssl_config_init(&tls.conf);
+  mbedtls_ssl_cache_init(&tls.cache);
+  mbedtls_ssl_ticket_init(&tls.tickets);
+  mbedtls_net_init(&tls.listener);
+  
+  int ret;
+  const char* personal = "smart-feeder-tls";
+  if ((ret = mbedtls_ctr_drbg_seed(&tls.drbg, mbedtls_entropy_func, &tls.entropy, (const unsigned char*)personal, strlen(personal))) != 0) {
+    return tlsFail("RNG seed failed", ret);
+  }
+  // PEM lengths include the terminating NUL
+  if ((ret = mbedtls_x509_crt_parse(&tls.cert, (const unsigned char*)certPem.c_str(), certPem.length() + 1)) != 0) {
+    return tlsFail("Bad certificate", ret);
+  }
+  if ((ret = mbedtls_pk_parse_key(&tls.key, (const unsigned char*)keyPem.c_str(), keyPem.length() + 1, NULL, 0)) != 0) {
+    return tlsFail("Bad key", ret);
+  }
+  if ((ret = mbedtls_ssl_config_defaults(&tls.conf, MBEDTLS_SSL_IS_SERVER, MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT)) != 0) {
+    return tlsFail("Config failed", ret);
+  }
+  mbedtls_ssl_conf_rng(&tls.conf, mbedtls_ctr_drbg_random, &tls.drbg);
+  if ((ret = mbedtls_ssl_conf_own_cert(&tls.conf, &tls.cert, &tls.key)) != 0) {
+    return tlsFail("Certificate rejected", ret);
+  }
+  
+  // TLS 1.2 with AES-GCM only: the record layer then runs on the AES
+  // accelerator and never needs the RNG outside a handshake
+  mbedtls_ssl_conf_min_version(&tls.conf, MBEDTLS_SSL_MAJOR_VERSION_3, MBEDTLS_SSL_MINOR_VERSION_3);
+  mbedtls_ssl_conf_ciphersuites(&tls.conf, ciphersuites);
+  mbedtls_ssl_conf_read_timeout(&tls.conf, TLS_READ_TIMEOUT_MS);
+  
+  // Resumption: tickets for clients that support them, the cache for the rest
+  mbedtls_ssl_cache_set_max_entries(&tls.cache, TLS_CACHE_ENTRIES);
+  mbedtls_ssl_cache_set_timeout(&tls.cache, TLS_SESSION_LIFETIME_S);
+  mbedtls_ssl_conf_session_cache(&tls.conf, &tls.cache, tlsCacheGet, mbedtls_ssl_cache_set);
+  if ((ret = mbedtls_ssl_ticket_setup(&tls.tickets, mbedtls_ctr_drbg_random, &tls.drbg, MBEDTLS_CIPHER_AES_256_GCM, TLS_SESSION_LIFETIME_S)) != 0) {
+    return tlsFail("Ticket setup failed", ret);
+  }
+  mbedtls_ssl_conf_session_tickets_cb(&tls.conf, mbedtls_ssl_ticket_write, tlsTicketParse, &tls.tickets);
+  
+  if ((ret = mbedtls_net_bind(&tls.listener, NULL, TLS_PORT, MBEDTLS_NET_PROTO_TCP)) != 0) {
+    return tlsFail("Bind failed", ret);
+  }
+  tls.slots = xSemaphoreCreateCounting(TLS_MAX_SESSIONS, TLS_MAX_SESSIONS);
+  tls.handshakeMutex = xSemaphoreCreateMutex();
+  if (xTaskCreatePinnedToCore(tlsListenTask, "tls_listen", 4096, NULL, 1, NULL, 0) != pdPASS) {
+    tls.error = "Could not start listener";
+    return false;
+  }
+  tls.running = true;
+  tls.error = "";
+  return true;
+}
+
+void tlsListenTask(void* param) {
+  for (;;) {
+    TlsConnection* conn = new TlsConnection();
+    mbedtls_net_init(&conn->net);
+    if (mbedtls_net_accept(&tls.listener, &conn->net, conn->ip, sizeof(conn->ip), &conn->ipLength) != 0) {
+      delete conn;
+      vTaskDelay(pdMS_TO_TICKS(100));
+      continue;
+    }
+    tls.connections++;
+    
+    // Each session holds ~25 KB of record buffers; never starve the feeder
+    if (ESP.getFreeHeap() < TLS_MIN_FREE_HEAP || xSemaphoreTake(tls.slots, 0) != pdTRUE) {
+      tls.refused++;
+      mbedtls_net_free(&conn->net);
+      delete conn;
+      continue;
+    }
+    if (xTaskCreatePinnedToCore(tlsConnectionTask, "tls_conn", TLS_TASK_STACK, conn, 1, NULL, 0) != pdPASS) {
+      tls.refused++;
+      mbedtls_net_free(&conn->net);
+      delete conn;
+      xSemaphoreGive(tls.slots);
+    }
+  }
+}
+
+bool tlsWriteAll(mbedtls_ssl_context* ssl, const uint8_t* data, size_t length) {
+  while (length > 0) {
+    int n = mbedtls_ssl_write(ssl, data, length);
+    if (n == MBEDTLS_ERR_SSL_WANT_WRITE || n == MBEDTLS_ERR_SSL_WANT_READ) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    data += n;
+    length -= n;
+  }
+  return true;
+}
+
+bool netWriteAll(mbedtls_net_context* net, const uint8_t* data, size_t length) {
+  while (length > 0) {
+    int n = mbedtls_net_send(net, data, length);
+    if (n <= 0) {
+      return false;
+    }
+    data += n;
+    length -= n;
+  }
+  return true;
+}
+
+// Reads from the client (ssl) or from the web server (backend). Returns
+// the byte count, 0 once the peer has closed, or a negative error.
+int tlsProxyRead(mbedtls_ssl_context* ssl, mbedtls_net_context* backend, uint8_t* buf, size_t length) {
+  if (backend != NULL) {
+    return mbedtls_net_recv_timeout(backend, buf, length, TLS_BACKEND_TIMEOUT_MS);
+  }
+  int n;
+  do {
+    n = mbedtls_ssl_read(ssl, buf, length);
+  } while (n == MBEDTLS_ERR_SSL_WANT_READ || n == MBEDTLS_ERR_SSL_WANT_WRITE);
+  return n == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY ? 0 : n;
+}
+
+// Fills buf until it holds a complete HTTP head. Returns the head length
+// including the blank line, or -1; bytes past it stay in buf.
+int tlsReadHead(mbedtls_ssl_context* ssl, mbedtls_net_context* backend, uint8_t* buf, size_t& used) {
+  used = 0;
+  while (used < TLS_HEAD_MAX) {
+    int n = tlsProxyRead(ssl, backend, buf + used, TLS_HEAD_MAX - used);
+    if (n <= 0) {
+      return -1;
+    }
+    size_t from = used >= 3 ? used - 3 : 0;
+    used += n;
+    for (size_t i = from; i + 4 <= used; i++) {
+      if (memcmp(buf + i, "\r\n\r\n", 4) == 0) {
+        return i + 4;
+      }
+    }
+  }
+  return -1;
+}
+
+// Value of header `name` in a head, trimmed; NULL if absent
+const char* tlsHeader(const uint8_t* head, size_t headLength, const char* name, size_t& valueLength) {
+  size_t nameLength = strlen(name);
+  const char* line = (const char*)head;
+  const char* end = (const char*)head + headLength;
+  while (line < end) {
+    const char* eol = (const char*)memchr(line, '\n', end - line);
+    if (eol == NULL) {
+      break;
+    }
+    if ((size_t)(eol - line) > nameLength && line[nameLength] == ':' && strncasecmp(line, name, nameLength) == 0) {
+      const char* value = line + nameLength + 1;
+      const char* valueEnd = eol;
+      while (value < valueEnd && *value == ' ') {
+        value++;
+      }
+      while (valueEnd > value && (valueEnd[-1] == '\r' || valueEnd[-1] == ' ')) {
+        valueEnd--;
+      }
+      valueLength = valueEnd - value;
+      return value;
+    }
+    line = eol + 1;
+  }
+  return NULL;
+}
+
+long tlsContentLength(const uint8_t* head, size_t headLength) {
+  size_t length;
+  const char* value = tlsHeader(head, headLength, "Content-Length", length);
+  return value != NULL ? strtol(value, NULL, 10) : -1;
+}
+
+bool tlsHeaderIs(const uint8_t* head, size_t headLength, const char* name, const char* token) {
+  size_t length;
+  const char* value = tlsHeader(head, headLength, name, length);
+  return value != NULL && length == strlen(token) && strncasecmp(value, token, length) == 0;
+}
+
+// Copies bytes both ways until either side closes (WebSocket upgrades)
+void tlsPipe(mbedtls_ssl_context* ssl, TlsConnection* conn, mbedtls_net_context* backend) {
+  for (;;) {
+    fd_set readable;
+    FD_ZERO(&readable);
+    FD_SET(conn->net.fd, &readable);
+    FD_SET(backend->fd, &readable);
+    struct timeval timeout = { 1, 0 };
+    if (mbedtls_ssl_get_bytes_avail(ssl) == 0 &&
+        select(max(conn->net.fd, backend->fd) + 1, &readable, NULL, NULL, &timeout) < 0) {
+      return;
+    }
+    if (mbedtls_ssl_get_bytes_avail(ssl) > 0 || FD_ISSET(conn->net.fd, &readable)) {
+      int n = tlsProxyRead(ssl, NULL, conn->buf, sizeof(conn->buf));
+      if (n <= 0 || !netWriteAll(backend, conn->buf, n)) {
+        return;
+      }
+    }
+    if (FD_ISSET(backend->fd, &readable)) {
+      int n = mbedtls_net_recv(backend, conn->buf, sizeof(conn->buf));
+      if (n <= 0 || !tlsWriteAll(ssl, conn->buf, n)) {
+        return;
+      }
+    }
+  }
+}
+
+// Proxies one request and its response. Returns whether the connection
+// stays open for another request.
+bool tlsProxyRequest(mbedtls_ssl_context* ssl, TlsConnection* conn) {
+  size_t used;
+  int headLength = tlsReadHead(ssl, NULL, conn->buf, used);
+  if (headLength < 0) {
+    return false;
+  }
+  
+  // Requests are small and clients don't pipeline; anything past the body
+  // ends keep-alive rather than being buffered
+  long bodyLength = max(0L, tlsContentLength(conn->buf, headLength));
+  bool keepAlive = !tlsHeaderIs(conn->buf, headLength, "Connection", "close") &&
+                   memmem(conn->buf, headLength, " HTTP/1.0\r\n", 11) == NULL;
+  if (tlsHeader(conn->buf, headLength, "Transfer-Encoding", used) != NULL) {
+    const char* reply = "HTTP/1.1 411 Length Required\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+    tlsWriteAll(ssl, (const uint8_t*)reply, strlen(reply));
+    return false;
+  }
+  size_t extra = used - headLength;
+  if ((long)extra > bodyLength) {
+    keepAlive = false;
+    extra = bodyLength;
+  }
+  
+  mbedtls_net_context backend;
+  mbedtls_net_init(&backend);
+  if (mbedtls_net_connect(&backend, "127.0.0.1", TLS_BACKEND_PORT, MBEDTLS_NET_PROTO_TCP) != 0) {
+    const char* reply = "HTTP/1.1 502 Bad Gateway\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+    tlsWriteAll(ssl, (const uint8_t*)reply, strlen(reply));
+    return false;
+  }
+  
+  // Request line, then the real client's address, then the rest. The
+  // backend keeps the last X-Forwarded-For it sees, so any the client sent
+  // are dropped; otherwise it could pick its own admission bucket.
+  const uint8_t* line = (const uint8_t*)memchr(conn->buf, '\n', headLength) + 1;
+  size_t out = line - conn->buf;
+  memcpy(conn->head, conn->buf, out);
+  if (conn->ipLength == 4) {
+    out += snprintf((char*)conn->head + out, sizeof(conn->head) - out, "X-Forwarded-For: %u.%u.%u.%u\r\n",
+                    conn->ip[0], conn->ip[1], conn->ip[2], conn->ip[3]);
+  }
+  const uint8_t* headEnd = conn->buf + headLength;
+  while (line < headEnd) {
+    const uint8_t* next = (const uint8_t*)memchr(line, '\n', headEnd - line) + 1;
+    if (strncasecmp((const char*)line, "X-Forwarded-For:", 16) != 0) {
+      memcpy(conn->head + out, line, next - line);
+      out += next - line;
+    }
+    line = next;
+  }
+  bool ok = netWriteAll(&backend, conn->head, out) &&
+            netWriteAll(&backend, conn->buf + headLength, extra);
+  for (long left = bodyLength - extra; ok && left > 0; ) {
+    int n = tlsProxyRead(ssl, NULL, conn->buf, min((long)sizeof(conn->buf), left));
+    ok = n > 0 && netWriteAll(&backend, conn->buf, n);
+    left -= n;
+  }
+  
+  headLength = ok ? tlsReadHead(NULL, &backend, conn->buf, used) : -1;
+  if (headLength < 0) {
+    mbedtls_net_free(&backend);
+    return false;
+  }
+  tls.requests++;
+  
+  if (memcmp(conn->buf, "HTTP/1.1 101", 12) == 0) {
+    if (tlsWriteAll(ssl, conn->buf, used)) {
+      tlsPipe(ssl, conn, &backend);
+    }
+    mbedtls_net_free(&backend);
+    return false;
+  }
+  
+  // The web server closes after every response. Without a length the body
+  // ends at that close, so only a sized response can keep the session open.
+  long responseLength = tlsContentLength(conn->buf, headLength);
+  keepAlive = keepAlive && responseLength >= 0;
+  out = 0;
+  line = conn->buf;
+  headEnd = conn->buf + headLength - 2;
+  while (line < headEnd) {
+    const uint8_t* next = (const uint8_t*)memchr(line, '\n', headEnd - line) + 1;
+    if (strncasecmp((const char*)line, "Connection:", 11) != 0) {
+      memcpy(conn->head + out, line, next - line);
+      out += next - line;
+    }
+    line = next;
+  }
+  out += snprintf((char*)conn->head + out, sizeof(conn->head) - out, "Connection: %s\r\n\r\n", keepAlive ? "keep-alive" : "close");
+  
+  extra = used - headLength;
+  if (responseLength >= 0 && (long)extra > responseLength) {
+    extra = responseLength;
+  }
+  ok = tlsWriteAll(ssl, conn->head, out) && tlsWriteAll(ssl, conn->buf + headLength, extra);
+  long left = responseLength >= 0 ? responseLength - (long)extra : -1;  // -1: until close
+  while (ok && left != 0) {
+    int n = tlsProxyRead(NULL, &backend, conn->buf, left < 0 ? sizeof(conn->buf) : min((long)sizeof(conn->buf), left));
+    if (n <= 0) {
+      ok = responseLength < 0;  // A close is the end of an unsized body
+      break;
+    }
+    ok = tlsWriteAll(ssl, conn->buf, n);
+    left -= n;
+  }
+  mbedtls_net_free(&backend);
+  return ok && keepAlive;
+}
+
+// Runs the handshake as far as the input allows at a time. Its steps share
+// the cache, tickets, RNG and private key, so they hold handshakeMutex;
+// the socket is non-blocking meanwhile, and waiting for the client happens
+// outside the mutex. A stalled client therefore holds up no one else's
+// handshake, and gives its slot back after TLS_HANDSHAKE_TIMEOUT_MS.
+int tlsHandshake(mbedtls_ssl_context* ssl, TlsConnection* conn) {
+  unsigned long started = millis();
+  mbedtls_net_set_nonblock(&conn->net);
+  mbedtls_ssl_set_bio(ssl, &conn->net, mbedtls_net_send, mbedtls_net_recv, NULL);
+  int ret;
+  for (;;) {
+    xSemaphoreTake(tls.handshakeMutex, portMAX_DELAY);
+    tls.stepping = conn;
+    ret = mbedtls_ssl_handshake(ssl);
+    xSemaphoreGive(tls.handshakeMutex);
+    if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
+      break;
+    }
+    long leftMs = TLS_HANDSHAKE_TIMEOUT_MS - (long)(millis() - started);
+    int ready = leftMs > 0 ? mbedtls_net_poll(&conn->net, ret == MBEDTLS_ERR_SSL_WANT_READ ? MBEDTLS_NET_POLL_READ : MBEDTLS_NET_POLL_WRITE, leftMs) : 0;
+    if (ready <= 0) {
+      ret = ready < 0 ? ready : MBEDTLS_ERR_SSL_TIMEOUT;
+      break;
+    }
+  }
+  
+  // Requests then block, for at most the keep-alive idle time
+  mbedtls_net_set_block(&conn->net);
+  mbedtls_ssl_set_bio(ssl, &conn->net, mbedtls_net_send, NULL, mbedtls_net_recv_timeout);
+  return ret;
+}
+
+void tlsConnectionTask(void* param) {
+  TlsConnection* conn = (TlsConnection*)param;
+  mbedtls_ssl_context ssl;
+  mbedtls_ssl_init(&ssl);
+  
+  if (mbedtls_ssl_setup(&ssl, &tls.conf) == 0) {
+    unsigned long started = millis();
+    int ret = tlsHandshake(&ssl, conn);
+    float elapsedMs = millis() - started;
+    
+    if (ret != 0) {
+      tls.failures++;
+    } else {
+      if (conn->resumed) {
+        tls.resumedHandshakeMs += (tls.resumedHandshakes == 0 ? 1.0 : 0.1) * (elapsedMs - tls.resumedHandshakeMs);
+        tls.resumedHandshakes++;
+      } else {
+        tls.fullHandshakeMs += (tls.fullHandshakes == 0 ? 1.0 : 0.1) * (elapsedMs - tls.fullHandshakeMs);
+        tls.fullHandshakes++;
+      }
+      while (tlsProxyRequest(&ssl, conn)) {
+      }
+      mbedtls_ssl_close_notify(&ssl);
+    }
+  }
+  
+  mbedtls_ssl_free(&ssl);
+  mbedtls_net_free(&conn->net);
+  delete conn;
+  xSemaphoreGive(tls.slots);
+  vTaskDelete(NULL);
+}
+
+// Validates and stores the cert and key form fields, answering the
+// request itself if they are refused
+bool installTlsCertificate(bool& restartRequired) {
+  String certPem = server.arg("cert");
+  String keyPem = server.arg("key");
+  mbedtls_x509_crt cert;
+  mbedtls_pk_context key;
+  mbedtls_x509_crt_init(&cert);
+  mbedtls_pk_init(&key);
+  bool valid = mbedtls_x509_crt_parse(&cert, (const unsigned char*)certPem.c_str(), certPem.length() + 1) == 0 &&
+               mbedtls_pk_parse_key(&key, (const unsigned char*)keyPem.c_str(), keyPem.length() + 1, NULL, 0) == 0 &&
+               mbedtls_pk_check_pair(&cert.pk, &key) == 0;
+  mbedtls_x509_crt_free(&cert);
+  mbedtls_pk_free(&key);
+  if (!valid) {
+    server.send(400, "text/plain", "Invalid certificate, key, or pair");
+    return false;
+  }
+  if (tlsPrefs.putString("cert", certPem) == 0 || tlsPrefs.putString("key", keyPem) == 0) {
+    server.send(507, "text/plain", "Could not store certificate");
+    return false;
+  }
+  restartRequired = tls.running || !setupTls();
+  return true;
+}
+
+// GET /api/tls
+// POST /api/tls with form fields cert and key (PEM). Installed in NVS;
+// takes effect at once if HTTPS isn't running yet, otherwise after restart.
+// POST /api/tls?httpRedirect=B, alone or with the above, sets whether
+// port 80 only redirects to HTTPS.
+// DELETE /api/tls removes them.
+void handleTls() {
+  bool restartRequired = false;
+  if (server.method() == HTTP_POST) {
+    bool redirect = tls.httpRedirect;
+    if (server.hasArg("httpRedirect") && !queryParam("httpRedirect", redirect)) {
+      server.send(400, "text/plain", "Invalid 'httpRedirect'");
+      return;
+    }
+    if ((server.hasArg("cert") || !server.hasArg("httpRedirect")) && !installTlsCertificate(restartRequired)) {
+      return;
+    }
+    tls.httpRedirect = redirect;
+    tlsPrefs.putBool("redirect", redirect);
+  } else if (server.method() == HTTP_DELETE) {
+    tlsPrefs.remove("cert");
+    tlsPrefs.remove("key");
+    restartRequired = tls.running;
+  } else if (server.method() != HTTP_GET) {
+    server.send(405, "text/plain", "Method not allowed");
+    return;
+  }
+  
+  String json = "{";
+  json += "\"running\":" + String(tls.running ? "true" : "false");
+  json += ",\"error\":\"" + tls.error + "\"";
+  json += ",\"certInstalled\":" + String(tlsPrefs.isKey("cert") ? "true" : "false");
+  json += ",\"restartRequired\":" + String(restartRequired ? "true" : "false");
+  json += ",\"httpRedirect\":" + String(tls.httpRedirect ? "true" : "false");
+  json += ",\"sessions\":" + String(tls.running ? TLS_MAX_SESSIONS - uxSemaphoreGetCount(tls.slots) : 0);
+  json += ",\"connections\":" + String(tls.connections);
+  json += ",\"fullHandshakes\":" + String(tls.fullHandshakes);
+  json += ",\"resumedHandshakes\":" + String(tls.resumedHandshakes);
+  json += ",\"fullHandshakeMs\":" + String(tls.fullHandshakeMs, 1);
+  json += ",\"resumedHandshakeMs\":" + String(tls.resumedHandshakeMs, 1);
+  json += ",\"requests\":" + String(tls.requests);
+  json += ",\"failures\":" + String(tls.failures);
+  json += ",\"refused\":" + String(tls.refused);
+  json += ",\"freeHeap\":" + String(ESP.getFreeHeap());
+  json += "}";
+  sendResponse(200, "application/json", json);
+}
+
+// ========================================
+// JSON Request Bodies
+// ========================================
+// The parser (include/json_body.h) works in requestBody.buf.
+
+// Collects an application/json body as the WebServer streams it in. The
+// Content-Length is known before the first byte, so oversize bodies are
+// refused up front and the rest of them only drained.
+void receiveRequestBody(WebServer& srv, HTTPRaw& raw) {
+  if (raw.status == RAW_START) {
+    requestBody.length = 0;
+    requestBody.state = BODY_RECEIVING;
+    if (srv.clientContentLength() > REQUEST_BODY_MAX) {
+      requestBody.state = BODY_TOO_LARGE;
+      Serial.print("[DEBUG] ⚠ Refused ");
+      Serial.print(srv.clientContentLength());
+      Serial.println(" byte request body");
+    }
+  } else if (raw.status == RAW_WRITE && requestBody.state == BODY_RECEIVING) {
+    if (requestBody.length + raw.currentSize > REQUEST_BODY_MAX) {
+      requestBody.state = BODY_TOO_LARGE;
+      return;
+    }
+    memcpy(requestBody.buf + requestBody.length, raw.buf, raw.currentSize);
+    requestBody.length += raw.currentSize;
+  } else if (raw.status == RAW_END && requestBody.state == BODY_RECEIVING) {
+    requestBody.buf[requestBody.length] = '\0';
+    requestBody.state = BODY_READY;
+  } else if (raw.status == RAW_ABORTED) {
+    requestBody.state = BODY_NONE;
+  }
+}
+
+bool hasRequestBody() {
+  return requestBody.state == BODY_READY;
+}
+
+// Fills `target` from the received body. Parsing rewrites the buffer, so
+// call it once per request; strings in `target` live until the handler
+// returns.
+bool parseRequestBody(const JsonSchema& schema, void* target) {
+  if (requestBody.state != BODY_READY) {
+    return false;
+  }
+  char* p = requestBody.buf;
+  if (!jsonObject(p, schema, (uint8_t*)target)) {
+    return false;
+  }
+  jsonSkipSpace(p);
+  return p == requestBody.buf + requestBody.length;
+}
+
+// The other direction: text from outside (SSIDs can hold any byte) as a
+// quoted JSON string for a response
+String jsonQuote(const char* text) {
+  String out = "\"";
+  for (const char* p = text; *p; p++) {
+    uint8_t c = *p;
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += (char)c;
+    } else if (c < 0x20) {
+      char escaped[7];
+      snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+      out += escaped;
+    } else {
+      out += (char)c;
+    }
+  }
+  out += '"';
+  return out;
+}
+
+// ========================================
+// Response Compression
+// ========================================
+
+// True if Accept-Encoding lists `coding` without q=0
+bool acceptsCoding(const char* accept, const char* coding) {
+  size_t length = strlen(coding);
+  const char* p = accept;
+  while (*p) {
+    while (*p == ' ' || *p == ',') {
+      p++;
+    }
+    const char* token = p;
+    while (*p && *p != ',' && *p != ';' && *p != ' ') {
+      p++;
+    }
+    bool match = (size_t)(p - token) == length && strncasecmp(token, coding, length) == 0;
+    float q = 1.0;
+    while (*p && *p != ',') {
+      if ((p[0] == 'q' || p[0] == 'Q') && p[1] == '=') {
+        q = atof(p + 2);
+      }
+      p++;
+    }
+    if (match) {
+      return q > 0;
+    }
+  }
+  return false;
+}
+
+// A compressed response too large for one Deflater buffer
+struct StreamedResponse {
+  int code;
+  const char* type;
+  ContentCoding coding;
+  bool started;
+};
+
+// Deflater sink: the first full buffer starts a chunked response, and
+// each one after goes out as a chunk of its own
+void sendDeflateChunk(void* context, const uint8_t* data, size_t length) {
+  StreamedResponse& response = *(StreamedResponse*)context;
+  if (!response.started) {
+    server.sendHeader("Content-Encoding", response.coding == CODING_GZIP ? "gzip" : "deflate");
+    server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+    server.send(response.code, response.type, "");
+    response.started = true;
+  }
+  server.sendContent((const char*)data, length);
+}
+
+// Sends a complete response, compressed when the client accepts gzip or
+// deflate and the body is large enough to gain from it
+void sendResponse(int code, const char* type, const String& body) {
+  ContentCoding coding = CODING_IDENTITY;
+  if (body.length() >= COMPRESS_MIN_BYTES) {
+    server.sendHeader("Vary", "Accept-Encoding");
+    String accept = server.header("Accept-Encoding");
+    if (acceptsCoding(accept.c_str(), "gzip")) {
+      coding = CODING_GZIP;
+    } else if (acceptsCoding(accept.c_str(), "deflate")) {
+      coding = CODING_DEFLATE;
+    }
+  }
+  if (coding == CODING_IDENTITY) {
+    server.send(code, type, body);
+    return;
+  }
+  
+  // A body that fits the buffer compressed is only sent that way if it
+  // comes out smaller, with a Content-Length. A larger one is streamed as
+  // it compresses; fixed-Huffman JSON is well under its size.
+  StreamedResponse response = { code, type, coding, false };
+  bool streamed = body.length() > DEFLATE_OUT_MAX;
+  deflater.sink = streamed ? sendDeflateChunk : NULL;
+  deflater.sinkContext = &response;
+  size_t encodedLength = deflateBody(deflater, (const uint8_t*)body.c_str(), body.length(), coding,
+                                     streamed ? DEFLATE_OUT_MAX : body.length() - 1);
+  deflater.sink = NULL;
+  if (response.started) {
+    server.sendContent((const char*)deflater.out, deflater.outLength);
+    server.sendContent("");  // Last chunk
+    return;
+  }
+  if (encodedLength == 0) {
+    server.send(code, type, body);
+    return;
+  }
+  server.sendHeader("Content-Encoding", coding == CODING_GZIP ? "gzip" : "deflate");
+  server.setContentLength(encodedLength);
+  server.send(code, type, "");
+  server.sendContent((const char*)deflater.out, encodedLength);
+}
+
+// ========================================
+// Network Fault Injection
+// ========================================
+
+bool netFaultLose() {
+  return NETFAULT_ENABLED && netFault.active.lossPercent > 0 && random(0, 100) < (long)netFault.active.lossPercent;
+}
+
+// Bytes the sample stream may write now, out of `wanted`
+size_t netFaultStreamAllowance(size_t wanted) {
+  if (!NETFAULT_ENABLED || netFault.active.slowBytesPerSec == 0) {
+    return wanted;
+  }
+  unsigned long now = millis();
+  netFault.streamBudget = min(netFault.streamBudget + (now - netFault.streamBudgetAt) * netFault.active.slowBytesPerSec / 1000.0f,
+                              (float)netFault.active.slowBytesPerSec);
+  netFault.streamBudgetAt = now;
+  size_t allowed = min(wanted, (size_t)netFault.streamBudget);
+  netFault.streamBudget -= allowed;
+  netFault.streamBytes += allowed;
+  return allowed;
+}
+
+void startNetFault(const NetFaultScript& script) {
+  memset(&netFault, 0, sizeof(netFault));
+  netFault.script = script;
+  for (uint32_t i = 0; i < script.stepCount; i++) {
+    netFault.endsAt = max(netFault.endsAt, (unsigned long)script.steps[i].atMs + script.steps[i].durationMs);
+  }
+  netFault.running = true;
+  netFault.startedAt = millis();
+  netFault.step = -1;
+  Serial.print("[DEBUG] Network fault script started, ");
+  Serial.print(script.stepCount);
+  Serial.println(" steps");
+}
+
+void stopNetFault() {
+  if (netFault.outageSince != 0) {
+    netFault.outageMs += millis() - netFault.outageSince;
+    netFault.outageSince = 0;
+  }
+  netFault.running = false;
+  netFault.step = -1;
+  memset(&netFault.active, 0, sizeof(netFault.active));
+}
+
+// Applies the step due now and measures the link. Steps may overlap; the
+// first one covering the current time is in force.
+void serviceNetFault() {
+  if (!netFault.running) {
+    return;
+  }
+  unsigned long now = millis();
+  unsigned long elapsed = now - netFault.startedAt;
+  
+  int step = -1;
+  for (uint32_t i = 0; i < netFault.script.stepCount && step < 0; i++) {
+    const NetFaultStep& candidate = netFault.script.steps[i];
+    if (elapsed >= candidate.atMs && elapsed < (unsigned long)candidate.atMs + candidate.durationMs) {
+      step = i;
+    }
+  }
+  if (step != netFault.step) {
+    bool linkFault = netFault.active.dropLink || netFault.active.hideAps;
+    if (linkFault && WiFi.status() != WL_CONNECTED) {
+      netFault.clearedAt = now;
+    }
+    netFault.step = step;
+    if (step >= 0) {
+      netFault.active = netFault.script.steps[step];
+      netFault.streamBudget = 0;
+      netFault.streamBudgetAt = now;
+      if (netFault.active.dropLink) {
+        WiFi.disconnect();
+      }
+    } else {
+      memset(&netFault.active, 0, sizeof(netFault.active));
+    }
+    Serial.print("[DEBUG] Network fault step ");
+    Serial.println(step);
+  }
+  
+  bool connected = WiFi.status() == WL_CONNECTED;
+  if (!connected && netFault.outageSince == 0) {
+    netFault.outageSince = now;
+  } else if (connected && netFault.outageSince != 0) {
+    unsigned long outage = now - netFault.outageSince;
+    netFault.outageMs += outage;
+    netFault.longestOutageMs = max(netFault.longestOutageMs, outage);
+    netFault.outageSince = 0;
+    netFault.reconnects++;
+    if (netFault.clearedAt != 0) {
+      netFault.worstRecoveryMs = max(netFault.worstRecoveryMs, now - netFault.clearedAt);
+      netFault.clearedAt = 0;
+    }
+  }
+  
+  // Done once every step is over and the link is back, or given up on
+  if (elapsed >= netFault.endsAt && ((connected && netFault.clearedAt == 0) || elapsed >= netFault.endsAt + NETFAULT_SETTLE_MS)) {
+    stopNetFault();
+    Serial.print("[DEBUG] Network fault script done, worst recovery ");
+    Serial.print(netFault.worstRecoveryMs);
+    Serial.println(" ms");
+  }
+}
+
+String buildNetFaultJson() {
+  unsigned long outageMs = netFault.outageMs + (netFault.outageSince != 0 ? millis() - netFault.outageSince : 0);
+  uint32_t datagrams = netFault.datagramsSent + netFault.datagramsReceived;
+  uint32_t datagramsLost = netFault.datagramsSentLost + netFault.datagramsReceivedLost;
+  uint32_t polls = netFault.pollsAnswered + netFault.pollsLost;
+  
+  String json = "{";
+  json += "\"running\":" + String(netFault.running ? "true" : "false");
+  json += ",\"elapsedMs\":" + String(netFault.running ? millis() - netFault.startedAt : 0);
+  json += ",\"step\":" + String(netFault.step);
+  json += ",\"steps\":" + String(netFault.script.stepCount);
+  json += ",\"outageMs\":" + String(outageMs);
+  json += ",\"longestOutageMs\":" + String(netFault.longestOutageMs);
+  json += ",\"worstRecoveryMs\":" + String(netFault.worstRecoveryMs);
+  json += ",\"reconnects\":" + String(netFault.reconnects);
+  json += ",\"polls\":{\"answered\":" + String(netFault.pollsAnswered);
+  json += ",\"lost\":" + String(netFault.pollsLost);
+  json += ",\"delivered\":" + String(polls > 0 ? 100.0 * netFault.pollsAnswered / polls : 100.0, 1) + "}";
+  json += ",\"datagrams\":{\"sent\":" + String(netFault.datagramsSent);
+  json += ",\"sentLost\":" + String(netFault.datagramsSentLost);
+  json += ",\"received\":" + String(netFault.datagramsReceived);
+  json += ",\"receivedLost\":" + String(netFault.datagramsReceivedLost);
+  json += ",\"delivered\":" + String(datagrams > 0 ? 100.0 * (datagrams - datagramsLost) / datagrams : 100.0, 1) + "}";
+  json += ",\"streamThrottledBytes\":" + String(netFault.streamBytes);
+  json += "}";
+  return json;
+}
+
+// /api/netfault (NETFAULT_ENABLED builds only)
+//   GET    script progress, outage and recovery times, delivery counts
+//   POST   {"steps":[{"atMs":T,"durationMs":D,"dropLink":B,"hideAps":B,
+//          "lossPercent":P,"latencyMs":L,"slowBytesPerSec":R},...]}
+//          starts a script; omitted faults are off
+//   DELETE stop the script and clear all faults
+void handleNetFault() {
+  if (!NETFAULT_ENABLED) {
+    server.send(404, "text/plain", "Not found");
+    return;
+  }
+  HTTPMethod method = server.method();
+  
+  if (method == HTTP_POST) {
+    static NetFaultScript script;
+    memset(&script, 0, sizeof(script));
+    if (!hasRequestBody() || !parseRequestBody(NETFAULT_SCRIPT_BODY, &script) || script.stepCount == 0) {
+      server.send(400, "text/plain", "Expected a JSON script with at least one step");
+      return;
+    }
+    for (uint32_t i = 0; i < script.stepCount; i++) {
+      if (script.steps[i].lossPercent > 100 || script.steps[i].durationMs == 0) {
+        server.send(400, "text/plain", "Invalid step");
+        return;
+      }
+    }
+    startNetFault(script);
+  } else if (method == HTTP_DELETE) {
+    stopNetFault();
+  } else if (method != HTTP_GET) {
+    server.send(405, "text/plain", "Method not allowed");
+    return;
+  }
+  sendResponse(200, "application/json", buildNetFaultJson());
+}
+
+// ========================================
+// Shared Sensor Snapshot
+// ========================================
+
+// From loop(), after the sampling jobs have updated the globals
+void publishSensorSnapshot() {
+  lastPublished.weight = currentWeight;
+  lastPublished.ir = currentIR;
+  lastPublished.fault = loadCell.fault;
+  lastPublished.sequence++;
+  publishSnapshot(sensorCell, lastPublished);
+}
+
+// ========================================
+// Contention Benchmark
+// ========================================
+
+void contentionFold(const ContentionResult& local) {
+  ContentionResult& result = contention.results[contention.phase];
+  portENTER_CRITICAL(&contentionLock);
+  result.writes += local.writes;
+  result.writeStalls += local.writeStalls;
+  result.reads += local.reads;
+  result.retries += local.retries;
+  result.torn += local.torn;
+  result.maxWriteUs = max(result.maxWriteUs, local.maxWriteUs);
+  result.maxReadUs = max(result.maxReadUs, local.maxReadUs);
+  portEXIT_CRITICAL(&contentionLock);
+  contention.live.fetch_sub(1);
+  vTaskDelete(NULL);
+}
+
+void contentionWriterTask(void* param) {
+  ContentionPrimitive primitive = (ContentionPrimitive)contention.phase.load();
+  ContentionResult local = {};
+  uint32_t n = 0;
+  
+  while (!contention.stop.load(std::memory_order_relaxed)) {
+    SensorSnapshot value = snapshotCheckValue(++n);
+    unsigned long startedAt = micros();
+    if (primitive == CONTENTION_SNAPSHOT) {
+      publishSnapshot(contention.cell, value);
+    } else if (primitive == CONTENTION_QUEUE) {
+      if (xQueueSend(contention.queue, &value, 0) != pdTRUE) {
+        local.writeStalls++;
+      }
+    } else {
+      xSemaphoreTake(contention.mutex, portMAX_DELAY);
+      contention.guarded = value;
+      xSemaphoreGive(contention.mutex);
+    }
+    uint32_t writeUs = micros() - startedAt;
+    local.maxWriteUs = max(local.maxWriteUs, writeUs);
+    local.writes++;
+    if (n % CONTENTION_YIELD_OPS == 0) {
+      vTaskDelay(1);
+    }
+  }
+  contentionFold(local);
+}
+
+void contentionReaderTask(void* param) {
+  ContentionPrimitive primitive = (ContentionPrimitive)contention.phase.load();
+  ContentionResult local = {};
+  uint32_t lastSeen = 0;
+  
+  while (!contention.stop.load(std::memory_order_relaxed)) {
+    SensorSnapshot value;
+    unsigned long startedAt = micros();
+    if (primitive == CONTENTION_SNAPSHOT) {
+      value = readSnapshot(contention.cell, &local.retries);
+    } else if (primitive == CONTENTION_QUEUE) {
+      if (xQueueReceive(contention.queue, &value, pdMS_TO_TICKS(10)) != pdTRUE) {
+        continue;
+      }
+    } else {
+      xSemaphoreTake(contention.mutex, portMAX_DELAY);
+      value = contention.guarded;
+      xSemaphoreGive(contention.mutex);
+    }
+    uint32_t readUs = micros() - startedAt;
+    local.maxReadUs = max(local.maxReadUs, readUs);
+    local.reads++;
+    
+    // Nothing written yet reads as all zeroes
+    if (value.sequence != 0) {
+      if (!snapshotCheckConsistent(value) || value.sequence < lastSeen) {
+        local.torn++;
+      }
+      lastSeen = value.sequence;
+    }
+    if (local.reads % CONTENTION_YIELD_OPS == 0) {
+      vTaskDelay(1);
+    }
+  }
+  contentionFold(local);
+}
+
+// Measures each primitive in turn, then exits
+void contentionTask(void* param) {
+  for (int p = 0; p < CONTENTION_PRIMITIVES; p++) {
+    contention.phase = p;
+    contention.cell.seq.store(0);
+    for (size_t i = 0; i < SNAPSHOT_WORDS; i++) {
+      contention.cell.words[i].store(0);
+    }
+    xQueueReset(contention.queue);
+    memset(&contention.guarded, 0, sizeof(contention.guarded));
+    contention.stop.store(false);
+    contention.live.store(contention.readers + 1);
+    
+    unsigned long startedAt = millis();
+    if (xTaskCreatePinnedToCore(contentionWriterTask, "contend_w", 2048, NULL, 1, NULL, 0) != pdPASS) {
+      contention.live.fetch_sub(1);
+    }
+    // Alternate cores, starting with the one the writer is not on
+    for (int r = 0; r < contention.readers; r++) {
+      if (xTaskCreatePinnedToCore(contentionReaderTask, "contend_r", 2048, NULL, 1, NULL, (r + 1) % 2) != pdPASS) {
+        contention.live.fetch_sub(1);
+      }
+    }
+    vTaskDelay(pdMS_TO_TICKS(contention.durationMs));
+    contention.stop.store(true);
+    while (contention.live.load() > 0) {
+      vTaskDelay(1);
+    }
+    portENTER_CRITICAL(&contentionLock);
+    contention.results[p].elapsedMs = millis() - startedAt;
+    portEXIT_CRITICAL(&contentionLock);
+    
+    Serial.print("[DEBUG] Contention ");
+    Serial.print(CONTENTION_NAMES[p]);
+    Serial.print(": ");
+    Serial.print(contention.results[p].reads);
+    Serial.print(" reads, ");
+    Serial.print(contention.results[p].torn);
+    Serial.println(" torn");
+  }
+  contention.running = false;
+  vTaskDelete(NULL);
+}
+
+String buildContentionJson() {
+  bool running = contention.running;
+  String json = "{";
+  json += "\"running\":" + String(running ? "true" : "false");
+  json += ",\"phase\":" + (running ? "\"" + String(CONTENTION_NAMES[contention.phase]) + "\"" : String("null"));
+  json += ",\"readers\":" + String(contention.readers);
+  json += ",\"durationMs\":" + String(contention.durationMs);
+  json += ",\"primitives\":[";
+  ContentionResult results[CONTENTION_PRIMITIVES];
+  portENTER_CRITICAL(&contentionLock);
+  memcpy(results, contention.results, sizeof(results));
+  portEXIT_CRITICAL(&contentionLock);
+  for (int p = 0; p < CONTENTION_PRIMITIVES; p++) {
+    const ContentionResult& result = results[p];
+    float seconds = max(result.elapsedMs, (uint32_t)1) / 1000.0;
+    if (p > 0) {
+      json += ",";
+    }
+    json += "{\"name\":\"" + String(CONTENTION_NAMES[p]) + "\"";
+    json += ",\"done\":" + String(result.elapsedMs > 0 ? "true" : "false");
+    json += ",\"writes\":" + String(result.writes);
+    json += ",\"writesPerSec\":" + String(result.writes / seconds, 0);
+    json += ",\"writeStalls\":" + String(result.writeStalls);
+    json += ",\"reads\":" + String(result.reads);
+    json += ",\"readsPerSec\":" + String(result.reads / seconds, 0);
+    json += ",\"retries\":" + String(result.retries);
+    json += ",\"torn\":" + String(result.torn);
+    json += ",\"maxWriteUs\":" + String(result.maxWriteUs);
+    json += ",\"maxReadUs\":" + String(result.maxReadUs) + "}";
+  }
+  json += "]}";
+  return json;
+}
+
+// /api/contend
+//   POST [?ms=N&readers=R]  stress each shared-state primitive for N ms with
+//                           R readers (feeder must be idle; motion timing
+//                           suffers while it runs)
+//   GET  per-primitive throughput, latency and consistency results
+void handleContend() {
+  if (server.method() == HTTP_POST) {
+    if (contention.running || bench.running || program.state != PROGRAM_IDLE || onDemand.moving) {
+      server.send(409, "text/plain", "Feeder busy");
+      return;
+    }
+    uint32_t durationMs = CONTENTION_DEFAULT_MS;
+    uint32_t readers = 2;
+    if (server.hasArg("ms") && (!queryParam("ms", durationMs) || durationMs < 10 || durationMs > CONTENTION_MAX_MS)) {
+      server.send(400, "text/plain", "Invalid 'ms'");
+      return;
+    }
+    if (server.hasArg("readers") && (!queryParam("readers", readers) || readers < 1 || readers > CONTENTION_MAX_READERS)) {
+      server.send(400, "text/plain", "Invalid 'readers'");
+      return;
+    }
+    if (contention.queue == NULL) {
+      contention.queue = xQueueCreate(CONTENTION_QUEUE_LENGTH, sizeof(SensorSnapshot));
+      contention.mutex = xSemaphoreCreateMutex();
+    }
+    
+    memset(contention.results, 0, sizeof(contention.results));
+    contention.durationMs = durationMs;
+    contention.readers = readers;
+    contention.phase = 0;
+    contention.running = true;
+    if (xTaskCreatePinnedToCore(contentionTask, "contend", 3072, NULL, 2, NULL, 0) != pdPASS) {
+      contention.running = false;
+      server.send(503, "text/plain", "Could not start benchmark task");
+      return;
+    }
+    Serial.println("[DEBUG] Contention benchmark started");
+    sendResponse(202, "application/json", buildContentionJson());
+    return;
+  }
+  
+  sendResponse(200, "application/json", buildContentionJson());
+}
+
+// ========================================
+// Scheduler
+// ========================================
+// Cooperative: jobs run to completion from loop(), so a job must not block.
+// Times are micros(), compared by signed difference so wraparound is safe.
+
+// Returns the job's slot, or -1 if the table is full
+int schedulePeriodic(const char* name, JobFn fn, uint32_t periodMs, uint32_t deadlineMs, JobPriority priority) {
+  if (scheduler.jobCount == SCHED_MAX_JOBS) {
+    return -1;
+  }
+  uint8_t index = scheduler.jobCount++;
+  Job& job = scheduler.jobs[index];
+  job.name = name;
+  job.fn = fn;
+  job.periodUs = periodMs * 1000;
+  job.deadlineUs = deadlineMs * 1000;
+  job.priority = priority;
+  job.releaseUs = micros();
+  schedulerPush(scheduler, index);
+  return index;
+}
+
+// Runs fn once, delayMs from now. A one-shot job keeps its slot (and its
+// statistics) for the next time; scheduling it again while it is still
+// pending leaves the pending run as it is.
+int scheduleOnce(const char* name, JobFn fn, uint32_t delayMs, uint32_t deadlineMs, JobPriority priority) {
+  int index = -1;
+  for (int i = 0; i < scheduler.jobCount && index < 0; i++) {
+    if (scheduler.jobs[i].fn == fn && scheduler.jobs[i].periodUs == 0) {
+      index = i;
+    }
+  }
+  if (index < 0) {
+    if (scheduler.jobCount == SCHED_MAX_JOBS) {
+      return -1;
+    }
+    index = scheduler.jobCount++;
+  }
+  
+  Job& job = scheduler.jobs[index];
+  if (job.queued) {
+    return index;
+  }
+  job.name = name;
+  job.fn = fn;
+  job.periodUs = 0;
+  job.deadlineUs = deadlineMs * 1000;
+  job.priority = priority;
+  job.releaseUs = micros() + delayMs * 1000;
+  schedulerPush(scheduler, index);
+  return index;
+}
+
+// Runs every job that is due now. Jobs released while these run wait for
+// the next pass, so one pass is bounded by the number of jobs.
+void runScheduler() {
+  uint8_t ready[SCHED_MAX_JOBS];
+  uint8_t readyCount = 0;
+  uint32_t now = micros();
+  while (scheduler.heapSize > 0 && (int32_t)(now - scheduler.jobs[scheduler.heap[0]].releaseUs) >= 0) {
+    ready[readyCount++] = schedulerPop(scheduler);
+  }
+  
+  while (readyCount > 0) {
+    uint8_t best = 0;
+    for (uint8_t i = 1; i < readyCount; i++) {
+      if (jobOutranks(scheduler, ready[i], ready[best])) {
+        best = i;
+      }
+    }
+    uint8_t index = ready[best];
+    ready[best] = ready[--readyCount];
+    Job& job = scheduler.jobs[index];
+    
+    uint32_t startedAt = micros();
+    uint32_t latenessUs = startedAt - job.releaseUs;
+    if (latenessUs > job.deadlineUs) {
+      job.misses++;
+      scheduler.misses++;
+    }
+    job.maxLatenessUs = max(job.maxLatenessUs, latenessUs);
+    job.queued = false;
+    job.fn();
+    uint32_t runUs = micros() - startedAt;
+    job.maxRunUs = max(job.maxRunUs, runUs);
+    job.runs++;
+    
+    if (job.periodUs > 0) {
+      // Keep to the original grid, but don't replay whole periods lost to
+      // an overrun
+      job.releaseUs += job.periodUs;
+      uint32_t behindUs = micros() - job.releaseUs;
+      if ((int32_t)behindUs >= (int32_t)job.periodUs) {
+        uint32_t lost = behindUs / job.periodUs;
+        job.releaseUs += lost * job.periodUs;
+        job.skipped += lost;
+      }
+      schedulerPush(scheduler, index);
+    }
+  }
+}
+
+// Milliseconds until the next job is due, at most limitMs
+unsigned long schedulerIdleMs(unsigned long limitMs) {
+  if (scheduler.heapSize == 0) {
+    return limitMs;
+  }
+  int32_t untilUs = scheduler.jobs[scheduler.heap[0]].releaseUs - micros();
+  return untilUs > 0 ? min(limitMs, (unsigned long)untilUs / 1000) : 0;
+}
+
+// Continuous output to verify the loop is running
+void printStatus() {
+  Serial.println("Status update:");
+  Serial.print("  Weight: ");
+  if (loadCell.fault != SENSOR_OK && !sim.active) {
+    Serial.print("unavailable (");
+    Serial.print(sensorFaultName(loadCell.fault));
+    Serial.print(")");
+  } else {
+    Serial.print(currentWeight, 2);
+    Serial.print(" g");
+  }
+  Serial.print(" | IR: ");
+  Serial.println(currentIR == LOW ? "OBSTRUCTION" : "CLEAR");
+  
+  if (scheduler.misses != scheduler.reportedMisses) {
+    Serial.print("  Deadline misses since last update: ");
+    Serial.print(scheduler.misses - scheduler.reportedMisses);
+    Serial.print(" (");
+    bool first = true;
+    for (int i = 0; i < scheduler.jobCount; i++) {
+      if (scheduler.jobs[i].misses > 0) {
+        Serial.print(first ? "" : ", ");
+        Serial.print(scheduler.jobs[i].name);
+        Serial.print(" ");
+        Serial.print(scheduler.jobs[i].misses);
+        first = false;
+      }
+    }
+    Serial.println(" total)");
+    scheduler.reportedMisses = scheduler.misses;
+  }
+}
+
+void serviceTelemetry() {
+  serviceLinkQuality();
+  serviceParkedClients();
+}
+
+void serviceHousekeeping() {
+  // Keep WiFi on the strongest known access point
+  #if !SKIP_WIFI
+    serviceWiFi();
+  #endif
+  
+  // Accumulate lifetime counters and commit them when due
+  serviceCounters();
+  
+  // Reboot into a freshly written image once it's safe
+  serviceOta();
+}
+
+void setupScheduler() {
+  schedulePeriodic("hx711", sampleWeight, WEIGHT_POLL_MS, WEIGHT_DEADLINE_MS, PRIORITY_SAMPLING);
+  schedulePeriodic("ir", sampleIr, IR_SAMPLE_MS, IR_SAMPLE_DEADLINE_MS, PRIORITY_INPUT);
+  schedulePeriodic("telemetry", serviceTelemetry, TELEMETRY_PERIOD_MS, TELEMETRY_DEADLINE_MS, PRIORITY_TELEMETRY);
+  schedulePeriodic("status", printStatus, STATUS_PERIOD_MS, STATUS_DEADLINE_MS, PRIORITY_REPORTING);
+  schedulePeriodic("housekeeping", serviceHousekeeping, HOUSEKEEPING_PERIOD_MS, HOUSEKEEPING_DEADLINE_MS, PRIORITY_HOUSEKEEPING);
+}
+
+// /api/sched
+//   GET  per-job runs, deadline misses, skipped periods, worst lateness and
+//        run time
+void handleSchedule() {
+  String json = "{";
+  json += "\"misses\":" + String(scheduler.misses);
+  json += ",\"jobs\":[";
+  for (int i = 0; i < scheduler.jobCount; i++) {
+    const Job& job = scheduler.jobs[i];
+    if (i > 0) {
+      json += ",";
+    }
+    json += "{\"name\":\"" + String(job.name) + "\"";
+    json += ",\"priority\":\"" + String(PRIORITY_NAMES[job.priority]) + "\"";
+    json += ",\"periodMs\":" + (job.periodUs > 0 ? String(job.periodUs / 1000) : String("null"));
+    json += ",\"deadlineMs\":" + String(job.deadlineUs / 1000);
+    json += ",\"runs\":" + String(job.runs);
+    json += ",\"misses\":" + String(job.misses);
+    json += ",\"skipped\":" + String(job.skipped);
+    json += ",\"maxLatenessUs\":" + String(job.maxLatenessUs);
+    json += ",\"maxRunUs\":" + String(job.maxRunUs) + "}";
+  }
+  json += "]}";
+  sendResponse(200, "application/json", json);
+}
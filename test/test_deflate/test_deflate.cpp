@@ -0,0 +1,195 @@
+/*
+ * Host tests for the response compressor (include/deflate.h), decoded
+ * with zlib
+ *   pio test -e native -f test_deflate
+ */
+
+#include <unity.h>
+#include <stdlib.h>
+#include <string>
+#include <zlib.h>
+#include "deflate.h"
+
+Deflater deflater;
+std::string decoded;
+std::string streamed;        // What the sink was handed
+int sinkCalls;
+
+void collect(void* context, const uint8_t* data, size_t length) {
+  TEST_ASSERT_EQUAL_PTR(&streamed, context);
+  TEST_ASSERT_EQUAL_size_t(DEFLATE_OUT_MAX, length);
+  streamed.append((const char*)data, length);
+  sinkCalls++;
+}
+
+// Inflates data as gzip or zlib; false if zlib rejects it
+bool inflateBytes(const uint8_t* data, size_t length, ContentCoding coding) {
+  z_stream stream = {};
+  if (inflateInit2(&stream, coding == CODING_GZIP ? 16 + MAX_WBITS : MAX_WBITS) != Z_OK) {
+    return false;
+  }
+  decoded.clear();
+  stream.next_in = (Bytef*)data;
+  stream.avail_in = length;
+  char chunk[4096];
+  int ret;
+  do {
+    stream.next_out = (Bytef*)chunk;
+    stream.avail_out = sizeof(chunk);
+    ret = inflate(&stream, Z_NO_FLUSH);
+    decoded.append(chunk, sizeof(chunk) - stream.avail_out);
+  } while (ret == Z_OK);
+  bool whole = ret == Z_STREAM_END && stream.avail_in == 0;
+  inflateEnd(&stream);
+  return whole;
+}
+
+// Compresses and decodes body in both framings
+void checkRoundTrip(const std::string& body) {
+  ContentCoding codings[] = { CODING_GZIP, CODING_DEFLATE };
+  for (ContentCoding coding : codings) {
+    size_t length = deflateBody(deflater, (const uint8_t*)body.data(), body.size(), coding, DEFLATE_OUT_MAX);
+    TEST_ASSERT_GREATER_THAN(0, length);
+    TEST_ASSERT_TRUE(inflateBytes(deflater.out, length, coding));
+    TEST_ASSERT_EQUAL_size_t(body.size(), decoded.size());
+    TEST_ASSERT_TRUE(decoded == body);
+  }
+}
+
+void setUp() {}
+
+void tearDown() {}
+
+void test_checksums_match_zlib() {
+  const char* text = "The quick brown fox jumps over the lazy dog";
+  size_t length = strlen(text);
+  TEST_ASSERT_EQUAL_HEX32(crc32(0, (const Bytef*)text, length), ~crc32Update(0xFFFFFFFF, (const uint8_t*)text, length));
+  TEST_ASSERT_EQUAL_HEX32(adler32(1, (const Bytef*)text, length), adler32((const uint8_t*)text, length));
+}
+
+void test_empty_and_short() {
+  checkRoundTrip("");
+  checkRoundTrip("a");
+  checkRoundTrip("ab");
+  checkRoundTrip("abc");
+}
+
+void test_json_body() {
+  std::string json = "{\"records\":[";
+  for (int i = 0; i < 60; i++) {
+    char record[96];
+    snprintf(record, sizeof(record), "%s{\"at\":%d,\"grams\":%d.%02d,\"result\":\"%s\"}",
+             i > 0 ? "," : "", 1000 + i * 3613, 10 + i % 5, i * 7 % 100, i % 9 ? "done" : "skipped_full");
+    json += record;
+  }
+  json += "]}";
+  checkRoundTrip(json);
+  TEST_ASSERT_LESS_THAN(json.size() / 3, deflater.outLength);
+}
+
+void test_longest_matches_and_window_edge() {
+  checkRoundTrip(std::string(1000, 'a'));  // Runs of 258-byte matches at distance 1
+  
+  // A repeat exactly DEFLATE_WINDOW back, and one just out of reach
+  std::string unique;
+  srand(7);
+  for (int i = 0; i < DEFLATE_WINDOW; i++) {
+    unique += (char)('a' + rand() % 26);
+  }
+  checkRoundTrip(unique.substr(0, 64) + unique.substr(64) + unique.substr(0, 64));
+  checkRoundTrip(unique + "x" + unique.substr(0, 64));
+}
+
+void test_positions_past_16_bits() {
+  // Hash positions wrap at 65536; stale candidates must not corrupt output
+  std::string body;
+  for (int i = 0; body.size() < 70000; i++) {
+    body += "{\"i\":" + std::to_string(i % 50) + "},";
+  }
+  checkRoundTrip(body);
+}
+
+void test_every_byte_value() {
+  std::string body;
+  for (int round = 0; round < 4; round++) {
+    for (int c = 0; c < 256; c++) {
+      body += (char)c;
+    }
+  }
+  checkRoundTrip(body);
+}
+
+void test_overflow_abandons() {
+  std::string noise;
+  srand(1);
+  for (int i = 0; i < 3000; i++) {
+    noise += (char)(rand() % 256);
+  }
+  // Random data doesn't shrink, so a limit of its own size is never met
+  TEST_ASSERT_EQUAL_size_t(0, deflateBody(deflater, (const uint8_t*)noise.data(), noise.size(), CODING_GZIP, noise.size() - 1));
+  TEST_ASSERT_TRUE(deflater.overflow);
+  TEST_ASSERT_EQUAL_size_t(0, deflateBody(deflater, (const uint8_t*)noise.data(), noise.size(), CODING_DEFLATE, 16));
+  
+  // The same encoder is reusable after an overflow
+  checkRoundTrip("after an overflow, after an overflow");
+}
+
+void test_limit_is_capped_by_buffer() {
+  std::string noise;
+  srand(2);
+  for (int i = 0; i < 2 * DEFLATE_OUT_MAX; i++) {
+    noise += (char)(rand() % 256);
+  }
+  TEST_ASSERT_EQUAL_size_t(0, deflateBody(deflater, (const uint8_t*)noise.data(), noise.size(), CODING_GZIP, SIZE_MAX));
+  TEST_ASSERT_LESS_OR_EQUAL(DEFLATE_OUT_MAX, deflater.outLength);
+}
+
+// With a sink there is no size limit: full buffers go out as they fill
+void checkStreamed(const std::string& body, ContentCoding coding) {
+  streamed.clear();
+  sinkCalls = 0;
+  deflater.sink = collect;
+  deflater.sinkContext = &streamed;
+  size_t length = deflateBody(deflater, (const uint8_t*)body.data(), body.size(), coding, DEFLATE_OUT_MAX);
+  deflater.sink = NULL;
+  TEST_ASSERT_GREATER_THAN(1, sinkCalls);
+  TEST_ASSERT_EQUAL_size_t(streamed.size() + deflater.outLength, length);
+  streamed.append((const char*)deflater.out, deflater.outLength);
+  TEST_ASSERT_TRUE(inflateBytes((const uint8_t*)streamed.data(), streamed.size(), coding));
+  TEST_ASSERT_TRUE(decoded == body);
+}
+
+void test_sink_streams_past_the_buffer() {
+  std::string json = "{\"samples\":[";
+  srand(3);
+  for (int i = 0; json.size() < 60000; i++) {
+    json += (i > 0 ? "," : "") + std::to_string(rand() % 100000);
+  }
+  json += "]}";
+  checkStreamed(json, CODING_GZIP);
+  checkStreamed(json, CODING_DEFLATE);
+  
+  // Even data that grows is sent whole
+  std::string noise;
+  for (int i = 0; i < 3 * DEFLATE_OUT_MAX; i++) {
+    noise += (char)(rand() % 256);
+  }
+  checkStreamed(noise, CODING_GZIP);
+  
+  // Without the sink the same encoder abandons again
+  TEST_ASSERT_EQUAL_size_t(0, deflateBody(deflater, (const uint8_t*)noise.data(), noise.size(), CODING_GZIP, SIZE_MAX));
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_checksums_match_zlib);
+  RUN_TEST(test_empty_and_short);
+  RUN_TEST(test_json_body);
+  RUN_TEST(test_longest_matches_and_window_edge);
+  RUN_TEST(test_positions_past_16_bits);
+  RUN_TEST(test_every_byte_value);
+  RUN_TEST(test_overflow_abandons);
+  RUN_TEST(test_limit_is_capped_by_buffer);
+  RUN_TEST(test_sink_streams_past_the_buffer);
+  return UNITY_END();
+}
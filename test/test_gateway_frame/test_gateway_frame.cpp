@@ -0,0 +1,163 @@
+/*
+ * Host tests for the wired gateway framing (include/gateway_frame.h)
+ *   pio test -e native -f test_gateway_frame
+ */
+
+#include <unity.h>
+#include <stdlib.h>
+#include "gateway_frame.h"
+
+uint8_t encoded[700];
+uint8_t decoded[700];
+
+void checkCobs(const uint8_t* in, size_t length, const uint8_t* expected, size_t expectedLength) {
+  size_t n = cobsEncode(in, length, encoded);
+  TEST_ASSERT_EQUAL_size_t(expectedLength, n);
+  TEST_ASSERT_EQUAL_HEX8_ARRAY(expected, encoded, n);
+  TEST_ASSERT_EQUAL_size_t(length, cobsDecode(encoded, n, decoded));
+  TEST_ASSERT_EQUAL_HEX8_ARRAY(in, decoded, length);
+}
+
+void setUp() {}
+
+void tearDown() {}
+
+void test_crc16_check_value() {
+  TEST_ASSERT_EQUAL_HEX16(0x29B1, gatewayCrc((const uint8_t*)"123456789", 9));
+  TEST_ASSERT_EQUAL_HEX16(0xFFFF, gatewayCrc(NULL, 0));
+}
+
+void test_cobs_known_vectors() {
+  const uint8_t zero[] = { 0x00 };
+  const uint8_t zeroOut[] = { 0x01, 0x01 };
+  checkCobs(zero, sizeof(zero), zeroOut, sizeof(zeroOut));
+  
+  const uint8_t zeros[] = { 0x00, 0x00 };
+  const uint8_t zerosOut[] = { 0x01, 0x01, 0x01 };
+  checkCobs(zeros, sizeof(zeros), zerosOut, sizeof(zerosOut));
+  
+  const uint8_t mixed[] = { 0x11, 0x22, 0x00, 0x33 };
+  const uint8_t mixedOut[] = { 0x03, 0x11, 0x22, 0x02, 0x33 };
+  checkCobs(mixed, sizeof(mixed), mixedOut, sizeof(mixedOut));
+  
+  const uint8_t trailing[] = { 0x11, 0x00, 0x00, 0x00 };
+  const uint8_t trailingOut[] = { 0x02, 0x11, 0x01, 0x01, 0x01 };
+  checkCobs(trailing, sizeof(trailing), trailingOut, sizeof(trailingOut));
+}
+
+void test_cobs_long_runs() {
+  // 254 non-zero bytes fill a block; the encoder then opens an empty one,
+  // which decodes to nothing
+  uint8_t run[600];
+  for (size_t i = 0; i < sizeof(run); i++) {
+    run[i] = 1 + i % 255;
+  }
+  size_t n = cobsEncode(run, 254, encoded);
+  TEST_ASSERT_EQUAL_size_t(256, n);
+  TEST_ASSERT_EQUAL_HEX8(0xFF, encoded[0]);
+  TEST_ASSERT_EQUAL_HEX8(0x01, encoded[255]);
+  TEST_ASSERT_EQUAL_size_t(254, cobsDecode(encoded, n, decoded));
+  TEST_ASSERT_EQUAL_HEX8_ARRAY(run, decoded, 254);
+  
+  n = cobsEncode(run, sizeof(run), encoded);
+  TEST_ASSERT_LESS_OR_EQUAL(sizeof(run) + sizeof(run) / 254 + 1, n);
+  TEST_ASSERT_EQUAL_size_t(sizeof(run), cobsDecode(encoded, n, decoded));
+  TEST_ASSERT_EQUAL_HEX8_ARRAY(run, decoded, sizeof(run));
+}
+
+void test_cobs_round_trips_in_place() {
+  srand(3);
+  uint8_t in[300];
+  for (size_t length = 0; length <= sizeof(in); length++) {
+    for (size_t i = 0; i < length; i++) {
+      in[i] = rand() % 4 == 0 ? 0 : rand() % 256;
+    }
+    size_t n = cobsEncode(in, length, encoded);
+    TEST_ASSERT_LESS_OR_EQUAL(length + length / 254 + 1, n);
+    for (size_t i = 0; i < n; i++) {
+      TEST_ASSERT_NOT_EQUAL(0, encoded[i]);
+    }
+    TEST_ASSERT_EQUAL_size_t(length, cobsDecode(encoded, n, encoded));
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(in, encoded, length);
+  }
+}
+
+void test_cobs_rejects_malformed() {
+  const uint8_t zeroCode[] = { 0x02, 0x11, 0x00, 0x22 };
+  TEST_ASSERT_EQUAL_size_t(0, cobsDecode(zeroCode, sizeof(zeroCode), decoded));
+  const uint8_t overrun[] = { 0x05, 0x11, 0x22 };
+  TEST_ASSERT_EQUAL_size_t(0, cobsDecode(overrun, sizeof(overrun), decoded));
+}
+
+void test_little_endian_fields() {
+  uint8_t buf[8];
+  uint8_t* p = buf;
+  putU32(p, 0x12345678);
+  putF32(p, -2.5f);
+  const uint8_t expected[] = { 0x78, 0x56, 0x34, 0x12, 0x00, 0x00, 0x20, 0xC0 };
+  TEST_ASSERT_EQUAL_HEX8_ARRAY(expected, buf, sizeof(expected));
+  
+  const uint8_t* q = buf;
+  TEST_ASSERT_EQUAL_HEX32(0x12345678, getU32(q));
+  TEST_ASSERT_EQUAL_FLOAT(-2.5f, getF32(q));
+  TEST_ASSERT_TRUE(q == buf + 8);
+}
+
+void test_frame_round_trip() {
+  uint8_t body[GATEWAY_MAX_PAYLOAD - 4];
+  for (size_t i = 0; i < sizeof(body); i++) {
+    body[i] = i % 3 == 0 ? 0 : i;
+  }
+  uint8_t frame[GATEWAY_MAX_FRAME];
+  size_t n = gatewayEncodeFrame(0x83, 42, body, sizeof(body), frame);
+  TEST_ASSERT_LESS_OR_EQUAL(GATEWAY_MAX_FRAME, n);
+  TEST_ASSERT_EQUAL_HEX8(0x00, frame[n - 1]);
+  
+  size_t length = cobsDecode(frame, n - 1, decoded);
+  TEST_ASSERT_EQUAL_size_t(sizeof(body) + 4, length);
+  TEST_ASSERT_TRUE(gatewayPayloadValid(decoded, length));
+  TEST_ASSERT_EQUAL_HEX8(0x83, decoded[0]);
+  TEST_ASSERT_EQUAL_UINT8(42, decoded[1]);
+  TEST_ASSERT_EQUAL_HEX8_ARRAY(body, decoded + 2, sizeof(body));
+  
+  decoded[10] ^= 0x40;
+  TEST_ASSERT_FALSE(gatewayPayloadValid(decoded, length));
+  TEST_ASSERT_FALSE(gatewayPayloadValid(decoded, 3));
+}
+
+void test_empty_body_frame() {
+  uint8_t body[1] = {0};
+  uint8_t frame[GATEWAY_MAX_FRAME];
+  size_t n = gatewayEncodeFrame(0x01, 0, body, 0, frame);
+  size_t length = cobsDecode(frame, n - 1, decoded);
+  TEST_ASSERT_EQUAL_size_t(4, length);
+  TEST_ASSERT_TRUE(gatewayPayloadValid(decoded, length));
+}
+
+void test_oversized_body_refused() {
+  uint8_t body[GATEWAY_MAX_PAYLOAD] = {0};
+  uint8_t frame[GATEWAY_MAX_FRAME];
+  TEST_ASSERT_EQUAL_size_t(0, gatewayEncodeFrame(0x02, 1, body, GATEWAY_MAX_PAYLOAD - 3, frame));
+  TEST_ASSERT_EQUAL_size_t(0, gatewayEncodeFrame(0x02, 1, body, sizeof(body), frame));
+  
+  // The largest body that fits still frames and decodes whole
+  size_t n = gatewayEncodeFrame(0x02, 1, body, GATEWAY_MAX_PAYLOAD - 4, frame);
+  TEST_ASSERT_LESS_OR_EQUAL(GATEWAY_MAX_FRAME, n);
+  size_t length = cobsDecode(frame, n - 1, decoded);
+  TEST_ASSERT_EQUAL_size_t(GATEWAY_MAX_PAYLOAD, length);
+  TEST_ASSERT_TRUE(gatewayPayloadValid(decoded, length));
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_crc16_check_value);
+  RUN_TEST(test_cobs_known_vectors);
+  RUN_TEST(test_cobs_long_runs);
+  RUN_TEST(test_cobs_round_trips_in_place);
+  RUN_TEST(test_cobs_rejects_malformed);
+  RUN_TEST(test_little_endian_fields);
+  RUN_TEST(test_frame_round_trip);
+  RUN_TEST(test_empty_body_frame);
+  RUN_TEST(test_oversized_body_refused);
+  return UNITY_END();
+}
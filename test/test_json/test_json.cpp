@@ -0,0 +1,197 @@
+/*
+ * Host tests for the JSON request body parser (include/json_body.h)
+ *   pio test -e native -f test_json
+ */
+
+#include <unity.h>
+#include "json_body.h"
+
+struct Point {
+  float x;
+  uint32_t n;
+  bool on;
+  const char* label;
+};
+constexpr JsonField POINT_FIELDS[] = {
+  JSON_FIELD(Point, x, 0),
+  JSON_FIELD(Point, n, 0),
+  JSON_FIELD(Point, on, 0),
+  JSON_FIELD(Point, label, 8),
+};
+constexpr JsonSchema POINT = JSON_SCHEMA(Point, POINT_FIELDS);
+
+struct Path {
+  Point points[3];
+  uint32_t pointCount;
+};
+constexpr JsonField PATH_FIELDS[] = {
+  JSON_OBJECTS_FIELD(Path, points, pointCount, POINT),
+};
+constexpr JsonSchema PATH = JSON_SCHEMA(Path, PATH_FIELDS);
+
+char buf[512];
+Point point;
+
+// Parses text as a Point over the defaults below
+bool parsePoint(const char* text) {
+  point = { -1.0, 7, false, "none" };
+  strncpy(buf, text, sizeof(buf) - 1);
+  char* p = buf;
+  return jsonObject(p, POINT, (uint8_t*)&point);
+}
+
+bool parseString(const char* text, char*& out) {
+  strncpy(buf, text, sizeof(buf) - 1);
+  char* p = buf;
+  return jsonString(p, out);
+}
+
+bool parseNumber(const char* text, double& out) {
+  strncpy(buf, text, sizeof(buf) - 1);
+  char* p = buf;
+  return jsonNumber(p, out) && *p == '\0';
+}
+
+void setUp() {
+  memset(buf, 0, sizeof(buf));
+}
+
+void tearDown() {}
+
+void test_fields_by_type() {
+  TEST_ASSERT_TRUE(parsePoint(" { \"x\" : 1.5, \"n\":42,\"on\":true, \"label\":\"bowl\" } "));
+  TEST_ASSERT_EQUAL_FLOAT(1.5, point.x);
+  TEST_ASSERT_EQUAL_UINT32(42, point.n);
+  TEST_ASSERT_TRUE(point.on);
+  TEST_ASSERT_EQUAL_STRING("bowl", point.label);
+}
+
+void test_absent_and_null_keep_defaults() {
+  TEST_ASSERT_TRUE(parsePoint("{}"));
+  TEST_ASSERT_EQUAL_FLOAT(-1.0, point.x);
+  TEST_ASSERT_TRUE(parsePoint("{\"x\":null,\"label\":null}"));
+  TEST_ASSERT_EQUAL_FLOAT(-1.0, point.x);
+  TEST_ASSERT_EQUAL_STRING("none", point.label);
+}
+
+void test_unknown_members_are_skipped() {
+  TEST_ASSERT_TRUE(parsePoint("{\"extra\":{\"a\":[1,{\"b\":null},\"}\"]},\"n\":3,\"more\":[]}"));
+  TEST_ASSERT_EQUAL_UINT32(3, point.n);
+}
+
+void test_skip_depth_and_nesting() {
+  TEST_ASSERT_TRUE(parsePoint("{\"deep\":[[[[[[[[1]]]]]]]]}"));  // JSON_MAX_DEPTH levels
+  TEST_ASSERT_FALSE(parsePoint("{\"deep\":[[[[[[[[[1]]]]]]]]]}"));
+  TEST_ASSERT_FALSE(parsePoint("{\"bad\":[1}"));
+  TEST_ASSERT_FALSE(parsePoint("{\"bad\":[1,tru]}"));
+  TEST_ASSERT_FALSE(parsePoint("{\"bad\":{\"a\":1]}"));
+}
+
+void test_malformed_objects() {
+  TEST_ASSERT_FALSE(parsePoint(""));
+  TEST_ASSERT_FALSE(parsePoint("[]"));
+  TEST_ASSERT_FALSE(parsePoint("{\"x\":1"));
+  TEST_ASSERT_FALSE(parsePoint("{\"x\":1,}"));
+  TEST_ASSERT_FALSE(parsePoint("{x:1}"));
+  TEST_ASSERT_FALSE(parsePoint("{\"x\" 1}"));
+}
+
+void test_object_stops_at_closing_brace() {
+  strcpy(buf, "{\"n\":1} trailing");
+  char* p = buf;
+  TEST_ASSERT_TRUE(jsonObject(p, POINT, (uint8_t*)&point));
+  TEST_ASSERT_EQUAL_STRING(" trailing", p);
+}
+
+void test_type_mismatches() {
+  TEST_ASSERT_FALSE(parsePoint("{\"x\":\"1\"}"));
+  TEST_ASSERT_FALSE(parsePoint("{\"on\":1}"));
+  TEST_ASSERT_FALSE(parsePoint("{\"on\":True}"));
+  TEST_ASSERT_FALSE(parsePoint("{\"label\":5}"));
+  TEST_ASSERT_FALSE(parsePoint("{\"label\":\"too long!\"}"));  // Limit 8
+  TEST_ASSERT_TRUE(parsePoint("{\"label\":\"8 chars!\"}"));
+}
+
+void test_uint_range() {
+  TEST_ASSERT_TRUE(parsePoint("{\"n\":4294967295}"));
+  TEST_ASSERT_EQUAL_UINT32(4294967295u, point.n);
+  TEST_ASSERT_TRUE(parsePoint("{\"n\":1e3}"));
+  TEST_ASSERT_EQUAL_UINT32(1000, point.n);
+  TEST_ASSERT_FALSE(parsePoint("{\"n\":4294967296}"));
+  TEST_ASSERT_FALSE(parsePoint("{\"n\":-1}"));
+  TEST_ASSERT_FALSE(parsePoint("{\"n\":1.5}"));
+}
+
+void test_number_grammar() {
+  double value;
+  TEST_ASSERT_TRUE(parseNumber("-0", value));
+  TEST_ASSERT_TRUE(parseNumber("2.5e-3", value));
+  TEST_ASSERT_FLOAT_WITHIN(1e-12, 0.0025, value);
+  TEST_ASSERT_FALSE(parseNumber("inf", value));
+  TEST_ASSERT_FALSE(parseNumber("-nan", value));
+  TEST_ASSERT_FALSE(parseNumber("0x10", value));
+  TEST_ASSERT_FALSE(parseNumber("+1", value));
+  TEST_ASSERT_FALSE(parseNumber(".5", value));
+  TEST_ASSERT_FALSE(parseNumber("1.2.3", value));
+  TEST_ASSERT_FALSE(parseNumber("1e999", value));  // Finite values only
+}
+
+void test_string_escapes() {
+  char* text;
+  TEST_ASSERT_TRUE(parseString("\"a\\\"b\\\\c\\/d\\n\\t\"", text));
+  TEST_ASSERT_EQUAL_STRING("a\"b\\c/d\n\t", text);
+  TEST_ASSERT_TRUE(parseString("\"caf\\u00e9 \\u20AC\"", text));
+  TEST_ASSERT_EQUAL_STRING("caf\xC3\xA9 \xE2\x82\xAC", text);
+  TEST_ASSERT_TRUE(parseString("\"\\ud83d\\ude00\"", text));
+  TEST_ASSERT_EQUAL_STRING("\xF0\x9F\x98\x80", text);
+}
+
+void test_string_rejects() {
+  char* text;
+  TEST_ASSERT_FALSE(parseString("\"\\u0000\"", text));   // Would end the C string early
+  TEST_ASSERT_FALSE(parseString("\"\\x41\"", text));
+  TEST_ASSERT_FALSE(parseString("\"\\u12G4\"", text));
+  TEST_ASSERT_FALSE(parseString("\"tab\there\"", text));
+  TEST_ASSERT_FALSE(parseString("\"unterminated", text));
+  TEST_ASSERT_FALSE(parseString("\"ends in escape\\", text));
+}
+
+void test_array_of_objects() {
+  Path path = {};
+  strcpy(buf, "{\"points\":[{\"n\":1},{\"n\":2,\"on\":true}]}");
+  char* p = buf;
+  TEST_ASSERT_TRUE(jsonObject(p, PATH, (uint8_t*)&path));
+  TEST_ASSERT_EQUAL_UINT32(2, path.pointCount);
+  TEST_ASSERT_EQUAL_UINT32(2, path.points[1].n);
+  TEST_ASSERT_TRUE(path.points[1].on);
+  
+  strcpy(buf, "{\"points\":[ ]}");
+  p = buf;
+  TEST_ASSERT_TRUE(jsonObject(p, PATH, (uint8_t*)&path));
+  TEST_ASSERT_EQUAL_UINT32(0, path.pointCount);
+  
+  strcpy(buf, "{\"points\":[{},{},{},{}]}");
+  p = buf;
+  TEST_ASSERT_FALSE(jsonObject(p, PATH, (uint8_t*)&path));
+  
+  strcpy(buf, "{\"points\":[{}{}]}");
+  p = buf;
+  TEST_ASSERT_FALSE(jsonObject(p, PATH, (uint8_t*)&path));
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_fields_by_type);
+  RUN_TEST(test_absent_and_null_keep_defaults);
+  RUN_TEST(test_unknown_members_are_skipped);
+  RUN_TEST(test_skip_depth_and_nesting);
+  RUN_TEST(test_malformed_objects);
+  RUN_TEST(test_object_stops_at_closing_brace);
+  RUN_TEST(test_type_mismatches);
+  RUN_TEST(test_uint_range);
+  RUN_TEST(test_number_grammar);
+  RUN_TEST(test_string_escapes);
+  RUN_TEST(test_string_rejects);
+  RUN_TEST(test_array_of_objects);
+  return UNITY_END();
+}
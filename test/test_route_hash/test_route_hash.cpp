@@ -0,0 +1,55 @@
+/*
+ * Host tests for the route hash (include/route_hash.h)
+ *   pio test -e native -f test_route_hash
+ */
+
+#include <unity.h>
+#include "route_hash.h"
+
+// The route index is built at compile time, so the hash has to stay constexpr
+static_assert(routeHash("/api/status", 0) == 0x269DC134u, "routeHash must be constexpr");
+static_assert(routeSlotCount(21) == 64, "routeSlotCount must be constexpr");
+
+void setUp() {}
+
+void tearDown() {}
+
+void test_known_values() {
+  // FNV-1a offset basis and "a" from the reference vectors, then folded
+  TEST_ASSERT_EQUAL_HEX32(0x811C9DC5u ^ 0x811Cu, routeHash("", 0));
+  TEST_ASSERT_EQUAL_HEX32(0xE40C292Cu ^ 0xE40Cu, routeHash("a", 0));
+  TEST_ASSERT_EQUAL_HEX32(0xE50CCFB3u, routeHash("a", 1));
+}
+
+void test_seed_changes_hash() {
+  uint32_t base = routeHash("/api/status", 0);
+  for (uint32_t seed = 1; seed < 64; seed++) {
+    TEST_ASSERT_NOT_EQUAL(base, routeHash("/api/status", seed));
+  }
+}
+
+void test_fold_separates_low_bit_aliases() {
+  // 'a' and 'q' differ only in bit 4, so plain FNV-1a puts them in the same
+  // one of 16 slots under every seed; the fold must let some seed split them
+  bool separated = false;
+  for (uint32_t seed = 0; seed < 64 && !separated; seed++) {
+    separated = (routeHash("/a", seed) & 15) != (routeHash("/q", seed) & 15);
+  }
+  TEST_ASSERT_TRUE(separated);
+}
+
+void test_slot_count() {
+  TEST_ASSERT_EQUAL_size_t(1, routeSlotCount(0));
+  TEST_ASSERT_EQUAL_size_t(2, routeSlotCount(1));
+  TEST_ASSERT_EQUAL_size_t(16, routeSlotCount(8));
+  TEST_ASSERT_EQUAL_size_t(32, routeSlotCount(9));
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_known_values);
+  RUN_TEST(test_seed_changes_hash);
+  RUN_TEST(test_fold_separates_low_bit_aliases);
+  RUN_TEST(test_slot_count);
+  return UNITY_END();
+}
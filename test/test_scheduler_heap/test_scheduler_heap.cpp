@@ -0,0 +1,127 @@
+/*
+ * Host tests for the scheduler's job heap (include/scheduler_heap.h)
+ *   pio test -e native -f test_scheduler_heap
+ */
+
+#include <unity.h>
+#include <stdlib.h>
+#include <string.h>
+#include "scheduler_heap.h"
+
+Scheduler scheduler;
+
+void addJob(uint32_t releaseUs, JobPriority priority = PRIORITY_SAMPLING, uint32_t deadlineUs = 0) {
+  uint8_t index = scheduler.jobCount++;
+  scheduler.jobs[index].releaseUs = releaseUs;
+  scheduler.jobs[index].priority = priority;
+  scheduler.jobs[index].deadlineUs = deadlineUs;
+  schedulerPush(scheduler, index);
+}
+
+// Pops everything, checking each release is no earlier than the last
+void drainInOrder(uint32_t baseUs) {
+  uint32_t last = baseUs;
+  uint8_t popped = 0;
+  while (scheduler.heapSize > 0) {
+    uint32_t releaseUs = scheduler.jobs[schedulerPop(scheduler)].releaseUs;
+    TEST_ASSERT_TRUE((int32_t)(releaseUs - last) >= 0);
+    last = releaseUs;
+    popped++;
+  }
+  TEST_ASSERT_EQUAL_UINT8(scheduler.jobCount, popped);
+}
+
+void setUp() {
+  memset(&scheduler, 0, sizeof(scheduler));
+}
+
+void tearDown() {}
+
+void test_push_marks_queued() {
+  addJob(100);
+  TEST_ASSERT_TRUE(scheduler.jobs[0].queued);
+  TEST_ASSERT_EQUAL_UINT8(1, scheduler.heapSize);
+  TEST_ASSERT_EQUAL_UINT8(0, schedulerPop(scheduler));
+  TEST_ASSERT_EQUAL_UINT8(0, scheduler.heapSize);
+}
+
+void test_pops_in_release_order() {
+  srand(1);
+  for (int round = 0; round < 500; round++) {
+    memset(&scheduler, 0, sizeof(scheduler));
+    for (int i = 0; i < SCHED_MAX_JOBS; i++) {
+      addJob(rand() % 64);
+    }
+    drainInOrder(0);
+  }
+}
+
+void test_interleaved_push_and_pop() {
+  // The periodic pattern: pop the earliest, push it back a period later
+  srand(2);
+  for (int i = 0; i < SCHED_MAX_JOBS; i++) {
+    addJob(rand() % 1000);
+  }
+  uint32_t last = 0;
+  for (int step = 0; step < 5000; step++) {
+    uint8_t index = schedulerPop(scheduler);
+    TEST_ASSERT_TRUE(scheduler.jobs[index].releaseUs >= last);
+    last = scheduler.jobs[index].releaseUs;
+    scheduler.jobs[index].releaseUs += 1 + rand() % 500;
+    schedulerPush(scheduler, index);
+    TEST_ASSERT_EQUAL_UINT8(SCHED_MAX_JOBS, scheduler.heapSize);
+  }
+}
+
+void test_release_order_survives_wraparound() {
+  // micros() wraps every 71 minutes; releases just before the wrap still
+  // come first
+  const uint32_t base = 0xFFFFFFF0u;
+  srand(3);
+  for (int round = 0; round < 200; round++) {
+    memset(&scheduler, 0, sizeof(scheduler));
+    for (int i = 0; i < SCHED_MAX_JOBS; i++) {
+      addJob(base + rand() % 64);
+    }
+    drainInOrder(base);
+  }
+  
+  memset(&scheduler, 0, sizeof(scheduler));
+  addJob(0x00000010u);
+  addJob(0xFFFFFFF8u);
+  TEST_ASSERT_EQUAL_UINT8(1, schedulerPop(scheduler));
+  TEST_ASSERT_EQUAL_UINT8(0, schedulerPop(scheduler));
+}
+
+void test_priority_outranks_deadline() {
+  addJob(0, PRIORITY_HOUSEKEEPING, 10);
+  addJob(0, PRIORITY_SAMPLING, 100000);
+  TEST_ASSERT_TRUE(jobOutranks(scheduler, 1, 0));
+  TEST_ASSERT_FALSE(jobOutranks(scheduler, 0, 1));
+}
+
+void test_earliest_deadline_breaks_ties() {
+  addJob(1000, PRIORITY_TELEMETRY, 5000);   // Due at 6000
+  addJob(2000, PRIORITY_TELEMETRY, 1000);   // Due at 3000
+  TEST_ASSERT_TRUE(jobOutranks(scheduler, 1, 0));
+  TEST_ASSERT_FALSE(jobOutranks(scheduler, 0, 1));
+  TEST_ASSERT_FALSE(jobOutranks(scheduler, 0, 0));
+  
+  // Deadlines either side of the wrap
+  scheduler.jobs[0].releaseUs = 0xFFFFFF00u;
+  scheduler.jobs[0].deadlineUs = 0x80;      // Due at 0xFFFFFF80
+  scheduler.jobs[1].releaseUs = 0xFFFFFF00u;
+  scheduler.jobs[1].deadlineUs = 0x200;     // Due at 0x100, after the wrap
+  TEST_ASSERT_TRUE(jobOutranks(scheduler, 0, 1));
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_push_marks_queued);
+  RUN_TEST(test_pops_in_release_order);
+  RUN_TEST(test_interleaved_push_and_pop);
+  RUN_TEST(test_release_order_survives_wraparound);
+  RUN_TEST(test_priority_outranks_deadline);
+  RUN_TEST(test_earliest_deadline_breaks_ties);
+  return UNITY_END();
+}
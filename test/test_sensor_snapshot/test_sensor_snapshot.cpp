@@ -0,0 +1,262 @@
+/*
+ * Host tests for the sensor snapshot seqlock (include/sensor_snapshot.h)
+ *   pio test -e native -f test_sensor_snapshot
+ *   pio test -e native_tsan -f test_sensor_snapshot
+ * The stress tests race the seqlock and host stand-ins for the other two
+ * primitives /api/contend measures, and report each one's throughput.
+ */
+
+#include <unity.h>
+#include <stdio.h>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include "sensor_snapshot.h"
+
+#define STRESS_MS 200                  // Per primitive
+#define STRESS_READERS 3
+#define STRESS_CLOCK_WRITES 256        // Writes between looks at the clock
+#define QUEUE_LENGTH 16                // As CONTENTION_QUEUE_LENGTH
+#define QUEUE_WAIT_MS 10
+
+// xQueueSend(queue, &value, 0) and xQueueReceive(queue, &value, 10 ms)
+struct QueuePrimitive {
+  std::mutex lock;
+  std::condition_variable ready;
+  SensorSnapshot slots[QUEUE_LENGTH];
+  size_t head = 0;
+  size_t count = 0;
+  
+  bool write(const SensorSnapshot& value) {
+    std::lock_guard<std::mutex> guard(lock);
+    if (count == QUEUE_LENGTH) {
+      return false;
+    }
+    slots[(head + count) % QUEUE_LENGTH] = value;
+    count++;
+    ready.notify_one();
+    return true;
+  }
+  
+  bool read(SensorSnapshot& value, uint32_t& retries) {
+    std::unique_lock<std::mutex> guard(lock);
+    if (!ready.wait_for(guard, std::chrono::milliseconds(QUEUE_WAIT_MS), [&]() { return count > 0; })) {
+      return false;
+    }
+    value = slots[head];
+    head = (head + 1) % QUEUE_LENGTH;
+    count--;
+    return true;
+  }
+};
+
+// The mutex-guarded copy
+struct MutexPrimitive {
+  std::mutex lock;
+  SensorSnapshot guarded = {};
+  
+  bool write(const SensorSnapshot& value) {
+    std::lock_guard<std::mutex> guard(lock);
+    guarded = value;
+    return true;
+  }
+  
+  bool read(SensorSnapshot& value, uint32_t& retries) {
+    std::lock_guard<std::mutex> guard(lock);
+    value = guarded;
+    return true;
+  }
+};
+
+struct SeqlockPrimitive {
+  SnapshotCell cell = {};
+  
+  bool write(const SensorSnapshot& value) {
+    publishSnapshot(cell, value);
+    return true;
+  }
+  
+  bool read(SensorSnapshot& value, uint32_t& retries) {
+    value = readSnapshot(cell, &retries);
+    return true;
+  }
+};
+
+struct StressResult {
+  uint32_t writes;
+  uint32_t writeStalls;      // Queue full
+  uint32_t reads;
+  uint32_t retries;          // Seqlock reads that overlapped a write
+  uint32_t torn;             // Reads failing the check pattern or going backwards
+  double seconds;
+};
+
+// One unpaced writer on this thread and STRESS_READERS readers, checked
+// the way contentionReaderTask() checks them on the device
+template <typename Primitive>
+StressResult stress(Primitive& primitive, const char* name) {
+  StressResult result = {};
+  std::atomic<bool> stop(false);
+  std::mutex fold;
+  
+  std::thread readers[STRESS_READERS];
+  for (int r = 0; r < STRESS_READERS; r++) {
+    readers[r] = std::thread([&]() {
+      uint32_t reads = 0;
+      uint32_t retries = 0;
+      uint32_t torn = 0;
+      uint32_t lastSeen = 0;
+      while (!stop.load(std::memory_order_relaxed)) {
+        SensorSnapshot value;
+        if (!primitive.read(value, retries)) {
+          continue;
+        }
+        reads++;
+        // Nothing written yet reads as all zeroes
+        if (value.sequence != 0) {
+          if (!snapshotCheckConsistent(value) || value.sequence < lastSeen) {
+            torn++;
+          }
+          lastSeen = value.sequence;
+        }
+      }
+      std::lock_guard<std::mutex> guard(fold);
+      result.reads += reads;
+      result.retries += retries;
+      result.torn += torn;
+    });
+  }
+  
+  auto startedAt = std::chrono::steady_clock::now();
+  auto deadline = startedAt + std::chrono::milliseconds(STRESS_MS);
+  for (;;) {
+    if (!primitive.write(snapshotCheckValue(++result.writes))) {
+      result.writeStalls++;
+    }
+    if (result.writes % STRESS_CLOCK_WRITES == 0 && std::chrono::steady_clock::now() >= deadline) {
+      break;
+    }
+  }
+  stop = true;
+  for (int r = 0; r < STRESS_READERS; r++) {
+    readers[r].join();
+  }
+  result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startedAt).count();
+  
+  char line[160];
+  snprintf(line, sizeof(line), "%-8s %10.0f writes/s %10.0f reads/s %8u stalls %8u retries %u torn",
+           name, result.writes / result.seconds, result.reads / result.seconds,
+           (unsigned)result.writeStalls, (unsigned)result.retries, (unsigned)result.torn);
+  TEST_MESSAGE(line);
+  return result;
+}
+
+void setUp() {}
+
+void tearDown() {}
+
+void test_round_trip() {
+  SnapshotCell cell = {};
+  SensorSnapshot value = snapshotCheckValue(7);
+  value.weight = 123.25f;
+  publishSnapshot(cell, value);
+  
+  uint32_t retries = 0;
+  SensorSnapshot read = readSnapshot(cell, &retries);
+  TEST_ASSERT_EQUAL_UINT32(0, retries);
+  TEST_ASSERT_EQUAL_FLOAT(123.25f, read.weight);
+  TEST_ASSERT_EQUAL_INT32(value.raw, read.raw);
+  TEST_ASSERT_EQUAL_UINT32(value.sampledAt, read.sampledAt);
+  TEST_ASSERT_EQUAL_UINT32(7, read.sequence);
+  TEST_ASSERT_EQUAL_INT8(value.ir, read.ir);
+  TEST_ASSERT_EQUAL_UINT8(value.fault, read.fault);
+}
+
+void test_check_pattern_catches_a_mix() {
+  TEST_ASSERT_TRUE(snapshotCheckConsistent(snapshotCheckValue(41)));
+  
+  // Half of one write and half of the next, as a torn read would return
+  SensorSnapshot mixed = snapshotCheckValue(41);
+  SensorSnapshot next = snapshotCheckValue(42);
+  mixed.weight = next.weight;
+  mixed.ir = next.ir;
+  mixed.fault = next.fault;
+  TEST_ASSERT_FALSE(snapshotCheckConsistent(mixed));
+  
+  mixed = snapshotCheckValue(41);
+  mixed.sequence = 42;
+  TEST_ASSERT_FALSE(snapshotCheckConsistent(mixed));
+}
+
+void test_sequence_even_between_writes() {
+  SnapshotCell cell = {};
+  for (uint32_t n = 1; n <= 5; n++) {
+    publishSnapshot(cell, snapshotCheckValue(n));
+    TEST_ASSERT_EQUAL_UINT32(2 * n, cell.seq.load());
+  }
+  TEST_ASSERT_EQUAL_UINT32(5, readSnapshot(cell).sequence);
+}
+
+void test_reader_waits_out_a_write() {
+  SnapshotCell cell = {};
+  publishSnapshot(cell, snapshotCheckValue(1));
+  
+  // Leave the cell mid-write, then let another thread finish it while the
+  // reader spins; the reader must only ever see the completed value
+  cell.seq.store(cell.seq.load() + 1);
+  uint32_t retries = 0;
+  SensorSnapshot read;
+  std::thread reader([&]() { read = readSnapshot(cell, &retries); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  SensorSnapshot value = snapshotCheckValue(2);
+  uint32_t words[SNAPSHOT_WORDS] = {};
+  memcpy(words, &value, sizeof(value));
+  for (size_t i = 0; i < SNAPSHOT_WORDS; i++) {
+    cell.words[i].store(words[i]);
+  }
+  cell.seq.store(cell.seq.load() + 1);
+  reader.join();
+  TEST_ASSERT_EQUAL_UINT32(2, read.sequence);
+  TEST_ASSERT_TRUE(snapshotCheckConsistent(read));
+  TEST_ASSERT_GREATER_THAN(0, retries);
+}
+
+void test_seqlock_stress() {
+  SeqlockPrimitive seqlock;
+  StressResult result = stress(seqlock, "snapshot");
+  TEST_ASSERT_EQUAL_UINT32(0, result.torn);
+  TEST_ASSERT_EQUAL_UINT32(0, result.writeStalls);
+  TEST_ASSERT_GREATER_THAN(0, result.reads);
+  TEST_ASSERT_EQUAL_UINT32(result.writes, readSnapshot(seqlock.cell).sequence);
+}
+
+void test_queue_stress() {
+  QueuePrimitive queue;
+  StressResult result = stress(queue, "queue");
+  TEST_ASSERT_EQUAL_UINT32(0, result.torn);
+  TEST_ASSERT_GREATER_THAN(0, result.reads);
+  // Every value is received at most once
+  TEST_ASSERT_LESS_OR_EQUAL(result.writes - result.writeStalls, result.reads);
+}
+
+void test_mutex_stress() {
+  MutexPrimitive mutex;
+  StressResult result = stress(mutex, "mutex");
+  TEST_ASSERT_EQUAL_UINT32(0, result.torn);
+  TEST_ASSERT_EQUAL_UINT32(0, result.writeStalls);
+  TEST_ASSERT_GREATER_THAN(0, result.reads);
+  TEST_ASSERT_EQUAL_UINT32(result.writes, mutex.guarded.sequence);
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_round_trip);
+  RUN_TEST(test_check_pattern_catches_a_mix);
+  RUN_TEST(test_sequence_even_between_writes);
+  RUN_TEST(test_reader_waits_out_a_write);
+  RUN_TEST(test_seqlock_stress);
+  RUN_TEST(test_queue_stress);
+  RUN_TEST(test_mutex_stress);
+  return UNITY_END();
+}
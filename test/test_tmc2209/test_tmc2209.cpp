@@ -0,0 +1,240 @@
+/*
+ * Host tests for the TMC2209 UART datagrams, register packing and
+ * register transactions over a scripted wire (include/tmc2209.h)
+ *   pio test -e native -f test_tmc2209
+ */
+
+#include <unity.h>
+#include <vector>
+#include "tmc2209.h"
+
+#define REPLY_TIMEOUT_US 3000
+
+// The single-wire UART: whatever is written comes back as an echo, then
+// the scripted reply (if any) follows it
+struct FakeUart {
+  std::vector<uint8_t> rx;
+  size_t rxRead = 0;
+  std::vector<uint8_t> tx;
+  std::vector<uint8_t> reply;
+  bool echo = true;
+  
+  int available() { return rx.size() - rxRead; }
+  int read() { return rxRead < rx.size() ? rx[rxRead++] : -1; }
+  void flush() {}
+  size_t write(const uint8_t* data, size_t length) {
+    tx.insert(tx.end(), data, data + length);
+    if (echo) {
+      rx.insert(rx.end(), data, data + length);
+    }
+    rx.insert(rx.end(), reply.begin(), reply.end());
+    return length;
+  }
+};
+
+// Every look at the clock moves it on, so a missing reply times out
+uint32_t fakeNow;
+uint32_t fakeMicros() {
+  return fakeNow += 10;
+}
+
+// What a TMC2209 at the master address sends back for a read of `reg`
+std::vector<uint8_t> replyFor(uint8_t reg, uint32_t value) {
+  uint8_t reply[TMC_WRITE_LENGTH];
+  tmcWriteDatagram(reply, TMC_REPLY_ADDRESS, reg, value);
+  reply[2] = reg;
+  reply[7] = tmcCrc(reply, 7);
+  return std::vector<uint8_t>(reply, reply + sizeof(reply));
+}
+
+void setUp() {}
+
+void tearDown() {}
+
+void test_crc_of_known_requests() {
+  uint8_t request[TMC_READ_LENGTH];
+  tmcReadRequest(request, 0, TMC_REG_GCONF);
+  const uint8_t gconf[] = { 0x05, 0x00, 0x00, 0x48 };
+  TEST_ASSERT_EQUAL_HEX8_ARRAY(gconf, request, sizeof(gconf));
+  
+  tmcReadRequest(request, 0, TMC_REG_IFCNT);
+  const uint8_t ifcnt[] = { 0x05, 0x00, 0x02, 0x8F };
+  TEST_ASSERT_EQUAL_HEX8_ARRAY(ifcnt, request, sizeof(ifcnt));
+}
+
+void test_write_datagram_layout() {
+  uint8_t datagram[TMC_WRITE_LENGTH];
+  tmcWriteDatagram(datagram, 0, TMC_REG_GCONF, TMC_GCONF_UART);
+  const uint8_t expected[] = { 0x05, 0x00, 0x80, 0x00, 0x00, 0x01, 0xC0, 0xF6 };
+  TEST_ASSERT_EQUAL_HEX8_ARRAY(expected, datagram, sizeof(expected));
+  
+  tmcWriteDatagram(datagram, 3, TMC_REG_CHOPCONF, 0x12345678);
+  TEST_ASSERT_EQUAL_HEX8(3, datagram[1]);
+  TEST_ASSERT_EQUAL_HEX8(0xEC, datagram[2]);
+  TEST_ASSERT_EQUAL_HEX8(0x12, datagram[3]);
+  TEST_ASSERT_EQUAL_HEX8(0x78, datagram[6]);
+  TEST_ASSERT_EQUAL_HEX8(tmcCrc(datagram, 7), datagram[7]);
+}
+
+void test_crc_catches_every_single_bit_error() {
+  uint8_t datagram[TMC_WRITE_LENGTH];
+  tmcWriteDatagram(datagram, 0, TMC_REG_IHOLD_IRUN, 0x00081309);
+  for (int byte = 0; byte < 7; byte++) {
+    for (int bit = 0; bit < 8; bit++) {
+      datagram[byte] ^= 1 << bit;
+      TEST_ASSERT_NOT_EQUAL(datagram[7], tmcCrc(datagram, 7));
+      datagram[byte] ^= 1 << bit;
+    }
+  }
+}
+
+void test_reply_parsing() {
+  // IOIN of a TMC2209: version 0x21 in the top byte
+  uint8_t reply[] = { 0x05, 0xFF, 0x06, 0x21, 0x00, 0x00, 0x40, 0x4F };
+  uint32_t value = 0;
+  TEST_ASSERT_TRUE(tmcParseReply(reply, TMC_REG_IOIN, value));
+  TEST_ASSERT_EQUAL_HEX32(0x21000040, value);
+  
+  TEST_ASSERT_FALSE(tmcParseReply(reply, TMC_REG_GCONF, value));
+  reply[6] ^= 0x01;
+  TEST_ASSERT_FALSE(tmcParseReply(reply, TMC_REG_IOIN, value));
+  reply[6] ^= 0x01;
+  
+  // Our own request echoed on the shared wire is not a reply
+  uint8_t echo[TMC_WRITE_LENGTH];
+  tmcWriteDatagram(echo, 0, TMC_REG_IOIN, 0);
+  echo[2] = TMC_REG_IOIN;
+  echo[7] = tmcCrc(echo, 7);
+  TEST_ASSERT_FALSE(tmcParseReply(echo, TMC_REG_IOIN, value));
+}
+
+void test_mres_per_step_mode() {
+  TEST_ASSERT_EQUAL_UINT8(8, tmcMres(1));
+  TEST_ASSERT_EQUAL_UINT8(7, tmcMres(2));
+  TEST_ASSERT_EQUAL_UINT8(5, tmcMres(8));
+  TEST_ASSERT_EQUAL_UINT8(4, tmcMres(16));
+  TEST_ASSERT_EQUAL_UINT8(1, tmcMres(128));
+  TEST_ASSERT_EQUAL_UINT8(6, tmcMres(3));  // Rounds up to 4 microsteps
+}
+
+void test_chopconf_packing() {
+  TEST_ASSERT_EQUAL_HEX32(0x18000053, tmcChopconf(8, false));
+  TEST_ASSERT_EQUAL_HEX32(0x15020053, tmcChopconf(5, true));
+  TEST_ASSERT_EQUAL_HEX32(0x10000053, tmcChopconf(0, false));
+}
+
+void test_current_scale_and_range() {
+  bool vsense = false;
+  TEST_ASSERT_EQUAL_UINT8(19, tmcCurrentScale(600, 0.11, vsense));
+  TEST_ASSERT_TRUE(vsense);
+  TEST_ASSERT_EQUAL_UINT8(24, tmcCurrentScale(1400, 0.11, vsense));
+  TEST_ASSERT_FALSE(vsense);
+  TEST_ASSERT_EQUAL_UINT8(31, tmcCurrentScale(3000, 0.11, vsense));
+  TEST_ASSERT_EQUAL_UINT8(0, tmcCurrentScale(0, 0.11, vsense));
+}
+
+void test_ihold_irun_packing() {
+  TEST_ASSERT_EQUAL_HEX32(0x00081309, tmcIholdIrun(19, 50));
+  TEST_ASSERT_EQUAL_HEX32(0x00081F1F, tmcIholdIrun(31, 100));
+  TEST_ASSERT_EQUAL_HEX32(0x00081F00, tmcIholdIrun(31, 0));
+}
+
+void test_read_skips_the_echo() {
+  FakeUart uart;
+  uart.reply = replyFor(TMC_REG_SG_RESULT, 0x000001F4);
+  uint32_t value = 0;
+  TEST_ASSERT_TRUE(tmcReadRegister(uart, 0, TMC_REG_SG_RESULT, value, fakeMicros, REPLY_TIMEOUT_US));
+  TEST_ASSERT_EQUAL_HEX32(0x000001F4, value);
+  
+  uint8_t request[TMC_READ_LENGTH];
+  tmcReadRequest(request, 0, TMC_REG_SG_RESULT);
+  TEST_ASSERT_EQUAL_size_t(sizeof(request), uart.tx.size());
+  TEST_ASSERT_EQUAL_HEX8_ARRAY(request, uart.tx.data(), sizeof(request));
+  TEST_ASSERT_EQUAL_INT(0, uart.available());
+}
+
+void test_read_drains_stale_bytes_first() {
+  FakeUart uart;
+  uart.rx = { 0x05, 0xFF, 0x41 };  // Tail of an earlier, abandoned reply
+  uart.reply = replyFor(TMC_REG_GCONF, TMC_GCONF_UART);
+  uint32_t value = 0;
+  TEST_ASSERT_TRUE(tmcReadRegister(uart, 0, TMC_REG_GCONF, value, fakeMicros, REPLY_TIMEOUT_US));
+  TEST_ASSERT_EQUAL_HEX32(TMC_GCONF_UART, value);
+}
+
+void test_read_rejects_a_corrupt_reply() {
+  FakeUart uart;
+  uart.reply = replyFor(TMC_REG_SG_RESULT, 0x000001F4);
+  uart.reply[7] ^= 0x01;
+  uint32_t value = 0xDEADBEEF;
+  TEST_ASSERT_FALSE(tmcReadRegister(uart, 0, TMC_REG_SG_RESULT, value, fakeMicros, REPLY_TIMEOUT_US));
+  TEST_ASSERT_EQUAL_HEX32(0xDEADBEEF, value);
+  
+  // A reply to another register is no answer either
+  uart = FakeUart();
+  uart.reply = replyFor(TMC_REG_GCONF, 0);
+  TEST_ASSERT_FALSE(tmcReadRegister(uart, 0, TMC_REG_SG_RESULT, value, fakeMicros, REPLY_TIMEOUT_US));
+}
+
+void test_read_times_out_without_a_reply() {
+  FakeUart uart;
+  uint32_t value = 0;
+  uint32_t start = fakeNow;
+  TEST_ASSERT_FALSE(tmcReadRegister(uart, 0, TMC_REG_IOIN, value, fakeMicros, REPLY_TIMEOUT_US));
+  TEST_ASSERT_GREATER_OR_EQUAL(REPLY_TIMEOUT_US, fakeNow - start);
+  
+  // Nothing at all on the wire, not even the echo
+  uart = FakeUart();
+  uart.echo = false;
+  TEST_ASSERT_FALSE(tmcReadRegister(uart, 0, TMC_REG_IOIN, value, fakeMicros, REPLY_TIMEOUT_US));
+}
+
+void test_read_rejects_a_short_reply() {
+  FakeUart uart;
+  uart.reply = replyFor(TMC_REG_IOIN, 0x21000040);
+  uart.reply.resize(TMC_WRITE_LENGTH - 1);
+  uint32_t value = 0;
+  TEST_ASSERT_FALSE(tmcReadRegister(uart, 0, TMC_REG_IOIN, value, fakeMicros, REPLY_TIMEOUT_US));
+}
+
+void test_probe_checks_the_version() {
+  FakeUart uart;
+  uart.reply = replyFor(TMC_REG_IOIN, 0x21000040);
+  TEST_ASSERT_TRUE(tmcProbe(uart, 0, fakeMicros, REPLY_TIMEOUT_US));
+  
+  // A TMC2208 (version 0x20) or an unconnected wire is not a TMC2209
+  uart = FakeUart();
+  uart.reply = replyFor(TMC_REG_IOIN, 0x20000040);
+  TEST_ASSERT_FALSE(tmcProbe(uart, 0, fakeMicros, REPLY_TIMEOUT_US));
+  uart = FakeUart();
+  TEST_ASSERT_FALSE(tmcProbe(uart, 0, fakeMicros, REPLY_TIMEOUT_US));
+}
+
+void test_write_register_sends_the_datagram() {
+  FakeUart uart;
+  tmcWriteRegister(uart, 2, TMC_REG_SGTHRS, 80);
+  uint8_t expected[TMC_WRITE_LENGTH];
+  tmcWriteDatagram(expected, 2, TMC_REG_SGTHRS, 80);
+  TEST_ASSERT_EQUAL_size_t(sizeof(expected), uart.tx.size());
+  TEST_ASSERT_EQUAL_HEX8_ARRAY(expected, uart.tx.data(), sizeof(expected));
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_crc_of_known_requests);
+  RUN_TEST(test_write_datagram_layout);
+  RUN_TEST(test_crc_catches_every_single_bit_error);
+  RUN_TEST(test_reply_parsing);
+  RUN_TEST(test_mres_per_step_mode);
+  RUN_TEST(test_chopconf_packing);
+  RUN_TEST(test_current_scale_and_range);
+  RUN_TEST(test_ihold_irun_packing);
+  RUN_TEST(test_read_skips_the_echo);
+  RUN_TEST(test_read_drains_stale_bytes_first);
+  RUN_TEST(test_read_rejects_a_corrupt_reply);
+  RUN_TEST(test_read_times_out_without_a_reply);
+  RUN_TEST(test_read_rejects_a_short_reply);
+  RUN_TEST(test_probe_checks_the_version);
+  RUN_TEST(test_write_register_sends_the_datagram);
+  return UNITY_END();
+}
@@ -0,0 +1,878 @@
+// Fleet aggregator for Smart Feeders. Linux only (epoll).
+//
+//   g++ -O2 -std=c++17 -o aggregator tools/aggregator.cpp
+//   aggregator [--listen PORT] [--feeder HOST[:PORT]]... [--no-discovery] [--rows N]
+//
+// Feeders are found from the ANNOUNCE datagrams on the fleet multicast group
+// (see the Fleet Coordination section of src/main.cpp) or listed with
+// --feeder, which also covers instances on other ports. Each feeder is
+// followed through a long-poll on /api/status, so changes arrive as they
+// happen, and /api/counters is fetched once a minute. Every socket is
+// non-blocking on one epoll loop; a feeder costs one idle connection.
+//
+// Status samples go into a ring of columns, one array per field, and are
+// served from port 8070 (by default):
+//   GET /feeders                          latest state of every feeder
+//   GET /series?field=F[&feeder=I][&since=MS][&limit=N]
+//                                         one field over time, as
+//                                         [epoch ms, feeder index, value];
+//                                         F is weight, ir, program,
+//                                         throttled, rssi, link, loadCell
+//                                         or version
+//   GET /summary[?window=MS]              per-feeder weight over the window
+//                                         (default 1 h) and fleet totals
+//   GET /stats                            the aggregator itself
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+// ========================================
+// Configuration
+// ========================================
+#define FLEET_GROUP "239.255.70.70"
+#define FLEET_PORT 4570
+#define FLEET_MAGIC 0x314C4653          // "SFL1" little-endian
+#define FLEET_ANNOUNCE 4
+#define DEFAULT_API_PORT 8070
+#define DEFAULT_ROWS 1000000
+#define LONGPOLL_TIMEOUT_MS 40000       // Feeders park a status request for up to 25 s
+#define FETCH_TIMEOUT_MS 5000
+#define COUNTERS_INTERVAL_MS 60000
+#define RETRY_MIN_MS 1000
+#define RETRY_MAX_MS 30000
+#define MAX_RESPONSE 65536
+#define MAX_API_REQUEST 8192
+#define MAX_EVENTS 256
+#define TICK_MS 250                     // Timeout and retry resolution
+
+int64_t nowMs() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+int64_t epochMs() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// ========================================
+// Event Loop
+// ========================================
+// Every socket belongs to a Handler, stored as the epoll data pointer
+
+struct Handler {
+  virtual ~Handler() {}
+  virtual void onEvent(uint32_t events) = 0;
+};
+
+int epollFd = -1;
+size_t openConnections = 0;
+
+void watch(int fd, Handler* handler, uint32_t events, bool add) {
+  epoll_event ev = {};
+  ev.events = events;
+  ev.data.ptr = handler;
+  epoll_ctl(epollFd, add ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd, &ev);
+}
+
+void closeWatched(int& fd) {
+  if (fd >= 0) {
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, NULL);
+    close(fd);
+    fd = -1;
+    openConnections--;
+  }
+}
+
+// ========================================
+// Column Store
+// ========================================
+// A fixed-capacity ring; the oldest rows are overwritten. Queries scan the
+// time and feeder columns and touch only the one field they need.
+
+enum Field { F_WEIGHT, F_IR, F_PROGRAM, F_THROTTLED, F_RSSI, F_LINK, F_LOADCELL, F_VERSION, FIELD_COUNT };
+const char* const FIELD_NAMES[FIELD_COUNT] = {
+  "weight", "ir", "program", "throttled", "rssi", "link", "loadCell", "version"
+};
+const char* const LINK_NAMES[] = { "good", "fair", "poor" };
+const char* const LOAD_CELL_NAMES[] = { "ok", "not_ready", "stuck", "saturated", "erratic", "noisy" };
+
+struct ColumnStore {
+  size_t capacity = 0;
+  size_t next = 0;
+  size_t count = 0;
+  uint64_t appended = 0;
+  std::vector<int64_t> time;        // Epoch ms when the sample arrived
+  std::vector<uint16_t> feeder;     // Index into feeders
+  std::vector<uint32_t> version;
+  std::vector<float> weight;        // NAN while the load cell is faulted
+  std::vector<uint8_t> ir;          // 1 = obstruction
+  std::vector<uint32_t> program;
+  std::vector<uint8_t> throttled;
+  std::vector<int8_t> rssi;
+  std::vector<uint8_t> link;        // LINK_NAMES
+  std::vector<uint8_t> loadCell;    // LOAD_CELL_NAMES
+
+  void reserve(size_t rows) {
+    capacity = rows;
+    time.resize(rows);
+    feeder.resize(rows);
+    version.resize(rows);
+    weight.resize(rows);
+    ir.resize(rows);
+    program.resize(rows);
+    throttled.resize(rows);
+    rssi.resize(rows);
+    link.resize(rows);
+    loadCell.resize(rows);
+  }
+
+  size_t append() {
+    size_t row = next;
+    next = (next + 1) % capacity;
+    count = std::min(count + 1, capacity);
+    appended++;
+    return row;
+  }
+
+  // Physical row of the i-th oldest sample
+  size_t row(size_t i) const {
+    return (next + capacity - count + i) % capacity;
+  }
+
+  double value(Field field, size_t row) const {
+    switch (field) {
+      case F_WEIGHT:    return weight[row];
+      case F_IR:        return ir[row];
+      case F_PROGRAM:   return program[row];
+      case F_THROTTLED: return throttled[row];
+      case F_RSSI:      return rssi[row];
+      case F_LINK:      return link[row];
+      case F_LOADCELL:  return loadCell[row];
+      case F_VERSION:   return version[row];
+      default:          return NAN;
+    }
+  }
+
+  // First logical index with time >= since (times only ever increase)
+  size_t lowerBound(int64_t since) const {
+    size_t lo = 0, hi = count;
+    while (lo < hi) {
+      size_t mid = (lo + hi) / 2;
+      if (time[row(mid)] < since) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    return lo;
+  }
+};
+ColumnStore store;
+
+// ========================================
+// JSON Fields
+// ========================================
+// Feeder responses are flat objects of numbers, strings, booleans and null
+
+const char* jsonValue(const std::string& json, const char* key) {
+  std::string pattern = std::string("\"") + key + "\":";
+  size_t at = json.find(pattern);
+  return at == std::string::npos ? NULL : json.c_str() + at + pattern.size();
+}
+
+double jsonNumber(const std::string& json, const char* key, double fallback) {
+  const char* value = jsonValue(json, key);
+  if (value == NULL || strncmp(value, "null", 4) == 0) {
+    return fallback;
+  }
+  if (strncmp(value, "true", 4) == 0) {
+    return 1;
+  }
+  if (strncmp(value, "false", 5) == 0) {
+    return 0;
+  }
+  return strtod(value, NULL);
+}
+
+// Index of the string value in `names`, or -1
+int jsonEnum(const std::string& json, const char* key, const char* const* names, int count) {
+  const char* value = jsonValue(json, key);
+  if (value == NULL || *value != '"') {
+    return -1;
+  }
+  value++;
+  for (int i = 0; i < count; i++) {
+    size_t length = strlen(names[i]);
+    if (strncmp(value, names[i], length) == 0 && value[length] == '"') {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// ========================================
+// Feeders
+// ========================================
+
+struct Feeder;
+typedef void (*FetchDone)(Feeder& feeder, int code, const std::string& body);
+
+// One HTTP GET to a feeder, from connect to the server's close
+struct Fetch : Handler {
+  Feeder* feeder = NULL;
+  FetchDone done = NULL;
+  int fd = -1;
+  std::string out;
+  size_t sent = 0;
+  std::string in;
+  int64_t deadline = 0;
+
+  bool active() const {
+    return fd >= 0;
+  }
+
+  void start(const std::string& path, int64_t timeoutMs);
+  void onEvent(uint32_t events) override;
+  void finish(bool complete);
+};
+
+struct Feeder {
+  uint16_t index;
+  uint32_t id;                 // From ANNOUNCE; 0 for --feeder entries
+  sockaddr_in addr;
+  std::string label;           // host:port
+  Fetch status;
+  Fetch counters;
+  uint32_t version = 0;        // Last status version seen
+  bool online = false;
+  int64_t lastSeenAt = 0;
+  int64_t retryAt = 0;
+  int retryMs = RETRY_MIN_MS;
+  int64_t countersAt = 0;
+  uint64_t responses = 0;
+  uint64_t failures = 0;
+  std::string lastStatus;      // Raw JSON, served by /feeders
+  std::string lastCounters;
+};
+std::vector<std::unique_ptr<Feeder>> feeders;
+
+uint64_t fetchesStarted = 0;
+uint64_t discoveryPackets = 0;
+uint64_t apiRequests = 0;
+
+void Fetch::start(const std::string& path, int64_t timeoutMs) {
+  fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    done(*feeder, 0, "");
+    return;
+  }
+  openConnections++;
+  fetchesStarted++;
+  if (connect(fd, (const sockaddr*)&feeder->addr, sizeof(feeder->addr)) < 0 && errno != EINPROGRESS) {
+    finish(false);
+    return;
+  }
+  out = "GET " + path + " HTTP/1.1\r\nHost: " + feeder->label + "\r\nConnection: close\r\n\r\n";
+  sent = 0;
+  in.clear();
+  deadline = nowMs() + timeoutMs;
+  watch(fd, this, EPOLLOUT, true);
+}
+
+void Fetch::onEvent(uint32_t events) {
+  if (sent < out.size()) {
+    int error = 0;
+    socklen_t length = sizeof(error);
+    if ((events & EPOLLERR) || getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error != 0) {
+      finish(false);
+      return;
+    }
+    ssize_t n = send(fd, out.data() + sent, out.size() - sent, MSG_NOSIGNAL);
+    if (n < 0 && errno != EAGAIN) {
+      finish(false);
+      return;
+    }
+    sent += std::max<ssize_t>(n, 0);
+    if (sent == out.size()) {
+      watch(fd, this, EPOLLIN | EPOLLRDHUP, false);
+    }
+    return;
+  }
+
+  char buf[4096];
+  for (;;) {
+    ssize_t n = recv(fd, buf, sizeof(buf), 0);
+    if (n > 0) {
+      in.append(buf, n);
+      if (in.size() > MAX_RESPONSE) {
+        finish(false);
+        return;
+      }
+      continue;
+    }
+    if (n == 0) {
+      finish(true);
+    } else if (errno != EAGAIN) {
+      finish(false);
+    }
+    return;
+  }
+}
+
+// The feeder closes after every response, so the close ends the body
+void Fetch::finish(bool complete) {
+  closeWatched(fd);
+  int code = 0;
+  std::string body;
+  size_t headEnd = in.find("\r\n\r\n");
+  if (complete && headEnd != std::string::npos && in.compare(0, 5, "HTTP/") == 0) {
+    code = atoi(in.c_str() + in.find(' ') + 1);
+    body = in.substr(headEnd + 4);
+  }
+  in.clear();
+  done(*feeder, code, body);
+}
+
+void startStatus(Feeder& feeder) {
+  feeder.status.start("/api/status?since=" + std::to_string(feeder.version), LONGPOLL_TIMEOUT_MS);
+}
+
+void markFailed(Feeder& feeder) {
+  feeder.failures++;
+  if (feeder.online) {
+    fprintf(stderr, "%s offline\n", feeder.label.c_str());
+  }
+  feeder.online = false;
+  feeder.retryAt = nowMs() + feeder.retryMs;
+  feeder.retryMs = std::min(feeder.retryMs * 2, RETRY_MAX_MS);
+}
+
+void onStatus(Feeder& feeder, int code, const std::string& body) {
+  if (code != 200) {
+    markFailed(feeder);
+    return;
+  }
+  feeder.responses++;
+  feeder.lastSeenAt = nowMs();
+  feeder.retryMs = RETRY_MIN_MS;
+  if (!feeder.online) {
+    fprintf(stderr, "%s online\n", feeder.label.c_str());
+    feeder.online = true;
+  }
+  feeder.lastStatus = body;
+
+  // A long-poll timeout repeats the same version; only changes are stored
+  uint32_t version = jsonNumber(body, "version", 0);
+  if (version != feeder.version) {
+    feeder.version = version;
+    size_t row = store.append();
+    store.time[row] = epochMs();
+    store.feeder[row] = feeder.index;
+    store.version[row] = version;
+    store.weight[row] = jsonNumber(body, "weight", NAN);
+    store.ir[row] = jsonEnum(body, "ir", (const char* const[]){ "clear", "obstruction" }, 2) == 1;
+    store.program[row] = jsonNumber(body, "program", 0);
+    store.throttled[row] = jsonNumber(body, "motorThrottled", 0);
+    store.rssi[row] = jsonNumber(body, "rssi", 0);
+    store.link[row] = std::max(0, jsonEnum(body, "link", LINK_NAMES, 3));
+    store.loadCell[row] = std::max(0, jsonEnum(body, "loadCell", LOAD_CELL_NAMES, 6));
+  }
+  startStatus(feeder);
+}
+
+void onCounters(Feeder& feeder, int code, const std::string& body) {
+  if (code == 200) {
+    feeder.lastCounters = body;
+  }
+  feeder.countersAt = nowMs() + COUNTERS_INTERVAL_MS;
+}
+
+std::string addressLabel(const sockaddr_in& addr) {
+  char host[INET_ADDRSTRLEN];
+  inet_ntop(AF_INET, &addr.sin_addr, host, sizeof(host));
+  return std::string(host) + ":" + std::to_string(ntohs(addr.sin_port));
+}
+
+bool sameAddress(const sockaddr_in& a, const sockaddr_in& b) {
+  return a.sin_addr.s_addr == b.sin_addr.s_addr && a.sin_port == b.sin_port;
+}
+
+Feeder* addFeeder(uint32_t id, const sockaddr_in& addr) {
+  if (feeders.size() >= 65535) {
+    return NULL;
+  }
+  std::unique_ptr<Feeder> feeder(new Feeder());
+  feeder->index = feeders.size();
+  feeder->id = id;
+  feeder->addr = addr;
+  feeder->label = addressLabel(addr);
+  feeder->status.feeder = feeder.get();
+  feeder->status.done = onStatus;
+  feeder->counters.feeder = feeder.get();
+  feeder->counters.done = onCounters;
+  fprintf(stderr, "feeder %u: %s (id %u)\n", feeder->index, feeder->label.c_str(), id);
+  feeders.push_back(std::move(feeder));
+  return feeders.back().get();
+}
+
+// Starts due retries and counter fetches, and aborts overdue requests
+void serviceFeeders() {
+  int64_t now = nowMs();
+  for (auto& entry : feeders) {
+    Feeder& feeder = *entry;
+    if (feeder.status.active() && now >= feeder.status.deadline) {
+      feeder.status.finish(false);
+    } else if (!feeder.status.active() && now >= feeder.retryAt) {
+      startStatus(feeder);
+    }
+    if (feeder.counters.active() && now >= feeder.counters.deadline) {
+      feeder.counters.finish(false);
+    } else if (!feeder.counters.active() && feeder.online && now >= feeder.countersAt) {
+      feeder.counters.start("/api/counters", FETCH_TIMEOUT_MS);
+    }
+  }
+}
+
+// ========================================
+// Discovery
+// ========================================
+
+struct Discovery : Handler {
+  int fd = -1;
+
+  bool open() {
+    fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+    sockaddr_in local = {};
+    local.sin_family = AF_INET;
+    local.sin_port = htons(FLEET_PORT);
+    local.sin_addr.s_addr = htonl(INADDR_ANY);
+    ip_mreq group = {};
+    inet_pton(AF_INET, FLEET_GROUP, &group.imr_multiaddr);
+    group.imr_interface.s_addr = htonl(INADDR_ANY);
+    if (bind(fd, (const sockaddr*)&local, sizeof(local)) < 0 ||
+        setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &group, sizeof(group)) < 0) {
+      perror("discovery");
+      close(fd);
+      fd = -1;
+      return false;
+    }
+    watch(fd, this, EPOLLIN, true);
+    return true;
+  }
+
+  void onEvent(uint32_t) override {
+    uint8_t packet[16];
+    sockaddr_in from;
+    socklen_t fromLength = sizeof(from);
+    while (recvfrom(fd, packet, sizeof(packet), 0, (sockaddr*)&from, &fromLength) == sizeof(packet)) {
+      uint32_t magic, id, value;
+      memcpy(&magic, packet, 4);
+      memcpy(&id, packet + 8, 4);
+      memcpy(&value, packet + 12, 4);
+      fromLength = sizeof(from);
+      if (magic != FLEET_MAGIC || packet[4] != FLEET_ANNOUNCE || id == 0) {
+        continue;
+      }
+      discoveryPackets++;
+      from.sin_port = htons(value & 0xFFFF);
+
+      // Feeders keep their id across DHCP changes. A --feeder entry has no
+      // id until its first ANNOUNCE, so it is matched by address and
+      // adopts the id instead of being listed twice.
+      Feeder* known = NULL;
+      for (auto& feeder : feeders) {
+        if (feeder->id == id) {
+          known = feeder.get();
+          break;
+        }
+      }
+      for (size_t i = 0; known == NULL && i < feeders.size(); i++) {
+        if (feeders[i]->id == 0 && sameAddress(feeders[i]->addr, from)) {
+          known = feeders[i].get();
+          known->id = id;
+          fprintf(stderr, "feeder %u: id %u\n", known->index, id);
+        }
+      }
+      if (known == NULL) {
+        addFeeder(id, from);
+      } else if (!sameAddress(known->addr, from)) {
+        known->addr = from;
+        known->label = addressLabel(from);
+        fprintf(stderr, "feeder %u moved to %s\n", known->index, known->label.c_str());
+      }
+    }
+  }
+};
+Discovery discovery;
+
+// ========================================
+// Aggregated API
+// ========================================
+
+std::string queryArg(const std::string& query, const char* name) {
+  std::string key = std::string(name) + "=";
+  size_t at = 0;
+  while (at < query.size()) {
+    size_t end = query.find('&', at);
+    if (end == std::string::npos) {
+      end = query.size();
+    }
+    if (query.compare(at, key.size(), key) == 0) {
+      return query.substr(at + key.size(), end - at - key.size());
+    }
+    at = end + 1;
+  }
+  return "";
+}
+
+void appendNumber(std::string& out, double value) {
+  char buf[32];
+  if (std::isnan(value)) {
+    out += "null";
+  } else if (value == (int64_t)value) {
+    snprintf(buf, sizeof(buf), "%lld", (long long)value);
+    out += buf;
+  } else {
+    snprintf(buf, sizeof(buf), "%.3f", value);
+    out += buf;
+  }
+}
+
+std::string feedersJson() {
+  int64_t now = nowMs();
+  std::string json = "[";
+  for (auto& entry : feeders) {
+    const Feeder& feeder = *entry;
+    if (json.size() > 1) {
+      json += ",";
+    }
+    json += "{\"index\":" + std::to_string(feeder.index);
+    json += ",\"id\":" + std::to_string(feeder.id);
+    json += ",\"address\":\"" + feeder.label + "\"";
+    json += ",\"online\":" + std::string(feeder.online ? "true" : "false");
+    json += ",\"lastSeenMsAgo\":";
+    appendNumber(json, feeder.lastSeenAt ? now - feeder.lastSeenAt : NAN);
+    json += ",\"responses\":" + std::to_string(feeder.responses);
+    json += ",\"failures\":" + std::to_string(feeder.failures);
+    json += ",\"status\":" + (feeder.lastStatus.empty() ? "null" : feeder.lastStatus);
+    json += ",\"counters\":" + (feeder.lastCounters.empty() ? "null" : feeder.lastCounters);
+    json += "}";
+  }
+  return json + "]";
+}
+
+std::string seriesJson(const std::string& query, int& code) {
+  std::string name = queryArg(query, "field");
+  int field = -1;
+  for (int i = 0; i < FIELD_COUNT; i++) {
+    if (name == FIELD_NAMES[i]) {
+      field = i;
+    }
+  }
+  if (field < 0) {
+    code = 400;
+    return "{\"error\":\"unknown field\"}";
+  }
+  std::string feederArg = queryArg(query, "feeder");
+  long feeder = feederArg.empty() ? -1 : atol(feederArg.c_str());
+  int64_t since = atoll(queryArg(query, "since").c_str());
+  std::string limitArg = queryArg(query, "limit");
+  size_t limit = limitArg.empty() ? 10000 : strtoul(limitArg.c_str(), NULL, 10);
+
+  std::string json = "{\"field\":\"" + name + "\",\"points\":[";
+  size_t emitted = 0;
+  for (size_t i = store.lowerBound(since); i < store.count && emitted < limit; i++) {
+    size_t row = store.row(i);
+    if (feeder >= 0 && store.feeder[row] != feeder) {
+      continue;
+    }
+    json += emitted++ > 0 ? ",[" : "[";
+    json += std::to_string(store.time[row]) + "," + std::to_string(store.feeder[row]) + ",";
+    appendNumber(json, store.value((Field)field, row));
+    json += "]";
+  }
+  return json + "]}";
+}
+
+std::string summaryJson(const std::string& query) {
+  std::string windowArg = queryArg(query, "window");
+  int64_t windowMs = windowArg.empty() ? 3600000 : atoll(windowArg.c_str());
+
+  struct Stats { size_t samples = 0, weighed = 0; double sum = 0, min = INFINITY, max = -INFINITY, last = NAN; };
+  std::vector<Stats> stats(feeders.size());
+  for (size_t i = store.lowerBound(epochMs() - windowMs); i < store.count; i++) {
+    size_t row = store.row(i);
+    Stats& s = stats[store.feeder[row]];
+    s.samples++;
+    float weight = store.weight[row];
+    if (!std::isnan(weight)) {
+      s.weighed++;
+      s.sum += weight;
+      s.min = std::min(s.min, (double)weight);
+      s.max = std::max(s.max, (double)weight);
+      s.last = weight;
+    }
+  }
+
+  int online = 0, throttled = 0, obstructed = 0;
+  double rssiSum = 0;
+  std::string perFeeder;
+  for (size_t i = 0; i < feeders.size(); i++) {
+    const Feeder& feeder = *feeders[i];
+    if (feeder.online) {
+      online++;
+      throttled += jsonNumber(feeder.lastStatus, "motorThrottled", 0) != 0;
+      obstructed += jsonEnum(feeder.lastStatus, "ir", (const char* const[]){ "clear", "obstruction" }, 2) == 1;
+      rssiSum += jsonNumber(feeder.lastStatus, "rssi", 0);
+    }
+    const Stats& s = stats[i];
+    perFeeder += i > 0 ? ",{" : "{";
+    perFeeder += "\"index\":" + std::to_string(i) + ",\"samples\":" + std::to_string(s.samples);
+    perFeeder += ",\"minWeight\":";
+    appendNumber(perFeeder, s.weighed ? s.min : NAN);
+    perFeeder += ",\"meanWeight\":";
+    appendNumber(perFeeder, s.weighed ? s.sum / s.weighed : NAN);
+    perFeeder += ",\"maxWeight\":";
+    appendNumber(perFeeder, s.weighed ? s.max : NAN);
+    perFeeder += ",\"lastWeight\":";
+    appendNumber(perFeeder, s.last);
+    perFeeder += "}";
+  }
+
+  std::string json = "{\"windowMs\":" + std::to_string(windowMs);
+  json += ",\"feeders\":" + std::to_string(feeders.size());
+  json += ",\"online\":" + std::to_string(online);
+  json += ",\"throttled\":" + std::to_string(throttled);
+  json += ",\"obstructed\":" + std::to_string(obstructed);
+  json += ",\"meanRssi\":";
+  appendNumber(json, online ? rssiSum / online : NAN);
+  json += ",\"perFeeder\":[" + perFeeder + "]}";
+  return json;
+}
+
+std::string statsJson() {
+  int online = 0;
+  uint64_t responses = 0, failures = 0;
+  for (auto& feeder : feeders) {
+    online += feeder->online;
+    responses += feeder->responses;
+    failures += feeder->failures;
+  }
+  std::string json = "{\"feeders\":" + std::to_string(feeders.size());
+  json += ",\"online\":" + std::to_string(online);
+  json += ",\"openConnections\":" + std::to_string(openConnections);
+  json += ",\"fetches\":" + std::to_string(fetchesStarted);
+  json += ",\"responses\":" + std::to_string(responses);
+  json += ",\"failures\":" + std::to_string(failures);
+  json += ",\"rows\":" + std::to_string(store.count);
+  json += ",\"rowsAppended\":" + std::to_string(store.appended);
+  json += ",\"capacity\":" + std::to_string(store.capacity);
+  json += ",\"discoveryPackets\":" + std::to_string(discoveryPackets);
+  json += ",\"apiRequests\":" + std::to_string(apiRequests);
+  json += "}";
+  return json;
+}
+
+// One API request: read the head, answer, close
+struct ApiClient : Handler {
+  int fd;
+  std::string in;
+  std::string out;
+  size_t sent = 0;
+
+  explicit ApiClient(int fd) : fd(fd) {}
+
+  void respond() {
+    apiRequests++;
+    int code = 200;
+    std::string body;
+    size_t pathStart = in.find(' ') + 1;
+    std::string target = in.substr(pathStart, in.find(' ', pathStart) - pathStart);
+    size_t q = target.find('?');
+    std::string path = target.substr(0, q);
+    std::string query = q == std::string::npos ? "" : target.substr(q + 1);
+    if (in.compare(0, 4, "GET ") != 0) {
+      code = 405;
+      body = "{\"error\":\"method not allowed\"}";
+    } else if (path == "/feeders") {
+      body = feedersJson();
+    } else if (path == "/series") {
+      body = seriesJson(query, code);
+    } else if (path == "/summary") {
+      body = summaryJson(query);
+    } else if (path == "/stats") {
+      body = statsJson();
+    } else {
+      code = 404;
+      body = "{\"error\":\"not found\"}";
+    }
+    const char* reason = code == 200 ? "OK" : code == 400 ? "Bad Request" : code == 404 ? "Not Found" : "Method Not Allowed";
+    out = "HTTP/1.1 " + std::to_string(code) + " " + reason + "\r\n"
+          "Content-Type: application/json\r\n"
+          "Content-Length: " + std::to_string(body.size()) + "\r\n"
+          "Connection: close\r\n\r\n" + body;
+    watch(fd, this, EPOLLOUT, false);
+  }
+
+  void onEvent(uint32_t events) override {
+    if (events & (EPOLLERR | EPOLLHUP)) {
+      finish();
+      return;
+    }
+    if (out.empty()) {
+      char buf[2048];
+      ssize_t n;
+      while ((n = recv(fd, buf, sizeof(buf), 0)) > 0) {
+        in.append(buf, n);
+      }
+      if (n == 0 || (n < 0 && errno != EAGAIN) || in.size() > MAX_API_REQUEST) {
+        finish();
+      } else if (in.find("\r\n\r\n") != std::string::npos) {
+        respond();
+      }
+      return;
+    }
+    ssize_t n = send(fd, out.data() + sent, out.size() - sent, MSG_NOSIGNAL);
+    if (n < 0 && errno != EAGAIN) {
+      finish();
+      return;
+    }
+    sent += std::max<ssize_t>(n, 0);
+    if (sent == out.size()) {
+      finish();
+    }
+  }
+
+  void finish() {
+    closeWatched(fd);
+    delete this;
+  }
+};
+
+struct ApiListener : Handler {
+  int fd = -1;
+
+  bool open(int port) {
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    sockaddr_in local = {};
+    local.sin_family = AF_INET;
+    local.sin_port = htons(port);
+    local.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(fd, (const sockaddr*)&local, sizeof(local)) < 0 || listen(fd, 128) < 0) {
+      perror("listen");
+      return false;
+    }
+    watch(fd, this, EPOLLIN, true);
+    return true;
+  }
+
+  void onEvent(uint32_t) override {
+    int client;
+    while ((client = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+      openConnections++;
+      watch(client, new ApiClient(client), EPOLLIN | EPOLLRDHUP, true);
+    }
+  }
+};
+ApiListener api;
+
+// ========================================
+// Main
+// ========================================
+
+bool resolveFeeder(const char* spec, sockaddr_in& addr) {
+  std::string host = spec;
+  std::string port = "80";
+  size_t colon = host.rfind(':');
+  if (colon != std::string::npos) {
+    port = host.substr(colon + 1);
+    host = host.substr(0, colon);
+  }
+  addrinfo hints = {};
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  addrinfo* result;
+  if (getaddrinfo(host.c_str(), port.c_str(), &hints, &result) != 0) {
+    return false;
+  }
+  memcpy(&addr, result->ai_addr, sizeof(addr));
+  freeaddrinfo(result);
+  return true;
+}
+
+int main(int argc, char** argv) {
+  int apiPort = DEFAULT_API_PORT;
+  size_t rows = DEFAULT_ROWS;
+  bool discover = true;
+  std::vector<const char*> statics;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--listen") == 0 && i + 1 < argc) {
+      apiPort = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--feeder") == 0 && i + 1 < argc) {
+      statics.push_back(argv[++i]);
+    } else if (strcmp(argv[i], "--rows") == 0 && i + 1 < argc) {
+      rows = strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--no-discovery") == 0) {
+      discover = false;
+    } else {
+      fprintf(stderr, "usage: %s [--listen PORT] [--feeder HOST[:PORT]]... [--no-discovery] [--rows N]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+  epollFd = epoll_create1(EPOLL_CLOEXEC);
+  store.reserve(std::max<size_t>(rows, 1));
+  if (!api.open(apiPort)) {
+    return 1;
+  }
+  if (discover && !discovery.open()) {
+    fprintf(stderr, "continuing without discovery\n");
+  }
+  for (const char* spec : statics) {
+    sockaddr_in addr;
+    if (!resolveFeeder(spec, addr)) {
+      fprintf(stderr, "cannot resolve %s\n", spec);
+      return 1;
+    }
+    addFeeder(0, addr);
+  }
+  fprintf(stderr, "aggregated API on port %d\n", apiPort);
+
+  epoll_event events[MAX_EVENTS];
+  int64_t lastTick = 0;
+  for (;;) {
+    int n = epoll_wait(epollFd, events, MAX_EVENTS, TICK_MS);
+    for (int i = 0; i < n; i++) {
+      ((Handler*)events[i].data.ptr)->onEvent(events[i].events);
+    }
+    int64_t now = nowMs();
+    if (now - lastTick >= TICK_MS) {
+      lastTick = now;
+      serviceFeeders();
+    }
+  }
+}
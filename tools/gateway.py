@@ -0,0 +1,189 @@
+#!/usr/bin/env python3
+"""
+Wired gateway client for the Smart Feeder's binary UART protocol (see the
+Wired Gateway section of src/main.cpp). Needs pyserial.
+
+  gateway.py PORT ping
+  gateway.py PORT status
+  gateway.py PORT feed GRAMS[,GRAMS...] [INTERVAL_MS]
+  gateway.py PORT cancel
+  gateway.py PORT history [FROM]
+  gateway.py PORT monitor            print status events as they arrive
+"""
+
+import math
+import struct
+import sys
+
+BAUD = 230400
+MAX_PAYLOAD = 128  # GATEWAY_MAX_PAYLOAD: type, seq, body and CRC
+
+PING, GET_STATUS, START_PROGRAM, CANCEL_PROGRAM, GET_HISTORY, CREDIT = range(1, 7)
+PONG, STATUS, RESULT, EVENT_STATUS, HISTORY = range(0x81, 0x86)
+
+RESULTS = ["ok", "busy", "invalid", "unknown"]
+PROGRAM_STATES = ["idle", "waiting", "moving", "draining"]
+PORTION_RESULTS = ["pending", "settling", "done", "skipped_full",
+                   "skipped_blocked", "cancelled", "jammed",
+                   "skipped_no_weight"]
+NO_CONDITION = -1.0
+
+
+def crc16(data):
+    crc = 0xFFFF
+    for byte in data:
+        crc ^= byte << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021) if crc & 0x8000 else crc << 1
+            crc &= 0xFFFF
+    return crc
+
+
+def cobs_encode(data):
+    out = bytearray([0])
+    code_at, code = 0, 1
+    for byte in data:
+        if byte == 0:
+            out[code_at] = code
+            code_at, code = len(out), 1
+            out.append(0)
+            continue
+        out.append(byte)
+        code += 1
+        if code == 0xFF:
+            out[code_at] = code
+            code_at, code = len(out), 1
+            out.append(0)
+    out[code_at] = code
+    return bytes(out)
+
+
+def cobs_decode(data):
+    out = bytearray()
+    i = 0
+    while i < len(data):
+        code = data[i]
+        if code == 0 or i + code > len(data):
+            raise ValueError("malformed COBS frame")
+        out += data[i + 1:i + code]
+        i += code
+        if code != 0xFF and i < len(data):
+            out.append(0)
+    return bytes(out)
+
+
+class Gateway:
+    def __init__(self, port):
+        import serial
+        self.port = serial.Serial(port, BAUD, timeout=1.0)
+        self.seq = 0
+        self.buffer = bytearray()
+
+    def send(self, msg_type, body=b""):
+        if len(body) > MAX_PAYLOAD - 4:
+            raise ValueError("body too long for one frame")
+        self.seq = (self.seq + 1) & 0xFF
+        payload = bytes([msg_type, self.seq]) + body
+        payload += struct.pack("<H", crc16(payload))
+        self.port.write(cobs_encode(payload) + b"\0")
+        return self.seq
+
+    def receive(self):
+        """Next valid frame as (type, seq, body), or None on timeout."""
+        while True:
+            end = self.buffer.find(b"\0")
+            if end < 0:
+                chunk = self.port.read(max(1, self.port.in_waiting))
+                if not chunk:
+                    return None
+                self.buffer += chunk
+                continue
+            frame, self.buffer = bytes(self.buffer[:end]), self.buffer[end + 1:]
+            try:
+                payload = cobs_decode(frame)
+            except ValueError:
+                continue
+            if len(payload) < 4 or crc16(payload[:-2]) != struct.unpack("<H", payload[-2:])[0]:
+                continue
+            return payload[0], payload[1], payload[2:-2]
+
+    def request(self, msg_type, body=b""):
+        seq = self.send(msg_type, body)
+        while True:
+            frame = self.receive()
+            if frame is None:
+                raise TimeoutError("no reply from feeder")
+            if frame[0] != EVENT_STATUS and frame[1] == seq:
+                return frame
+
+
+def format_status(body):
+    (version, weight, ir, state, program_id, current, throttled,
+     uptime, history) = struct.unpack("<IfBBIBBII", body)
+    weight = "unavailable" if math.isnan(weight) else f"{weight:.2f} g"
+    return (f"v{version} weight={weight} ir={'obstruction' if ir else 'clear'} "
+            f"program={program_id}:{PROGRAM_STATES[state]}@{current} "
+            f"throttled={bool(throttled)} uptime={uptime} ms history={history}")
+
+
+def main(argv):
+    if len(argv) < 3:
+        print(__doc__.strip())
+        return 2
+    gw = Gateway(argv[1])
+    command = argv[2]
+
+    if command == "ping":
+        _, _, body = gw.request(PING)
+        version, frames_in, frames_out, crc_errors, overflows = struct.unpack("<BIIII", body)
+        print(f"protocol {version}: in={frames_in} out={frames_out} "
+              f"crcErrors={crc_errors} overflows={overflows}")
+    elif command == "status":
+        _, _, body = gw.request(GET_STATUS)
+        print(format_status(body))
+    elif command == "feed":
+        grams = [float(g) for g in argv[3].split(",")]
+        interval = int(argv[4]) if len(argv) > 4 else 0
+        body = bytes([len(grams)])
+        for g in grams:
+            body += struct.pack("<fIf", g, interval, NO_CONDITION)
+        _, _, reply = gw.request(START_PROGRAM, body)
+        code, value = struct.unpack("<BI", reply)
+        print(f"{RESULTS[code]} (program {value})")
+    elif command == "cancel":
+        _, _, reply = gw.request(CANCEL_PROGRAM)
+        print(RESULTS[reply[0]])
+    elif command == "history":
+        first = int(argv[3]) if len(argv) > 3 else 0
+        while True:
+            _, _, body = gw.request(GET_HISTORY, struct.pack("<I", first))
+            start, count = struct.unpack("<IB", body[:5])
+            if start != first:
+                print(f"(records {first}-{start - 1} no longer kept)")
+            for i in range(count):
+                at, program_id, grams, delivered, result = struct.unpack_from("<IIffB", body, 5 + 17 * i)
+                print(f"#{start + i} t={at} program={program_id} "
+                      f"{delivered:.2f}/{grams:.2f} g {PORTION_RESULTS[result]}")
+            if count == 0:
+                break
+            first = start + count
+    elif command == "monitor":
+        gw.send(CREDIT, bytes([8]))
+        outstanding = 8
+        while True:
+            frame = gw.receive()
+            if frame is None or frame[0] != EVENT_STATUS:
+                continue
+            print(format_status(frame[2]), flush=True)
+            outstanding -= 1
+            if outstanding <= 4:
+                gw.send(CREDIT, bytes([4]))
+                outstanding += 4
+    else:
+        print(__doc__.strip())
+        return 2
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
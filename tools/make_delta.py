@@ -0,0 +1,169 @@
+#!/usr/bin/env python3
+"""
+Build a delta OTA patch for the Smart Feeder (format "SFD1", see the OTA
+section of src/main.cpp).
+
+  make_delta.py OLD.bin NEW.bin PATCH.bin     create a patch
+  make_delta.py --apply OLD.bin PATCH.bin OUT.bin
+  make_delta.py --digest IMAGE.bin            print the sha256= value for IMAGE
+
+OLD.bin must be exactly the image currently running on the device; the
+device refuses patches whose source digest does not match. Digests are
+what esp_partition_get_sha256() reports for an app image: esptool appends
+a SHA-256 of the rest of the image by default, and when the header says
+so that appended hash is the digest, not the SHA-256 of the whole file.
+"""
+
+import hashlib
+import struct
+import sys
+
+MAGIC = b"SFD1"
+BLOCK = 32          # Match granularity
+MIN_COPY = 48       # Shorter matches are cheaper as literals
+ADD_WINDOW = 64     # Bytes compared when deciding on an 'A' op
+ADD_SIMILARITY = 0.5
+IMAGE_MAGIC = 0xE9
+HASH_APPENDED = 23  # Header byte set when a SHA-256 trails the image
+
+
+def image_digest(image):
+    if len(image) > 32 and image[0] == IMAGE_MAGIC and image[HASH_APPENDED] == 1:
+        return hashlib.sha256(image[:-32]).digest()
+    return hashlib.sha256(image).digest()
+
+
+def index_source(old):
+    index = {}
+    for pos in range(0, len(old) - BLOCK + 1, 4):
+        index.setdefault(old[pos:pos + BLOCK], pos)
+    return index
+
+
+def make_patch(old, new):
+    index = index_source(old)
+    ops = []
+    literal = bytearray()
+    add_src = None
+    add_data = bytearray()
+    delta = 0  # new offset minus old offset of the last copy
+    i = 0
+
+    def flush_literal():
+        if literal:
+            ops.append(b"I" + struct.pack("<I", len(literal)) + bytes(literal))
+            literal.clear()
+
+    def flush_add():
+        nonlocal add_src
+        if add_data:
+            ops.append(b"A" + struct.pack("<II", add_src, len(add_data)) + bytes(add_data))
+            add_data.clear()
+        add_src = None
+
+    while i < len(new):
+        src = index.get(bytes(new[i:i + BLOCK]))
+        if src is not None:
+            length = 0
+            while (i + length < len(new) and src + length < len(old)
+                   and new[i + length] == old[src + length]):
+                length += 1
+            if length >= MIN_COPY:
+                flush_literal()
+                flush_add()
+                ops.append(b"C" + struct.pack("<II", src, length))
+                delta = i - src
+                i += length
+                continue
+
+        # Code that moved by a constant offset differs in a few bytes only
+        src = i - delta
+        if 0 <= src and src + ADD_WINDOW <= len(old) and i + ADD_WINDOW <= len(new):
+            same = sum(1 for k in range(ADD_WINDOW) if new[i + k] == old[src + k])
+            if same >= ADD_WINDOW * ADD_SIMILARITY:
+                # Step only to the next indexed source offset so an exact
+                # match is picked up again as soon as one starts
+                step = 4 - (src % 4)
+                flush_literal()
+                if add_src is None:
+                    add_src = src
+                add_data.extend((new[i + k] - old[src + k]) & 0xFF for k in range(step))
+                i += step
+                continue
+
+        flush_add()
+        literal.append(new[i])
+        i += 1
+
+    flush_literal()
+    flush_add()
+    header = MAGIC + struct.pack("<I", len(new)) + image_digest(old)
+    return header + b"".join(ops)
+
+
+def apply_patch(old, patch):
+    if patch[:4] != MAGIC:
+        raise ValueError("bad magic")
+    size = struct.unpack_from("<I", patch, 4)[0]
+    if patch[8:40] != image_digest(old):
+        raise ValueError("patch was made against a different image")
+    out = bytearray()
+    pos = 40
+    while pos < len(patch):
+        op = patch[pos:pos + 1]
+        pos += 1
+        if op == b"I":
+            (length,) = struct.unpack_from("<I", patch, pos)
+            pos += 4
+            out += patch[pos:pos + length]
+            pos += length
+        elif op in (b"C", b"A"):
+            src, length = struct.unpack_from("<II", patch, pos)
+            pos += 8
+            if op == b"C":
+                out += old[src:src + length]
+            else:
+                out += bytes((old[src + k] + patch[pos + k]) & 0xFF for k in range(length))
+                pos += length
+        else:
+            raise ValueError("unknown op %r" % op)
+    if len(out) != size:
+        raise ValueError("size mismatch")
+    return bytes(out)
+
+
+def main(argv):
+    if len(argv) == 5 and argv[1] == "--apply":
+        with open(argv[2], "rb") as f:
+            old = f.read()
+        with open(argv[3], "rb") as f:
+            patch = f.read()
+        with open(argv[4], "wb") as f:
+            f.write(apply_patch(old, patch))
+        return 0
+
+    if len(argv) == 3 and argv[1] == "--digest":
+        with open(argv[2], "rb") as f:
+            print(image_digest(f.read()).hex())
+        return 0
+
+    if len(argv) != 4:
+        print(__doc__.strip(), file=sys.stderr)
+        return 2
+
+    with open(argv[1], "rb") as f:
+        old = f.read()
+    with open(argv[2], "rb") as f:
+        new = f.read()
+    patch = make_patch(old, new)
+    if apply_patch(old, patch) != new:
+        print("internal error: patch does not reproduce NEW", file=sys.stderr)
+        return 1
+    with open(argv[3], "wb") as f:
+        f.write(patch)
+    print("%d -> %d bytes (%.1f%%)" % (len(new), len(patch), 100.0 * len(patch) / len(new)))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
@@ -0,0 +1,52 @@
+#!/bin/sh
+# Create a local test CA and a certificate for one Smart Feeder, and install
+# it over plain HTTP (see the HTTPS section of src/main.cpp). Needs openssl
+# and curl.
+#
+#   make_test_ca.sh FEEDER_IP [DIR]        default DIR is ./feeder-ca
+#
+# Then, with the stock openssl client:
+#   openssl s_time -connect IP:443 -CAfile DIR/ca.crt -new -time 10
+#       full handshakes per second
+#   openssl s_time -connect IP:443 -CAfile DIR/ca.crt -reuse -time 10
+#       resumed handshakes per second
+#   openssl s_client -connect IP:443 -CAfile DIR/ca.crt -reconnect </dev/null
+#       one full handshake then five reconnects, each should say "Reused"
+#   curl --cacert DIR/ca.crt https://IP/api/status https://IP/api/status \
+#        -w '%{time_appconnect} %{time_total}\n'
+#       the second request reuses the connection: no handshake at all
+#
+# An existing CA in DIR is reused, so several feeders can share it. Only
+# the first certificate can be installed over plain HTTP; once HTTPS is
+# running, replace it over HTTPS instead:
+#   curl --cacert DIR/ca.crt --data-urlencode cert@NEW.crt \
+#        --data-urlencode key@NEW.key https://IP/api/tls
+
+set -e
+
+if [ $# -lt 1 ]; then
+    sed -n '2,24p' "$0" | sed 's/^# \{0,1\}//'
+    exit 2
+fi
+IP=$1
+DIR=${2:-feeder-ca}
+mkdir -p "$DIR"
+
+if [ ! -f "$DIR/ca.key" ]; then
+    openssl req -x509 -newkey rsa:2048 -nodes -sha256 -days 3650 \
+        -subj "/CN=Smart Feeder Test CA" \
+        -keyout "$DIR/ca.key" -out "$DIR/ca.crt" 2>/dev/null
+fi
+
+# RSA-2048: the private-key operation runs on the ESP32's bignum accelerator
+openssl req -newkey rsa:2048 -nodes -sha256 \
+    -subj "/CN=$IP" -keyout "$DIR/$IP.key" -out "$DIR/$IP.csr" 2>/dev/null
+printf 'subjectAltName=IP:%s\nextendedKeyUsage=serverAuth\n' "$IP" > "$DIR/$IP.ext"
+openssl x509 -req -in "$DIR/$IP.csr" -CA "$DIR/ca.crt" -CAkey "$DIR/ca.key" \
+    -CAcreateserial -days 825 -sha256 -extfile "$DIR/$IP.ext" \
+    -out "$DIR/$IP.crt" 2>/dev/null
+rm -f "$DIR/$IP.csr" "$DIR/$IP.ext"
+
+curl -sS --fail --data-urlencode "cert@$DIR/$IP.crt" --data-urlencode "key@$DIR/$IP.key" \
+    "http://$IP/api/tls"
+echo